@@ -26,6 +26,7 @@
 #include <ctype.h>
 #include <errno.h>
 #include <sys/stat.h>
+#include <time.h>
 #include <curl/curl.h>
 #include <zlib.h>
 #include "cJSON.h"
@@ -38,6 +39,17 @@
 #include <readline/history.h>
 #include <dirent.h> 
 #include <fcntl.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <arpa/inet.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#elif defined(__aarch64__)
+#include <arm_neon.h>
+#endif
 #define NULL_DEVICE "/dev/null"
 #define MKDIR(path) mkdir(path, 0755)
 #define STRCASECMP strcasecmp
@@ -53,11 +65,118 @@
 #define GZIP_CHUNK_SIZE 16384
 #define ATTACHMENT_LIMIT 1024
 #define MAX_FREE_MODE_CONTEXT_SIZE 102400
+#define TRANSPORT_POOL_SIZE 8
+#define PREWARM_PING_INTERVAL_SEC 30
+#define PREWARM_SETTLE_MAX_MS 1000
+#define FREE_API_HOST "gemini.google.com"
+#define KEY_CHECK_TIMEOUT_SEC 10
+#define KEY_CHECK_TTL_SEC 600
+#define KEY_COOLDOWN_BASE_SEC 30
+#define KEY_COOLDOWN_MAX_SEC 600
+#define KEY_LATENCY_EWMA_ALPHA 0.3
+#define QUOTA_LEDGER_FILENAME "quota.json"
+#define NET_CACHE_FILENAME "netcache.json"
+#define NET_CACHE_DNS_TTL_SEC 300
+#define NET_CACHE_MAX_TLS_SESSIONS 16
+#define FILES_CACHE_FILENAME "files.json"
+#define FILES_UPLOAD_MIN_BYTES (4 * 1024 * 1024) // Smaller attachments are sent inline.
+#define FILES_CHUNK_SIZE (8 * 1024 * 1024)
+#define FILES_DEFAULT_TTL_SEC (48 * 3600)
+#define FILES_EXPIRY_MARGIN_SEC 3600
+#define BLOB_STORE_DIRNAME "blobs"
+#define BLOB_GC_GRACE_SEC 3600        // Blobs written this recently may belong to a session being saved.
+#define BLOB_MAP_MIN_SIZE (1024 * 1024) // Smaller files are read when attached rather than mapped.
+#define FILES_PROCESSING_TIMEOUT_SEC 300
+#define FILES_POLL_INTERVAL_MS 2000
+#define CONTEXT_CACHE_DEFAULT_MIN_TOKENS 32768
+#define CONTEXT_CACHE_TTL_SEC 3600
+#define CONTEXT_CACHE_REFRESH_SEC 900        // The TTL is extended when less than this is left.
+#define CONTEXT_CACHE_MARGIN_SEC 60          // A cache this close to expiry is not referenced.
+#define RATE_LIMIT_MAX_WAIT_SEC 120
+#define RETRY_DEFAULT_MAX_ATTEMPTS 3
+#define RETRY_DEFAULT_BASE_DELAY_MS 1000
+#define RETRY_DEFAULT_MAX_DELAY_MS 30000
+#define RETRY_DEFAULT_BUDGET 10
+#define ENDPOINT_PROBE_INTERVAL_SEC 60
+#define ENDPOINT_PROBE_TIMEOUT_SEC 5
+#define ENDPOINT_DOWN_BASE_SEC 30
+#define ENDPOINT_DOWN_MAX_SEC 300
+#define ENDPOINT_LATENCY_EWMA_ALPHA 0.3
+#define ENDPOINT_SWITCH_MARGIN 0.8
+#define HEDGE_DEFAULT_PERCENTILE 95
+#define HEDGE_DEFAULT_DELAY_MS 2000
+#define HEDGE_MIN_SAMPLES 5
+#define HEDGE_TTFT_HISTORY 64
+#define FAILOVER_FAILURE_THRESHOLD 2
+#define FAILOVER_OPEN_BASE_SEC 60
+#define FAILOVER_OPEN_MAX_SEC 600
+#define STREAM_MAX_CONTINUATIONS 4
+#define FNV1A_64_INIT 0xcbf29ce484222325ULL
+#define LIVE_PATH "/ws/google.ai.generativelanguage.v1beta.GenerativeService.BidiGenerateContent"
+#define LIVE_TIMEOUT_SEC 60
+#define LIVE_RETRY_SEC 300
+#define LIVE_MAX_MESSAGE_SIZE (64 * 1024 * 1024)
+#define STREAM_RING_SIZE (1024 * 1024) // Must be a power of two.
+#define STREAM_WAIT_MS 5
+#define COMPRESS_NUM_LEVELS 4
+#define COMPRESS_MIN_BODY 1024             // Smaller bodies are sent without gzip.
+#define COMPRESS_UPLOAD_WEIGHT 3           // Sends a cached segment is expected to make.
+#define COMPRESS_DEFAULT_BANDWIDTH 1250.0  // Upload bytes per ms until measured (10 Mbit/s).
+#define COMPRESS_MIN_SAMPLE (256 * 1024)
+#define COMPRESS_EWMA_ALPHA 0.3
+#define COMPRESS_PARALLEL_MIN (1024 * 1024) // Segments at least this large are compressed on all cores.
+#define COMPRESS_BLOCK_SIZE (128 * 1024)
+#define COMPRESS_MAX_THREADS 16
+#define DEFLATE_WINDOW_SIZE 32768
+#define UPLOAD_STREAM_CHUNK (64 * 1024)   // JSON read at a time when a message is streamed into a request.
 
 // --- Data Structures ---
 typedef struct { unsigned char* data; size_t size; } GzipResult;
 typedef struct { unsigned char* data; size_t size; } Base64DecodeResult;
 typedef enum { PART_TYPE_TEXT, PART_TYPE_FILE, PART_TYPE_URI } PartType;
+
+/**
+ * @brief The bytes of an attachment, shared by every part that refers to them.
+ * @details Large regular files are mapped rather than read (see
+ *          `blob_map_file`), so an attachment takes no heap and the kernel can
+ *          drop its pages when memory is short; small files and piped data are
+ *          kept on the heap. Copies of a part
+ *          share the blob and hold one reference each, and the blob store
+ *          makes equal content attached or loaded twice share one blob too.
+ */
+typedef struct Blob {
+    int refs;
+    unsigned char* data;
+    size_t size;
+    bool mapped;                   // `data` is a read-only mapping of `path`; otherwise it is on the heap.
+    bool in_store;                 // Mapped from a blob store file, which never changes once written.
+    int fd;                        // Mapped: the file, kept open to read it safely and notice writes; else -1.
+    unsigned int version;          // Goes up when the data is replaced by a copy of the changed file.
+    char* path;
+    struct stat file;              // The file as it was mapped, to notice changes.
+    char hash[65];                 // SHA-256 of the data in hex; empty until `blob_hash` is called.
+    bool stored;                   // The data is in the blob store on disk, as of the last session save.
+    struct BlobStore* store;       // The store that indexes this blob, or NULL.
+} Blob;
+
+/**
+ * @brief Attachments by content hash, in memory and on disk, see `blob_store_intern`.
+ * @details In memory the store indexes every live blob, so the same content
+ *          is held once however often it is attached or loaded. On disk it is
+ *          the `blobs` directory of the application data directory, holding
+ *          one file per content hash; named sessions refer to their
+ *          attachments there instead of embedding them.
+ */
+typedef struct BlobStore {
+    Blob** blobs;
+    int num_blobs;
+    int capacity;
+    bool enabled;                  // "blob_store" from config.json: named sessions reference the store.
+    long shared;                   // Attachments found held already and shared.
+    long written;                  // Blobs written to disk.
+    long long bytes_written;
+} BlobStore;
+
 typedef struct {
     PartType type;
     char* text;
@@ -65,10 +184,392 @@ typedef struct {
     char* base64_data;
     char* filename;
     char* uri;
+    Blob* blob;                    // Data of a PART_TYPE_FILE without `base64_data`; encoded only when sent.
+                                   // On a PART_TYPE_URI upload, the data to upload again once it expired.
 } Part;
-typedef struct { char* role; Part* parts; int num_parts; } Content;
+typedef struct {
+    char* role;
+    Part* parts;
+    int num_parts;
+    char* json;                    // Serialized form, cached by `content_json`; NULL until needed.
+    size_t json_length;
+    unsigned char* deflated;       // `json` as a raw deflate segment, cached by `content_deflated`.
+    size_t deflated_length;
+    uLong json_crc;                // CRC-32 of the JSON, for the gzip trailer.
+    size_t* splices;               // Where in `json` the data of each blob part goes, or NULL if there is none.
+    int num_splices;
+    size_t full_length;            // With splices: the length of the JSON once the data is in.
+    unsigned long blob_versions;   // With splices: the sum of the blobs' versions it was serialized from.
+} Content;
+
+/**
+ * @brief A read position in the JSON of a message with blob parts (see `content_stream_read`).
+ */
+typedef struct {
+    int piece;                     // Even: text of `json` before splice piece / 2; odd: data of that splice.
+    size_t offset;                 // Bytes of the piece already read.
+    bool failed;                   // The file of a mapped blob could not be read in full.
+} ContentCursor;
 typedef struct { Content* contents; int num_contents; } History;
-typedef struct { char* buffer; size_t size; char* full_response; size_t full_response_size; } MemoryStruct;
+typedef struct { char* buffer; size_t size; char* full_response; size_t full_response_size; long total_tokens; char finish_reason[32]; } MemoryStruct;
+
+/**
+ * @brief Totals of the receive rings over the session, for `/stats`.
+ */
+typedef struct {
+    long streams;
+    long long bytes;
+    size_t peak_fill;              // Highest ring occupancy seen, in bytes.
+    long network_stalls;           // Writes that found the ring full and had to wait.
+    double stall_ms;               // Time the network side spent waiting for room.
+    long renderer_waits;           // Times the renderer caught up and had to wait for data.
+} ReceiveStats;
+
+/**
+ * @brief A single-producer/single-consumer byte ring between libcurl and the renderer.
+ * @details The write callback (`stream_pipe_write`, the producer) only copies
+ *          received bytes into the ring. A renderer thread (the consumer) feeds
+ *          them to the real write callback, which parses, prints and stores
+ *          the answer. `head` is written only by the producer and `tail` only
+ *          by the consumer, so passing data needs no lock; the mutex and the
+ *          condition variable are used only to sleep while the ring is empty
+ *          or full.
+ */
+typedef struct {
+    unsigned char* data;           // STREAM_RING_SIZE bytes.
+    _Atomic size_t head;           // Bytes written so far.
+    _Atomic size_t tail;           // Bytes consumed so far.
+    atomic_bool closed;            // The transfer is over: drain the ring and stop.
+    atomic_bool failed;            // The consumer refused data or the user interrupted.
+    atomic_bool consumer_waiting;
+    atomic_bool producer_waiting;
+    pthread_mutex_t lock;
+    pthread_cond_t wake;
+    pthread_t thread;
+    bool threaded;                 // false if no thread could be started; data is then passed on inline.
+    size_t (*sink)(void*, size_t, size_t, void*);
+    void* sink_data;
+    size_t peak_fill;
+    long stalls;
+    double stall_ms;
+    long waits;
+} StreamPipe;
+
+/**
+ * @brief Chooses how the segments of request bodies are compressed, see `compress_policy_choose`.
+ * @details Speeds and ratios start from typical zlib figures and are then
+ *          learned from every segment compressed, separately for text and for
+ *          base64 media; the upload bandwidth is learned from large uploads.
+ */
+typedef struct {
+    bool adaptive;                 // false: every segment at Z_BEST_COMPRESSION, and always gzip.
+    double speed[2][COMPRESS_NUM_LEVELS];  // Bytes compressed per ms, for text [0] and media [1].
+    double ratio[2][COMPRESS_NUM_LEVELS];  // Compressed size / original size.
+    double upload_bytes_per_ms;    // 0 until measured.
+    long choices[COMPRESS_NUM_LEVELS];     // New segments compressed at each level.
+    long plain_bodies;             // Bodies sent without gzip.
+    long long bytes_in;            // JSON of the new segments.
+    long long bytes_out;           // Their compressed size.
+    double compress_ms;
+    double saved_ms;               // Estimated time saved over Z_BEST_COMPRESSION.
+    long parallel_segments;        // Segments compressed by `deflate_segment_parallel`.
+    long streamed_segments;        // Messages with blob parts, compressed anew with every body they are in.
+    // The last request body.
+    bool last_plain;
+    size_t last_json_length;
+    size_t last_wire_length;
+    int last_choices[COMPRESS_NUM_LEVELS];
+    int last_reused;
+    int last_streamed;
+    double last_compress_ms;
+} CompressionPolicy;
+
+/**
+ * @brief One raw deflate stream per compression level, opened on first use.
+ */
+typedef struct {
+    z_stream streams[COMPRESS_NUM_LEVELS];
+    bool ready[COMPRESS_NUM_LEVELS];
+} SegmentCompressor;
+
+/**
+ * @brief The gzip-compressed body of a request, kept as the list of segments it is made of.
+ * @details Built by `request_body_build`. The segments are independent raw
+ *          deflate streams that end on a full flush, mostly the cached ones of
+ *          the history messages; sent one after the other between the gzip
+ *          header and trailer they form a single gzip member. Small bodies are
+ *          sent as plain JSON instead, with the segments holding the JSON
+ *          pieces. Messages with blob parts are kept in neither form: their
+ *          segments are produced while the body is sent (see
+ *          `body_upload_stream`). The struct may be copied, so the header and
+ *          trailer are not in the segment list.
+ */
+typedef struct {
+    const unsigned char** segments;
+    size_t* lengths;
+    int num_segments;
+    unsigned char* owned[3];       // Segments of this body alone: the opening, the separator and the tail.
+    bool gzip;                     // false: the segments are plain JSON.
+    unsigned char* owned_message;  // Segment of a message that is not part of the history.
+    unsigned char header[10];
+    unsigned char trailer[10];     // Empty final block, CRC-32 and size of the JSON.
+    size_t json_length;            // Total uncompressed size.
+    size_t wire_length;            // Size as sent; without the streamed segments when `streaming` is set.
+    Content** sources;             // Per segment: the message it is streamed from, or NULL if it is in memory.
+    bool streaming;                // Streamed segments are compressed while they are sent, so the size is not known.
+    bool stream_best;              // Compress them at Z_BEST_COMPRESSION, as the policy is not adaptive.
+    int key_index;                 // Key the body must be sent with because of a context cache or uploaded files, or -1.
+} RequestBody;
+
+/**
+ * @brief One upload of a RequestBody.
+ */
+typedef struct {
+    const RequestBody* body;
+    int segment;                   // Segment being copied: 0 is the header, num_segments + 1 the trailer.
+    size_t offset;                 // Bytes of that segment already copied.
+    size_t bytes_sent;             // Compressed bytes handed to libcurl.
+    struct timespec first_read;    // When libcurl took the first bytes...
+    struct timespec last_read;     // ...and the last ones, to measure the bandwidth.
+    // A segment streamed from a message (see `body_upload_stream`).
+    ContentCursor cursor;
+    z_stream* deflate;             // Compresses it in gzip bodies; opened on first use.
+    unsigned char* buffer;         // UPLOAD_STREAM_CHUNK bytes each of JSON, of output and of blob data.
+    size_t buffered;               // Output waiting in the buffer...
+    size_t buffer_offset;          // ...and how much of it was handed to libcurl.
+    bool input_done;               // All of the message's JSON was read.
+    bool blob_unreadable;          // An attachment's file shrank while it was sent; the body must be rebuilt.
+} BodyUpload;
+
+struct Transfer;
+typedef void (*TransferCallback)(struct Transfer* transfer, void* userdata);
+
+/**
+ * @brief One request submitted to the asynchronous request engine.
+ * @details Created by `transport_submit`, which takes ownership of the handle
+ *          and header list. The transfer is either awaited with
+ *          `transport_await` or detached and freed by the engine on completion.
+ */
+typedef struct Transfer {
+    CURL* curl;
+    struct curl_slist* headers;    // Freed together with the transfer.
+    CURLcode result;
+    long http_code;
+    bool done;
+    bool detached;                 // Freed by the engine once it completes.
+    bool background;               // Not counted in the connection statistics.
+    TransferCallback on_done;
+    void* userdata;
+    struct Transfer* next;
+} Transfer;
+
+/**
+ * @brief Owns the long-lived cURL handles used for every request in a session.
+ * @details Handles are kept in a small pool and reset between requests instead of
+ *          being destroyed, and all of them are attached to one share object
+ *          holding the DNS cache, the TLS session cache and the connection pool.
+ *          This lets consecutive turns, retries and paginated calls reuse an open
+ *          (HTTP/2 where available) connection instead of paying a new TCP+TLS
+ *          handshake each time.
+ */
+typedef struct {
+    CURLSH* share;
+    CURL* handles[TRANSPORT_POOL_SIZE];
+    bool in_use[TRANSPORT_POOL_SIZE];
+    long new_connections;
+    long reused_connections;
+    CURLcode last_result;          // Outcome of the last foreground transfer.
+    long last_retry_after;         // Its Retry-After header in seconds, 0 if absent.
+    double last_ttfb_ms;           // Its time to first byte.
+
+    // Asynchronous request engine: every transfer runs on this multi handle.
+    CURLM* multi;
+    struct Transfer* transfers;    // All submitted transfers not yet freed.
+    int active_transfers;          // Submitted transfers still in flight.
+
+    // Background pre-warming, driven while readline waits for input.
+    bool prewarm_enabled;
+    struct Transfer* warm_transfer; // In-flight warm-up transfer, NULL when idle.
+    char warm_url[512];            // Endpoint the pooled connection was warmed for.
+    time_t warm_last_touch;        // When that connection last carried traffic.
+    double warm_pending_ms;        // Handshake time paid in the background since the last request.
+    double warm_last_saved_ms;     // Handshake time the last request did not have to wait for.
+    double warm_total_saved_ms;
+
+    // Addresses and TLS sessions persisted across invocations, see `transport_load_net_cache`.
+    bool net_cache_enabled;
+    bool net_cache_record;         // Addresses may be recorded: no proxy sits in between.
+    cJSON* net_cache;              // Entries loaded from, and to be merged into, the cache file.
+    bool net_cache_dirty;
+    bool net_cache_imported;       // TLS sessions were handed to libcurl.
+    struct curl_slist* resolve;    // CURLOPT_RESOLVE entries built from the cache.
+    time_t resolve_until;          // When the oldest of them goes stale.
+    int cached_addresses;          // Fresh addresses loaded at startup.
+    int cached_tls_sessions;       // TLS sessions imported at startup.
+} Transport;
+/**
+ * @brief The retry policy shared by every API call, see `retry_policy_should_retry`.
+ */
+typedef struct {
+    int max_attempts;              // Attempts per request, including the first.
+    int base_delay_ms;             // Backoff cap for the first retry; doubles per attempt.
+    int max_delay_ms;              // Upper bound of any single backoff.
+    int budget;                    // Retries allowed for the whole process.
+    int budget_left;
+    long retries_taken;
+} RetryPolicy;
+
+/**
+ * @brief Client-side per-key rate limits, enforced through the shared quota ledger.
+ */
+typedef struct {
+    int rpm;                       // Requests per minute per key; 0 = unlimited.
+    int tpm;                       // Tokens per minute per key; 0 = unlimited.
+    int rpd;                       // Requests per day per key; 0 = unlimited.
+    long pending_tokens;           // Estimated tokens of the generate request being sent, -1 if none.
+    int reserved_key_index;        // Key charged for the request in flight, -1 if none.
+    long reserved_tokens;          // Tokens charged for it up front.
+    long delayed_requests;
+    long rerouted_requests;
+    double total_wait_ms;
+} RateLimiter;
+
+/**
+ * @brief Hedging of generate requests across keys, see `perform_hedged_generate`.
+ */
+typedef struct {
+    bool enabled;
+    int percentile;                // Recent TTFT percentile after which a second key is tried.
+    double ttft_ms[HEDGE_TTFT_HISTORY]; // Ring of recent times to first data.
+    int num_samples;
+    int next_sample;
+    long hedged_requests;          // Requests that raced a second key.
+    long hedge_wins;               // Of those, how many the second key answered first.
+} HedgePolicy;
+
+/**
+ * @brief One way of reaching the API: a host, reached directly or through a proxy.
+ */
+typedef struct {
+    char* host;
+    char* proxy;                   // Empty for a direct connection.
+    double latency_ewma_ms;        // Probe round trip, exponentially weighted; 0 if not measured.
+    long requests;
+    long failures;
+    int consecutive_failures;
+    time_t down_until;             // Not used before this time.
+    time_t last_probe_at;
+    struct Transfer* probe;        // In-flight probe, NULL when idle.
+} Endpoint;
+
+/**
+ * @brief The configured hosts and proxies and the routes built from them, see `endpoint_pool_select`.
+ */
+typedef struct {
+    char** hosts;                  // "hosts" from config.json; empty to use `host` alone.
+    int num_hosts;
+    char** proxies;                // "proxies" from config.json; "direct" means no proxy.
+    int num_proxies;
+    Endpoint* routes;              // Every host combined with every proxy.
+    int num_routes;
+    int current;                   // Route in use, mirrored into `host` and `proxy`.
+    long failovers;
+} EndpointPool;
+
+typedef enum { BREAKER_CLOSED, BREAKER_OPEN, BREAKER_HALF_OPEN } BreakerState;
+
+/**
+ * @brief Circuit breaker between the official API and the free backend, see `send_api_request`.
+ */
+typedef struct {
+    bool enabled;
+    BreakerState state;
+    int consecutive_failures;      // Official turns in a row lost to an outage.
+    int trips;                     // Openings since the last recovery; doubles the open time.
+    time_t open_until;             // While open, the official API is not tried before this time.
+    long total_trips;
+    long failover_turns;           // Turns answered by the free backend instead.
+} FailoverBreaker;
+
+/**
+ * @brief A Live API session on a WebSocket, see `live_session_turn`.
+ */
+typedef struct {
+    bool enabled;
+    char* model;                   // "live_model" from config.json; NULL to use `model_name`.
+    CURL* curl;                    // Connect-only handle carrying the WebSocket; NULL when closed.
+    int key_index;                 // Key the session was opened with; its turns are charged to it.
+    unsigned char* rx;             // Received bytes not yet parsed into frames.
+    size_t rx_size;
+    int synced_contents;           // History messages the server already holds.
+    uint64_t synced_hash;          // Hash of those messages, to notice when the history changes.
+    uint64_t setup_hash;           // Hash of the setup the session was opened with.
+    time_t unavailable_until;      // After a failed connect, HTTP is used until then.
+    long turns;
+    long fallbacks;                // Turns that went over HTTP because the session failed.
+} LiveSession;
+
+/**
+ * @brief Uploads large attachments through the Files API, see `files_api_attach`.
+ */
+typedef struct {
+    bool enabled;
+    long uploads;
+    long reused;                   // Attachments found in the upload cache.
+    long long bytes_uploaded;
+} FilesApi;
+
+/**
+ * @brief A cachedContents entry holding the stable start of the conversation, see `context_cache_prepare`.
+ */
+typedef struct {
+    int min_tokens;                // "context_cache_min_tokens" from config.json; 0 turns caching off.
+    char name[128];                // "cachedContents/..."; empty when there is none.
+    char key_id[17];               // `quota_key_id` of the key that created it; caches belong to its project.
+    int num_contents;              // History messages it holds.
+    uint64_t setup_hash;           // Hash of the model, system instruction and tools it holds.
+    uint64_t contents_hash;        // Hash of those messages.
+    long tokens;
+    time_t expire_time;
+    time_t last_used;
+    Transfer* refresh;             // TTL update in flight, or NULL.
+    MemoryStruct refresh_response;
+    time_t next_refresh_at;        // After a failed TTL update, not tried again before this time.
+    uint64_t rejected_hash;        // Prefix found too small or refused by the server; not tried again.
+    long created;
+    long refreshed;
+    long requests;                 // Requests that referenced a cache.
+    long long cached_tokens;       // Tokens those requests did not send again.
+} ContextCache;
+
+typedef enum { KEY_STATUS_UNKNOWN, KEY_STATUS_VALID, KEY_STATUS_RATE_LIMITED, KEY_STATUS_INVALID } KeyStatus;
+
+/**
+ * @brief Health of one API key: its validation result and scheduler statistics.
+ * @details The validation fields are filled by `check_api_keys` (or by the
+ *          scheduler when the API rejects the key); the statistics are updated
+ *          by `key_scheduler_record` after every request made with the key.
+ */
+typedef struct {
+    char* key;
+    KeyStatus status;
+    long http_code;                // Last probe result; negative CURLcode on transport failure.
+    double latency_ms;
+    time_t checked_at;             // 0 if the key was never probed.
+
+    long requests;
+    long successes;
+    long rate_limited;             // 429 responses.
+    long forbidden;                // 401/403 responses.
+    long server_errors;            // 5xx responses and transport failures.
+    int consecutive_failures;
+    time_t last_failure_at;
+    double latency_ewma_ms;        // Time to first byte, exponentially weighted.
+    time_t cooldown_until;         // Not scheduled before this time.
+    double quota_ready_at;         // Out of client-side quota until this time.
+    unsigned long last_used;       // Scheduling sequence number, for spreading load.
+} KeyHealth;
+
 typedef struct AppState {
     char api_key[128];
     char origin[128];
@@ -76,6 +577,10 @@ typedef struct AppState {
     char** origins;
     int num_api_keys;
     int next_key_index;
+    int last_key_index;            // Key used by the most recent request.
+    KeyHealth* key_health;
+    int num_key_health;
+    unsigned long key_use_sequence;
     char model_name[128];
     char proxy[256];
     float temperature;
@@ -101,6 +606,21 @@ typedef struct AppState {
     char *host;
     bool safety;
     char *media_resolution;
+    Transport transport;
+    EndpointPool endpoints;
+    RetryPolicy retry;
+    RateLimiter rate_limit;
+    HedgePolicy hedge;
+    FailoverBreaker failover;
+    bool auto_continue;            // Continue answers that stop at the model's output token limit.
+    bool keep_partial;             // Keep the text of an interrupted answer in the history.
+    LiveSession live;
+    ReceiveStats receive;
+    CompressionPolicy compress;
+    FilesApi files;
+    BlobStore blob_store;
+    ContextCache context_cache;
+    int pinned_key_index;          // Key every request must use for now, or -1; see `build_generate_body`.
 } AppState;
 
 typedef struct {
@@ -114,12 +634,44 @@ void load_history_from_file(AppState* state, const char* filepath);
 void add_content_to_history(History* history, const char* role, Part* parts, int num_parts);
 void free_history(History* history);
 void free_content(Content* content);
+const char* content_json(Content* content, size_t* length_out);
+static size_t content_length(const Content* content);
+void content_invalidate_cache(Content* content);
 int get_token_count(AppState* state);
 char* base64_encode(const unsigned char* data, size_t input_length);
+size_t base64_encode_to(const unsigned char* data, size_t input_length, char* out);
 Base64DecodeResult base64_decode(const char* data);
-const char* get_mime_type(const char* filename);
+Base64DecodeResult base64_decode_length(const char* data, size_t length);
+const char* get_mime_type(const char* filename, const unsigned char* header, size_t header_size);
+Blob* blob_from_buffer(unsigned char* data, size_t size);
+Blob* blob_retain(Blob* blob);
+void blob_release(Blob* blob);
+static Blob* blob_from_base64(const char* text);
+static void blob_check(Blob* blob);
+static bool blob_pread(const Blob* blob, unsigned char* out, size_t offset, size_t length);
+static Blob* blob_store_map(const char* hash);
+static const char* blob_hash(Blob* blob);
+static void blob_store_remove(BlobStore* store, Blob* blob);
+static Blob* blob_store_intern(BlobStore* store, Blob* blob);
+static Blob* blob_store_open(BlobStore* store, const char* hash);
+static void blob_store_save_history(AppState* state);
+static void blob_store_gc(AppState* state, FILE* stream);
+static void blob_store_print(AppState* state, FILE* stream);
+static bool session_path_is_named(const char* filepath);
 GzipResult gzip_compress(const unsigned char* input_data, size_t input_size);
-cJSON* build_request_json(AppState* state);
+int run_benchmark(const char* name, const char* filepath);
+static int benchmark_base64(const char* filepath);
+cJSON* build_request_json(AppState* state, bool by_reference);
+bool request_body_build(AppState* state, const cJSON* settings, RequestBody* body);
+bool request_body_build_range(AppState* state, const cJSON* settings, int first, int count, RequestBody* body);
+void request_body_free(RequestBody* body);
+void body_upload_init(BodyUpload* upload, const RequestBody* body);
+void body_upload_end(BodyUpload* upload);
+static CURL* build_api_post_handle(AppState* state, int key_index, const char* endpoint, BodyUpload* upload, size_t (*callback)(void*, size_t, size_t, void*), void* callback_data, struct curl_slist** headers_out);
+static time_t files_parse_time(const char* text);
+static int files_api_prepare(AppState* state);
+static cJSON* build_request_tree(AppState* state, bool include_contents, bool by_reference);
+static cJSON* build_content_json(const Content* content, bool by_reference);
 bool is_path_safe(const char* path);
 void get_api_key_securely(AppState* state);
 void parse_and_print_error_json(const char* error_buffer);
@@ -140,16 +692,72 @@ static void json_read_float(const cJSON* obj, const char* key, float* target);
 static void json_read_int(const cJSON* obj, const char* key, int* target);
 static void json_read_bool(const cJSON* obj, const char* key, bool* target);
 static void json_read_strdup(const cJSON* obj, const char* key, char** target);
+static void json_read_string_array(const cJSON* obj, const char* key, char*** target, int* count);
+static void free_string_list(char*** list, int* count);
 bool send_api_request(AppState* state, char** full_response_out);
 bool build_session_path(const char* session_name, char* path_buffer, size_t buffer_size);
-long perform_api_curl_request(AppState* state, const char* endpoint, const char* compressed_payload, size_t payload_size, size_t (*callback)(void*, size_t, size_t, void*), void* callback_data);
+long perform_api_curl_request(AppState* state, const char* endpoint, const RequestBody* body, size_t (*callback)(void*, size_t, size_t, void*), void* callback_data);
+long perform_hedged_generate(AppState* state, const RequestBody* body, MemoryStruct* chunk);
 void export_history_to_markdown(AppState* state, const char* filepath);
 void list_available_models(AppState* state);
 void save_configuration(AppState* state);
 void load_configuration_from_path(AppState* state, const char* filepath);
 void get_masked_input(const char* prompt, char* buffer, size_t buffer_size);
+CURL* transport_acquire(Transport* transport);
+void transport_release(Transport* transport, CURL* curl);
+Transfer* transport_submit(Transport* transport, CURL* curl, struct curl_slist* headers, TransferCallback on_done, void* userdata);
+bool transport_interrupted(CURLcode result);
+CURLcode transport_await(Transport* transport, Transfer* transfer, long* http_code_out);
+void transport_detach(Transport* transport, Transfer* transfer);
+void transport_cancel(Transport* transport, Transfer* transfer);
+int transport_poll(Transport* transport, int timeout_ms);
+CURLcode transport_perform(Transport* transport, CURL* curl, struct curl_slist* headers, long* http_code_out);
+void transport_cleanup(Transport* transport);
+void transport_load_net_cache(Transport* transport, bool proxied);
+void transport_save_net_cache(Transport* transport);
+int prewarm_event_hook(void);
+static size_t discard_callback(void* contents, size_t size, size_t nmemb, void* userp);
+KeyHealth* key_health_get(AppState* state, const char* key);
+const KeyHealth* key_health_cached(AppState* state, const char* key);
+void free_key_health(AppState* state);
+int select_api_key(AppState* state);
+static int key_scheduler_pick(AppState* state);
+static double wall_clock_now(void);
+static int json_file_lock(const char* filename, cJSON** json_out);
+static bool json_file_unlock(int fd, cJSON* json, bool save);
+void get_base_app_path(char* buffer, size_t buffer_size);
+int key_scheduler_available(AppState* state);
+void key_scheduler_record(AppState* state, int key_index, long http_code);
+void key_scheduler_record_latency(AppState* state, int key_index, double ttfb_ms);
+void key_scheduler_quarantine(AppState* state, int key_index, long http_code);
+void key_scheduler_commit(AppState* state, int key_index);
+int rate_limited_select_api_key(AppState* state);
+void rate_limiter_settle(AppState* state, bool succeeded, long actual_tokens);
+int rate_limited_select_spare_key(AppState* state, int exclude, long* reserved_tokens_out);
+void rate_limiter_settle_key(AppState* state, int key_index, long reserved_tokens, bool succeeded, long actual_tokens);
+void print_key_health(FILE* stream, AppState* state, const char* key);
+void endpoint_pool_build(AppState* state);
+void endpoint_pool_free(AppState* state);
+void endpoint_pool_select(AppState* state);
+void endpoint_pool_record(AppState* state, long http_code);
+void endpoint_pool_probe_step(AppState* state);
+bool endpoint_pool_uses_proxy(const AppState* state);
+void print_endpoint_pool(FILE* stream, const AppState* state);
+void check_api_keys(AppState* state, FILE* stream);
+void report_prewarm_saving(AppState* state);
 
 bool send_free_api_request(AppState* state, const char* prompt);
+void print_failover_status(FILE* stream, AppState* state);
+void print_live_status(FILE* stream, AppState* state);
+void print_receive_stats(FILE* stream, AppState* state);
+void compress_policy_init(CompressionPolicy* policy);
+void print_compression_stats(FILE* stream, AppState* state);
+void context_cache_refresh_step(AppState* state);
+void context_cache_forget(AppState* state, bool delete_remote);
+void print_context_cache_stats(FILE* stream, AppState* state);
+void live_close(LiveSession* live);
+static void transport_apply_defaults(Transport* transport, CURL* curl);
+bool retry_policy_should_retry(AppState* state, const char* operation, int attempt, long http_code);
 static void process_free_line(char* line, AppState* state);
 static size_t write_free_memory_callback(void* contents, size_t size, size_t nmemb, void* userp);
 char* build_free_request_payload(AppState* state, const char* current_prompt, bool is_pro_model);
@@ -158,6 +766,10 @@ char* build_free_request_payload(AppState* state, const char* current_prompt, bo
 // --- Global Interrupt Flag ---
 volatile sig_atomic_t interrupt_flag = 0;
 
+// The session whose connections are pre-warmed from readline's idle hook,
+// which takes no arguments.
+static AppState* prewarm_state = NULL;
+
 /**
  * @brief Signal handler for SIGINT (Ctrl+C).
  * @details Sets a global flag to indicate that an interrupt has been requested.
@@ -199,6 +811,13 @@ static void process_line(char* line, MemoryStruct* mem) {
     cJSON* json_root = cJSON_Parse(line + 6);
     if (!json_root) return;
 
+    // Usage metadata (sent with the last chunks) feeds the client-side rate limiter.
+    cJSON* usage = cJSON_GetObjectItem(json_root, "usageMetadata");
+    cJSON* total_tokens = cJSON_GetObjectItem(usage, "totalTokenCount");
+    if (cJSON_IsNumber(total_tokens)) {
+        mem->total_tokens = (long)total_tokens->valuedouble;
+    }
+
     cJSON* candidates = cJSON_GetObjectItem(json_root, "candidates");
     if (!cJSON_IsArray(candidates)) {
         cJSON_Delete(json_root);
@@ -211,6 +830,12 @@ static void process_line(char* line, MemoryStruct* mem) {
         return;
     }
 
+    // The last chunk of a complete answer says why generation stopped.
+    cJSON* finish_reason = cJSON_GetObjectItem(candidate, "finishReason");
+    if (cJSON_IsString(finish_reason) && finish_reason->valuestring) {
+        snprintf(mem->finish_reason, sizeof(mem->finish_reason), "%s", finish_reason->valuestring);
+    }
+
     cJSON* content = cJSON_GetObjectItem(candidate, "content");
     if (!content) {
         cJSON_Delete(json_root);
@@ -311,6 +936,213 @@ static size_t write_memory_callback(void* contents, size_t size, size_t nmemb, v
     return realsize;
 }
 
+/**
+ * @brief Wakes the other side of a receive ring.
+ */
+static void stream_pipe_signal(StreamPipe* pipe) {
+    pthread_mutex_lock(&pipe->lock);
+    pthread_cond_signal(&pipe->wake);
+    pthread_mutex_unlock(&pipe->lock);
+}
+
+/**
+ * @brief Sleeps until the ring has data (or room), or STREAM_WAIT_MS passed.
+ * @details The waiting flag is raised before the ring is checked again under
+ *          the lock, and the other side reads the flag after publishing, so a
+ *          wake-up cannot be missed; the timeout is only a safety net.
+ * @param pipe The ring.
+ * @param for_room true for the producer, waiting for free space; false for the
+ *                 consumer, waiting for data.
+ */
+static void stream_pipe_wait(StreamPipe* pipe, bool for_room) {
+    atomic_bool* waiting = for_room ? &pipe->producer_waiting : &pipe->consumer_waiting;
+    pthread_mutex_lock(&pipe->lock);
+    atomic_store(waiting, true);
+    size_t fill = atomic_load(&pipe->head) - atomic_load(&pipe->tail);
+    bool ready = for_room ? fill < STREAM_RING_SIZE : fill > 0 || atomic_load(&pipe->closed);
+    if (!ready && !atomic_load(&pipe->failed)) {
+        struct timespec until;
+        clock_gettime(CLOCK_REALTIME, &until);
+        until.tv_nsec += STREAM_WAIT_MS * 1000000L;
+        if (until.tv_nsec >= 1000000000L) {
+            until.tv_sec++;
+            until.tv_nsec -= 1000000000L;
+        }
+        pthread_cond_timedwait(&pipe->wake, &pipe->lock, &until);
+    }
+    atomic_store(waiting, false);
+    pthread_mutex_unlock(&pipe->lock);
+}
+
+/**
+ * @brief Body of the renderer thread: passes the ring's contents to the real write callback.
+ * @details Runs until the transfer is over and the ring is drained. Once the
+ *          callback refuses data (or the user interrupts), the rest is
+ *          discarded so the producer never blocks on a ring nobody empties.
+ */
+static void* stream_pipe_consume(void* arg) {
+    StreamPipe* pipe = arg;
+    bool idle = false;
+    for (;;) {
+        size_t tail = atomic_load_explicit(&pipe->tail, memory_order_relaxed);
+        size_t head = atomic_load_explicit(&pipe->head, memory_order_acquire);
+        if (head == tail) {
+            // `closed` is set after the last write, so look at the head once more.
+            if (atomic_load(&pipe->closed) && atomic_load(&pipe->head) == tail) break;
+            if (!idle) pipe->waits++;
+            idle = true;
+            stream_pipe_wait(pipe, false);
+            continue;
+        }
+        idle = false;
+
+        size_t offset = tail & (STREAM_RING_SIZE - 1);
+        size_t length = head - tail;
+        if (length > STREAM_RING_SIZE - offset) length = STREAM_RING_SIZE - offset;
+        if (interrupt_flag) atomic_store(&pipe->failed, true);
+        if (!atomic_load(&pipe->failed) && pipe->sink(pipe->data + offset, 1, length, pipe->sink_data) != length) {
+            atomic_store(&pipe->failed, true);
+        }
+        atomic_store_explicit(&pipe->tail, tail + length, memory_order_release);
+        if (atomic_load(&pipe->producer_waiting)) stream_pipe_signal(pipe);
+    }
+    return NULL;
+}
+
+/**
+ * @brief Starts a receive ring and its renderer thread in front of a write callback.
+ * @details Until `stream_pipe_close` returns, the callback and its data belong
+ *          to the renderer thread and must not be touched by the caller. If
+ *          the ring or the thread cannot be set up, `stream_pipe_write` calls
+ *          the callback directly, as before.
+ * @param pipe The ring to set up.
+ * @param sink The write callback that parses and prints the response.
+ * @param sink_data The callback's user data.
+ */
+static void stream_pipe_open(StreamPipe* pipe, size_t (*sink)(void*, size_t, size_t, void*), void* sink_data) {
+    memset(pipe, 0, sizeof(*pipe));
+    atomic_init(&pipe->head, 0);
+    atomic_init(&pipe->tail, 0);
+    atomic_init(&pipe->closed, false);
+    atomic_init(&pipe->failed, false);
+    atomic_init(&pipe->consumer_waiting, false);
+    atomic_init(&pipe->producer_waiting, false);
+    pipe->sink = sink;
+    pipe->sink_data = sink_data;
+
+    pipe->data = malloc(STREAM_RING_SIZE);
+    if (!pipe->data) return;
+    pthread_mutex_init(&pipe->lock, NULL);
+    pthread_cond_init(&pipe->wake, NULL);
+    pipe->threaded = pthread_create(&pipe->thread, NULL, stream_pipe_consume, pipe) == 0;
+    if (!pipe->threaded) {
+        pthread_cond_destroy(&pipe->wake);
+        pthread_mutex_destroy(&pipe->lock);
+        free(pipe->data);
+        pipe->data = NULL;
+    }
+}
+
+/**
+ * @brief libcurl write callback that hands received bytes to the renderer thread.
+ * @details Only copies into the ring, so a slow terminal no longer holds up
+ *          reading from the socket. If the ring is full the network side waits
+ *          for room, which is counted as a stall.
+ * @param contents The received data.
+ * @param size The size of each data member.
+ * @param nmemb The number of data members.
+ * @param userp The StreamPipe.
+ * @return The number of bytes taken, or 0 to abort the transfer.
+ */
+static size_t stream_pipe_write(void* contents, size_t size, size_t nmemb, void* userp) {
+    StreamPipe* pipe = userp;
+    if (!pipe->threaded) return pipe->sink(contents, size, nmemb, pipe->sink_data);
+
+    size_t realsize = size * nmemb;
+    const unsigned char* bytes = contents;
+    size_t written = 0;
+    bool stalled = false;
+    struct timespec stall_start;
+    while (written < realsize) {
+        if (interrupt_flag) atomic_store(&pipe->failed, true);
+        if (atomic_load(&pipe->failed)) return 0;
+
+        size_t head = atomic_load_explicit(&pipe->head, memory_order_relaxed);
+        size_t tail = atomic_load_explicit(&pipe->tail, memory_order_acquire);
+        size_t room = STREAM_RING_SIZE - (head - tail);
+        if (room == 0) {
+            if (!stalled) {
+                stalled = true;
+                pipe->stalls++;
+                clock_gettime(CLOCK_MONOTONIC, &stall_start);
+            }
+            stream_pipe_wait(pipe, true);
+            continue;
+        }
+
+        size_t offset = head & (STREAM_RING_SIZE - 1);
+        size_t length = realsize - written;
+        if (length > room) length = room;
+        if (length > STREAM_RING_SIZE - offset) length = STREAM_RING_SIZE - offset;
+        memcpy(pipe->data + offset, bytes + written, length);
+        atomic_store_explicit(&pipe->head, head + length, memory_order_release);
+        written += length;
+
+        size_t fill = head + length - tail;
+        if (fill > pipe->peak_fill) pipe->peak_fill = fill;
+        if (atomic_load(&pipe->consumer_waiting)) stream_pipe_signal(pipe);
+    }
+    if (stalled) {
+        struct timespec now;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        pipe->stall_ms += (now.tv_sec - stall_start.tv_sec) * 1000.0 + (now.tv_nsec - stall_start.tv_nsec) / 1e6;
+    }
+    return realsize;
+}
+
+/**
+ * @brief Waits for the renderer to finish the ring, stops it and records its statistics.
+ * @details Call this once the transfer is over; afterwards the write
+ *          callback's data belongs to the caller again.
+ * @param pipe The ring.
+ * @param stats The session totals to add to.
+ */
+static void stream_pipe_close(StreamPipe* pipe, ReceiveStats* stats) {
+    if (!pipe->threaded) return;
+    atomic_store(&pipe->closed, true);
+    stream_pipe_signal(pipe);
+    pthread_join(pipe->thread, NULL);
+    pthread_cond_destroy(&pipe->wake);
+    pthread_mutex_destroy(&pipe->lock);
+    free(pipe->data);
+    pipe->data = NULL;
+    pipe->threaded = false;
+
+    stats->streams++;
+    stats->bytes += (long long)atomic_load(&pipe->head);
+    if (pipe->peak_fill > stats->peak_fill) stats->peak_fill = pipe->peak_fill;
+    stats->network_stalls += pipe->stalls;
+    stats->stall_ms += pipe->stall_ms;
+    stats->renderer_waits += pipe->waits;
+}
+
+/**
+ * @brief Prints the receive ring statistics for `/stats`.
+ * @param stream The stream to print to.
+ * @param state The current application state.
+ */
+void print_receive_stats(FILE* stream, AppState* state) {
+    const ReceiveStats* stats = &state->receive;
+    fprintf(stream, "Receive ring: %d KiB, peak %.1f%% full; %ld streams, %lld bytes; ",
+            STREAM_RING_SIZE / 1024, 100.0 * stats->peak_fill / STREAM_RING_SIZE, stats->streams, stats->bytes);
+    if (stats->network_stalls > 0) {
+        fprintf(stream, "network stalled %ld times (%.0f ms)", stats->network_stalls, stats->stall_ms);
+    } else {
+        fprintf(stream, "network never stalled");
+    }
+    fprintf(stream, ", renderer idle %ld times\n", stats->renderer_waits);
+}
+
 /**
  * @brief Handles the /deep command for a silent, multi-step self-correction process.
  * @details This function orchestrates an invisible, multi-step conversation with the model.
@@ -385,6 +1217,10 @@ void handle_deep_command(AppState* state, char* initial_prompt, int iterations)
     }
     close(null_fd);
 
+    // An interrupted step must abort the whole run, not feed a fragment into the next one.
+    bool old_keep_partial = state->keep_partial;
+    state->keep_partial = false;
+
     // --- Steps 1-N: Generate and Refine Solutions Silently ---
     for (int i = 0; i < iterations; i++) {
           // Use the dynamically selected temperature for this iteration
@@ -505,6 +1341,7 @@ void handle_deep_command(AppState* state, char* initial_prompt, int iterations)
     }
 
     state->thinking_budget=old_thinking_budget;
+    state->keep_partial = old_keep_partial;
 
     // --- Cleanup ---
     for (int i = 0; i < iterations; i++) {
@@ -557,6 +1394,10 @@ void generate_session(int argc, char* argv[], bool interactive, bool is_stdin_a_
     // --- 3. Argument Processing ---
     // Parse standard options like --model, --temp, etc.
     int first_arg_index = parse_common_options(argc, argv, &state);
+    // Combine the configured hosts and proxies into routes, then reuse
+    // addresses and TLS sessions of earlier invocations.
+    endpoint_pool_build(&state);
+    transport_load_net_cache(&state.transport, endpoint_pool_uses_proxy(&state));
 
     // Buffer to aggregate prompt text from command line arguments.
     char initial_prompt_buffer[16384] = {0};
@@ -585,7 +1426,7 @@ void generate_session(int argc, char* argv[], bool interactive, bool is_stdin_a_
             struct stat st;
             // Check if it's a regular file.
             if (fstat(fileno(file_arg), &st) == 0 && S_ISREG(st.st_mode)) {
-                handle_attachment_from_stream(file_arg, argv[i], get_mime_type(argv[i]), &state);
+                handle_attachment_from_stream(file_arg, argv[i], NULL, &state);
             } else {
                 // If it's not a regular file (e.g., a directory), treat it as prompt text.
                 size_t arg_len = strlen(argv[i]);
@@ -803,6 +1644,10 @@ void generate_session(int argc, char* argv[], bool interactive, bool is_stdin_a_
         char* line = NULL;
         char prompt_buffer[16384];
 
+        // Open (and keep alive) the connection for the next turn while the user types.
+        prewarm_state = &state;
+        rl_event_hook = prewarm_event_hook;
+
         while (1) {
         	  interrupt_flag = 1;
             // Display the prompt, e.g., "([unsaved])>: "
@@ -847,6 +1692,7 @@ void generate_session(int argc, char* argv[], bool interactive, bool is_stdin_a_
                     } else {
                         // Call the handler with the correct, dynamically set depth.
                         handle_deep_command(&state, deep_prompt, depth);
+                        report_prewarm_saving(&state);
                     }
 
                     // The single, shared block for history and cleanup.
@@ -943,7 +1789,8 @@ void generate_session(int argc, char* argv[], bool interactive, bool is_stdin_a_
                        "  /session list              - List all saved sessions.\n"
                        "  /session save <name>       - Save the current chat to a named session.\n"
                        "  /session load <name>       - Load a named session.\n"
-                       "  /session delete <name>     - Delete a named session.\n");
+                       "  /session delete <name>     - Delete a named session.\n"
+                       "  /blobs [gc]                - Show the attachment blob store, or delete blobs no session uses.\n");
                 } else if (strcmp(command_buffer, "/keys") == 0) {
                     char sub_command[64] = {0};
                     char arg_str[256] = {0}; // Buffer for key or index
@@ -954,6 +1801,7 @@ void generate_session(int argc, char* argv[], bool interactive, bool is_stdin_a_
                         if (state.num_api_keys == 0) {
                             fprintf(stderr, "  (No API keys are currently loaded)\n");
                         } else {
+                            int next_index = key_scheduler_pick(&state);
                             for (int i = 0; i < state.num_api_keys; i++) {
                                 const char* key = state.api_keys[i];
                                 const char* origin = state.origins[i];
@@ -964,9 +1812,10 @@ void generate_session(int argc, char* argv[], bool interactive, bool is_stdin_a_
                                 } else {
                                     fprintf(stderr, "%.*s... (%s)", (int)key_len, key, origin);
                                 }
-                                if (i == state.next_key_index) {
+                                if (i == next_index) {
                                     fprintf(stderr, " (next)");
                                 }
+                                print_key_health(stderr, &state, key);
                                 fprintf(stderr, "\n");
                             }
                         }
@@ -976,10 +1825,13 @@ void generate_session(int argc, char* argv[], bool interactive, bool is_stdin_a_
                             fprintf(stderr, "Usage: /keys add <api_key_string>\n");
                         } else {
                             char** new_keys = realloc(state.api_keys, sizeof(char*) * (state.num_api_keys + 1));
-                            if (!new_keys) {
+                            char** new_origins = new_keys ? realloc(state.origins, sizeof(char*) * (state.num_api_keys + 1)) : NULL;
+                            if (new_keys) state.api_keys = new_keys;
+                            if (!new_keys || !new_origins) {
                                 fprintf(stderr, "Error: Failed to allocate memory for new key.\n");
                             } else {
-                                state.api_keys = new_keys;
+                                state.origins = new_origins;
+                                state.origins[state.num_api_keys] = strdup("default");
                                 state.api_keys[state.num_api_keys] = strdup(arg_str);
                                 state.num_api_keys++;
                                 fprintf(stderr, "Added key (index %d). Use '/config save' to make it permanent.\n", state.num_api_keys - 1);
@@ -994,8 +1846,10 @@ void generate_session(int argc, char* argv[], bool interactive, bool is_stdin_a_
                                 fprintf(stderr, "Error: Invalid key index.\n");
                             } else {
                                 free(state.api_keys[index]);
+                                free(state.origins[index]);
                                 if (index < state.num_api_keys - 1) {
                                     memmove(&state.api_keys[index], &state.api_keys[index + 1], sizeof(char*) * (state.num_api_keys - index - 1));
+                                    memmove(&state.origins[index], &state.origins[index + 1], sizeof(char*) * (state.num_api_keys - index - 1));
                                 }
                                 state.num_api_keys--;
                                 // Adjust next_key_index if it's now out of bounds
@@ -1007,28 +1861,7 @@ void generate_session(int argc, char* argv[], bool interactive, bool is_stdin_a_
                         }
                     } else if (strcmp(sub_command, "check") == 0) {
                          fprintf(stderr, "Checking API keys...\n");
-                         if (state.num_api_keys == 0) {
-                            fprintf(stderr, "  (No keys to check)\n");
-                         } else {
-                            int original_next_index = state.next_key_index;
-                            for (int i = 0; i < state.num_api_keys; i++) {
-                                state.next_key_index = i; // Temporarily set the index to the key we want to test
-                                int token_count = get_token_count(&state);
-
-                                const char* key = state.api_keys[i];
-                                size_t key_len = strlen(key);
-                                fprintf(stderr, "  [%d] ", i);
-                                if (key_len > 11) fprintf(stderr, "%.4s...%.4s", key + 6, key + key_len - 4);
-                                else fprintf(stderr, "%.*s...", (int)key_len, key);
-
-                                if (token_count >= 0) {
-                                    fprintf(stderr, " : OK\n");
-                                } else {
-                                    fprintf(stderr, " : FAILED\n");
-                                }
-                            }
-                            state.next_key_index = original_next_index; // Restore the original index
-                         }
+                         check_api_keys(&state, stderr);
                     } else {
                         fprintf(stderr, "Unknown command for '/keys'. Use list, add, remove, or check.\n");
                     }
@@ -1095,6 +1928,16 @@ void generate_session(int argc, char* argv[], bool interactive, bool is_stdin_a_
                     } else {
                         fprintf(stderr,"Unknown session command: '%s'. Use '/help' to see options.\n", sub_command);
                     }
+                } else if (strcmp(command_buffer, "/blobs") == 0) {
+                    char sub_command[64] = {0};
+                    sscanf(arg_start, "%63s", sub_command);
+                    if (sub_command[0] == '\0' || strcmp(sub_command, "list") == 0) {
+                        blob_store_print(&state, stderr);
+                    } else if (strcmp(sub_command, "gc") == 0) {
+                        blob_store_gc(&state, stderr);
+                    } else {
+                        fprintf(stderr, "Usage: /blobs [list|gc]\n");
+                    }
                 } else if (strcmp(command_buffer, "/config") == 0) {
                     char sub_command[64] = {0};
                     sscanf(arg_start, "%63s", sub_command);
@@ -1103,13 +1946,16 @@ void generate_session(int argc, char* argv[], bool interactive, bool is_stdin_a_
                         save_configuration(&state);
                     } else if (strcmp(sub_command, "load") == 0) {
                         load_configuration(&state);
+                        endpoint_pool_build(&state);
                         fprintf(stderr, "Configuration reloaded from file.\n");
                     } else {
                         fprintf(stderr, "Usage: /config <save|load>\n");
                     }
                 } else if (strcmp(command_buffer, "/host") == 0) {
                     if (*arg_start == '\0') {
-                        if (state.host) {
+                        if (state.endpoints.num_routes > 1) {
+                            print_endpoint_pool(stderr, &state);
+                        } else if (state.host) {
                             fprintf(stderr, "Host is https://%s\n", state.host);
                         } else {
                             fprintf(stderr, "Host is empty.\n");
@@ -1120,6 +1966,8 @@ void generate_session(int argc, char* argv[], bool interactive, bool is_stdin_a_
                         if (!state.host) {
                             fprintf(stderr, "Error: Failed to allocate memory for host.\n");
                         } else {
+                            free_string_list(&state.endpoints.hosts, &state.endpoints.num_hosts);
+                            endpoint_pool_build(&state);
                             fprintf(stderr, "Host set to: '%s'\n", state.host);
                         }
                     }
@@ -1133,6 +1981,42 @@ void generate_session(int argc, char* argv[], bool interactive, bool is_stdin_a_
                     fprintf(stderr,"System Prompt: %s\n", state.system_prompt ? state.system_prompt : "Not set");
                     fprintf(stderr,"Messages in history: %d\n", state.history.num_contents);
                     fprintf(stderr,"Pending attachments: %d\n", state.num_attached_parts);
+                    fprintf(stderr,"Connections: %ld new, %ld reused\n", state.transport.new_connections, state.transport.reused_connections);
+                    if (state.endpoints.num_routes > 1) {
+                        print_endpoint_pool(stderr, &state);
+                    }
+                    fprintf(stderr,"Pre-warming: %s (handshake time saved: %.0f ms)\n", state.transport.prewarm_enabled ? "ON" : "OFF", state.transport.warm_total_saved_ms);
+                    fprintf(stderr,"Network cache: %s (%d addresses, %d TLS sessions reused from earlier runs)\n", state.transport.net_cache ? "ON" : "OFF",
+                            state.transport.cached_addresses, state.transport.cached_tls_sessions);
+                    fprintf(stderr,"Retries: %ld taken, %d of %d left in budget\n", state.retry.retries_taken, state.retry.budget_left, state.retry.budget);
+                    if (state.rate_limit.rpm > 0 || state.rate_limit.tpm > 0 || state.rate_limit.rpd > 0) {
+                        fprintf(stderr,"Rate limits per key: %d rpm, %d tpm, %d rpd (0 = none); %ld delayed (%.1f s), %ld rerouted\n",
+                                state.rate_limit.rpm, state.rate_limit.tpm, state.rate_limit.rpd,
+                                state.rate_limit.delayed_requests, state.rate_limit.total_wait_ms / 1000.0, state.rate_limit.rerouted_requests);
+                    }
+                    if (state.hedge.enabled) {
+                        fprintf(stderr,"Hedging: ON (p%d of %d samples); %ld hedged, %ld won by the second key\n",
+                                state.hedge.percentile, state.hedge.num_samples, state.hedge.hedged_requests, state.hedge.hedge_wins);
+                    }
+                    if (state.failover.enabled) {
+                        print_failover_status(stderr, &state);
+                    }
+                    if (state.live.enabled) {
+                        print_live_status(stderr, &state);
+                    }
+                    if (state.receive.streams > 0) {
+                        print_receive_stats(stderr, &state);
+                    }
+                    print_compression_stats(stderr, &state);
+                    if (state.blob_store.shared > 0 || state.blob_store.written > 0) {
+                        fprintf(stderr,"Blob store: %ld attachments shared instead of held twice, %ld written (%.1f MB)\n",
+                                state.blob_store.shared, state.blob_store.written, state.blob_store.bytes_written / 1048576.0);
+                    }
+                    if (state.files.uploads > 0 || state.files.reused > 0) {
+                        fprintf(stderr,"Files API: %ld uploaded (%.1f MB), %ld reused from the upload cache\n",
+                                state.files.uploads, state.files.bytes_uploaded / 1048576.0, state.files.reused);
+                    }
+                    print_context_cache_stats(stderr, &state);
 
                     if (state.history.num_contents == 0 && state.num_attached_parts == 0) {
                         fprintf(stderr,"---------------------\n");
@@ -1346,7 +2230,7 @@ void generate_session(int argc, char* argv[], bool interactive, bool is_stdin_a_
                         // Step 2: Attach the file using the *original*, unchanged function.
                         // We pass NULL for the stream because we are providing a filepath.
                         // (The function will open the file itself).
-                        handle_attachment_from_stream(NULL, filename, get_mime_type(filename), &state);
+                        handle_attachment_from_stream(NULL, filename, NULL, &state);
 
                         // Step 3: Check if an optional prompt was provided after the filename.
                         prompt_start = strstr(arg_start, filename);
@@ -1415,6 +2299,7 @@ void generate_session(int argc, char* argv[], bool interactive, bool is_stdin_a_
                                 if (part_to_remove->mime_type) free(part_to_remove->mime_type);
                                 if (part_to_remove->base64_data) free(part_to_remove->base64_data);
                                 if (part_to_remove->uri) free(part_to_remove->uri);
+                                blob_release(part_to_remove->blob);
 
 
                                 if (index_to_remove < state.num_attached_parts - 1) {
@@ -1495,11 +2380,13 @@ void generate_session(int argc, char* argv[], bool interactive, bool is_stdin_a_
                                         if (part_to_remove->base64_data) free(part_to_remove->base64_data);
                                         if (part_to_remove->text) free(part_to_remove->text);
                                         if (part_to_remove->uri) free(part_to_remove->uri);
+                                        blob_release(part_to_remove->blob);
 
                                         if (part_idx < content->num_parts - 1) {
                                             memmove(&content->parts[part_idx], &content->parts[part_idx + 1], (content->num_parts - part_idx - 1) * sizeof(Part));
                                         }
                                         content->num_parts--;
+                                        content_invalidate_cache(content);
                                     }
                                 }
                             }
@@ -1585,6 +2472,7 @@ void generate_session(int argc, char* argv[], bool interactive, bool is_stdin_a_
                     }
                 }
                 free(current_turn_prompt);
+                report_prewarm_saving(&state);
 
             } else { // Logic for handling prompts with the official API.
                 int total_parts = state.num_attached_parts + (strlen(p) > 0 ? 1 : 0);
@@ -1628,10 +2516,14 @@ void generate_session(int argc, char* argv[], bool interactive, bool is_stdin_a_
                         free_content(&state.history.contents[state.history.num_contents]);
                     }
                 }
+                report_prewarm_saving(&state);
             }
 
             free(line);
         }
+
+        rl_event_hook = NULL;
+        prewarm_state = NULL;
     }
 
     if (state.save_session_path) {
@@ -1657,6 +2549,7 @@ void generate_session(int argc, char* argv[], bool interactive, bool is_stdin_a_
         free(state.origins);
     }
 
+    free_key_health(&state);
     if(state.host) free(state.host);
     if(state.last_model_response) free(state.last_model_response);
     if(state.last_free_response_part) free(state.last_free_response_part);
@@ -1664,6 +2557,15 @@ void generate_session(int argc, char* argv[], bool interactive, bool is_stdin_a_
     if(state.final_code) free(state.final_code);
     free_history(&state.history);
     free_pending_attachments(&state);
+    live_close(&state.live);
+    free(state.live.model);
+    context_cache_forget(&state, false);
+    free(state.context_cache.refresh_response.buffer);
+    endpoint_pool_free(&state);
+    free_string_list(&state.endpoints.hosts, &state.endpoints.num_hosts);
+    free_string_list(&state.endpoints.proxies, &state.endpoints.num_proxies);
+    transport_save_net_cache(&state.transport);
+    transport_cleanup(&state.transport);
 
     if (interactive) fprintf(stderr,"\nExiting session.\n");
 }
@@ -1728,32 +2630,27 @@ const char* get_image_mime_type_from_data(const unsigned char* data, size_t size
 
 /**
  * @brief Determines the MIME type of a file by inspecting its content and extension.
- * @details This function first attempts to open the file and read its header to
- *          check for known "magic bytes" (for images) or to heuristically
- *          determine if it's a text file. If the file cannot be opened or if the
- *          content is inconclusive, it falls back to checking the file extension
- *          using efficient array lookups.
+ * @details The start of the content is checked first for known "magic bytes"
+ *          (for images) and heuristically for text. If that is inconclusive,
+ *          it falls back to checking the file extension using efficient array
+ *          lookups. The caller passes the content it already has, so the file
+ *          is not opened a second time just to look at its header.
  * @param filename The name of the file.
+ * @param header The start of the content (the first 1 KB is looked at); may be NULL.
+ * @param header_size The number of bytes available at `header`.
  * @return A constant string literal representing the guessed MIME type.
  */
-const char* get_mime_type(const char* filename) {
+const char* get_mime_type(const char* filename, const unsigned char* header, size_t header_size) {
     // --- Content-Aware Analysis ---
-    FILE *file = fopen(filename, "rb");
-    if (file) {
-        unsigned char buffer[1024];
-        size_t bytes_read = fread(buffer, 1, sizeof(buffer), file);
-        fclose(file);
-
-        if (bytes_read > 0) {
-            // 1. Check for image formats by magic bytes first.
-            const char* image_mime = get_image_mime_type_from_data(buffer, bytes_read);
-            if (image_mime != NULL) {
-                return image_mime;
-            }
-            // 2. Heuristically check if the file is plain text.
-            if (is_data_text(buffer, bytes_read)) {
-                return "text/plain";
-            }
+    if (header && header_size > 0) {
+        // 1. Check for image formats by magic bytes first.
+        const char* image_mime = get_image_mime_type_from_data(header, header_size);
+        if (image_mime != NULL) {
+            return image_mime;
+        }
+        // 2. Heuristically check if the file is plain text.
+        if (is_data_text(header, header_size)) {
+            return "text/plain";
         }
     }
 
@@ -2233,6 +3130,181 @@ char* build_free_request_payload(AppState* state, const char* current_prompt, bo
     return final_json_str;
 }
 
+/**
+ * @brief Returns the next value of the jitter generator.
+ * @details A small xorshift generator, seeded lazily from the clock and the
+ *          process id so that concurrently started invocations do not pick the
+ *          same delays. The global `rand()` state is left alone because `--seed`
+ *          is a model parameter, not a process-wide setting.
+ */
+static uint32_t retry_random(void) {
+    static uint32_t rng = 0;
+    if (rng == 0) {
+        struct timespec now;
+        clock_gettime(CLOCK_REALTIME, &now);
+        rng = (uint32_t)now.tv_nsec ^ ((uint32_t)now.tv_sec << 7) ^ ((uint32_t)getpid() << 16);
+        if (rng == 0) rng = 0x9e3779b9u;
+    }
+    rng ^= rng << 13;
+    rng ^= rng >> 17;
+    rng ^= rng << 5;
+    return rng;
+}
+
+/**
+ * @brief Classifies a failed attempt as retryable or fatal.
+ * @details Throttling (429), request timeouts (408) and transient server errors
+ *          (500, 502, 503, 504) are worth another attempt, as are network errors
+ *          that may clear up (connect, resolve, TLS handshake, timeouts, dropped
+ *          or empty replies, HTTP/2 stream resets). Everything else - malformed
+ *          requests, bad keys, missing models, local failures and transfers that
+ *          were aborted on purpose - fails the same way every time.
+ * @param http_code The HTTP status, or a negative CURLcode for transport errors.
+ * @param result The CURLcode the transfer finished with.
+ * @return true if the request may succeed when repeated.
+ */
+static bool retry_is_retryable(long http_code, CURLcode result) {
+    // Aborted by a callback (interrupt, --loc/--map early exit): never repeat.
+    if (result == CURLE_WRITE_ERROR || result == CURLE_ABORTED_BY_CALLBACK) return false;
+
+    if (http_code < 0) {
+        switch ((CURLcode)-http_code) {
+            case CURLE_COULDNT_RESOLVE_PROXY:
+            case CURLE_COULDNT_RESOLVE_HOST:
+            case CURLE_COULDNT_CONNECT:
+            case CURLE_OPERATION_TIMEDOUT:
+            case CURLE_SSL_CONNECT_ERROR:
+            case CURLE_SEND_ERROR:
+            case CURLE_RECV_ERROR:
+            case CURLE_GOT_NOTHING:
+            case CURLE_PARTIAL_FILE:
+            case CURLE_HTTP2:
+            case CURLE_HTTP2_STREAM:
+                return true;
+            default:
+                return false;
+        }
+    }
+
+    switch (http_code) {
+        case 200: // Reached only for an empty answer, which is transient.
+        case 408:
+        case 429:
+        case 500:
+        case 502:
+        case 503:
+        case 504:
+            return true;
+        default:
+            return false;
+    }
+}
+
+/**
+ * @brief Sleeps for a backoff delay, keeping background transfers moving.
+ * @details The wait is sliced so that Ctrl+C cancels it promptly; while other
+ *          transfers are in flight the slices are spent driving the request
+ *          engine instead of idling.
+ * @param state The current application state.
+ * @param delay_ms The time to wait in milliseconds.
+ * @return false if the wait was interrupted by the user.
+ */
+static bool retry_sleep(AppState* state, long delay_ms) {
+    struct timespec start, now;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (;;) {
+        if (interrupt_flag) return false;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        long elapsed_ms = (now.tv_sec - start.tv_sec) * 1000L + (now.tv_nsec - start.tv_nsec) / 1000000L;
+        long remaining_ms = delay_ms - elapsed_ms;
+        if (remaining_ms <= 0) return true;
+        long slice_ms = remaining_ms < 50 ? remaining_ms : 50;
+        if (state->transport.active_transfers > 0) {
+            transport_poll(&state->transport, (int)slice_ms);
+        } else {
+            struct timespec pause = { 0, slice_ms * 1000000L };
+            nanosleep(&pause, NULL);
+        }
+    }
+}
+
+/**
+ * @brief Decides whether a failed request should be repeated, and waits if so.
+ * @details This is the single retry policy shared by every API call. A failure
+ *          is retried only if it is retryable (see `retry_is_retryable`), the
+ *          attempt limit is not reached and the per-process retry budget is not
+ *          exhausted; a key-specific failure (429, 401, 403) is retried on
+ *          another key whenever the key scheduler has one ready, without a
+ *          backoff for a rejected key (401, 403). The delay
+ *          uses exponential backoff with full jitter, a uniformly random wait
+ *          between 0 and min(max_delay, base * 2^n), so that many clients
+ *          failing together do not retry in lockstep. A
+ *          Retry-After header from the server is a lower bound on the wait; if
+ *          it asks for longer than the maximum delay the request is given up.
+ *          Every decision is logged to stderr as one line of key=value pairs,
+ *          for example:
+ *          `[retry] op=generate attempt=1 status=503 class=retryable retry_after_s=1 delay_ms=1000 budget_left=9 decision=retry`
+ * @param state The current application state holding the policy.
+ * @param operation A short name of the operation, used in the log line.
+ * @param attempt The 1-based number of the attempt that just failed.
+ * @param http_code The HTTP status of that attempt, or a negative CURLcode.
+ * @return true if the caller should try again (the backoff has been slept),
+ *         false if it should give up.
+ */
+bool retry_policy_should_retry(AppState* state, const char* operation, int attempt, long http_code) {
+    RetryPolicy* policy = &state->retry;
+    CURLcode result = state->transport.last_result;
+    long retry_after_s = state->transport.last_retry_after;
+    bool retryable = retry_is_retryable(http_code, result);
+
+    // A 429 throttles the key, not the client, and a 401/403 rejects only that
+    // key: when the scheduler has another key ready, the retry goes there and
+    // the server's Retry-After does not apply.
+    bool other_key_ready = !state->free_mode && key_scheduler_available(state) > 0;
+    if (http_code == 429 && other_key_ready) {
+        retry_after_s = 0;
+    }
+    bool key_rejected = (http_code == 401 || http_code == 403) && other_key_ready;
+    if (key_rejected) {
+        retryable = true;
+    }
+
+    const char* decision = "retry";
+    long delay_ms = 0;
+    if (!retryable) {
+        decision = "give_up_fatal";
+    } else if (attempt >= policy->max_attempts) {
+        decision = "give_up_attempts";
+    } else if (policy->budget_left <= 0) {
+        decision = "give_up_budget";
+    } else if (retry_after_s * 1000L > policy->max_delay_ms) {
+        decision = "give_up_retry_after";
+    } else {
+        long cap_ms = policy->base_delay_ms;
+        for (int i = 1; i < attempt && cap_ms < policy->max_delay_ms; i++) cap_ms *= 2;
+        if (cap_ms > policy->max_delay_ms) cap_ms = policy->max_delay_ms;
+        // Nothing is overloaded when a key is rejected, so the next one goes at once.
+        delay_ms = cap_ms > 0 && !key_rejected ? (long)(retry_random() % (uint32_t)(cap_ms + 1)) : 0;
+        if (delay_ms < retry_after_s * 1000L) delay_ms = retry_after_s * 1000L;
+    }
+
+    bool retry = strcmp(decision, "retry") == 0;
+    if (retry) {
+        policy->budget_left--;
+        policy->retries_taken++;
+    }
+    fprintf(stderr, "[retry] op=%s attempt=%d status=%ld class=%s retry_after_s=%ld delay_ms=%ld budget_left=%d decision=%s\n",
+            operation, attempt, http_code, retryable ? "retryable" : "fatal", retry_after_s, delay_ms, policy->budget_left, decision);
+    if (!retry) return false;
+
+    if (!retry_sleep(state, delay_ms)) {
+        fprintf(stderr, "\n[Interrupted]\n");
+        interrupt_flag = 0;
+        return false;
+    }
+    return true;
+}
+
 /**
  * @brief Sends a request to the unofficial, key-free Gemini API with retry logic.
  * @details This function orchestrates the entire process of making a request
@@ -2257,11 +3329,11 @@ bool send_free_api_request(AppState* state, const char* prompt) {
 
     long http_code = 0;
     CURLcode res = CURLE_OK;
-    int max_retries = 3;
 
-    for (int i = 0; i < max_retries; i++) {
-        // All cURL resources must be initialized inside the loop for a clean retry.
-        CURL* curl = curl_easy_init();
+    for (int attempt = 1; ; attempt++) {
+        endpoint_pool_select(state);
+        // The handle comes from the session pool, so a retry reuses the open connection.
+        CURL* curl = transport_acquire(&state->transport);
         if (!curl) {
             res = CURLE_FAILED_INIT;
             break; // Fatal error, no point retrying.
@@ -2270,9 +3342,9 @@ bool send_free_api_request(AppState* state, const char* prompt) {
         char* escaped_payload = curl_easy_escape(curl, freq_payload, 0);
         if (!escaped_payload) {
             fprintf(stderr, "Error: Failed to URL-encode payload.\n");
-            curl_easy_cleanup(curl);
+            transport_release(&state->transport, curl);
             res = CURLE_OUT_OF_MEMORY;
-            continue; // Try again.
+            break; // Fatal error, no point retrying.
         }
 
         size_t post_fields_len = strlen("f.req=") + strlen(escaped_payload) + 1;
@@ -2297,14 +3369,16 @@ bool send_free_api_request(AppState* state, const char* prompt) {
         }
         curl_easy_setopt(curl, CURLOPT_HTTPHEADER, headers);
         curl_easy_setopt(curl, CURLOPT_POSTFIELDS, post_fields);
-        curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, write_free_memory_callback);
-        curl_easy_setopt(curl, CURLOPT_WRITEDATA, &callback_data);
+        StreamPipe pipe;
+        stream_pipe_open(&pipe, write_free_memory_callback, &callback_data);
+        curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, stream_pipe_write);
+        curl_easy_setopt(curl, CURLOPT_WRITEDATA, &pipe);
 
-        http_code = 0;
-        res = curl_easy_perform(curl);
-        curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &http_code);
+        // The engine releases the handle and frees the headers once the transfer is done.
+        res = transport_perform(&state->transport, curl, headers, &http_code);
+        stream_pipe_close(&pipe, &state->receive);
 
-        if (res == CURLE_WRITE_ERROR && interrupt_flag) {
+        if (transport_interrupted(res)) {
             fprintf(stderr, "\n[Interrupted]\n");
             interrupt_flag = 0;
         }
@@ -2312,8 +3386,6 @@ bool send_free_api_request(AppState* state, const char* prompt) {
         // Clean up all resources allocated for THIS specific attempt.
         free(post_fields);
         free(chunk.buffer);
-        curl_slist_free_all(headers);
-        curl_easy_cleanup(curl);
 
         // --- Decision Logic for the current attempt ---
 
@@ -2322,14 +3394,14 @@ bool send_free_api_request(AppState* state, const char* prompt) {
             break; // Success, exit the retry loop.
         }
 
-        // Case 2: Retryable server error
-        if ((http_code != 403) && (http_code!=200)){
-            fprintf(stderr, "\nAPI returned %ld (Service Unavailable), retrying... (%d/%d)\n", http_code, i + 1, max_retries);
-            if (i < max_retries - 1) { // Don't sleep after the final attempt.
-                sleep(2);
-            }
-        } else {
-            // Case 3: Any other error is final, so don't retry.
+        // Case 2: The answer was already (partly) streamed, so repeating it is not an option.
+        if (http_code == 200) {
+            break;
+        }
+
+        // Case 3: Let the shared retry policy decide.
+        long status = (res != CURLE_OK && http_code == 0) ? -(long)res : http_code;
+        if (!retry_policy_should_retry(state, "free_generate", attempt, status)) {
             break;
         }
     }
@@ -2342,9 +3414,14 @@ bool send_free_api_request(AppState* state, const char* prompt) {
     if ((res == CURLE_OK && http_code == 200) || (res == CURLE_WRITE_ERROR && state->loc_gathered)) {
         return true;
     }
+    if ((res == CURLE_WRITE_ERROR || res == CURLE_ABORTED_BY_CALLBACK) && http_code == 200 &&
+        state->keep_partial && state->last_free_response_part && state->last_free_response_part[0] != '\0') {
+        fprintf(stderr, "[Partial answer kept in the history]\n");
+        return true;
+    }
 
-    // If we're here, all retries failed.
-    fprintf(stderr, "\nFree API call failed after retries (Last HTTP code: %ld, Curl error: %s)\n", http_code, curl_easy_strerror(res));
+    // If we're here, the last attempt failed.
+    fprintf(stderr, "\nFree API call failed (Last HTTP code: %ld, Curl error: %s)\n", http_code, curl_easy_strerror(res));
     return false;
 }
 
@@ -2372,15 +3449,24 @@ void save_configuration(AppState* state) {
         return;
     }
 
-    // Add all configurable values from the state to the JSON object.
-    cJSON_AddStringToObject(root, "host", state->host);
+    // Add all configurable values from the state to the JSON object. With an
+    // endpoint pool, `host` and `proxy` follow the active route, so the
+    // configured lists are saved instead.
+    const EndpointPool* pool = &state->endpoints;
+    cJSON_AddStringToObject(root, "host", pool->num_hosts > 0 ? pool->hosts[0] : state->host);
+    if (pool->num_hosts > 0) {
+        cJSON_AddItemToObject(root, "hosts", cJSON_CreateStringArray((const char * const *)pool->hosts, pool->num_hosts));
+    }
+    if (pool->num_proxies > 0) {
+        cJSON_AddItemToObject(root, "proxies", cJSON_CreateStringArray((const char * const *)pool->proxies, pool->num_proxies));
+    }
     cJSON_AddStringToObject(root, "model", state->model_name);
     cJSON_AddNumberToObject(root, "temperature", state->temperature);
     cJSON_AddNumberToObject(root, "seed", state->seed);
     if (state->system_prompt) {
         cJSON_AddStringToObject(root, "system_prompt", state->system_prompt);
     }
-    if (state->proxy[0] != '\0') {
+    if (pool->num_proxies == 0 && state->proxy[0] != '\0') {
         cJSON_AddStringToObject(root, "proxy", state->proxy);
     }
 
@@ -2407,6 +3493,34 @@ void save_configuration(AppState* state) {
     if (state->topP > 0.0f) {
         cJSON_AddNumberToObject(root, "top_p", state->topP);
     }
+    if (!state->transport.prewarm_enabled) {
+        cJSON_AddBoolToObject(root, "prewarm", false);
+    }
+    if (!state->transport.net_cache_enabled) {
+        cJSON_AddBoolToObject(root, "net_cache", false);
+    }
+    // Only save the retry policy where it differs from the defaults.
+    if (state->retry.max_attempts != RETRY_DEFAULT_MAX_ATTEMPTS) cJSON_AddNumberToObject(root, "retry_max_attempts", state->retry.max_attempts);
+    if (state->retry.base_delay_ms != RETRY_DEFAULT_BASE_DELAY_MS) cJSON_AddNumberToObject(root, "retry_base_delay_ms", state->retry.base_delay_ms);
+    if (state->retry.max_delay_ms != RETRY_DEFAULT_MAX_DELAY_MS) cJSON_AddNumberToObject(root, "retry_max_delay_ms", state->retry.max_delay_ms);
+    if (state->retry.budget != RETRY_DEFAULT_BUDGET) cJSON_AddNumberToObject(root, "retry_budget", state->retry.budget);
+    if (state->rate_limit.rpm > 0 || state->rate_limit.tpm > 0 || state->rate_limit.rpd > 0) {
+        cJSON* rate_limits = cJSON_AddObjectToObject(root, "rate_limits");
+        if (state->rate_limit.rpm > 0) cJSON_AddNumberToObject(rate_limits, "rpm", state->rate_limit.rpm);
+        if (state->rate_limit.tpm > 0) cJSON_AddNumberToObject(rate_limits, "tpm", state->rate_limit.tpm);
+        if (state->rate_limit.rpd > 0) cJSON_AddNumberToObject(rate_limits, "rpd", state->rate_limit.rpd);
+    }
+    if (state->hedge.enabled) cJSON_AddBoolToObject(root, "hedging", true);
+    if (state->hedge.percentile != HEDGE_DEFAULT_PERCENTILE) cJSON_AddNumberToObject(root, "hedge_percentile", state->hedge.percentile);
+    if (state->failover.enabled) cJSON_AddBoolToObject(root, "failover", true);
+    if (!state->auto_continue) cJSON_AddBoolToObject(root, "auto_continue", false);
+    if (!state->keep_partial) cJSON_AddBoolToObject(root, "keep_partial", false);
+    if (!state->compress.adaptive) cJSON_AddBoolToObject(root, "adaptive_compression", false);
+    if (!state->files.enabled) cJSON_AddBoolToObject(root, "files_api", false);
+    if (!state->blob_store.enabled) cJSON_AddBoolToObject(root, "blob_store", false);
+    if (state->context_cache.min_tokens != CONTEXT_CACHE_DEFAULT_MIN_TOKENS) cJSON_AddNumberToObject(root, "context_cache_min_tokens", state->context_cache.min_tokens);
+    if (state->live.enabled) cJSON_AddBoolToObject(root, "live", true);
+    if (state->live.model) cJSON_AddStringToObject(root, "live_model", state->live.model);
 
     // Convert the cJSON object to a formatted, human-readable string.
     char* json_string = cJSON_Print(root);
@@ -2447,18 +3561,18 @@ void save_configuration(AppState* state) {
  *         DNS failure), it returns a negative CURLcode.
  */
 long perform_api_get_request(const char* url, AppState* state, size_t (*callback)(void*, size_t, size_t, void*), void* callback_data) {
-    CURL* curl = curl_easy_init();
-    if (!curl) {
-        return -CURLE_FAILED_INIT;
-    }
-
     if (state->num_api_keys == 0) {
         fprintf(stderr, "Error: No API key provided.\n");
         return -1;
     }
-    const char* current_key = state->api_keys[state->next_key_index];
-    const char* current_origin = state->origins[state->next_key_index];
-    state->next_key_index = (state->next_key_index + 1) % state->num_api_keys;
+
+    CURL* curl = transport_acquire(&state->transport);
+    if (!curl) {
+        return -CURLE_FAILED_INIT;
+    }
+    int key_index = select_api_key(state);
+    const char* current_key = state->api_keys[key_index];
+    const char* current_origin = state->origins[key_index];
     
     // Prepare the required HTTP headers for authentication.
     char auth_header[256];
@@ -2485,2407 +3599,9149 @@ long perform_api_get_request(const char* url, AppState* state, size_t (*callback
 
     // Execute the request and retrieve the HTTP response code.
     long http_code = 0;
-    CURLcode res = curl_easy_perform(curl);
-    curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &http_code);
+    CURLcode res = transport_perform(&state->transport, curl, headers, &http_code);
 
     // If the request failed at the transport layer (e.g., could not connect),
     // http_code will be 0. In this case, we return the negative cURL error code.
     if (res != CURLE_OK && http_code == 0) {
-        http_code = -res;
+        http_code = -(long)res;
     }
+    key_scheduler_record(state, key_index, http_code);
+    endpoint_pool_record(state, http_code);
 
-    // Clean up allocated resources.
-    curl_easy_cleanup(curl);
-    curl_slist_free_all(headers);
-    
     return http_code;
 }
 
 
 /**
- * @brief Fetches and lists all available models from the Gemini API.
- * @details This function retrieves a list of all models accessible with the
- *          configured API key. It handles API pagination by making repeated
- *          GET requests if a `nextPageToken` is present in the response,
- *          ensuring that all available models are fetched and displayed.
- * @param state The current application state, used to provide the API key
- *              for the request.
+ * @brief Finds the health record of an API key, creating it on first use.
+ * @details Records are keyed by the key string rather than by index, so they
+ *          stay correct when keys are added, removed or reordered.
+ * @param state The current application state owning the cache.
+ * @param key The API key.
+ * @return The record, or NULL on allocation failure.
  */
-void list_available_models(AppState* state) {
-    char next_page_token[256] = {0};
-    bool first_page = true;
-    int model_count = 0;
+KeyHealth* key_health_get(AppState* state, const char* key) {
+    for (int i = 0; i < state->num_key_health; i++) {
+        if (strcmp(state->key_health[i].key, key) == 0) return &state->key_health[i];
+    }
+    KeyHealth* grown = realloc(state->key_health, sizeof(KeyHealth) * (state->num_key_health + 1));
+    if (!grown) return NULL;
+    state->key_health = grown;
+    KeyHealth* health = &state->key_health[state->num_key_health];
+    memset(health, 0, sizeof(*health));
+    health->key = strdup(key);
+    if (!health->key) return NULL;
+    state->num_key_health++;
+    return health;
+}
 
-    // Allocate a memory buffer to store the API's JSON response.
-    MemoryStruct chunk = { .buffer = malloc(1), .size = 0 };
-    if (!chunk.buffer) {
-        fprintf(stderr, "Error: Failed to allocate memory for API response.\n");
-        return;
+/**
+ * @brief Returns the cached validation result of an API key if it is still fresh.
+ * @param state The current application state owning the cache.
+ * @param key The API key.
+ * @return The record if the key was probed less than KEY_CHECK_TTL_SEC seconds
+ *         ago, otherwise NULL.
+ */
+const KeyHealth* key_health_cached(AppState* state, const char* key) {
+    for (int i = 0; i < state->num_key_health; i++) {
+        const KeyHealth* health = &state->key_health[i];
+        if (strcmp(health->key, key) != 0) continue;
+        if (health->checked_at == 0 || time(NULL) - health->checked_at >= KEY_CHECK_TTL_SEC) return NULL;
+        return health;
+    }
+    return NULL;
+}
+
+/**
+ * @brief Frees the API key health cache.
+ * @param state The current application state owning the cache.
+ */
+void free_key_health(AppState* state) {
+    for (int i = 0; i < state->num_key_health; i++) {
+        free(state->key_health[i].key);
     }
-    chunk.buffer[0] = '\0';
+    free(state->key_health);
+    state->key_health = NULL;
+    state->num_key_health = 0;
+}
 
-    fprintf(stderr, "Fetching available models...\n");
+/**
+ * @brief Finds the health record of an API key without creating one.
+ */
+static KeyHealth* key_health_find(AppState* state, const char* key) {
+    for (int i = 0; i < state->num_key_health; i++) {
+        if (strcmp(state->key_health[i].key, key) == 0) return &state->key_health[i];
+    }
+    return NULL;
+}
 
-    // Loop to handle paginated results.
-    do {
-        char full_url[1024];
-
-        // Construct the appropriate URL for the request.
-        if (first_page) {
-            snprintf(full_url, sizeof(full_url), "https://%s/v1beta/models?pageSize=50", state->host);
-            first_page = false;
-        } else {
-            snprintf(full_url, sizeof(full_url), "https://%s/v1beta/models?pageSize=50&pageToken=%s", state->host, next_page_token);
-        }
-
-        // --- START OF MODIFICATION ---
-
-        long http_code = 0;
-        int max_retries = 3;
-
-        for (int i = 0; i < max_retries; i++) {
-            // Reset the response buffer for each new attempt.
-            chunk.size = 0;
-            chunk.buffer[0] = '\0';
+/**
+ * @brief Tells whether a key is quarantined, i.e. known to be rejected by the API.
+ */
+static bool key_is_quarantined(AppState* state, const char* key) {
+    const KeyHealth* cached = key_health_cached(state, key);
+    return cached && cached->status == KEY_STATUS_INVALID;
+}
 
-            // Perform the GET request.
-            http_code = perform_api_get_request(full_url, state, write_to_memory_struct_callback, &chunk);
+/**
+ * @brief Rates how healthy a key is for scheduling; higher is better.
+ * @details The smoothed success rate, (successes + 1) / (requests + 1), so an
+ *          unused key starts at 1.0, scaled down mildly by the key's time to
+ *          first byte so that consistently slow keys are preferred less.
+ */
+static double key_health_score(const KeyHealth* health) {
+    if (!health) return 1.0;
+    double success_rate = (health->successes + 1.0) / (health->requests + 1.0);
+    return success_rate / (1.0 + health->latency_ewma_ms / 10000.0);
+}
 
-            if (http_code == 200) {
-                break; // Success, exit the retry loop.
-            }
+/**
+ * @brief Returns when a key can be scheduled again: the later of its cooldown
+ *        and the time its client-side quota refills.
+ */
+static double key_ready_at(const KeyHealth* health) {
+    if (!health) return 0;
+    return health->cooldown_until > health->quota_ready_at ? (double)health->cooldown_until : health->quota_ready_at;
+}
 
-            if ((http_code != 403) && (http_code!=200)) {
-                fprintf(stderr, "\nAPI returned %ld (Service Unavailable), retrying... (%d/%d)\n", http_code, i + 1, max_retries);
-                if (i < max_retries - 1) { // Don't sleep after the final attempt.
-                    sleep(2);
-                }
-            } else {
-                // Any other error is final, don't retry.
-                break;
-            }
+/**
+ * @brief Chooses the healthiest key that can take a request right now.
+ * @details Quarantined keys, keys in a cooldown window and keys out of
+ *          client-side quota are skipped. Among the rest, every key scoring
+ *          within 5% of the healthiest one is considered equally good, and the
+ *          least recently used of them wins, which spreads load over all
+ *          healthy keys. While a key is pinned (a request references a
+ *          context cache, which only the key that created it can read), that
+ *          key is the only choice.
+ * @param state The current application state.
+ * @param exclude A key index that must not be chosen, or -1.
+ * @return The index of the chosen key, or -1 if no other key is ready.
+ */
+static int key_scheduler_pick_ready(AppState* state, int exclude) {
+    if (state->pinned_key_index >= 0) {
+        return state->pinned_key_index != exclude ? state->pinned_key_index : -1;
+    }
+    double now = wall_clock_now();
+    double best_score = -1.0;
+
+    for (int i = 0; i < state->num_api_keys; i++) {
+        if (i == exclude) continue;
+        const char* key = state->api_keys[i];
+        if (key_is_quarantined(state, key)) continue;
+        const KeyHealth* health = key_health_find(state, key);
+        if (key_ready_at(health) > now) continue;
+        double score = key_health_score(health);
+        if (score > best_score) best_score = score;
+    }
+    if (best_score < 0) return -1;
+
+    int chosen = -1;
+    unsigned long chosen_used = 0;
+    for (int tried = 0; tried < state->num_api_keys; tried++) {
+        // Start at the rotation position so ties keep the familiar round-robin order.
+        int i = (state->next_key_index + tried) % state->num_api_keys;
+        if (i == exclude) continue;
+        const char* key = state->api_keys[i];
+        if (key_is_quarantined(state, key)) continue;
+        const KeyHealth* health = key_health_find(state, key);
+        if (key_ready_at(health) > now) continue;
+        if (key_health_score(health) < best_score * 0.95) continue;
+        unsigned long used = health ? health->last_used : 0;
+        if (chosen < 0 || used < chosen_used) {
+            chosen = i;
+            chosen_used = used;
         }
+    }
+    return chosen;
+}
 
-        // --- END OF MODIFICATION ---
-
-        // This block now correctly handles the final result after all retries.
-        if (http_code != 200) {
-            fprintf(stderr, "\nAPI call to list models failed (Last HTTP code: %ld)\n", http_code);
-            if(http_code < 0) fprintf(stderr, "Curl error: %s\n", curl_easy_strerror(-http_code));
-            parse_and_print_error_json(chunk.buffer);
-            break; // Exit the pagination loop on failure.
+/**
+ * @brief Chooses the key the next request should use, without using it.
+ * @details The healthiest ready key, see `key_scheduler_pick_ready`. If every
+ *          key is cooling down, the one whose cooldown ends first is chosen; if
+ *          every key is quarantined, the plain rotation is used so the API can
+ *          report the error.
+ * @param state The current application state.
+ * @return The index of the chosen key.
+ */
+static int key_scheduler_pick(AppState* state) {
+    int chosen = key_scheduler_pick_ready(state, -1);
+    if (chosen >= 0) return chosen;
+
+    int soonest = -1;
+    double soonest_until = 0;
+    for (int i = 0; i < state->num_api_keys; i++) {
+        const char* key = state->api_keys[i];
+        if (key_is_quarantined(state, key)) continue;
+        double ready_at = key_ready_at(key_health_find(state, key));
+        if (soonest < 0 || ready_at < soonest_until) {
+            soonest = i;
+            soonest_until = ready_at;
         }
+    }
+    return soonest >= 0 ? soonest : state->next_key_index % state->num_api_keys;
+}
 
-        // Parse the JSON response from the buffer.
-        cJSON* root = cJSON_Parse(chunk.buffer);
-        if (!root) {
-            fprintf(stderr, "Error: Failed to parse JSON response for models list.\n");
-            break;
-        }
+/**
+ * @brief Counts the keys that could take a request right now.
+ * @param state The current application state.
+ * @return The number of keys neither quarantined nor cooling down.
+ */
+int key_scheduler_available(AppState* state) {
+    double now = wall_clock_now();
+    int available = 0;
+    for (int i = 0; i < state->num_api_keys; i++) {
+        const KeyHealth* health = key_health_find(state, state->api_keys[i]);
+        if (key_is_quarantined(state, state->api_keys[i])) continue;
+        if (key_ready_at(health) > now) continue;
+        available++;
+    }
+    return available;
+}
 
-        // Extract and iterate over the array of models.
-        cJSON* models_array = cJSON_GetObjectItem(root, "models");
-        if (cJSON_IsArray(models_array)) {
-            cJSON* model_item;
-            cJSON_ArrayForEach(model_item, models_array) {
-                cJSON* name = cJSON_GetObjectItem(model_item, "name");
-                cJSON* display_name = cJSON_GetObjectItem(model_item, "displayName");
+/**
+ * @brief Picks the API key for the next request.
+ * @details Asks the health-aware scheduler (see `key_scheduler_pick`) for the
+ *          healthiest key and marks it as used. `next_key_index` is kept
+ *          pointing past it, so ties fall back to round-robin order.
+ * @param state The current application state.
+ * @return The index of the key to use; it is also stored in `last_key_index`.
+ */
+int select_api_key(AppState* state) {
+    int index = key_scheduler_pick(state);
+    key_scheduler_commit(state, index);
+    return index;
+}
 
-                if (cJSON_IsString(name)) {
-                    const char* full_model_name = name->valuestring;
-                    const char* prefix = "models/";
-                    const char* name_to_print = (strncmp(full_model_name, prefix, strlen(prefix)) == 0)
-                                                ? full_model_name + strlen(prefix)
-                                                : full_model_name;
-                    fprintf(stdout, "- %s (%s)\n", name_to_print, cJSON_IsString(display_name) ? display_name->valuestring : "N/A");
-                    model_count++;
-                }
-            }
-        }
+/**
+ * @brief Marks a key as used by the request about to be sent.
+ * @param state The current application state.
+ * @param key_index The index of the key; it is stored in `last_key_index`.
+ */
+void key_scheduler_commit(AppState* state, int key_index) {
+    KeyHealth* health = key_health_get(state, state->api_keys[key_index]);
+    if (health) {
+        health->last_used = ++state->key_use_sequence;
+    }
+    state->last_key_index = key_index;
+    state->next_key_index = (key_index + 1) % state->num_api_keys;
+}
 
-        // Check for a token for the next page.
-        const cJSON* token_item = cJSON_GetObjectItem(root, "nextPageToken");
-        if (cJSON_IsString(token_item) && (token_item->valuestring != NULL)) {
-            strncpy(next_page_token, token_item->valuestring, sizeof(next_page_token) - 1);
-        } else {
-            next_page_token[0] = '\0'; // No more pages.
-        }
+/**
+ * @brief Takes a key the API rejected out of rotation.
+ * @details The key is marked invalid for KEY_CHECK_TTL_SEC, exactly as if
+ *          `/keys check` had found it so; a later successful check lifts the
+ *          quarantine early.
+ * @param state The current application state.
+ * @param key_index The index of the rejected key.
+ * @param http_code The status the API rejected it with.
+ */
+void key_scheduler_quarantine(AppState* state, int key_index, long http_code) {
+    if (key_index < 0 || key_index >= state->num_api_keys) return;
+    const char* key = state->api_keys[key_index];
+    KeyHealth* health = key_health_get(state, key);
+    if (!health) return;
+    health->status = KEY_STATUS_INVALID;
+    health->http_code = http_code;
+    health->checked_at = time(NULL);
+    size_t key_len = strlen(key);
+    fprintf(stderr, "[Key ...%s rejected with HTTP %ld, quarantined for %ds]\n",
+            key + (key_len > 4 ? key_len - 4 : 0), http_code, KEY_CHECK_TTL_SEC);
+}
 
-        cJSON_Delete(root);
+/**
+ * @brief Adds a time to first byte to a key's latency average.
+ * @details Also used for a hedged request that was cancelled because another
+ *          key answered first: the time it stayed silent is a lower bound of
+ *          its latency, so a consistently slow key is picked less often.
+ * @param state The current application state.
+ * @param key_index The index of the key.
+ * @param ttfb_ms The observed time to first byte; ignored unless positive.
+ */
+void key_scheduler_record_latency(AppState* state, int key_index, double ttfb_ms) {
+    if (key_index < 0 || key_index >= state->num_api_keys || ttfb_ms <= 0) return;
+    KeyHealth* health = key_health_get(state, state->api_keys[key_index]);
+    if (!health) return;
+    health->latency_ewma_ms = health->latency_ewma_ms == 0
+        ? ttfb_ms
+        : KEY_LATENCY_EWMA_ALPHA * ttfb_ms + (1.0 - KEY_LATENCY_EWMA_ALPHA) * health->latency_ewma_ms;
+}
 
-    } while (next_page_token[0] != '\0');
+/**
+ * @brief Feeds the outcome of a request into the key scheduler.
+ * @details Successful requests update the success rate and the time-to-first-
+ *          byte average. A 429 puts the key into a cooldown window that honors
+ *          Retry-After and doubles with each consecutive throttle, up to
+ *          KEY_COOLDOWN_MAX_SEC. A 401/403 quarantines the key for
+ *          KEY_CHECK_TTL_SEC, as if `/keys check` had found it invalid. Server
+ *          and network errors count against the key, and three in a row cool it
+ *          down for KEY_COOLDOWN_BASE_SEC. Other client errors (400, 404, ...)
+ *          are caused by the request rather than the key and are not counted.
+ * @param state The current application state.
+ * @param key_index The index of the key the request used.
+ * @param http_code The HTTP status, or a negative CURLcode for transport errors.
+ */
+void key_scheduler_record(AppState* state, int key_index, long http_code) {
+    if (key_index < 0 || key_index >= state->num_api_keys) return;
+    const char* key = state->api_keys[key_index];
+    KeyHealth* health = key_health_get(state, key);
+    if (!health) return;
+
+    bool is_server_error = http_code >= 500 || http_code < 0;
+    bool is_key_error = http_code == 429 || http_code == 401 || http_code == 403;
+    if (http_code >= 300 && !is_server_error && !is_key_error) return;
+
+    time_t now = time(NULL);
+    size_t key_len = strlen(key);
+    const char* key_tail = key + (key_len > 4 ? key_len - 4 : 0);
+    health->requests++;
+
+    if (http_code >= 200 && http_code < 300) {
+        health->successes++;
+        health->consecutive_failures = 0;
+        key_scheduler_record_latency(state, key_index, state->transport.last_ttfb_ms);
+        return;
+    }
 
-    if (model_count > 0) {
-        fprintf(stderr, "\nFound %d models.\n", model_count);
+    health->consecutive_failures++;
+    health->last_failure_at = now;
+    if (http_code == 429) {
+        health->rate_limited++;
+        long cooldown = KEY_COOLDOWN_BASE_SEC;
+        for (int i = 1; i < health->consecutive_failures && cooldown < KEY_COOLDOWN_MAX_SEC; i++) cooldown *= 2;
+        if (cooldown > KEY_COOLDOWN_MAX_SEC) cooldown = KEY_COOLDOWN_MAX_SEC;
+        if (state->transport.last_retry_after > cooldown) cooldown = state->transport.last_retry_after;
+        health->cooldown_until = now + cooldown;
+        fprintf(stderr, "[Key ...%s rate limited, cooling down for %lds]\n", key_tail, cooldown);
+    } else if (http_code == 401 || http_code == 403) {
+        health->forbidden++;
+        key_scheduler_quarantine(state, key_index, http_code);
     } else {
-        fprintf(stderr, "No models were found or an error occurred.\n");
+        health->server_errors++;
+        if (health->consecutive_failures >= 3) {
+            health->cooldown_until = now + KEY_COOLDOWN_BASE_SEC;
+        }
     }
-
-    free(chunk.buffer);
 }
 
 /**
- * @brief Exports the current conversation history to a human-readable Markdown file.
- * @details This function iterates through the entire conversation history stored in
- *          the AppState. It formats each user and model turn into a simple Markdown
- *          structure, including the system prompt, text content, and placeholders
- *          for file attachments. The output is saved to the specified file path.
- *          MODIFIED: It now decodes and prints the content of text/plain attachments.
- * @param state The current application state, containing the history to be exported.
- * @param filepath The path to the Markdown file that will be created or overwritten.
+ * @brief Returns a short human-readable label for a key validation result.
  */
-void export_history_to_markdown(AppState* state, const char* filepath) {
-    // Ensure the file path is safe and does not attempt directory traversal.
-    if (!is_path_safe(filepath)) {
-        fprintf(stderr, "Error: Unsafe or absolute file path specified: %s\n", filepath);
-        return;
+static const char* key_status_label(KeyStatus status) {
+    switch (status) {
+        case KEY_STATUS_VALID:        return "valid";
+        case KEY_STATUS_RATE_LIMITED: return "valid, rate limited";
+        case KEY_STATUS_INVALID:      return "INVALID";
+        default:                      return "unknown";
     }
+}
 
-    FILE* file = fopen(filepath, "w");
-    if (!file) {
-        perror("Failed to open file for export");
-        return;
+/**
+ * @brief Prints the validation result and scheduler statistics of a key for `/keys list`.
+ * @param stream The stream to print to.
+ * @param state The current application state owning the cache.
+ * @param key The API key.
+ */
+void print_key_health(FILE* stream, AppState* state, const char* key) {
+    const KeyHealth* cached = key_health_cached(state, key);
+    if (cached && cached->status != KEY_STATUS_UNKNOWN) {
+        fprintf(stream, " [%s, checked %lds ago]", key_status_label(cached->status), (long)(time(NULL) - cached->checked_at));
     }
 
-    fprintf(stderr, "Exporting conversation to %s...\n", filepath);
-
-    // First, write the system prompt to the file if one is set.
-    if (state->system_prompt) {
-        fprintf(file, "## System Prompt\n\n```\n%s\n```\n\n---\n\n", state->system_prompt);
+    const KeyHealth* health = key_health_find(state, key);
+    if (!health || health->requests == 0) return;
+    fprintf(stream, "\n        %ld req, %.0f%% ok, 429: %ld, 403: %ld, 5xx/net: %ld, ttfb %.0f ms",
+            health->requests, 100.0 * health->successes / health->requests,
+            health->rate_limited, health->forbidden, health->server_errors, health->latency_ewma_ms);
+    time_t now = time(NULL);
+    if (health->cooldown_until > now) {
+        fprintf(stream, ", cooling down %lds", (long)(health->cooldown_until - now));
     }
+    if (health->quota_ready_at > now) {
+        fprintf(stream, ", out of quota for %.0fs", health->quota_ready_at - now);
+    }
+}
 
-    // Iterate through each content block (turn) in the history.
-    for (int i = 0; i < state->history.num_contents; i++) {
-        Content* content = &state->history.contents[i];
-
-        // Write the role ("User" or "Model") as a level-3 Markdown header.
-        fprintf(file, "### %c%s\n\n", toupper((unsigned char)content->role[0]), content->role + 1);
-
-        bool has_text = false;
-        // Iterate through each part within the content block.
-        for (int j = 0; j < content->num_parts; j++) {
-            Part* part = &content->parts[j];
-            if (part->type == PART_TYPE_TEXT && part->text) {
-                // Write the text content directly.
-                fprintf(file, "%s\n", part->text);
-                has_text = true;
-            } else if (part->type == PART_TYPE_FILE) {
-                // --- MODIFICATION START ---
-                // Check if the attachment is text/plain and has data to be decoded.
-                if (part->mime_type && strcmp(part->mime_type, "text/plain") == 0 && part->base64_data) {
-                    Base64DecodeResult decoded = base64_decode(part->base64_data);
-                    if (decoded.data) {
-                        // If decoding is successful, print the content in a formatted block.
-                        fprintf(file, "\n```text\n%s\n```\n", (char*)decoded.data);
-                        free(decoded.data); // Free the memory from the decoder.
-                    } else {
-                        // If decoding fails, print a placeholder with an error.
-                        const char* filename = part->filename ? part->filename : "Pasted Data";
-                        fprintf(file, "\n`[Attached File: %s (text/plain, decoding failed)]`\n", filename);
-                    }
-                } else {
-                    // For all other file types, use the original placeholder.
-                    const char* filename = part->filename ? part->filename : "Pasted Data";
-                    const char* mime_type = part->mime_type ? part->mime_type : "unknown";
-                    fprintf(file, "\n`[Attached File: %s (%s)]`\n", filename, mime_type);
-                }
-                // --- MODIFICATION END ---
-            }
-        }
+/**
+ * @brief Returns the wall-clock time in seconds, with sub-second precision.
+ */
+static double wall_clock_now(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    return now.tv_sec + now.tv_nsec / 1e9;
+}
 
-        // Add extra spacing for readability if there was text content.
-        if (has_text) {
-            fprintf(file, "\n");
-        }
+/**
+ * @brief Tells whether any per-key limit is configured.
+ */
+static bool rate_limiter_enabled(const RateLimiter* limiter) {
+    return limiter->rpm > 0 || limiter->tpm > 0 || limiter->rpd > 0;
+}
 
-        // Add a horizontal rule to separate turns, except after the very last one.
-        if (i < state->history.num_contents - 1) {
-            fprintf(file, "---\n\n");
-        }
+/**
+ * @brief Feeds bytes into a 64-bit FNV-1a hash.
+ * @param hash The hash so far; start with FNV1A_64_INIT.
+ * @param data The bytes to add.
+ * @param size The number of bytes.
+ * @return The updated hash.
+ */
+static uint64_t fnv1a_64(uint64_t hash, const void* data, size_t size) {
+    const unsigned char* p = data;
+    for (size_t i = 0; i < size; i++) {
+        hash ^= p[i];
+        hash *= 0x100000001b3ULL;
     }
-
-    fclose(file);
-    fprintf(stderr, "Successfully exported history to %s\n", filepath);
+    return hash;
 }
 
 /**
- * @brief Gets the base path for the application's data directory.
- * @details This function provides a portable way to determine the correct location
- *          for storing configuration and session files. It creates the directory
- *          if it does not already exist.
- *          - On Windows, it resolves to `%APPDATA%\gemini-cli`.
- *          - On POSIX systems (Linux, macOS), it resolves to `~/.config/gemini-cli`.
- * @param buffer A character buffer to store the resulting path.
- * @param buffer_size The size of the buffer. The buffer will be empty on failure.
+ * @brief Derives the ledger id of an API key.
+ * @details The ledger is keyed by a 64-bit FNV-1a hash of the key so that the
+ *          keys themselves are not written to yet another file.
+ * @param key The API key.
+ * @param out Receives the id as 16 hex digits.
+ * @param out_size The size of `out`, at least 17.
  */
-void get_base_app_path(char* buffer, size_t buffer_size) {
-    const char* config_dir_name = "gemini-cli";
+static void quota_key_id(const char* key, char* out, size_t out_size) {
+    uint64_t hash = fnv1a_64(FNV1A_64_INIT, key, strlen(key));
+    snprintf(out, out_size, "%016llx", (unsigned long long)hash);
+}
 
-    // On POSIX systems, the standard is the .config directory in the user's home.
-    char* base_path = getenv("HOME");
-    if (!base_path) {
-        buffer[0] = '\0'; // Unable to find HOME directory.
-        return;
+/**
+ * @brief Finds the loaded key with a given `quota_key_id`.
+ * @return Its index, or -1 if that key is no longer loaded.
+ */
+static int quota_key_index(AppState* state, const char* id) {
+    char key_id[17];
+    for (int i = 0; i < state->num_api_keys; i++) {
+        quota_key_id(state->api_keys[i], key_id, sizeof(key_id));
+        if (strcmp(key_id, id) == 0) return i;
     }
-    // First, ensure the ~/.config directory exists.
-    char dir_path[PATH_MAX];
-    snprintf(dir_path, sizeof(dir_path), "%s/.config", base_path);
-    MKDIR(dir_path);
+    return -1;
+}
 
-    // Then, construct the full path: /home/user/.config/gemini-cli
-    snprintf(buffer, buffer_size, "%s/.config/%s", base_path, config_dir_name);
-    MKDIR(buffer); // Create the final directory if it doesn't exist.
+/**
+ * @brief Returns the quota day a point in time falls on.
+ * @details Daily quotas reset at midnight Pacific Time; this uses the fixed
+ *          UTC-8 offset, so during daylight saving time the day turns over an
+ *          hour late, which errs on the safe side.
+ */
+static long quota_day(double now) {
+    return (long)((now - 8 * 3600) / 86400);
 }
 
 /**
- * @brief Safely constructs the full file path for a named session.
- * @details This function combines the base sessions directory path with a
- *          user-provided session name to create a full, absolute path to a
- *          session's .json file. It performs critical safety checks to ensure
- *          the session name is valid and to prevent path traversal attacks.
- * @param session_name The name of the session, provided by the user.
- * @param path_buffer A buffer to store the resulting full file path.
- * @param buffer_size The size of the `path_buffer`.
- * @return Returns true if the path was constructed successfully and safely.
- *         Returns false if the session name is unsafe or if the resulting
- *         path would be too long for the buffer.
+ * @brief Opens a JSON file in the application data directory and locks it.
+ * @details The exclusive lock is held until `json_file_unlock`, so a
+ *          read-modify-write through these two calls is safe against other
+ *          processes doing the same. A missing, empty or corrupt file yields
+ *          an empty object.
+ * @param filename The file name inside the application data directory.
+ * @param[out] json_out Receives the parsed object; free it with `json_file_unlock`.
+ * @return The locked file descriptor, or -1 if the file is unavailable.
  */
-bool build_session_path(const char* session_name, char* path_buffer, size_t buffer_size) {
-    // First, validate the session name to prevent directory traversal.
-    if (!is_session_name_safe(session_name)) {
-        // The is_session_name_safe function prints its own specific error message.
-        return false;
+static int json_file_lock(const char* filename, cJSON** json_out) {
+    char base_app_path[PATH_MAX];
+    get_base_app_path(base_app_path, sizeof(base_app_path));
+    if (base_app_path[0] == '\0') return -1;
+
+    char file_path[PATH_MAX + 64];
+    snprintf(file_path, sizeof(file_path), "%s/%s", base_app_path, filename);
+    int fd = open(file_path, O_RDWR | O_CREAT, 0600);
+    if (fd < 0) return -1;
+    if (flock(fd, LOCK_EX) != 0) {
+        close(fd);
+        return -1;
     }
 
-    // Get the base path for the "sessions" subdirectory (e.g., ~/.config/gemini-cli/sessions).
-    char sessions_path[PATH_MAX];
-    get_sessions_path(sessions_path, sizeof(sessions_path));
-    if (sessions_path[0] == '\0') {
-        // This can happen if the base app path could not be determined.
-        return false;
+    cJSON* json = NULL;
+    struct stat st;
+    if (fstat(fd, &st) == 0 && st.st_size > 0) {
+        char* buffer = malloc(st.st_size + 1);
+        if (buffer) {
+            ssize_t bytes_read = pread(fd, buffer, st.st_size, 0);
+            if (bytes_read > 0) {
+                buffer[bytes_read] = '\0';
+                json = cJSON_Parse(buffer);
+            }
+            free(buffer);
+        }
     }
-
-    // Define the correct path separator for the operating system.
-    const char* separator = "/";
-
-    // Pre-calculate the required buffer size to prevent overflow with snprintf.
-    // Required size = base_path + separator + session_name + ".json" + null_terminator
-    size_t required_size = strlen(sessions_path) + strlen(separator) + strlen(session_name) + 5 + 1;
-    if (required_size > buffer_size) {
-        fprintf(stderr, "Error: Session name '%s' results in a path that is too long.\n", session_name);
-        return false;
+    if (!cJSON_IsObject(json)) {
+        cJSON_Delete(json);
+        json = cJSON_CreateObject();
     }
+    *json_out = json;
+    return fd;
+}
 
-    // Safely construct the final, full path.
-    snprintf(path_buffer, buffer_size, "%s%s%s.json", sessions_path, separator, session_name);
-    return true;
+/**
+ * @brief Optionally writes a locked JSON file back, then releases its lock.
+ * @param fd The descriptor returned by `json_file_lock`.
+ * @param json The object; it is freed.
+ * @param save Whether the object was modified and must be written.
+ * @return false if the file could not be written.
+ */
+static bool json_file_unlock(int fd, cJSON* json, bool save) {
+    bool written = true;
+    if (save && json) {
+        char* json_string = cJSON_PrintUnformatted(json);
+        if (json_string) {
+            size_t length = strlen(json_string);
+            written = ftruncate(fd, 0) == 0 && pwrite(fd, json_string, length, 0) == (ssize_t)length;
+            free(json_string);
+        }
+    }
+    flock(fd, LOCK_UN);
+    close(fd);
+    cJSON_Delete(json);
+    return written;
 }
 
 /**
- * @brief Sends a request to the official Gemini API and handles the response.
- * @details This is the primary function for interacting with the official Gemini
- *          API. It builds the JSON request payload, Gzip-compresses it for
- *          efficiency, sends it via a POST request, and processes the streaming
- *          SSE response. The full, concatenated response from the model is
- *          returned upon success. It includes retry logic for transient errors.
- * @param state The current application state, containing the history, configuration,
- *              and API key needed for the request.
- * @param[out] full_response_out A pointer to a character pointer. On success, this
- *             will be updated to point to a newly allocated string containing the
- *             complete model response. The caller is responsible for freeing this
- *             memory.
- * @return Returns true if the API call was successful (HTTP 200), and false otherwise.
+ * @brief Opens the quota ledger and takes an exclusive lock on it.
+ * @details The ledger lives in `quota.json` in the application data directory
+ *          and is shared by every process of the user. Holding the lock across
+ *          the read-modify-write keeps concurrent invocations from handing out
+ *          the same budget twice. A missing, empty or corrupt ledger starts
+ *          out empty.
+ * @param[out] ledger_out Receives the parsed ledger; free it with `quota_ledger_unlock`.
+ * @return The locked file descriptor, or -1 if the ledger is unavailable.
  */
-bool send_api_request(AppState* state, char** full_response_out) {
-    *full_response_out = NULL;
+static int quota_ledger_lock(cJSON** ledger_out) {
+    return json_file_lock(QUOTA_LEDGER_FILENAME, ledger_out);
+}
 
-    // 1. Build and compress the payload once. It's the same for all retries.
-    cJSON* root = build_request_json(state);
-    if (!root) {
-        fprintf(stderr, "Error: Failed to build JSON request.\n");
-        return false;
+/**
+ * @brief Optionally writes the ledger back, then releases its lock.
+ * @param fd The descriptor returned by `quota_ledger_lock`.
+ * @param ledger The ledger; it is freed.
+ * @param save Whether the ledger was modified and must be written.
+ */
+static void quota_ledger_unlock(int fd, cJSON* ledger, bool save) {
+    if (!json_file_unlock(fd, ledger, save)) {
+        fprintf(stderr, "Warning: Could not update the quota ledger.\n");
     }
-    char* json_string = cJSON_PrintUnformatted(root);
-    cJSON_Delete(root);
-    if (!json_string) {
-        fprintf(stderr, "Error: Failed to print JSON to string.\n");
-        return false;
+}
+
+/**
+ * @brief Reads a number from a ledger entry.
+ */
+static double quota_get(const cJSON* entry, const char* name, double fallback) {
+    const cJSON* item = cJSON_GetObjectItem(entry, name);
+    return cJSON_IsNumber(item) ? item->valuedouble : fallback;
+}
+
+/**
+ * @brief Writes a number into a ledger entry, adding the field if needed.
+ */
+static void quota_set(cJSON* entry, const char* name, double value) {
+    cJSON* item = cJSON_GetObjectItem(entry, name);
+    if (cJSON_IsNumber(item)) {
+        cJSON_SetNumberValue(item, value);
+    } else {
+        cJSON_DeleteItemFromObject(entry, name);
+        cJSON_AddNumberToObject(entry, name, value);
     }
-    GzipResult compressed_result = gzip_compress((unsigned char*)json_string, strlen(json_string));
-    free(json_string);
-    if (!compressed_result.data) {
-        fprintf(stderr, "Error: Failed to compress request payload.\n");
-        return false;
+}
+
+/**
+ * @brief Returns a key's ledger entry with its buckets refilled up to now.
+ * @details Each key has two token buckets, one holding requests (capacity
+ *          `rpm`) and one holding tokens (capacity `tpm`), both refilling
+ *          continuously at their per-minute rate, plus a request counter for
+ *          the current quota day.
+ * @param ledger The locked ledger.
+ * @param key The API key.
+ * @param limiter The configured limits.
+ * @param now The current wall-clock time.
+ * @return The entry, or NULL on allocation failure.
+ */
+static cJSON* quota_entry(cJSON* ledger, const char* key, const RateLimiter* limiter, double now) {
+    char id[17];
+    quota_key_id(key, id, sizeof(id));
+    cJSON* entry = cJSON_GetObjectItem(ledger, id);
+    if (!cJSON_IsObject(entry)) {
+        cJSON_DeleteItemFromObject(ledger, id);
+        entry = cJSON_AddObjectToObject(ledger, id);
+        if (!entry) return NULL;
+    }
+
+    double elapsed = now - quota_get(entry, "updated", now);
+    if (elapsed < 0) elapsed = 0;
+    if (limiter->rpm > 0) {
+        double requests = quota_get(entry, "rpm_tokens", limiter->rpm) + elapsed * limiter->rpm / 60.0;
+        quota_set(entry, "rpm_tokens", requests < limiter->rpm ? requests : limiter->rpm);
+    }
+    if (limiter->tpm > 0) {
+        double tokens = quota_get(entry, "tpm_tokens", limiter->tpm) + elapsed * limiter->tpm / 60.0;
+        quota_set(entry, "tpm_tokens", tokens < limiter->tpm ? tokens : limiter->tpm);
+    }
+
+    double day_requests = quota_get(entry, "day_requests", 0);
+    if ((long)quota_get(entry, "day", quota_day(now)) != quota_day(now)) day_requests = 0;
+
+    quota_set(entry, "day", quota_day(now));
+    quota_set(entry, "day_requests", day_requests);
+    quota_set(entry, "updated", now);
+    return entry;
+}
+
+/**
+ * @brief Computes how long a key must wait before it can take a request.
+ * @param entry The key's refilled ledger entry.
+ * @param limiter The configured limits.
+ * @param tokens The estimated tokens of the request.
+ * @param now The current wall-clock time.
+ * @return The wait in seconds; 0 if the request fits the budget now.
+ */
+static double quota_wait_seconds(const cJSON* entry, const RateLimiter* limiter, long tokens, double now) {
+    double wait = 0;
+    if (limiter->rpd > 0 && quota_get(entry, "day_requests", 0) >= limiter->rpd) {
+        wait = (quota_day(now) + 1) * 86400.0 + 8 * 3600 - now;
+    }
+    if (limiter->rpm > 0) {
+        double requests = quota_get(entry, "rpm_tokens", limiter->rpm);
+        if (requests < 1.0 && (1.0 - requests) * 60.0 / limiter->rpm > wait) {
+            wait = (1.0 - requests) * 60.0 / limiter->rpm;
+        }
+    }
+    if (limiter->tpm > 0) {
+        // A request larger than the whole bucket only has to wait for a full one.
+        double needed = tokens < limiter->tpm ? tokens : limiter->tpm;
+        double available = quota_get(entry, "tpm_tokens", limiter->tpm);
+        if (available < needed && (needed - available) * 60.0 / limiter->tpm > wait) {
+            wait = (needed - available) * 60.0 / limiter->tpm;
+        }
     }
+    return wait;
+}
 
-    // 2. Prepare the memory structure. We allocate it once and reuse/reset it.
-    MemoryStruct chunk = { .buffer = malloc(1), .size = 0, .full_response = malloc(1), .full_response_size = 0 };
-    if (!chunk.buffer || !chunk.full_response) {
-        fprintf(stderr, "Error: Failed to allocate memory for curl response chunk.\n");
-        free(compressed_result.data);
-        if(chunk.buffer) free(chunk.buffer);
-        if(chunk.full_response) free(chunk.full_response);
-        return false;
+/**
+ * @brief Tells the scheduler which keys are out of client-side quota.
+ * @details Every key is marked as unavailable until its buckets hold enough
+ *          for the request: one request, the estimated tokens and a slot in
+ *          today's request count.
+ * @param state The current application state.
+ * @param ledger The locked quota ledger; its buckets are refilled.
+ * @param tokens The estimated tokens of the request.
+ * @param now The current wall-clock time.
+ */
+static void quota_mark_ready_times(AppState* state, cJSON* ledger, long tokens, double now) {
+    for (int i = 0; i < state->num_api_keys; i++) {
+        cJSON* entry = quota_entry(ledger, state->api_keys[i], &state->rate_limit, now);
+        KeyHealth* health = key_health_get(state, state->api_keys[i]);
+        if (!entry || !health) continue;
+        double wait = quota_wait_seconds(entry, &state->rate_limit, tokens, now);
+        health->quota_ready_at = wait > 0 ? now + wait : 0;
     }
+}
 
-    long http_code = 0;
-    bool success = false;
-    int max_retries = 3;
+/**
+ * @brief Charges one request and its estimated tokens to a key's ledger entry.
+ */
+static void quota_charge(cJSON* entry, const RateLimiter* limiter, long tokens) {
+    if (!entry) return;
+    if (limiter->rpm > 0) quota_set(entry, "rpm_tokens", quota_get(entry, "rpm_tokens", 0) - 1);
+    if (limiter->tpm > 0) quota_set(entry, "tpm_tokens", quota_get(entry, "tpm_tokens", 0) - tokens);
+    quota_set(entry, "day_requests", quota_get(entry, "day_requests", 0) + 1);
+}
 
-    for (int i = 0; i < max_retries; i++) {
-        // 3. Reset buffers for this attempt to clear data from any previous failed attempt.
-        chunk.buffer[0] = '\0';
-        chunk.size = 0;
-        chunk.full_response[0] = '\0';
-        chunk.full_response_size = 0;
-
-        // 4. Perform the API request.
-        http_code = perform_api_curl_request(
-            state,
-            "streamGenerateContent?alt=sse",
-            (const char*)compressed_result.data,
-            compressed_result.size,
-            write_memory_callback,
-            &chunk
-        );
-
-        // 5. Decide if this attempt was successful, retryable, or a final failure.
-        if (http_code == 200) {
-            // --- MODIFICATION START ---
-            // A 200 OK is only a true success if the response body is not empty.
-            if (chunk.full_response_size == 0) {
-                // Treat the empty response as a transient, retryable error.
-                fprintf(stderr, "\nAPI returned an empty response, retrying... (%d/%d)\n", i + 1, max_retries);
-                if (i < max_retries - 1) { // Don't sleep after the final attempt.
-                    sleep(2);
-                }
-                // By not setting 'success' or breaking, we allow the loop to proceed to the next iteration.
-            } else {
-                // The response is valid and non-empty. This is a true success.
-                success = true;
-                break; // Success, exit the loop.
-            }
-            // --- MODIFICATION END ---
-        } else if ((http_code != 403) && (http_code!=200)) {
-            fprintf(stderr, "\nAPI returned %ld (Service Unavailable), retrying... (%d/%d)\n", http_code, i + 1, max_retries);
-            if (i < max_retries - 1) { // Don't sleep after the final attempt.
-                sleep(2);
+/**
+ * @brief Picks a key for a generate request and charges it against the quota ledger.
+ * @details With no limits configured, or for requests other than generation,
+ *          this is just `select_api_key`. Otherwise the shared ledger is
+ *          refilled and every key without budget for the request is told to the
+ *          scheduler as unavailable. The scheduler then
+ *          routes the request to the healthiest key that has budget now. If no
+ *          key has, the request is delayed until the first one does, unless
+ *          that would take longer than RATE_LIMIT_MAX_WAIT_SEC, in which case
+ *          it is sent anyway and left to the server. The charge is corrected
+ *          by `rate_limiter_settle` once the actual usage is known.
+ * @param state The current application state.
+ * @return The index of the key to use, or -1 if the user interrupted the wait.
+ */
+int rate_limited_select_api_key(AppState* state) {
+    RateLimiter* limiter = &state->rate_limit;
+    if (!rate_limiter_enabled(limiter) || limiter->pending_tokens < 0) {
+        return select_api_key(state);
+    }
+
+    long tokens = limiter->pending_tokens;
+    bool delayed = false;
+    for (;;) {
+        cJSON* ledger = NULL;
+        int fd = quota_ledger_lock(&ledger);
+        if (fd < 0) return select_api_key(state);
+
+        double now = wall_clock_now();
+        for (int i = 0; i < state->num_api_keys; i++) {
+            KeyHealth* health = key_health_get(state, state->api_keys[i]);
+            if (health) health->quota_ready_at = 0;
+        }
+        int unconstrained = key_scheduler_pick(state);
+        quota_mark_ready_times(state, ledger, tokens, now);
+
+        int index = key_scheduler_pick(state);
+        const KeyHealth* health = key_health_get(state, state->api_keys[index]);
+        double wait = (health && health->quota_ready_at > now) ? health->quota_ready_at - now : 0;
+
+        if (wait <= 0 || wait > RATE_LIMIT_MAX_WAIT_SEC) {
+            if (wait > 0) {
+                fprintf(stderr, "[Rate limit: every key is out of quota for %.0fs, sending anyway]\n", wait);
             }
-        } else {
-            // Any other error is final, don't retry.
-            break;
+            quota_charge(quota_entry(ledger, state->api_keys[index], limiter, now), limiter, tokens);
+            quota_ledger_unlock(fd, ledger, true);
+
+            if (index != unconstrained) limiter->rerouted_requests++;
+            limiter->reserved_key_index = index;
+            limiter->reserved_tokens = tokens;
+            key_scheduler_commit(state, index);
+            return index;
+        }
+
+        // Nobody has budget yet: release the ledger so other processes can
+        // proceed, wait for the first key to refill, then look again.
+        quota_ledger_unlock(fd, ledger, true);
+        if (!delayed) {
+            fprintf(stderr, "[Rate limit: waiting %.1fs for quota]\n", wait);
+            limiter->delayed_requests++;
+            delayed = true;
+        }
+        limiter->total_wait_ms += wait * 1000.0;
+        if (!retry_sleep(state, (long)(wait * 1000.0) + 1)) {
+            return -1;
         }
     }
+}
 
-    // 6. Handle the final result after the loop is finished.
-    if (success) {
-        *full_response_out = chunk.full_response;
-    } else if (http_code == 403) {
-        size_t last_index = (state->next_key_index + state->num_api_keys - 1) % state->num_api_keys;
-          char *current_key = state->api_keys[last_index];
-          char *current_origin = state->origins[last_index];
-          size_t key_len = strlen(current_key);
-        fprintf(stderr, "\nAPI returned 403 (Unauthorized) for key: %.4s...%.4s (%s)\n", current_key + 6, current_key + key_len - 4, current_origin);
-        return false;
-    } else {
-        fprintf(stderr, "\nAPI call failed after retries (Last HTTP code: %ld)\n", http_code);
-        if(http_code < 0) fprintf(stderr, "Curl error: %s\n", curl_easy_strerror(-http_code));
-        parse_and_print_error_json(chunk.buffer);
-        free(chunk.full_response); // Free the unused response buffer on failure.
+/**
+ * @brief Picks a second key for a request already in flight on another key.
+ * @details Used by request hedging. Unlike `rate_limited_select_api_key` this
+ *          never waits and never falls back to a busy key: only a key that is
+ *          healthy, not cooling down and (with limits configured) has budget
+ *          right now is taken, and it is charged like any other request.
+ * @param state The current application state.
+ * @param exclude The key the request is already running on.
+ * @param[out] reserved_tokens_out Receives the tokens charged to the key, or -1
+ *             if nothing was charged; settle with `rate_limiter_settle_key`.
+ * @return The index of the key, or -1 if no other key is available now.
+ */
+int rate_limited_select_spare_key(AppState* state, int exclude, long* reserved_tokens_out) {
+    RateLimiter* limiter = &state->rate_limit;
+    *reserved_tokens_out = -1;
+
+    cJSON* ledger = NULL;
+    int fd = -1;
+    if (rate_limiter_enabled(limiter) && limiter->pending_tokens >= 0) {
+        fd = quota_ledger_lock(&ledger);
+    }
+    double now = wall_clock_now();
+    if (fd >= 0) {
+        quota_mark_ready_times(state, ledger, limiter->pending_tokens, now);
     }
 
-    // 7. Clean up all remaining resources.
-    free(chunk.buffer);
-    free(compressed_result.data);
-    return success;
+    int index = key_scheduler_pick_ready(state, exclude);
+    if (fd >= 0) {
+        if (index >= 0) {
+            quota_charge(quota_entry(ledger, state->api_keys[index], limiter, now), limiter, limiter->pending_tokens);
+            *reserved_tokens_out = limiter->pending_tokens;
+        }
+        quota_ledger_unlock(fd, ledger, true);
+    }
+    if (index >= 0) {
+        key_scheduler_commit(state, index);
+    }
+    return index;
 }
 
 /**
- * @brief Safely reads a string value from a cJSON object into a fixed-size buffer.
- * @param obj The cJSON object to read from.
- * @param key The key of the string value to read.
- * @param buffer The character buffer to store the string.
- * @param buffer_size The size of the buffer.
+ * @brief Corrects the ledger charge of a generate request sent with a given key.
+ * @details The request was charged its estimated tokens up front. Once the
+ *          response reports its usage, the difference is booked so the token
+ *          bucket reflects what was actually consumed; a failed or cancelled
+ *          request gets its tokens back (its request slot stays used).
+ * @param state The current application state.
+ * @param key_index The key the request was charged to, or -1 for none.
+ * @param reserved_tokens The tokens charged up front.
+ * @param succeeded Whether the request produced an answer.
+ * @param actual_tokens The `totalTokenCount` reported by the API, or 0 if none.
  */
-static void json_read_string(const cJSON* obj, const char* key, char* buffer, size_t buffer_size) {
-    const cJSON* item = cJSON_GetObjectItem(obj, key);
-    if (cJSON_IsString(item) && (item->valuestring != NULL)) {
-        strncpy(buffer, item->valuestring, buffer_size - 1);
-        buffer[buffer_size - 1] = '\0'; // Ensure null-termination.
+void rate_limiter_settle_key(AppState* state, int key_index, long reserved_tokens, bool succeeded, long actual_tokens) {
+    RateLimiter* limiter = &state->rate_limit;
+    if (key_index < 0 || key_index >= state->num_api_keys) return;
+
+    long correction = 0;
+    if (!succeeded) {
+        correction = -reserved_tokens;
+    } else if (actual_tokens > 0) {
+        correction = actual_tokens - reserved_tokens;
+    }
+    if (correction == 0 || limiter->tpm <= 0) return;
+
+    cJSON* ledger = NULL;
+    int fd = quota_ledger_lock(&ledger);
+    if (fd < 0) return;
+    cJSON* entry = quota_entry(ledger, state->api_keys[key_index], limiter, wall_clock_now());
+    if (entry) {
+        double tokens = quota_get(entry, "tpm_tokens", 0) - correction;
+        quota_set(entry, "tpm_tokens", tokens < limiter->tpm ? tokens : limiter->tpm);
+    }
+    quota_ledger_unlock(fd, ledger, entry != NULL);
+}
+
+/**
+ * @brief Corrects the ledger charge of the last generate request.
+ * @details See `rate_limiter_settle_key`; the key and charge are the ones
+ *          reserved by `rate_limited_select_api_key`.
+ * @param state The current application state.
+ * @param succeeded Whether the request produced an answer.
+ * @param actual_tokens The `totalTokenCount` reported by the API, or 0 if none.
+ */
+void rate_limiter_settle(AppState* state, bool succeeded, long actual_tokens) {
+    RateLimiter* limiter = &state->rate_limit;
+    int index = limiter->reserved_key_index;
+    limiter->reserved_key_index = -1;
+    rate_limiter_settle_key(state, index, limiter->reserved_tokens, succeeded, actual_tokens);
+}
+
+/**
+ * @brief Frees a list of strings read with `json_read_string_array`.
+ */
+static void free_string_list(char*** list, int* count) {
+    for (int i = 0; i < *count; i++) free((*list)[i]);
+    free(*list);
+    *list = NULL;
+    *count = 0;
+}
+
+/**
+ * @brief Describes a route for messages, e.g. "host via http://proxy:3128".
+ */
+static void endpoint_describe(const Endpoint* route, char* buffer, size_t buffer_size) {
+    snprintf(buffer, buffer_size, "%s via %s", route->host, route->proxy[0] ? route->proxy : "direct");
+}
+
+/**
+ * @brief Makes a route the one every request uses.
+ * @details The route is mirrored into `host` and `proxy`, which all request
+ *          paths read.
+ */
+static void endpoint_pool_apply(AppState* state, int index) {
+    const Endpoint* route = &state->endpoints.routes[index];
+    state->endpoints.current = index;
+    if (!state->host || strcmp(state->host, route->host) != 0) {
+        char* host = strdup(route->host);
+        if (!host) return;
+        free(state->host);
+        state->host = host;
+    }
+    snprintf(state->proxy, sizeof(state->proxy), "%s", route->proxy);
+}
+
+/**
+ * @brief Stops the in-flight probes and frees the routes.
+ * @param state The current application state.
+ */
+void endpoint_pool_free(AppState* state) {
+    EndpointPool* pool = &state->endpoints;
+    for (int i = 0; i < pool->num_routes; i++) {
+        if (pool->routes[i].probe) transport_cancel(&state->transport, pool->routes[i].probe);
+        free(pool->routes[i].host);
+        free(pool->routes[i].proxy);
+    }
+    free(pool->routes);
+    pool->routes = NULL;
+    pool->num_routes = 0;
+    pool->current = 0;
+}
+
+/**
+ * @brief Builds the routes from the configured hosts and proxies.
+ * @details Every host is combined with every proxy, so with two regional hosts
+ *          and two egress proxies there are four routes. Without a `hosts` list
+ *          the single `host` is used, and without a `proxies` list the single
+ *          `proxy` (or a direct connection); the proxy name "direct" also means
+ *          no proxy. The first route is used until probes or failures say
+ *          otherwise.
+ * @param state The current application state.
+ */
+void endpoint_pool_build(AppState* state) {
+    EndpointPool* pool = &state->endpoints;
+    endpoint_pool_free(state);
+
+    char* single_host = state->host ? state->host : "generativelanguage.googleapis.com";
+    char* single_proxy = state->proxy;
+    char** hosts = pool->num_hosts > 0 ? pool->hosts : &single_host;
+    int num_hosts = pool->num_hosts > 0 ? pool->num_hosts : 1;
+    char** proxies = pool->num_proxies > 0 ? pool->proxies : &single_proxy;
+    int num_proxies = pool->num_proxies > 0 ? pool->num_proxies : 1;
+
+    pool->routes = calloc(num_hosts * num_proxies, sizeof(Endpoint));
+    if (!pool->routes) return;
+    for (int h = 0; h < num_hosts; h++) {
+        for (int p = 0; p < num_proxies; p++) {
+            Endpoint* route = &pool->routes[pool->num_routes];
+            const char* proxy = strcmp(proxies[p], "direct") == 0 ? "" : proxies[p];
+            route->host = strdup(hosts[h]);
+            route->proxy = strdup(proxy);
+            if (!route->host || !route->proxy) {
+                free(route->host);
+                free(route->proxy);
+                continue;
+            }
+            pool->num_routes++;
+        }
+    }
+    if (pool->num_routes > 0) {
+        endpoint_pool_apply(state, 0);
     }
 }
 
 /**
- * @brief Safely reads a float value from a cJSON object.
- * @param obj The cJSON object to read from.
- * @param key The key of the float value to read.
- * @param target A pointer to the float variable to update.
+ * @brief Tells whether any route goes through a proxy.
  */
-static void json_read_float(const cJSON* obj, const char* key, float* target) {
-    const cJSON* item = cJSON_GetObjectItem(obj, key);
-    if (cJSON_IsNumber(item)) {
-        *target = (float)item->valuedouble;
+bool endpoint_pool_uses_proxy(const AppState* state) {
+    for (int i = 0; i < state->endpoints.num_routes; i++) {
+        if (state->endpoints.routes[i].proxy[0] != '\0') return true;
     }
+    return state->endpoints.num_routes == 0 && state->proxy[0] != '\0';
 }
 
 /**
- * @brief Safely reads an integer value from a cJSON object.
- * @param obj The cJSON object to read from.
- * @param key The key of the integer value to read.
- * @param target A pointer to the integer variable to update.
+ * @brief Takes a route out of rotation after a failure.
+ * @details The route is skipped for ENDPOINT_DOWN_BASE_SEC seconds, doubling
+ *          with each further failure in a row up to ENDPOINT_DOWN_MAX_SEC. A
+ *          successful probe brings it back early.
  */
-static void json_read_int(const cJSON* obj, const char* key, int* target) {
-    const cJSON* item = cJSON_GetObjectItem(obj, key);
-    if (cJSON_IsNumber(item)) {
-        *target = item->valueint;
+static void endpoint_mark_down(AppState* state, Endpoint* route, const char* reason) {
+    long down = ENDPOINT_DOWN_BASE_SEC;
+    for (int i = 1; i < route->consecutive_failures && down < ENDPOINT_DOWN_MAX_SEC; i++) down *= 2;
+    if (down > ENDPOINT_DOWN_MAX_SEC) down = ENDPOINT_DOWN_MAX_SEC;
+    bool was_up = route->down_until <= time(NULL);
+    route->down_until = time(NULL) + down;
+    if (was_up && state->endpoints.num_routes > 1) {
+        char name[512];
+        endpoint_describe(route, name, sizeof(name));
+        fprintf(stderr, "[Endpoint %s is down (%s), avoiding it for %lds]\n", name, reason, down);
     }
 }
 
 /**
- * @brief Safely reads a boolean value from a cJSON object.
- * @details It handles both true/false boolean types and numeric 0/1 values
- *          for better compatibility.
- * @param obj The cJSON object to read from.
- * @param key The key of the boolean value to read.
- * @param target A pointer to the bool variable to update.
+ * @brief Completion callback of an endpoint probe.
+ * @details Any HTTP answer means the route works; its latency sample is the
+ *          time from the end of the handshake to the first response byte, which
+ *          is comparable whether or not the probe reused a connection. A probe
+ *          that gets no answer marks the route down.
  */
-static void json_read_bool(const cJSON* obj, const char* key, bool* target) {
-    const cJSON* item = cJSON_GetObjectItem(obj, key);
-    if (cJSON_IsBool(item)) {
-        *target = cJSON_IsTrue(item);
-    } else if (cJSON_IsNumber(item)) { // For compatibility with config files using 0/1
-        *target = (item->valueint != 0);
+static void endpoint_probe_done(Transfer* transfer, void* userdata) {
+    AppState* state = userdata;
+    Endpoint* route = NULL;
+    for (int i = 0; i < state->endpoints.num_routes; i++) {
+        if (state->endpoints.routes[i].probe == transfer) route = &state->endpoints.routes[i];
+    }
+    if (!route) return;
+    route->probe = NULL;
+
+    if (transfer->http_code > 0) {
+        curl_off_t appconnect_us = 0, starttransfer_us = 0;
+        curl_easy_getinfo(transfer->curl, CURLINFO_APPCONNECT_TIME_T, &appconnect_us);
+        curl_easy_getinfo(transfer->curl, CURLINFO_STARTTRANSFER_TIME_T, &starttransfer_us);
+        double sample_ms = (starttransfer_us - appconnect_us) / 1000.0;
+        if (sample_ms <= 0) sample_ms = starttransfer_us / 1000.0;
+        route->latency_ewma_ms = route->latency_ewma_ms == 0
+            ? sample_ms
+            : ENDPOINT_LATENCY_EWMA_ALPHA * sample_ms + (1.0 - ENDPOINT_LATENCY_EWMA_ALPHA) * route->latency_ewma_ms;
+        route->consecutive_failures = 0;
+        route->down_until = 0;
+    } else {
+        route->consecutive_failures++;
+        endpoint_mark_down(state, route, curl_easy_strerror(transfer->result));
     }
 }
 
 /**
- * @brief Parses command-line options and updates the application state.
- * @details This function iterates through the command-line arguments, looking for
- *          recognized flags (e.g., -m, --temp, --free). When a flag is found,
- *          it updates the corresponding field in the AppState struct. The parsing
- *          stops when the first non-option argument (like a prompt word or
- *          filename) is encountered.
- * @param argc The argument count from main().
- * @param argv The argument vector from main().
- * @param state A pointer to the AppState struct to be updated.
- * @return The index of the first argument that was not a recognized option. This
- *         allows the main session logic to process the remaining arguments as
- *         part of the initial prompt or as file attachments.
+ * @brief Starts the background probes that are due. Never blocks.
+ * @details Each route is probed with a HEAD request every
+ *          ENDPOINT_PROBE_INTERVAL_SEC seconds, and a route that is down as
+ *          soon as its down time is over. Probes run on the request engine next
+ *          to any other transfer and are driven while a request is in flight or
+ *          the prompt is idle. With a single route nothing is probed.
+ * @param state The current application state.
  */
+void endpoint_pool_probe_step(AppState* state) {
+    EndpointPool* pool = &state->endpoints;
+    if (pool->num_routes < 2) return;
+
+    time_t now = time(NULL);
+    for (int i = 0; i < pool->num_routes; i++) {
+        Endpoint* route = &pool->routes[i];
+        if (route->probe) continue;
+        bool is_down = route->down_until > now;
+        time_t due = route->last_probe_at == 0 ? 0
+                   : route->consecutive_failures > 0 ? (is_down ? route->down_until : now)
+                   : route->last_probe_at + ENDPOINT_PROBE_INTERVAL_SEC;
+        if (now < due) continue;
+
+        CURL* curl = transport_acquire(&state->transport);
+        if (!curl) return;
+        char url[512];
+        snprintf(url, sizeof(url), "https://%s/", route->host);
+        curl_easy_setopt(curl, CURLOPT_URL, url);
+        if (route->proxy[0] != '\0') {
+            curl_easy_setopt(curl, CURLOPT_PROXY, route->proxy);
+        }
+        curl_easy_setopt(curl, CURLOPT_NOBODY, 1L);
+        curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, discard_callback);
+        curl_easy_setopt(curl, CURLOPT_TIMEOUT, (long)ENDPOINT_PROBE_TIMEOUT_SEC);
 
-/*
-  Enum of all recognized options
-*/
-typedef enum {
-    OPT_UNKNOWN,
-    OPT_MODEL, OPT_HOST, OPT_SYSTEM, OPT_CONFIG,
-    OPT_TEMP, OPT_PROXY, OPT_SEED, OPT_MAX_TOKENS,
-    OPT_TOPK, OPT_TOPP, OPT_BUDGET, OPT_ML, OPT_MM,
-    OPT_EXECUTE, OPT_QUIET, OPT_NO_GROUNDING, OPT_FREE, OPT_NO_URL_CONTEXT, OPT_SAFETY,
-    OPT_LOC, OPT_MAP,
-    OPT_LIST_KEYS, OPT_ADD_KEY, OPT_REMOVE_KEY, OPT_CHECK_KEYS,
-    OPT_LIST_MODELS, OPT_LIST_SESSIONS, OPT_SAVE_SESSION, OPT_LOAD_SESSION,
-    OPT_HELP
-} OptionType;
+        route->last_probe_at = now;
+        Transfer* transfer = transport_submit(&state->transport, curl, NULL, endpoint_probe_done, state);
+        if (!transfer) continue;
+        transfer->background = true;
+        route->probe = transfer;
+        transport_detach(&state->transport, transfer);
+    }
+}
 
-/*
-  Map a flag string to its OptionType
-*/
-static OptionType classify_option(const char *arg) {
-    if (!STRCASECMP(arg, "-m")          || !STRCASECMP(arg, "--model"))          return OPT_MODEL;
-    if (!STRCASECMP(arg, "-H")          || !STRCASECMP(arg, "--host"))           return OPT_HOST;
-    if (!STRCASECMP(arg, "-S")          || !STRCASECMP(arg, "--system"))         return OPT_SYSTEM;
-    if (!STRCASECMP(arg, "-c")          || !STRCASECMP(arg, "--config"))         return OPT_CONFIG;
-    if (!STRCASECMP(arg, "-t")          || !STRCASECMP(arg, "--temp"))           return OPT_TEMP;
-    if (!STRCASECMP(arg, "-p")          || !STRCASECMP(arg, "--proxy"))          return OPT_PROXY;
-    if (!STRCASECMP(arg, "-s")          || !STRCASECMP(arg, "--seed"))           return OPT_SEED;
-    if (!STRCASECMP(arg, "-o")          || !STRCASECMP(arg, "--max-tokens"))     return OPT_MAX_TOKENS;
-    if (!STRCASECMP(arg, "--topk"))                                              return OPT_TOPK;
-    if (!STRCASECMP(arg, "--topp"))                                              return OPT_TOPP;
-    if (!STRCASECMP(arg, "-b")          || !STRCASECMP(arg, "--budget"))         return OPT_BUDGET;
-    if (!STRCASECMP(arg, "-e")          || !STRCASECMP(arg, "--execute"))        return OPT_EXECUTE;
-    if (!STRCASECMP(arg, "-q")          || !STRCASECMP(arg, "--quiet"))          return OPT_QUIET;
-    if (!STRCASECMP(arg, "-ng")         || !STRCASECMP(arg, "--no-grounding"))   return OPT_NO_GROUNDING;
-    if (!STRCASECMP(arg, "-f")          || !STRCASECMP(arg, "--free"))           return OPT_FREE;
-    if (!STRCASECMP(arg, "-nu")         || !STRCASECMP(arg, "--no-url-context")) return OPT_NO_URL_CONTEXT;
-    if (!STRCASECMP(arg, "--safety"))                                            return OPT_SAFETY;
-    if (!STRCASECMP(arg, "--loc"))                                               return OPT_LOC;
-    if (!STRCASECMP(arg, "--map"))                                               return OPT_MAP;
-    if (!STRCASECMP(arg, "--list-keys"))                                         return OPT_LIST_KEYS;
-    if (!STRCASECMP(arg, "--add-key"))                                           return OPT_ADD_KEY;
-    if (!STRCASECMP(arg, "--remove-key"))                                        return OPT_REMOVE_KEY;
-    if (!STRCASECMP(arg, "--check-keys"))                                        return OPT_CHECK_KEYS;
-    if (!STRCASECMP(arg, "-l")          || !STRCASECMP(arg, "--list"))           return OPT_LIST_MODELS;
-    if (!STRCASECMP(arg, "--mm"))                                                return OPT_MM;
-    if (!STRCASECMP(arg, "--ml"))                                                return OPT_ML;
-    if (!STRCASECMP(arg, "--list-sessions") || !STRCASECMP(arg, "--sl"))         return OPT_LIST_SESSIONS;
-    if (!STRCASECMP(arg, "--save-session")  || !STRCASECMP(arg, "--ss"))         return OPT_SAVE_SESSION;
-    if (!STRCASECMP(arg, "--load-session")  || !STRCASECMP(arg, "--ls"))         return OPT_LOAD_SESSION;
-    if (!STRCASECMP(arg, "-h")          || !STRCASECMP(arg, "--help"))           return OPT_HELP;
-    return OPT_UNKNOWN;
+/**
+ * @brief Routes the next request to the best endpoint.
+ * @details A route that is down is left for the fastest route that is up
+ *          (or, if all are down, for the one that comes back first). A working
+ *          route is left for a faster one only when probes show the other to be
+ *          at least ENDPOINT_SWITCH_MARGIN times faster, so that measurement
+ *          noise does not make requests flap between routes. Every switch is
+ *          reported on stderr.
+ * @param state The current application state.
+ */
+void endpoint_pool_select(AppState* state) {
+    EndpointPool* pool = &state->endpoints;
+    if (pool->num_routes < 2) return;
+    endpoint_pool_probe_step(state);
+
+    time_t now = time(NULL);
+    const Endpoint* current = &pool->routes[pool->current];
+    int best = -1;
+    for (int i = 0; i < pool->num_routes; i++) {
+        const Endpoint* route = &pool->routes[i];
+        if (route->down_until > now) continue;
+        if (best < 0) {
+            best = i;
+            continue;
+        }
+        double best_latency = pool->routes[best].latency_ewma_ms;
+        // Unmeasured routes rank after measured ones, in configuration order.
+        if (route->latency_ewma_ms > 0 && (best_latency == 0 || route->latency_ewma_ms < best_latency)) best = i;
+    }
+
+    const char* reason = NULL;
+    if (current->down_until > now) {
+        reason = "current endpoint is down";
+        if (best < 0) {
+            for (int i = 0; i < pool->num_routes; i++) {
+                if (best < 0 || pool->routes[i].down_until < pool->routes[best].down_until) best = i;
+            }
+        }
+    } else if (best >= 0 && best != pool->current && pool->routes[best].latency_ewma_ms > 0 &&
+               current->latency_ewma_ms > 0 &&
+               pool->routes[best].latency_ewma_ms < current->latency_ewma_ms * ENDPOINT_SWITCH_MARGIN) {
+        reason = "faster";
+    }
+    if (!reason || best < 0 || best == pool->current) return;
+
+    char from[512], to[512];
+    endpoint_describe(current, from, sizeof(from));
+    endpoint_describe(&pool->routes[best], to, sizeof(to));
+    fprintf(stderr, "[Endpoint: switching from %s to %s (%s)]\n", from, to, reason);
+    pool->failovers++;
+    endpoint_pool_apply(state, best);
 }
 
-int parse_common_options(int argc, char *argv[], AppState *state) {
-	
-    for (int i = 1; i < argc; i++) {
-        const char   *arg      = argv[i];
-        const char   *next_arg = (i + 1 < argc ? argv[i + 1] : NULL);
-        OptionType    opt      = classify_option(arg);
+/**
+ * @brief Feeds the outcome of a request into the endpoint ranking.
+ * @details Transport failures (no connection, proxy or TLS errors, timeouts)
+ *          take the route down at once, since the next attempt through it is
+ *          likely to fail the same way. Any HTTP answer, even a server error,
+ *          shows that the route works: a 503 for an overloaded model would hit
+ *          every other route too, and is left to the retry policy and the key
+ *          scheduler. Aborts by the user are not counted.
+ * @param state The current application state.
+ * @param http_code The HTTP status, or a negative CURLcode for transport errors.
+ */
+void endpoint_pool_record(AppState* state, long http_code) {
+    EndpointPool* pool = &state->endpoints;
+    if (pool->num_routes == 0) return;
+    Endpoint* route = &pool->routes[pool->current];
+    if (http_code == -CURLE_ABORTED_BY_CALLBACK || http_code == -CURLE_WRITE_ERROR) return;
+
+    route->requests++;
+    if (http_code < 0) {
+        route->failures++;
+        route->consecutive_failures++;
+        endpoint_mark_down(state, route, curl_easy_strerror((CURLcode)-http_code));
+    } else if (http_code > 0) {
+        route->consecutive_failures = 0;
+    }
+}
 
-        switch (opt) {
+/**
+ * @brief Prints the routes and their health for `/stats`.
+ */
+void print_endpoint_pool(FILE* stream, const AppState* state) {
+    const EndpointPool* pool = &state->endpoints;
+    time_t now = time(NULL);
+    fprintf(stream, "Endpoints: %d routes, %ld switches\n", pool->num_routes, pool->failovers);
+    for (int i = 0; i < pool->num_routes; i++) {
+        const Endpoint* route = &pool->routes[i];
+        char name[512];
+        endpoint_describe(route, name, sizeof(name));
+        fprintf(stream, "  %s %s: ", i == pool->current ? "*" : " ", name);
+        if (route->latency_ewma_ms > 0) fprintf(stream, "%.0f ms", route->latency_ewma_ms);
+        else fprintf(stream, "not measured");
+        fprintf(stream, ", %ld req, %ld failed", route->requests, route->failures);
+        if (route->down_until > now) fprintf(stream, ", down for %lds", (long)(route->down_until - now));
+        fprintf(stream, "\n");
+    }
+}
 
-            // --- Model and Configuration ---
-            case OPT_MODEL:
-                if (next_arg) {
-                    strncpy(state->model_name,
-                            next_arg,
-                            sizeof(state->model_name) - 1);
-                    i++;
-                }
-                break;
-
-            case OPT_HOST:
-                if (next_arg) {
-                    if (state->host) {
-                        free(state->host);
-                    }
-                    state->host = strdup(next_arg);
-                    i++;
-                }
-                break;
+typedef struct {
+    AppState* state;
+    int index;
+} KeyProbe;
 
-            case OPT_SYSTEM:
-                if (next_arg) {
-                    free(state->system_prompt);
-                    state->system_prompt = strdup(next_arg);
-                    i++;
-                }
-                break;
+/**
+ * @brief Completion callback of a key validation probe.
+ * @details Classifies the probe result and stores it in the key health cache.
+ *          Keys rejected by the API (400, 401, 403) are marked invalid, a 429
+ *          means the key works but is out of quota, and transport errors or
+ *          other statuses leave the validity unknown.
+ * @param transfer The finished probe.
+ * @param userdata The KeyProbe describing which key was probed.
+ */
+static void key_probe_done(Transfer* transfer, void* userdata) {
+    KeyProbe* probe = userdata;
+    KeyHealth* health = key_health_get(probe->state, probe->state->api_keys[probe->index]);
+    if (!health) return;
+
+    curl_off_t total_us = 0;
+    curl_easy_getinfo(transfer->curl, CURLINFO_TOTAL_TIME_T, &total_us);
+    long http_code = transfer->http_code;
+    if (transfer->result != CURLE_OK && http_code == 0) {
+        http_code = -(long)transfer->result;
+    }
+
+    health->http_code = http_code;
+    health->latency_ms = total_us / 1000.0;
+    health->checked_at = time(NULL);
+    if (http_code >= 200 && http_code < 300) {
+        health->status = KEY_STATUS_VALID;
+    } else if (http_code == 429) {
+        health->status = KEY_STATUS_RATE_LIMITED;
+    } else if (http_code == 400 || http_code == 401 || http_code == 403) {
+        health->status = KEY_STATUS_INVALID;
+    } else {
+        health->status = KEY_STATUS_UNKNOWN;
+    }
+}
 
-            case OPT_CONFIG:
-                if (next_arg) {
-                    // config already loaded; just skip its value
-                    i++;
-                }
-                break;
+/**
+ * @brief Validates all loaded API keys concurrently and prints the results.
+ * @details Each key is probed with a lightweight `models.get` request for the
+ *          current model instead of uploading the conversation. All probes are
+ *          submitted to the request engine at once (multiplexed over one
+ *          HTTP/2 connection where possible) and each is bounded by
+ *          KEY_CHECK_TIMEOUT_SEC, so the whole check takes about as long as
+ *          the slowest key. Results are stored in the key health cache, where
+ *          the key rotation and `/keys list` pick them up.
+ * @param state The current application state.
+ * @param stream The stream to print the results to.
+ */
+void check_api_keys(AppState* state, FILE* stream) {
+    if (state->num_api_keys == 0) {
+        fprintf(stream, "  (No keys to check)\n");
+        return;
+    }
 
+    endpoint_pool_select(state);
+    char url[512];
+    snprintf(url, sizeof(url), "https://%s/v1beta/models/%s", state->host, state->model_name);
 
-            // --- Generation Parameters ---
-            case OPT_TEMP:
-                if (next_arg) {
-                    state->temperature = atof(next_arg);
-                    i++;
-                }
-                break;
+    Transfer** transfers = calloc(state->num_api_keys, sizeof(Transfer*));
+    KeyProbe* probes = calloc(state->num_api_keys, sizeof(KeyProbe));
+    if (!transfers || !probes) {
+        fprintf(stderr, "Error: Failed to allocate memory for key check.\n");
+        free(transfers);
+        free(probes);
+        return;
+    }
 
-            case OPT_MM:
-                state->media_resolution = "MEDIA_RESOLUTION_MEDIUM";
-                break;
+    for (int i = 0; i < state->num_api_keys; i++) {
+        probes[i].state = state;
+        probes[i].index = i;
 
-            case OPT_ML:
-                state->media_resolution = "MEDIA_RESOLUTION_LOW";
-                break;
+        CURL* curl = transport_acquire(&state->transport);
+        if (!curl) continue;
 
-            case OPT_PROXY:
-                if (next_arg) {
-                    snprintf(state->proxy,
-                             sizeof(state->proxy),
-                             "%s",
-                             next_arg);
-                    i++;
-                }
-                break;
+        char auth_header[256];
+        snprintf(auth_header, sizeof(auth_header), "x-goog-api-key: %s", state->api_keys[i]);
+        struct curl_slist* headers = curl_slist_append(NULL, auth_header);
+        if (strcmp(state->origins[i], "default") != 0) {
+            char origin_header[256];
+            snprintf(origin_header, sizeof(origin_header), "Origin: %s", state->origins[i]);
+            headers = curl_slist_append(headers, origin_header);
+        }
 
-            case OPT_SEED:
-                if (next_arg) {
-                    state->seed = atoi(next_arg);
-                    i++;
-                }
-                break;
+        curl_easy_setopt(curl, CURLOPT_URL, url);
+        if (state->proxy[0] != '\0') {
+            curl_easy_setopt(curl, CURLOPT_PROXY, state->proxy);
+        }
+        curl_easy_setopt(curl, CURLOPT_HTTPHEADER, headers);
+        curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, discard_callback);
+        curl_easy_setopt(curl, CURLOPT_TIMEOUT, (long)KEY_CHECK_TIMEOUT_SEC);
+        // Wait for the first connection and multiplex onto it rather than
+        // opening one connection per key.
+        curl_easy_setopt(curl, CURLOPT_PIPEWAIT, 1L);
 
-            case OPT_MAX_TOKENS:
-                if (next_arg) {
-                    state->max_output_tokens = atoi(next_arg);
-                    i++;
-                }
-                break;
+        transfers[i] = transport_submit(&state->transport, curl, headers, key_probe_done, &probes[i]);
+    }
 
-            case OPT_TOPK:
-                if (next_arg) {
-                    state->topK = atoi(next_arg);
-                    i++;
-                }
-                break;
+    for (int i = 0; i < state->num_api_keys; i++) {
+        const char* key = state->api_keys[i];
+        size_t key_len = strlen(key);
+        long http_code = 0;
+        CURLcode res = transfers[i] ? transport_await(&state->transport, transfers[i], &http_code) : CURLE_FAILED_INIT;
+
+        fprintf(stream, "  [%d] ", i);
+        if (key_len > 11) fprintf(stream, "%.4s...%.4s", key + 6, key + key_len - 4);
+        else fprintf(stream, "%.*s...", (int)key_len, key);
+
+        const KeyHealth* health = key_health_cached(state, key);
+        if (res == CURLE_OPERATION_TIMEDOUT) {
+            fprintf(stream, " : TIMEOUT\n");
+        } else if (health && health->status == KEY_STATUS_VALID) {
+            fprintf(stream, " : OK (%.0f ms)\n", health->latency_ms);
+        } else if (health && health->status == KEY_STATUS_RATE_LIMITED) {
+            fprintf(stream, " : OK (rate limited)\n");
+        } else if (health && health->status == KEY_STATUS_INVALID) {
+            fprintf(stream, " : INVALID (HTTP %ld)\n", http_code);
+        } else if (http_code > 0) {
+            fprintf(stream, " : FAILED (HTTP %ld)\n", http_code);
+        } else {
+            fprintf(stream, " : FAILED (%s)\n", curl_easy_strerror(res));
+        }
+    }
 
-            case OPT_TOPP:
-                if (next_arg) {
-                    state->topP = atof(next_arg);
-                    i++;
-                }
-                break;
+    free(transfers);
+    free(probes);
+}
 
-            case OPT_BUDGET:
-                if (next_arg) {
-                    state->thinking_budget = atoi(next_arg);
-                    i++;
-                }
-                break;
+/**
+ * @brief Fetches and lists all available models from the Gemini API.
+ * @details This function retrieves a list of all models accessible with the
+ *          configured API key. It handles API pagination by making repeated
+ *          GET requests if a `nextPageToken` is present in the response,
+ *          ensuring that all available models are fetched and displayed.
+ * @param state The current application state, used to provide the API key
+ *              for the request.
+ */
+void list_available_models(AppState* state) {
+    char next_page_token[256] = {0};
+    bool first_page = true;
+    int model_count = 0;
 
+    // Allocate a memory buffer to store the API's JSON response.
+    MemoryStruct chunk = { .buffer = malloc(1), .size = 0 };
+    if (!chunk.buffer) {
+        fprintf(stderr, "Error: Failed to allocate memory for API response.\n");
+        return;
+    }
+    chunk.buffer[0] = '\0';
 
-            // --- Boolean Flags ---
-            case OPT_EXECUTE:
-            case OPT_QUIET:
-                // handled elsewhere, just consume
-                break;
+    fprintf(stderr, "Fetching available models...\n");
 
-            case OPT_NO_GROUNDING:
-                state->google_grounding = false;
-                break;
+    // Loop to handle paginated results.
+    do {
+        char full_url[1024];
 
-            case OPT_FREE:
-                state->free_mode = true;
-                break;
+        long http_code = 0;
+        for (int attempt = 1; ; attempt++) {
+            // Reset the response buffer for each new attempt.
+            chunk.size = 0;
+            chunk.buffer[0] = '\0';
 
-            case OPT_NO_URL_CONTEXT:
-                state->url_context = false;
-                break;
+            // Construct the appropriate URL for the request; a retry may go
+            // to another host if the endpoint pool failed over.
+            endpoint_pool_select(state);
+            if (first_page) {
+                snprintf(full_url, sizeof(full_url), "https://%s/v1beta/models?pageSize=50", state->host);
+            } else {
+                snprintf(full_url, sizeof(full_url), "https://%s/v1beta/models?pageSize=50&pageToken=%s", state->host, next_page_token);
+            }
 
-            case OPT_LOC:
-                state->loc_tile |= 1;
+            // Perform the GET request.
+            http_code = perform_api_get_request(full_url, state, write_to_memory_struct_callback, &chunk);
+            if (http_code == 200 || !retry_policy_should_retry(state, "list_models", attempt, http_code)) {
                 break;
+            }
+        }
 
-            case OPT_SAFETY:
-                state->safety |= 1;
-                break;
+        // Handle the final result of the last attempt.
+        if (http_code != 200) {
+            fprintf(stderr, "\nAPI call to list models failed (Last HTTP code: %ld)\n", http_code);
+            if(http_code < 0) fprintf(stderr, "Curl error: %s\n", curl_easy_strerror(-http_code));
+            parse_and_print_error_json(chunk.buffer);
+            break; // Exit the pagination loop on failure.
+        }
 
-            case OPT_MAP:
-                state->loc_tile |= 2;
-                break;
+        // Parse the JSON response from the buffer.
+        cJSON* root = cJSON_Parse(chunk.buffer);
+        if (!root) {
+            fprintf(stderr, "Error: Failed to parse JSON response for models list.\n");
+            break;
+        }
 
+        // Extract and iterate over the array of models.
+        cJSON* models_array = cJSON_GetObjectItem(root, "models");
+        if (cJSON_IsArray(models_array)) {
+            cJSON* model_item;
+            cJSON_ArrayForEach(model_item, models_array) {
+                cJSON* name = cJSON_GetObjectItem(model_item, "name");
+                cJSON* display_name = cJSON_GetObjectItem(model_item, "displayName");
 
-            // --- Immediate Actions (exit) ---
-            case OPT_LIST_KEYS: {
-                fprintf(stdout, "--- API Keys in Config ---\n");
-                if (state->num_api_keys == 0) {
-                    fprintf(stdout, "  (No API keys found in configuration)\n");
-                } else {
-                    for (int j = 0; j < state->num_api_keys; j++) {
-                        const char *key    = state->api_keys[j];
-                        const char *origin = state->origins[j];
-                        size_t key_len     = strlen(key);
-                        fprintf(stdout, "  [%d] ", j);
-                        if (key_len > 11)
-                            fprintf(stdout,
-                                    "%.4s...%.4s (%s)",
-                                    key + 6,
-                                    key + key_len - 4,
-                                    origin);
-                        else
-                            fprintf(stdout,
-                                    "%.*s... (%s)",
-                                    (int)key_len,
-                                    key,
-                                    origin);
-                        fprintf(stdout, "\n");
-                    }
+                if (cJSON_IsString(name)) {
+                    const char* full_model_name = name->valuestring;
+                    const char* prefix = "models/";
+                    const char* name_to_print = (strncmp(full_model_name, prefix, strlen(prefix)) == 0)
+                                                ? full_model_name + strlen(prefix)
+                                                : full_model_name;
+                    fprintf(stdout, "- %s (%s)\n", name_to_print, cJSON_IsString(display_name) ? display_name->valuestring : "N/A");
+                    model_count++;
                 }
-                exit(0);
             }
+        }
 
-            case OPT_ADD_KEY:
-                get_api_key_securely(state);
-                save_configuration(state);
-                exit(0);
+        // Check for a token for the next page.
+        const cJSON* token_item = cJSON_GetObjectItem(root, "nextPageToken");
+        if (cJSON_IsString(token_item) && (token_item->valuestring != NULL)) {
+            strncpy(next_page_token, token_item->valuestring, sizeof(next_page_token) - 1);
+        } else {
+            next_page_token[0] = '\0'; // No more pages.
+        }
 
-            case OPT_REMOVE_KEY:
-                if (next_arg) {
-                    long idx = strtol(next_arg, NULL, 10);
-                    if (idx < 0 || idx >= state->num_api_keys) {
-                        fprintf(stderr, "Error: Invalid key index.\n");
-                    } else {
-                        free(state->api_keys[idx]);
-                        if (idx < state->num_api_keys - 1) {
-                            memmove(&state->api_keys[idx],
-                                    &state->api_keys[idx + 1],
-                                    sizeof(char*) *
-                                      (state->num_api_keys - idx - 1));
-                        }
-                        state->num_api_keys--;
-                        if (state->next_key_index >= state->num_api_keys &&
-                            state->num_api_keys > 0) {
-                            state->next_key_index = 0;
-                        }
-                        save_configuration(state);
-                        fprintf(stdout,
-                                "Removed key at index %ld from configuration.\n",
-                                idx);
-                    }
-                    i++;
-                }
-                exit(0);
+        cJSON_Delete(root);
+        first_page = false;
 
-            case OPT_CHECK_KEYS: {
-                fprintf(stdout, "Checking API keys from configuration...\n");
-                if (state->num_api_keys == 0) {
-                    fprintf(stdout, "  (No keys to check)\n");
-                } else {
-                    int original_next = state->next_key_index;
-                    for (int j = 0; j < state->num_api_keys; j++) {
-                        state->next_key_index = j;
-                        int token_count       = get_token_count(state);
-                        const char *key       = state->api_keys[j];
-                        size_t key_len        = strlen(key);
-                        fprintf(stdout, "  [%d] ", j);
-                        if (key_len > 11)
-                            fprintf(stdout,
-                                    "%.4s...%.4s",
-                                    key + 6,
-                                    key + key_len - 4);
-                        else
-                            fprintf(stdout,
-                                    "%.*s...",
-                                    (int)key_len,
-                                    key);
-                        if (token_count >= 0)
-                            fprintf(stdout, " : OK\n");
-                        else
-                            fprintf(stdout, " : FAILED\n");
-                    }
-                    state->next_key_index = original_next;
-                }
-                exit(0);
-            }
+    } while (next_page_token[0] != '\0');
 
-            case OPT_LIST_MODELS:
-                list_available_models(state);
-                exit(0);
+    if (model_count > 0) {
+        fprintf(stderr, "\nFound %d models.\n", model_count);
+    } else {
+        fprintf(stderr, "No models were found or an error occurred.\n");
+    }
 
-            case OPT_LIST_SESSIONS:
-                list_sessions();
-                exit(0);
+    free(chunk.buffer);
+}
 
-            case OPT_SAVE_SESSION:
-                if (next_arg) {
-                    free(state->save_session_path);
-                    state->save_session_path = strdup(next_arg);
-                    i++;
-                }
-                break;
+/**
+ * @brief Exports the current conversation history to a human-readable Markdown file.
+ * @details This function iterates through the entire conversation history stored in
+ *          the AppState. It formats each user and model turn into a simple Markdown
+ *          structure, including the system prompt, text content, and placeholders
+ *          for file attachments. The output is saved to the specified file path.
+ *          MODIFIED: It now decodes and prints the content of text/plain attachments.
+ * @param state The current application state, containing the history to be exported.
+ * @param filepath The path to the Markdown file that will be created or overwritten.
+ */
+void export_history_to_markdown(AppState* state, const char* filepath) {
+    // Ensure the file path is safe and does not attempt directory traversal.
+    if (!is_path_safe(filepath)) {
+        fprintf(stderr, "Error: Unsafe or absolute file path specified: %s\n", filepath);
+        return;
+    }
 
-            case OPT_LOAD_SESSION:
-                if (next_arg) {
-                    char file_path[PATH_MAX];
-                    if (build_session_path(next_arg,
-                                            file_path,
-                                            sizeof(file_path))) {
-                        load_history_from_file(state, file_path);
-                        strncpy(state->current_session_name,
-                                next_arg,
-                                sizeof(state->current_session_name) - 1);
+    FILE* file = fopen(filepath, "w");
+    if (!file) {
+        perror("Failed to open file for export");
+        return;
+    }
+
+    fprintf(stderr, "Exporting conversation to %s...\n", filepath);
+
+    // First, write the system prompt to the file if one is set.
+    if (state->system_prompt) {
+        fprintf(file, "## System Prompt\n\n```\n%s\n```\n\n---\n\n", state->system_prompt);
+    }
+
+    // Iterate through each content block (turn) in the history.
+    for (int i = 0; i < state->history.num_contents; i++) {
+        Content* content = &state->history.contents[i];
+
+        // Write the role ("User" or "Model") as a level-3 Markdown header.
+        fprintf(file, "### %c%s\n\n", toupper((unsigned char)content->role[0]), content->role + 1);
+
+        bool has_text = false;
+        // Iterate through each part within the content block.
+        for (int j = 0; j < content->num_parts; j++) {
+            Part* part = &content->parts[j];
+            if (part->type == PART_TYPE_TEXT && part->text) {
+                // Write the text content directly.
+                fprintf(file, "%s\n", part->text);
+                has_text = true;
+            } else if (part->type == PART_TYPE_FILE) {
+                // --- MODIFICATION START ---
+                // Check if the attachment is text/plain and has data to be decoded.
+                bool is_text = part->mime_type && strcmp(part->mime_type, "text/plain") == 0;
+                if (is_text && part->blob) {
+                    // Held as raw bytes already; nothing to decode.
+                    blob_check(part->blob);
+                    fprintf(file, "\n```text\n");
+                    fwrite(part->blob->data, 1, part->blob->size, file);
+                    fprintf(file, "\n```\n");
+                } else if (is_text && part->base64_data) {
+                    Base64DecodeResult decoded = base64_decode(part->base64_data);
+                    if (decoded.data) {
+                        // If decoding is successful, print the content in a formatted block.
+                        fprintf(file, "\n```text\n%s\n```\n", (char*)decoded.data);
+                        free(decoded.data); // Free the memory from the decoder.
+                    } else {
+                        // If decoding fails, print a placeholder with an error.
+                        const char* filename = part->filename ? part->filename : "Pasted Data";
+                        fprintf(file, "\n`[Attached File: %s (text/plain, decoding failed)]`\n", filename);
                     }
-                    i++;
+                } else {
+                    // For all other file types, use the original placeholder.
+                    const char* filename = part->filename ? part->filename : "Pasted Data";
+                    const char* mime_type = part->mime_type ? part->mime_type : "unknown";
+                    fprintf(file, "\n`[Attached File: %s (%s)]`\n", filename, mime_type);
                 }
-                break;
+                // --- MODIFICATION END ---
+            }
+        }
 
-            case OPT_HELP:
-                print_usage(argv[0]);
-                exit(0);
+        // Add extra spacing for readability if there was text content.
+        if (has_text) {
+            fprintf(file, "\n");
+        }
 
-            case OPT_UNKNOWN:
-            default:
-                // first non-option → return its index
-                return i;
+        // Add a horizontal rule to separate turns, except after the very last one.
+        if (i < state->history.num_contents - 1) {
+            fprintf(file, "---\n\n");
         }
     }
 
-    // all args parsed as options
-    return argc;
+    fclose(file);
+    fprintf(stderr, "Successfully exported history to %s\n", filepath);
 }
 
 /**
- * @brief Prints the command-line usage instructions and exits.
- * @details This function displays a comprehensive help message that outlines the
- *          program's modes of operation and lists all available command-line
- *          options with brief descriptions. It is typically called when the
- *          user provides the -h or --help flag.
- * @param prog_name The name of the executable (from argv[0]).
+ * @brief Gets the base path for the application's data directory.
+ * @details This function provides a portable way to determine the correct location
+ *          for storing configuration and session files. It creates the directory
+ *          if it does not already exist.
+ *          - On Windows, it resolves to `%APPDATA%\gemini-cli`.
+ *          - On POSIX systems (Linux, macOS), it resolves to `~/.config/gemini-cli`.
+ * @param buffer A character buffer to store the resulting path.
+ * @param buffer_size The size of the buffer. The buffer will be empty on failure.
  */
-void print_usage(const char* prog_name) {
-    fprintf(stderr, "Usage: %s [options] [prompt or files...]\n\n", prog_name);
-    fprintf(stderr, "A portable, feature-rich command-line client for the Google Gemini API.\n\n");
-    fprintf(stderr, "The client operates in two modes:\n");
-    fprintf(stderr, "  - Interactive Mode: (Default) A full chat session with history and commands.\n");
-    fprintf(stderr, "  - Non-Interactive Mode: Engaged if stdin or stdout is piped.\n\n");
-    fprintf(stderr, "Options:\n");
-    fprintf(stderr, "  -c, --config <path>        Load configuration from a specific file path.\n");
-    fprintf(stderr, "  -m, --model <name>         Specify the model name (e.g., gemini-1.5-pro-latest).\n");
-    fprintf(stderr, "  -t, --temp <float>         Set the generation temperature (e.g., 1.0).\n");
-    fprintf(stderr, "  -s, --seed <int>           Set the random seed for reproducible outputs.\n");
-    fprintf(stderr, "  -S, --system <prompt>      Set a system prompt for the entire session.\n");
-    fprintf(stderr, "  -o, --max-tokens <int>     Set the maximum number of tokens in the response.\n");
-    fprintf(stderr, "  -b, --budget <int>         Set the model's max 'thinking' token budget.\n");
-    fprintf(stderr, "  -p, --proxy <url>          Specify a proxy to use (e.g., 'http://localhost:8080').\n");
-    fprintf(stderr, "      --topk <int>           Set the Top-K sampling parameter.\n");
-    fprintf(stderr, "      --topp <float>         Set the Top-P (nucleus) sampling parameter.\n");
-    fprintf(stderr, "  -e, --execute              Execute a single prompt non-interactively and exit.\n");
-    fprintf(stderr, "  -q, --quiet                Enable quiet mode; print only the final response to stdout.\n");
-    fprintf(stderr, "  -f, --free                 Use the unofficial, key-free API endpoint.\n");
-    fprintf(stderr, "      --loc                  Get location information (requires --free mode).\n");
-    fprintf(stderr, "      --map                  Get map URL for location (requires --free mode).\n");
-    fprintf(stderr, "  -ng, --no-grounding        Disable Google Search grounding for the response.\n");
-    fprintf(stderr, "  -nu, --no-url-context      Disable automatic fetching of URL context.\n");
-    fprintf(stderr, "  -l, --list                 List all available models and exit.\n");
-    fprintf(stderr, "  --sl --list-sessions       List all saved sessions and exit.\n");
-    fprintf(stderr, "  --ls --load-session <name> Load a saved session by name and start chatting.\n");
-    fprintf(stderr, "  --ss --save-session <file> Save the conversation to a file after a non-interactive run.\n");
-    fprintf(stderr, "\nKey Management:\n");
-    fprintf(stderr, "      --list-keys            List API keys from the configuration file and exit.\n");
-    fprintf(stderr, "      --add-key <key>        Add a new API key to the configuration file and exit.\n");
-    fprintf(stderr, "      --remove-key <index>   Remove an API key from the configuration file and exit.\n");
-    fprintf(stderr, "      --check-keys           Validate all configured API keys and exit.\n\n");
-    fprintf(stderr, "  -h, --help                 Show this help message and exit.\n\n");
-    fprintf(stderr, "For a list of in-session commands (like /save, /attach), start interactive mode and type /help.\n");
+void get_base_app_path(char* buffer, size_t buffer_size) {
+    const char* config_dir_name = "gemini-cli";
+
+    // On POSIX systems, the standard is the .config directory in the user's home.
+    char* base_path = getenv("HOME");
+    if (!base_path) {
+        buffer[0] = '\0'; // Unable to find HOME directory.
+        return;
+    }
+    // First, ensure the ~/.config directory exists.
+    char dir_path[PATH_MAX];
+    snprintf(dir_path, sizeof(dir_path), "%s/.config", base_path);
+    MKDIR(dir_path);
+
+    // Then, construct the full path: /home/user/.config/gemini-cli
+    snprintf(buffer, buffer_size, "%s/.config/%s", base_path, config_dir_name);
+    MKDIR(buffer); // Create the final directory if it doesn't exist.
 }
 
 /**
- * @brief Sets the application state to its default values.
- * @details This function initializes a new AppState struct by first clearing it
- *          with `memset` and then populating it with the standard default
- *          settings for the model, generation parameters, and features. This
- *          ensures the application starts in a consistent state before any
- *          user configuration is loaded.
- * @param state A pointer to the AppState struct to be initialized.
+ * @brief Safely constructs the full file path for a named session.
+ * @details This function combines the base sessions directory path with a
+ *          user-provided session name to create a full, absolute path to a
+ *          session's .json file. It performs critical safety checks to ensure
+ *          the session name is valid and to prevent path traversal attacks.
+ * @param session_name The name of the session, provided by the user.
+ * @param path_buffer A buffer to store the resulting full file path.
+ * @param buffer_size The size of the `path_buffer`.
+ * @return Returns true if the path was constructed successfully and safely.
+ *         Returns false if the session name is unsafe or if the resulting
+ *         path would be too long for the buffer.
  */
-void initialize_default_state(AppState* state) {
-    // Start with a clean, zeroed-out state struct to prevent undefined behavior.
-    memset(state, 0, sizeof(AppState));
+bool build_session_path(const char* session_name, char* path_buffer, size_t buffer_size) {
+    // First, validate the session name to prevent directory traversal.
+    if (!is_session_name_safe(session_name)) {
+        // The is_session_name_safe function prints its own specific error message.
+        return false;
+    }
 
-    // --- Set default values ---
-    strncpy(state->current_session_name, "[unsaved]", sizeof(state->current_session_name) - 1);
-    strncpy(state->origin, "default", sizeof(state->origin) - 1);
+    // Get the base path for the "sessions" subdirectory (e.g., ~/.config/gemini-cli/sessions).
+    char sessions_path[PATH_MAX];
+    get_sessions_path(sessions_path, sizeof(sessions_path));
+    if (sessions_path[0] == '\0') {
+        // This can happen if the base app path could not be determined.
+        return false;
+    }
 
-    // Default model and generation parameters.
-    strncpy(state->model_name, DEFAULT_MODEL_NAME, sizeof(state->model_name) - 1);
-    state->temperature = 0.75f;
-    state->seed = 42;
-    state->max_output_tokens = 0; // A high default limit.
+    // Define the correct path separator for the operating system.
+    const char* separator = "/";
 
-    // Default feature toggles.
-    state->google_grounding = true;
-    state->url_context = true;
+    // Pre-calculate the required buffer size to prevent overflow with snprintf.
+    // Required size = base_path + separator + session_name + ".json" + null_terminator
+    size_t required_size = strlen(sessions_path) + strlen(separator) + strlen(session_name) + 5 + 1;
+    if (required_size > buffer_size) {
+        fprintf(stderr, "Error: Session name '%s' results in a path that is too long.\n", session_name);
+        return false;
+    }
 
-    // Default values indicating that these parameters are not set by default.
-    // The API will use its own defaults for these.
-    state->thinking_budget = -1;
-    state->topK = -1;
+    // Safely construct the final, full path.
+    snprintf(path_buffer, buffer_size, "%s%s%s.json", sessions_path, separator, session_name);
+    return true;
+}
+
+/**
+ * @brief Tells whether a file is a named session, i.e. lies in the sessions directory.
+ * @details Only named sessions refer to attachments in the blob store, so that
+ *          `/blobs gc` finds every reference by reading that directory.
+ */
+static bool session_path_is_named(const char* filepath) {
+    char sessions_path[PATH_MAX];
+    get_sessions_path(sessions_path, sizeof(sessions_path));
+    size_t length = strlen(sessions_path);
+    return length > 0 && strncmp(filepath, sessions_path, length) == 0 && filepath[length] == '/' &&
+           !strchr(filepath + length + 1, '/');
+}
+
+/**
+ * @brief Finds how many leading history messages belong in the context cache.
+ * @details The stable prefix ends with the last message that carries an
+ *          attachment, followed by the model's answer to it, so that the
+ *          request referencing the cache goes on with a user turn. The newest
+ *          message, the prompt being sent, is never part of it.
+ * @param state The current application state.
+ * @return The number of messages; 0 if only the system instruction is stable.
+ */
+static int context_cache_prefix_length(const AppState* state) {
+    int num_contents = state->history.num_contents;
+    for (int i = num_contents - 2; i >= 0; i--) {
+        const Content* content = &state->history.contents[i];
+        for (int j = 0; j < content->num_parts; j++) {
+            if (content->parts[j].type == PART_TYPE_TEXT) continue;
+            bool answered = i + 1 < num_contents - 1 && strcmp(state->history.contents[i + 1].role, "model") == 0;
+            return answered ? i + 2 : i + 1;
+        }
+    }
+    return 0;
+}
+
+/**
+ * @brief Hashes the serialized form of the first messages of the history.
+ * @details The data of blob parts is not in the serialized text; the CRC-32
+ *          and length of the full JSON stand in for it.
+ */
+static uint64_t context_cache_hash_contents(AppState* state, int count) {
+    uint64_t hash = FNV1A_64_INIT;
+    for (int i = 0; i < count; i++) {
+        Content* content = &state->history.contents[i];
+        size_t length = 0;
+        const char* json = content_json(content, &length);
+        if (json) hash = fnv1a_64(hash, json, length);
+        if (json && content->splices) {
+            hash = fnv1a_64(hash, &content->json_crc, sizeof(content->json_crc));
+            hash = fnv1a_64(hash, &content->full_length, sizeof(content->full_length));
+        }
+    }
+    return hash;
+}
+
+/**
+ * @brief Builds what a context cache holds besides the messages: the model,
+ *        the system instruction and the tools.
+ * @details A request that references a cache may not set the system
+ *          instruction or the tools itself, so they have to go into the cache.
+ * @param state The current application state.
+ * @return The object, which the caller frees, or NULL on allocation failure.
+ */
+static cJSON* context_cache_setup(AppState* state) {
+    cJSON* settings = build_request_tree(state, false, false);
+    cJSON* setup = cJSON_CreateObject();
+    if (!settings || !setup) {
+        cJSON_Delete(settings);
+        cJSON_Delete(setup);
+        return NULL;
+    }
+    char model[256];
+    snprintf(model, sizeof(model), "models/%s", state->model_name);
+    cJSON_AddStringToObject(setup, "model", model);
+    cJSON* system_instruction = cJSON_DetachItemFromObject(settings, "systemInstruction");
+    if (system_instruction) cJSON_AddItemToObject(setup, "systemInstruction", system_instruction);
+    cJSON* tools = cJSON_DetachItemFromObject(settings, "tools");
+    if (tools) cJSON_AddItemToObject(setup, "tools", tools);
+    cJSON_Delete(settings);
+    return setup;
+}
+
+/**
+ * @brief Finds the key that created the context cache.
+ * @return Its index, or -1 if that key is no longer loaded.
+ */
+static int context_cache_key_index(AppState* state) {
+    return quota_key_index(state, state->context_cache.key_id);
+}
+
+/**
+ * @brief Configures a handle for a small call on the context cache: a TTL update or a deletion.
+ * @param state The current application state.
+ * @param key_index The key that created the cache.
+ * @param method "PATCH" or "DELETE".
+ * @param body The JSON to send, or NULL.
+ * @param[out] headers_out Receives the header list set on the handle.
+ * @return The handle, or NULL if none could be acquired.
+ */
+static CURL* context_cache_handle(AppState* state, int key_index, const char* method, const char* body, struct curl_slist** headers_out) {
+    *headers_out = NULL;
+    CURL* curl = transport_acquire(&state->transport);
+    if (!curl) return NULL;
+
+    char url[512];
+    snprintf(url, sizeof(url), "https://%s/v1beta/%s%s", state->host, state->context_cache.name, body ? "?updateMask=ttl" : "");
+    char auth_header[256];
+    snprintf(auth_header, sizeof(auth_header), "x-goog-api-key: %s", state->api_keys[key_index]);
+    struct curl_slist* headers = curl_slist_append(NULL, auth_header);
+    if (strcmp(state->origins[key_index], "default") != 0) {
+        char origin_header[256];
+        snprintf(origin_header, sizeof(origin_header), "Origin: %s", state->origins[key_index]);
+        headers = curl_slist_append(headers, origin_header);
+    }
+    headers = curl_slist_append(headers, "Content-Type: application/json");
+
+    curl_easy_setopt(curl, CURLOPT_URL, url);
+    if (state->proxy[0] != '\0') {
+        curl_easy_setopt(curl, CURLOPT_PROXY, state->proxy);
+    }
+    curl_easy_setopt(curl, CURLOPT_HTTPHEADER, headers);
+    curl_easy_setopt(curl, CURLOPT_CUSTOMREQUEST, method);
+    if (body) curl_easy_setopt(curl, CURLOPT_COPYPOSTFIELDS, body);
+    curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, discard_callback);
+    curl_easy_setopt(curl, CURLOPT_TIMEOUT, 30L);
+    *headers_out = headers;
+    return curl;
+}
+
+/**
+ * @brief Stops using the context cache.
+ * @param state The current application state.
+ * @param delete_remote Whether to delete the cache on the server as well, in
+ *        the background, rather than leave it to expire.
+ */
+void context_cache_forget(AppState* state, bool delete_remote) {
+    ContextCache* cache = &state->context_cache;
+    if (cache->refresh) {
+        transport_cancel(&state->transport, cache->refresh);
+        cache->refresh = NULL;
+    }
+    int key_index = delete_remote ? context_cache_key_index(state) : -1;
+    if (cache->name[0] != '\0' && key_index >= 0 && state->host) {
+        struct curl_slist* headers = NULL;
+        CURL* curl = context_cache_handle(state, key_index, "DELETE", NULL, &headers);
+        Transfer* transfer = curl ? transport_submit(&state->transport, curl, headers, NULL, NULL) : NULL;
+        if (transfer) {
+            transfer->background = true;
+            transport_detach(&state->transport, transfer);
+        }
+    }
+    cache->name[0] = '\0';
+    cache->key_id[0] = '\0';
+    cache->num_contents = 0;
+    cache->tokens = 0;
+    cache->expire_time = 0;
+}
+
+/**
+ * @brief Completion callback of a TTL update.
+ * @details The new expiry comes from the response. A cache the server no
+ *          longer has, or that the key may no longer read, is forgotten; after
+ *          other failures the update is tried again a minute later.
+ */
+static void context_cache_refresh_done(Transfer* transfer, void* userdata) {
+    AppState* state = userdata;
+    ContextCache* cache = &state->context_cache;
+    if (cache->refresh != transfer) return;
+    cache->refresh = NULL;
+
+    if (transfer->http_code == 200) {
+        cJSON* root = cJSON_Parse(cache->refresh_response.buffer);
+        const cJSON* expire_time = cJSON_GetObjectItem(root, "expireTime");
+        time_t expires = files_parse_time(cJSON_IsString(expire_time) ? expire_time->valuestring : NULL);
+        if (expires > 0) {
+            cache->expire_time = expires;
+            cache->refreshed++;
+        }
+        cJSON_Delete(root);
+    } else if (transfer->http_code == 403 || transfer->http_code == 404) {
+        context_cache_forget(state, false);
+    } else {
+        cache->next_refresh_at = time(NULL) + 60;
+    }
+}
+
+/**
+ * @brief Extends the TTL of the context cache in the background when it runs low. Never blocks.
+ * @details Called from the prompt's idle hook and before every request. Once
+ *          less than CONTEXT_CACHE_REFRESH_SEC of the TTL is left, it is reset
+ *          to CONTEXT_CACHE_TTL_SEC, but only while the cache is in use: after
+ *          a full TTL without a request the cache is left to expire, so an
+ *          abandoned terminal does not keep paying for its storage.
+ * @param state The current application state.
+ */
+void context_cache_refresh_step(AppState* state) {
+    ContextCache* cache = &state->context_cache;
+    if (cache->name[0] == '\0' || cache->refresh || !state->host) return;
+    time_t now = time(NULL);
+    if (cache->expire_time <= now || cache->expire_time - now > CONTEXT_CACHE_REFRESH_SEC) return;
+    if (now - cache->last_used > CONTEXT_CACHE_TTL_SEC || now < cache->next_refresh_at) return;
+    int key_index = context_cache_key_index(state);
+    if (key_index < 0) return;
+
+    MemoryStruct* response = &cache->refresh_response;
+    if (!response->buffer) response->buffer = malloc(1);
+    if (!response->buffer) return;
+    response->buffer[0] = '\0';
+    response->size = 0;
+
+    char body[64];
+    snprintf(body, sizeof(body), "{\"ttl\":\"%ds\"}", CONTEXT_CACHE_TTL_SEC);
+    struct curl_slist* headers = NULL;
+    CURL* curl = context_cache_handle(state, key_index, "PATCH", body, &headers);
+    if (!curl) return;
+    curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, write_to_memory_struct_callback);
+    curl_easy_setopt(curl, CURLOPT_WRITEDATA, response);
+    Transfer* transfer = transport_submit(&state->transport, curl, headers, context_cache_refresh_done, state);
+    if (!transfer) return;
+    transfer->background = true;
+    cache->refresh = transfer;
+    transport_detach(&state->transport, transfer);
+}
+
+/**
+ * @brief Counts the tokens of a stable prefix.
+ * @details The messages are counted with countTokens; the system instruction
+ *          is estimated at four bytes per token.
+ * @param state The current application state.
+ * @param count The number of leading history messages.
+ * @return The tokens, or -1 if they could not be counted.
+ */
+static long context_cache_count_tokens(AppState* state, int count) {
+    long tokens = state->system_prompt ? (long)(strlen(state->system_prompt) / 4) : 0;
+    if (count == 0) return tokens;
+
+    cJSON* settings = cJSON_CreateObject();
+    RequestBody body;
+    bool built = settings && request_body_build_range(state, settings, 0, count, &body);
+    cJSON_Delete(settings);
+    if (!built) return -1;
+    MemoryStruct response = { .buffer = malloc(1), .size = 0 };
+    long counted = -1;
+    if (response.buffer) {
+        response.buffer[0] = '\0';
+        long http_code = perform_api_curl_request(state, "countTokens", &body, write_to_memory_struct_callback, &response);
+        cJSON* root = http_code == 200 ? cJSON_Parse(response.buffer) : NULL;
+        const cJSON* total = cJSON_GetObjectItem(root, "totalTokens");
+        if (cJSON_IsNumber(total)) counted = (long)total->valuedouble;
+        cJSON_Delete(root);
+    }
+    request_body_free(&body);
+    free(response.buffer);
+    return counted >= 0 ? tokens + counted : -1;
+}
+
+/**
+ * @brief Stores a stable prefix as a new context cache, replacing the old one.
+ * @details The body is stitched from the cached message segments like any
+ *          request and posted with the healthiest key that has quota for the
+ *          prefix's tokens, which the cache is then bound to.
+ * @param state The current application state.
+ * @param setup The model, system instruction and tools, from `context_cache_setup`.
+ * @param count The number of leading history messages to store.
+ * @param setup_hash The hash of `setup`.
+ * @param contents_hash The hash of the messages.
+ * @param tokens Their tokens as counted.
+ * @param[out] http_code_out Receives the status of the request (a negative
+ *             CURLcode for transport errors, 0 if nothing was sent).
+ * @return true if the cache was created.
+ */
+static bool context_cache_create(AppState* state, cJSON* setup, int count, uint64_t setup_hash, uint64_t contents_hash, long tokens,
+                                 long* http_code_out) {
+    ContextCache* cache = &state->context_cache;
+    char ttl[32];
+    snprintf(ttl, sizeof(ttl), "%ds", CONTEXT_CACHE_TTL_SEC);
+    cJSON_AddStringToObject(setup, "ttl", ttl);
+
+    *http_code_out = 0;
+    RequestBody body;
+    if (!request_body_build_range(state, setup, 0, count, &body)) return false;
+    // Storing the prefix takes a request and its tokens from the key's quota.
+    long pending_tokens = state->rate_limit.pending_tokens;
+    state->rate_limit.pending_tokens = tokens;
+    int key_index = rate_limited_select_api_key(state);
+    state->rate_limit.pending_tokens = pending_tokens;
+    if (key_index < 0) {
+        request_body_free(&body);
+        return false;
+    }
+    MemoryStruct response = { .buffer = malloc(1), .size = 0 };
+    endpoint_pool_select(state);
+    BodyUpload upload;
+    body_upload_init(&upload, &body);
+    struct curl_slist* headers = NULL;
+    CURL* curl = response.buffer ? build_api_post_handle(state, key_index, "", &upload, write_to_memory_struct_callback, &response, &headers) : NULL;
+    long http_code = -CURLE_FAILED_INIT;
+    if (curl) {
+        response.buffer[0] = '\0';
+        // The handle is set up like a generate call; only the URL differs.
+        char url[512];
+        snprintf(url, sizeof(url), "https://%s/v1beta/cachedContents", state->host);
+        curl_easy_setopt(curl, CURLOPT_URL, url);
+        if (count > 0) {
+            fprintf(stderr, "[Context cache: storing the first %d messages (%ld tokens)]\n", count, tokens);
+        } else {
+            fprintf(stderr, "[Context cache: storing the system instruction (%ld tokens)]\n", tokens);
+        }
+        CURLcode res = transport_perform(&state->transport, curl, headers, &http_code);
+        if (res != CURLE_OK && http_code == 0) http_code = -(long)res;
+        key_scheduler_record(state, key_index, http_code);
+    }
+    body_upload_end(&upload);
+    request_body_free(&body);
+
+    cJSON* root = http_code == 200 ? cJSON_Parse(response.buffer) : NULL;
+    const cJSON* name = cJSON_GetObjectItem(root, "name");
+    const cJSON* expire_time = cJSON_GetObjectItem(root, "expireTime");
+    const cJSON* usage = cJSON_GetObjectItem(root, "usageMetadata");
+    const cJSON* total = cJSON_GetObjectItem(usage, "totalTokenCount");
+    bool created = cJSON_IsString(name) && strlen(name->valuestring) < sizeof(cache->name);
+    rate_limiter_settle(state, created, cJSON_IsNumber(total) ? (long)total->valuedouble : 0);
+    *http_code_out = http_code;
+    if (created) {
+        context_cache_forget(state, true);
+        snprintf(cache->name, sizeof(cache->name), "%s", name->valuestring);
+        quota_key_id(state->api_keys[key_index], cache->key_id, sizeof(cache->key_id));
+        cache->num_contents = count;
+        cache->setup_hash = setup_hash;
+        cache->contents_hash = contents_hash;
+        cache->tokens = cJSON_IsNumber(total) ? (long)total->valuedouble : tokens;
+        cache->expire_time = files_parse_time(cJSON_IsString(expire_time) ? expire_time->valuestring : NULL);
+        if (cache->expire_time == 0) cache->expire_time = time(NULL) + CONTEXT_CACHE_TTL_SEC;
+        cache->next_refresh_at = 0;
+        cache->created++;
+    } else if (http_code > 0) {
+        fprintf(stderr, "[Context cache: not created (HTTP %ld), sending the whole conversation]\n", http_code);
+        parse_and_print_error_json(response.buffer);
+    }
+    cJSON_Delete(root);
+    free(response.buffer);
+    return created;
+}
+
+/**
+ * @brief Brings the context cache in line with the conversation before a generate request.
+ * @details Sessions often start with a long system prompt and a set of
+ *          attached documents that every turn sends, and pays for, again. Once
+ *          this stable prefix - the system instruction, the tools and the
+ *          messages up to the answer to the last attachment, see
+ *          `context_cache_prefix_length` - reaches `context_cache_min_tokens`,
+ *          it is stored once as a cachedContents entry. Requests then
+ *          reference the entry and send only the messages after it, and the
+ *          API bills the cached tokens at its reduced rate. Whether the prefix
+ *          is large enough is first estimated from the size of its JSON; only
+ *          a prefix that may qualify is counted with countTokens. A prefix that
+ *          stays under the threshold, or that the server refuses to cache, is
+ *          not tried again.
+ *
+ *          Like the Live session, the cache is checked against the
+ *          conversation on every request: after `/clear`, `/load`, edits, a
+ *          new model, system prompt or tool setting, or when it is about to
+ *          expire, it is dropped and deleted on the server. When later
+ *          attachments make the prefix longer, a larger cache replaces it.
+ *          Caches belong to the project of the key that created them, so a
+ *          request that references one is pinned to that key.
+ * @param state The current application state, with the prompt being sent as
+ *              the last history message.
+ * @return The number of leading messages the cache holds, or -1 if the request
+ *         should not reference a cache.
+ */
+static int context_cache_prepare(AppState* state) {
+    ContextCache* cache = &state->context_cache;
+    if (cache->min_tokens <= 0 || state->free_mode || state->num_api_keys == 0) return -1;
+    context_cache_refresh_step(state);
+
+    cJSON* setup = context_cache_setup(state);
+    char* setup_json = setup ? cJSON_PrintUnformatted(setup) : NULL;
+    if (!setup_json) {
+        cJSON_Delete(setup);
+        return -1;
+    }
+    uint64_t setup_hash = fnv1a_64(FNV1A_64_INIT, setup_json, strlen(setup_json));
+    free(setup_json);
+
+    // Is the cache still in step with the conversation?
+    if (cache->name[0] != '\0') {
+        int key_index = context_cache_key_index(state);
+        bool usable = cache->setup_hash == setup_hash && cache->num_contents < state->history.num_contents &&
+                      key_index >= 0 && (state->pinned_key_index < 0 || key_index == state->pinned_key_index) &&
+                      cache->expire_time > time(NULL) + CONTEXT_CACHE_MARGIN_SEC &&
+                      context_cache_hash_contents(state, cache->num_contents) == cache->contents_hash;
+        if (!usable) context_cache_forget(state, true);
+    }
+
+    // Create one for a stable prefix longer than what is cached, if it is large enough.
+    int prefix = context_cache_prefix_length(state);
+    if (cache->name[0] == '\0' || prefix > cache->num_contents) {
+        uint64_t contents_hash = context_cache_hash_contents(state, prefix);
+        uint64_t prefix_hash = fnv1a_64(contents_hash, &setup_hash, sizeof(setup_hash));
+        size_t bytes = state->system_prompt ? strlen(state->system_prompt) : 0;
+        for (int i = 0; i < prefix; i++) {
+            size_t length = 0;
+            if (content_json(&state->history.contents[i], &length)) bytes += content_length(&state->history.contents[i]);
+        }
+        if (prefix_hash != cache->rejected_hash && bytes / 4 >= (size_t)cache->min_tokens) {
+            long tokens = context_cache_count_tokens(state, prefix);
+            if (tokens >= cache->min_tokens) {
+                // Only a refusal of the request itself is final; throttling,
+                // server and network errors may pass.
+                long http_code = 0;
+                if (!context_cache_create(state, setup, prefix, setup_hash, contents_hash, tokens, &http_code) &&
+                    http_code >= 400 && http_code < 500 && http_code != 408 && http_code != 429) {
+                    cache->rejected_hash = prefix_hash;
+                }
+            } else if (tokens >= 0) {
+                cache->rejected_hash = prefix_hash;
+            }
+        }
+    }
+    cJSON_Delete(setup);
+
+    if (cache->name[0] == '\0') return -1;
+    cache->last_used = time(NULL);
+    cache->requests++;
+    cache->cached_tokens += cache->tokens;
+    return cache->num_contents;
+}
+
+/**
+ * @brief Stops using a context cache the API refused to read.
+ * @details A cache that is gone (it expired early, or a loaded session named a
+ *          deleted one) may be created again. A cache the API rejected for
+ *          another reason is not: its prefix is marked as rejected for the
+ *          rest of the session.
+ * @param state The current application state.
+ * @param http_code The status of the failed request.
+ */
+static void context_cache_abandon(AppState* state, long http_code) {
+    ContextCache* cache = &state->context_cache;
+    fprintf(stderr, "[Context cache %s %s, sending the whole conversation]\n", cache->name, http_code == 404 ? "is gone" : "is not readable");
+    if (http_code != 404) {
+        cache->rejected_hash = fnv1a_64(cache->contents_hash, &cache->setup_hash, sizeof(cache->setup_hash));
+    }
+    context_cache_forget(state, false);
+}
+
+/**
+ * @brief Prints the context cache statistics for `/stats`.
+ * @param stream The stream to print to.
+ * @param state The current application state.
+ */
+void print_context_cache_stats(FILE* stream, AppState* state) {
+    const ContextCache* cache = &state->context_cache;
+    if (cache->name[0] == '\0' && cache->created == 0) return;
+    fprintf(stream, "Context cache: ");
+    if (cache->name[0] != '\0') {
+        fprintf(stream, "%s holds %d messages (%ld tokens), expires in %ld min; ",
+                cache->name, cache->num_contents, cache->tokens, (long)(cache->expire_time - time(NULL)) / 60);
+    } else {
+        fprintf(stream, "none; ");
+    }
+    fprintf(stream, "%ld created, %ld TTL refreshes, %ld requests used one (%lld tokens not sent again)\n",
+            cache->created, cache->refreshed, cache->requests, cache->cached_tokens);
+}
+
+/**
+ * @brief Builds the body of a generate request.
+ * @details When the start of the conversation is held by a context cache (see
+ *          `context_cache_prepare`), the body references the cache instead of
+ *          repeating it. Such a body, and one whose history holds uploaded
+ *          files (see `files_api_prepare`), must be sent with the key in
+ *          `body->key_index`.
+ * @param state The current application state; its history is the conversation.
+ * @param model_prefix Text the model's answer must start with, or NULL. It is
+ *        sent as a trailing model turn, which the model continues.
+ * @param[out] body Receives the body; free it with `request_body_free`.
+ * @return true on success.
+ */
+static bool build_generate_body(AppState* state, const char* model_prefix, RequestBody* body) {
+    // The context cache is created with the key of the uploaded files, too.
+    int files_key = files_api_prepare(state);
+    state->pinned_key_index = files_key;
+    int cached = context_cache_prepare(state);
+    state->pinned_key_index = -1;
+    if (model_prefix) {
+        Part prefix_part = { .type = PART_TYPE_TEXT, .text = (char*)model_prefix };
+        add_content_to_history(&state->history, "model", &prefix_part, 1);
+    }
+    cJSON* settings = build_request_tree(state, false, false);
+    if (settings && cached >= 0) {
+        // The cache holds these, and a request that references it may not set them.
+        cJSON_DeleteItemFromObject(settings, "systemInstruction");
+        cJSON_DeleteItemFromObject(settings, "tools");
+        cJSON_AddStringToObject(settings, "cachedContent", state->context_cache.name);
+    }
+    int first = cached >= 0 ? cached : 0;
+    bool built = settings && request_body_build_range(state, settings, first, state->history.num_contents - first, body);
+    if (built) body->key_index = cached >= 0 ? context_cache_key_index(state) : files_key;
+    cJSON_Delete(settings);
+    if (model_prefix) {
+        // The body keeps the prefix turn's segment; the turn itself leaves the history.
+        Content* prefix = &state->history.contents[state->history.num_contents - 1];
+        if (built && body->gzip) {
+            body->owned_message = prefix->deflated;
+            prefix->deflated = NULL;
+        } else if (built) {
+            body->owned_message = (unsigned char*)prefix->json;
+            prefix->json = NULL;
+        }
+        state->history.num_contents--;
+        free_content(prefix);
+    }
+    if (!built) {
+        fprintf(stderr, "Error: Failed to build JSON request.\n");
+    }
+    return built;
+}
+
+/**
+ * @brief Sends a request to the official Gemini API and handles the response.
+ * @details This is the primary function for interacting with the official Gemini
+ *          API. It builds the JSON request payload, Gzip-compresses it for
+ *          efficiency, sends it via a POST request, and processes the streaming
+ *          SSE response. The full, concatenated response from the model is
+ *          returned upon success. It includes retry logic for transient errors.
+ * @param state The current application state, containing the history, configuration,
+ *              and API key needed for the request.
+ * @param resume The start of an answer that was broken off elsewhere (a lost
+ *               Live session), to be continued rather than regenerated; or NULL.
+ * @param[out] full_response_out A pointer to a character pointer. On success, this
+ *             will be updated to point to a newly allocated string containing the
+ *             complete model response. The caller is responsible for freeing this
+ *             memory.
+ * @param[out] http_code_out Receives the status of the last attempt (a negative
+ *             CURLcode for transport errors, 0 if nothing was sent).
+ * @return Returns true if the API call was successful (HTTP 200), and false otherwise.
+ */
+static bool send_official_api_request(AppState* state, const char* resume, char** full_response_out, long* http_code_out) {
+    *full_response_out = NULL;
+    *http_code_out = 0;
+
+    // 1. Build the payload once. It's the same for all retries, and only
+    //    its new messages are compressed.
+    RequestBody body;
+    if (!build_generate_body(state, resume, &body)) {
+        return false;
+    }
+
+    // 2. Prepare the memory structure. We allocate it once and reuse/reset it.
+    MemoryStruct chunk = { .buffer = malloc(1), .size = 0, .full_response = malloc(1), .full_response_size = 0 };
+    if (!chunk.buffer || !chunk.full_response) {
+        fprintf(stderr, "Error: Failed to allocate memory for curl response chunk.\n");
+        request_body_free(&body);
+        if(chunk.buffer) free(chunk.buffer);
+        if(chunk.full_response) free(chunk.full_response);
+        return false;
+    }
+
+    long http_code = 0;
+    bool success = false;
+    bool interrupted = false;
+    bool cache_abandoned = false;
+    bool body_rebuilt = false;
+    int continuations = 0;
+    if (resume) {
+        size_t resume_length = strlen(resume);
+        char* grown = realloc(chunk.full_response, resume_length + 1);
+        if (!grown) {
+            fprintf(stderr, "Error: Failed to allocate memory for curl response chunk.\n");
+            request_body_free(&body);
+            free(chunk.buffer);
+            free(chunk.full_response);
+            return false;
+        }
+        memcpy(grown, resume, resume_length + 1);
+        chunk.full_response = grown;
+        chunk.full_response_size = resume_length;
+        continuations = 1;
+    }
+
+    // Roughly four bytes of request JSON per token; the rate limiter charges
+    // this up front and corrects it from the usage metadata of the response.
+    state->rate_limit.pending_tokens = (long)(body.json_length / 4);
+
+    for (int attempt = 1; ; attempt++) {
+        // 3. Reset buffers for this attempt. The answer streamed so far is
+        //    kept only when this attempt continues it.
+        chunk.buffer[0] = '\0';
+        chunk.size = 0;
+        chunk.total_tokens = 0;
+        chunk.finish_reason[0] = '\0';
+        if (continuations == 0) {
+            chunk.full_response[0] = '\0';
+            chunk.full_response_size = 0;
+        }
+
+        // 4. Perform the API request, hedged across keys when enabled. A body
+        //    that references a context cache or uploaded files can only go to
+        //    the key that created them.
+        state->pinned_key_index = body.key_index;
+        if (state->hedge.enabled && state->num_api_keys > 1) {
+            http_code = perform_hedged_generate(state, &body, &chunk);
+        } else {
+            // Parsing and printing run on the renderer thread, so a slow
+            // terminal does not hold up reading the stream.
+            StreamPipe pipe;
+            stream_pipe_open(&pipe, write_memory_callback, &chunk);
+            http_code = perform_api_curl_request(
+                state,
+                "streamGenerateContent?alt=sse",
+                &body,
+                stream_pipe_write,
+                &pipe
+            );
+            stream_pipe_close(&pipe, &state->receive);
+        }
+        state->pinned_key_index = -1;
+        rate_limiter_settle(state, http_code == 200, chunk.total_tokens);
+
+        // 5. An answer cut off by a dropped connection or by the model's own
+        //    output token limit is continued rather than regenerated: the text
+        //    so far is sent back as the start of the model's turn, and the
+        //    model picks up where it stopped.
+        CURLcode result = state->transport.last_result;
+        interrupted = result == CURLE_WRITE_ERROR || result == CURLE_ABORTED_BY_CALLBACK;
+        if (interrupted) {
+            if (http_code == 200 && chunk.full_response_size > 0 && state->keep_partial) {
+                fprintf(stderr, "[Partial answer kept in the history]\n");
+                success = true;
+            }
+            break;
+        }
+        bool stream_broken = http_code == 200 && result != CURLE_OK;
+        // A limit the user set with max_output_tokens is honoured, not continued past.
+        bool max_tokens = http_code == 200 && state->auto_continue && state->max_output_tokens <= 0 &&
+                          strcmp(chunk.finish_reason, "MAX_TOKENS") == 0;
+        if ((stream_broken || max_tokens) && chunk.full_response_size > 0 && continuations < STREAM_MAX_CONTINUATIONS &&
+            (!stream_broken || retry_policy_should_retry(state, "generate_resume", attempt, -(long)result))) {
+            RequestBody continuation;
+            if (build_generate_body(state, chunk.full_response, &continuation)) {
+                fprintf(stderr, "\n[Answer %s after %zu bytes, continuing it]\n",
+                        stream_broken ? "broken off" : "hit the output limit", chunk.full_response_size);
+                request_body_free(&body);
+                body = continuation;
+                state->rate_limit.pending_tokens = (long)(body.json_length / 4);
+                continuations++;
+                if (max_tokens) attempt = 0;
+                continue;
+            }
+        }
+        if (stream_broken && chunk.full_response_size > 0) {
+            // Out of retries: keep what was shown rather than throwing it away.
+            fprintf(stderr, "\n[Answer broken off: %s]\n", curl_easy_strerror(result));
+        }
+
+        // 6. A 200 OK is only a true success if the response body is not empty;
+        //    an empty answer is treated as a transient, retryable error.
+        if (http_code == 200 && chunk.full_response_size > 0) {
+            success = true;
+            break;
+        }
+        if (http_code == 200) {
+            fprintf(stderr, "\nAPI returned an empty response.\n");
+        }
+        // An invalid key is reported as a 400, which the scheduler cannot tell
+        // apart from a bad request without looking at the error body. It is
+        // retried like a 401, at once on another key when one is ready.
+        long retry_code = http_code;
+        if (http_code == 400 && strstr(chunk.buffer, "API_KEY_INVALID")) {
+            key_scheduler_quarantine(state, state->last_key_index, http_code);
+            retry_code = 401;
+        }
+        // A context cache that is gone, or that the key may not read, fails
+        // the request; it is built once more without that cache.
+        // The file of an attachment shrank while it was sent; building the
+        // body again takes a copy of it (see `blob_check`).
+        if (result == CURLE_READ_ERROR && !body_rebuilt) {
+            RequestBody rebuilt;
+            body_rebuilt = true;
+            if (build_generate_body(state, continuations > 0 ? chunk.full_response : NULL, &rebuilt)) {
+                request_body_free(&body);
+                body = rebuilt;
+                attempt--;
+                continue;
+            }
+        }
+        if (body.key_index >= 0 && state->context_cache.name[0] != '\0' && !cache_abandoned && (http_code == 403 || http_code == 404 ||
+            (http_code == 400 && (strstr(chunk.buffer, "CachedContent") || strstr(chunk.buffer, "cached content"))))) {
+            RequestBody uncached;
+            cache_abandoned = true;
+            context_cache_abandon(state, http_code);
+            if (build_generate_body(state, continuations > 0 ? chunk.full_response : NULL, &uncached)) {
+                request_body_free(&body);
+                body = uncached;
+                attempt--;
+                continue;
+            }
+        }
+        if (!retry_policy_should_retry(state, "generate", attempt, retry_code)) {
+            break;
+        }
+    }
+    state->rate_limit.pending_tokens = -1;
+    *http_code_out = http_code;
+
+    // 7. Handle the final result after the loop is finished.
+    if (success) {
+        *full_response_out = chunk.full_response;
+    } else if (interrupted) {
+        // Already reported where the transfer was aborted.
+        free(chunk.full_response);
+    } else if (http_code == 403) {
+        int last_index = state->last_key_index;
+          char *current_key = state->api_keys[last_index];
+          char *current_origin = state->origins[last_index];
+          size_t key_len = strlen(current_key);
+        fprintf(stderr, "\nAPI returned 403 (Unauthorized) for key: %.4s...%.4s (%s)\n", current_key + 6, current_key + key_len - 4, current_origin);
+        return false;
+    } else {
+        fprintf(stderr, "\nAPI call failed (Last HTTP code: %ld)\n", http_code);
+        if(http_code < 0) fprintf(stderr, "Curl error: %s\n", curl_easy_strerror(-http_code));
+        parse_and_print_error_json(chunk.buffer);
+        free(chunk.full_response); // Free the unused response buffer on failure.
+    }
+
+    // 8. Clean up all remaining resources.
+    free(chunk.buffer);
+    request_body_free(&body);
+    return success;
+}
+
+/**
+ * @brief Tells whether a failed official turn points at an outage rather than at the request.
+ * @details Throttling, timeouts, server errors and network errors count; a
+ *          rejected request (400, 403, 404, ...) or a transfer the user
+ *          interrupted does not, since the free backend would not fix those.
+ */
+static bool failover_is_outage(long http_code) {
+    if (http_code == -(long)CURLE_WRITE_ERROR || http_code == -(long)CURLE_ABORTED_BY_CALLBACK) return false;
+    return http_code < 0 || http_code == 408 || http_code == 429 || http_code >= 500;
+}
+
+/**
+ * @brief Tells whether the conversation can be sent to the free backend.
+ * @details The free backend takes a plain transcript built by
+ *          `build_free_request_payload`, which keeps only the first part of each
+ *          message. A conversation qualifies if every message is a single text
+ *          part and the transcript fits MAX_FREE_MODE_CONTEXT_SIZE.
+ */
+static bool failover_history_is_text_only(AppState* state) {
+    size_t history_len = 0;
+    for (int i = 0; i < state->history.num_contents; i++) {
+        const Content* content = &state->history.contents[i];
+        if (content->num_parts != 1 || content->parts[0].type != PART_TYPE_TEXT || !content->parts[0].text) return false;
+        history_len += strlen(content->parts[0].text);
+    }
+    return state->history.num_contents > 0 && history_len <= MAX_FREE_MODE_CONTEXT_SIZE;
+}
+
+/**
+ * @brief Opens the breaker, so text-only turns go to the free backend for a while.
+ * @details The open time starts at FAILOVER_OPEN_BASE_SEC and doubles with each
+ *          failed recovery probe, up to FAILOVER_OPEN_MAX_SEC.
+ * @param state The current application state.
+ * @param reason What made the breaker open, for the transition message.
+ */
+static void failover_trip(AppState* state, const char* reason) {
+    FailoverBreaker* breaker = &state->failover;
+    long open_sec = FAILOVER_OPEN_BASE_SEC;
+    for (int i = 0; i < breaker->trips && open_sec < FAILOVER_OPEN_MAX_SEC; i++) open_sec *= 2;
+    if (open_sec > FAILOVER_OPEN_MAX_SEC) open_sec = FAILOVER_OPEN_MAX_SEC;
+    breaker->state = BREAKER_OPEN;
+    breaker->trips++;
+    breaker->total_trips++;
+    breaker->consecutive_failures = 0;
+    breaker->open_until = time(NULL) + open_sec;
+    fprintf(stderr, "[Failover: official API unavailable (%s), sending text-only turns to the free backend for %lds]\n", reason, open_sec);
+}
+
+/**
+ * @brief Closes the breaker after the official API answered again.
+ */
+static void failover_recover(AppState* state) {
+    FailoverBreaker* breaker = &state->failover;
+    if (breaker->state != BREAKER_CLOSED) {
+        fprintf(stderr, "\n[Failover: official API is back, switching to it]\n");
+    }
+    breaker->state = BREAKER_CLOSED;
+    breaker->trips = 0;
+    breaker->consecutive_failures = 0;
+}
+
+/**
+ * @brief Answers the pending turn with the free backend.
+ * @details The turn is already the last message of the history, where the
+ *          official path expects it; the free backend takes it separately, so
+ *          it is lifted off the history for the duration of the call.
+ * @param state The current application state.
+ * @param[out] full_response_out Receives the answer on success.
+ * @return true if the free backend answered.
+ */
+static bool failover_send_free(AppState* state, char** full_response_out) {
+    History* history = &state->history;
+    const char* prompt = history->contents[history->num_contents - 1].parts[0].text;
+    if (state->last_free_response_part) {
+        free(state->last_free_response_part);
+        state->last_free_response_part = NULL;
+    }
+
+    history->num_contents--;
+    bool success = send_free_api_request(state, prompt);
+    history->num_contents++;
+
+    if (success && state->last_free_response_part) {
+        *full_response_out = strdup(state->last_free_response_part);
+        state->failover.failover_turns++;
+        return *full_response_out != NULL;
+    }
+    return false;
+}
+
+/**
+ * @brief Computes the SHA-1 digest of a buffer.
+ * @details Only used to check the `Sec-WebSocket-Accept` answer of a WebSocket
+ *          handshake, which RFC 6455 defines in terms of SHA-1.
+ * @param data The bytes to hash.
+ * @param size The number of bytes.
+ * @param digest Receives the 20-byte digest.
+ */
+static void sha1_digest(const unsigned char* data, size_t size, unsigned char digest[20]) {
+    uint32_t h[5] = { 0x67452301, 0xEFCDAB89, 0x98BADCFE, 0x10325476, 0xC3D2E1F0 };
+    uint64_t bit_length = (uint64_t)size * 8;
+    size_t padded = ((size + 8) / 64 + 1) * 64;
+
+    for (size_t offset = 0; offset < padded; offset += 64) {
+        unsigned char block[64];
+        for (int i = 0; i < 64; i++) {
+            size_t pos = offset + i;
+            if (pos < size) block[i] = data[pos];
+            else if (pos == size) block[i] = 0x80;
+            else if (pos >= padded - 8) block[i] = (unsigned char)(bit_length >> (8 * (padded - 1 - pos)));
+            else block[i] = 0;
+        }
+
+        uint32_t w[80];
+        for (int i = 0; i < 16; i++) {
+            w[i] = (uint32_t)block[4 * i] << 24 | (uint32_t)block[4 * i + 1] << 16 | (uint32_t)block[4 * i + 2] << 8 | block[4 * i + 3];
+        }
+        for (int i = 16; i < 80; i++) {
+            uint32_t x = w[i - 3] ^ w[i - 8] ^ w[i - 14] ^ w[i - 16];
+            w[i] = x << 1 | x >> 31;
+        }
+
+        uint32_t a = h[0], b = h[1], c = h[2], d = h[3], e = h[4];
+        for (int i = 0; i < 80; i++) {
+            uint32_t f, k;
+            if (i < 20)      { f = (b & c) | (~b & d);          k = 0x5A827999; }
+            else if (i < 40) { f = b ^ c ^ d;                   k = 0x6ED9EBA1; }
+            else if (i < 60) { f = (b & c) | (b & d) | (c & d); k = 0x8F1BBCDC; }
+            else             { f = b ^ c ^ d;                   k = 0xCA62C1D6; }
+            uint32_t temp = (a << 5 | a >> 27) + f + e + k + w[i];
+            e = d;
+            d = c;
+            c = b << 30 | b >> 2;
+            b = a;
+            a = temp;
+        }
+        h[0] += a; h[1] += b; h[2] += c; h[3] += d; h[4] += e;
+    }
+
+    for (int i = 0; i < 5; i++) {
+        digest[4 * i] = (unsigned char)(h[i] >> 24);
+        digest[4 * i + 1] = (unsigned char)(h[i] >> 16);
+        digest[4 * i + 2] = (unsigned char)(h[i] >> 8);
+        digest[4 * i + 3] = (unsigned char)h[i];
+    }
+}
+
+/**
+ * @brief Closes the Live session, if one is open.
+ * @details The server forgets the conversation with the connection, so the
+ *          next session starts by sending the whole history again.
+ * @param live The session.
+ */
+void live_close(LiveSession* live) {
+    if (live->curl) {
+        curl_easy_cleanup(live->curl);
+        live->curl = NULL;
+    }
+    free(live->rx);
+    live->rx = NULL;
+    live->rx_size = 0;
+    live->synced_contents = 0;
+    live->synced_hash = 0;
+}
+
+/**
+ * @brief Waits until the session socket is readable or writable.
+ * @details Waits in short slices so that Ctrl+C is noticed promptly.
+ * @param live The session.
+ * @param for_write Whether to wait for writability instead of readability.
+ * @param deadline The monotonic time in milliseconds at which to give up.
+ * @return 1 when ready, 0 on timeout, -1 on error, -2 if the user interrupted.
+ */
+static int live_wait(LiveSession* live, bool for_write, long deadline) {
+    curl_socket_t sockfd = CURL_SOCKET_BAD;
+    if (curl_easy_getinfo(live->curl, CURLINFO_ACTIVESOCKET, &sockfd) != CURLE_OK || sockfd == CURL_SOCKET_BAD) {
+        return -1;
+    }
+    for (;;) {
+        if (interrupt_flag) return -2;
+        struct timespec now;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        long remaining = deadline - (now.tv_sec * 1000L + now.tv_nsec / 1000000L);
+        if (remaining <= 0) return 0;
+        struct pollfd pfd = { .fd = sockfd, .events = for_write ? POLLOUT : POLLIN };
+        int ready = poll(&pfd, 1, remaining < 100 ? (int)remaining : 100);
+        if (ready > 0) return 1;
+        if (ready < 0 && errno != EINTR) return -1;
+    }
+}
+
+/**
+ * @brief Returns a deadline `seconds` from now on the monotonic clock, in milliseconds.
+ */
+static long live_deadline(int seconds) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000L + now.tv_nsec / 1000000L + seconds * 1000L;
+}
+
+/**
+ * @brief Writes all bytes to the session socket.
+ * @return 1 on success, otherwise the failing `live_wait` result (0, -1 or -2).
+ */
+static int live_send_raw(LiveSession* live, const unsigned char* data, size_t size) {
+    long deadline = live_deadline(LIVE_TIMEOUT_SEC);
+    while (size > 0) {
+        size_t sent = 0;
+        CURLcode res = curl_easy_send(live->curl, data, size, &sent);
+        if (res == CURLE_AGAIN) {
+            int ready = live_wait(live, true, deadline);
+            if (ready <= 0) return ready < 0 ? ready : 0;
+            continue;
+        }
+        if (res != CURLE_OK) return -1;
+        data += sent;
+        size -= sent;
+    }
+    return 1;
+}
+
+/**
+ * @brief Reads whatever the socket has into the receive buffer.
+ * @return 1 if bytes were added, 0 on timeout, -1 if the connection closed or
+ *         failed, -2 if the user interrupted.
+ */
+static int live_receive(LiveSession* live, long deadline) {
+    for (;;) {
+        unsigned char buffer[16384];
+        size_t received = 0;
+        CURLcode res = curl_easy_recv(live->curl, buffer, sizeof(buffer), &received);
+        if (res == CURLE_AGAIN) {
+            int ready = live_wait(live, false, deadline);
+            if (ready <= 0) return ready < 0 ? ready : 0;
+            continue;
+        }
+        if (res != CURLE_OK || received == 0) return -1;
+        unsigned char* grown = realloc(live->rx, live->rx_size + received);
+        if (!grown) return -1;
+        live->rx = grown;
+        memcpy(live->rx + live->rx_size, buffer, received);
+        live->rx_size += received;
+        return 1;
+    }
+}
+
+/**
+ * @brief Sends one WebSocket frame.
+ * @details Client frames are masked with a fresh random key, as RFC 6455
+ *          requires.
+ * @param live The session.
+ * @param opcode The frame opcode (0x1 text, 0x8 close, 0xA pong, ...).
+ * @param payload The payload.
+ * @param size The payload size.
+ * @return 1 on success, otherwise the failing `live_send_raw` result.
+ */
+static int live_send_frame(LiveSession* live, int opcode, const void* payload, size_t size) {
+    unsigned char* frame = malloc(size + 14);
+    if (!frame) return -1;
+    size_t header = 0;
+    frame[header++] = (unsigned char)(0x80 | opcode);
+    if (size < 126) {
+        frame[header++] = (unsigned char)(0x80 | size);
+    } else if (size <= 0xFFFF) {
+        frame[header++] = 0x80 | 126;
+        frame[header++] = (unsigned char)(size >> 8);
+        frame[header++] = (unsigned char)size;
+    } else {
+        frame[header++] = 0x80 | 127;
+        for (int shift = 56; shift >= 0; shift -= 8) frame[header++] = (unsigned char)((uint64_t)size >> shift);
+    }
+    uint32_t mask = retry_random();
+    unsigned char* mask_key = frame + header;
+    memcpy(mask_key, &mask, 4);
+    header += 4;
+    const unsigned char* bytes = payload;
+    for (size_t i = 0; i < size; i++) frame[header + i] = bytes[i] ^ mask_key[i & 3];
+
+    int result = live_send_raw(live, frame, header + size);
+    free(frame);
+    return result;
+}
+
+/**
+ * @brief Reads the next complete message from the session.
+ * @details Parses frames out of the receive buffer, joining fragments, answering
+ *          pings and stopping at a close frame. Text and binary messages are
+ *          both returned; the Live API sends its JSON in either.
+ * @param live The session.
+ * @param[out] message_out Receives the NUL-terminated message; the caller frees it.
+ * @param timeout_sec How long to wait for it.
+ * @return 1 with a message, 0 on timeout, -1 if the connection closed or
+ *         failed, -2 if the user interrupted.
+ */
+static int live_read_message(LiveSession* live, char** message_out, int timeout_sec) {
+    long deadline = live_deadline(timeout_sec);
+    char* message = NULL;
+    size_t message_size = 0;
+    *message_out = NULL;
+
+    for (;;) {
+        // Parse as many complete frames as the buffer holds.
+        while (live->rx_size >= 2) {
+            const unsigned char* rx = live->rx;
+            bool fin = rx[0] & 0x80;
+            int opcode = rx[0] & 0x0F;
+            bool masked = rx[1] & 0x80;
+            uint64_t length = rx[1] & 0x7F;
+            size_t header = 2;
+            if (length == 126) {
+                if (live->rx_size < 4) break;
+                length = (uint64_t)rx[2] << 8 | rx[3];
+                header = 4;
+            } else if (length == 127) {
+                if (live->rx_size < 10) break;
+                length = 0;
+                for (int i = 0; i < 8; i++) length = length << 8 | rx[2 + i];
+                header = 10;
+            }
+            if (length > LIVE_MAX_MESSAGE_SIZE || message_size + length > LIVE_MAX_MESSAGE_SIZE) {
+                free(message);
+                return -1;
+            }
+            size_t mask_at = header;
+            if (masked) header += 4;
+            if (live->rx_size < header + length) break;
+
+            unsigned char* payload = live->rx + header;
+            if (masked) {
+                for (uint64_t i = 0; i < length; i++) payload[i] ^= live->rx[mask_at + (i & 3)];
+            }
+
+            int result = 0;
+            if (opcode == 0x8) {
+                result = -1;
+            } else if (opcode == 0x9) {
+                result = live_send_frame(live, 0xA, payload, (size_t)length) == 1 ? 0 : -1;
+            } else if (opcode <= 0x2) {
+                char* grown = realloc(message, message_size + length + 1);
+                if (!grown) {
+                    result = -1;
+                } else {
+                    message = grown;
+                    memcpy(message + message_size, payload, (size_t)length);
+                    message_size += length;
+                    message[message_size] = '\0';
+                    if (fin) result = 1;
+                }
+            }
+
+            size_t consumed = header + (size_t)length;
+            memmove(live->rx, live->rx + consumed, live->rx_size - consumed);
+            live->rx_size -= consumed;
+            if (result == 1) {
+                *message_out = message;
+                return 1;
+            }
+            if (result < 0) {
+                free(message);
+                return -1;
+            }
+        }
+
+        int received = live_receive(live, deadline);
+        if (received <= 0) {
+            free(message);
+            return received;
+        }
+    }
+}
+
+/**
+ * @brief Opens the WebSocket and sets up a Live session.
+ * @details libcurl is used in connect-only mode for the TCP/TLS (and proxy)
+ *          part, over HTTP/1.1 so that the connection can be upgraded; the
+ *          upgrade handshake and the framing are done here. The server's
+ *          `Sec-WebSocket-Accept` is checked, then the setup message is sent
+ *          and `setupComplete` awaited.
+ * @param state The current application state.
+ * @param key_index The key to open the session with.
+ * @param setup_json The setup message.
+ * @param reason Receives a short description if the session cannot be opened.
+ * @param reason_size The size of `reason`.
+ * @return true if the session is ready for turns.
+ */
+static bool live_connect(AppState* state, int key_index, const char* setup_json, char* reason, size_t reason_size) {
+    LiveSession* live = &state->live;
+    live_close(live);
+    endpoint_pool_select(state);
+    live->curl = curl_easy_init();
+    if (!live->curl) {
+        snprintf(reason, reason_size, "out of memory");
+        return false;
+    }
+
+    char url[512];
+    snprintf(url, sizeof(url), "https://%s/", state->host);
+    transport_apply_defaults(&state->transport, live->curl);
+    curl_easy_setopt(live->curl, CURLOPT_URL, url);
+    curl_easy_setopt(live->curl, CURLOPT_HTTP_VERSION, (long)CURL_HTTP_VERSION_1_1);
+    curl_easy_setopt(live->curl, CURLOPT_CONNECT_ONLY, 1L);
+    curl_easy_setopt(live->curl, CURLOPT_CONNECTTIMEOUT, 10L);
+    if (state->proxy[0] != '\0') {
+        curl_easy_setopt(live->curl, CURLOPT_PROXY, state->proxy);
+    }
+    CURLcode res = curl_easy_perform(live->curl);
+    if (res != CURLE_OK) {
+        snprintf(reason, reason_size, "%s", curl_easy_strerror(res));
+        live_close(live);
+        return false;
+    }
+
+    // Upgrade request.
+    unsigned char nonce[16];
+    for (int i = 0; i < 16; i += 4) {
+        uint32_t r = retry_random();
+        memcpy(nonce + i, &r, 4);
+    }
+    char* ws_key = base64_encode(nonce, sizeof(nonce));
+    char origin_header[300] = "";
+    if (strcmp(state->origins[key_index], "default") != 0) {
+        snprintf(origin_header, sizeof(origin_header), "Origin: %s\r\n", state->origins[key_index]);
+    }
+    char request[2048];
+    int request_length = snprintf(request, sizeof(request),
+        "GET %s HTTP/1.1\r\nHost: %s\r\nUpgrade: websocket\r\nConnection: Upgrade\r\n"
+        "Sec-WebSocket-Key: %s\r\nSec-WebSocket-Version: 13\r\nx-goog-api-key: %s\r\n%s\r\n",
+        LIVE_PATH, state->host, ws_key ? ws_key : "", state->api_keys[key_index], origin_header);
+    if (!ws_key || request_length >= (int)sizeof(request) ||
+        live_send_raw(live, (const unsigned char*)request, request_length) != 1) {
+        snprintf(reason, reason_size, "handshake could not be sent");
+        free(ws_key);
+        live_close(live);
+        return false;
+    }
+
+    // Response headers, up to the blank line; anything after it is frame data.
+    long deadline = live_deadline(LIVE_TIMEOUT_SEC);
+    char* header_end = NULL;
+    for (;;) {
+        if (live->rx_size > 0) {
+            char* grown = realloc(live->rx, live->rx_size + 1);
+            if (grown) {
+                live->rx = (unsigned char*)grown;
+                grown[live->rx_size] = '\0';
+                header_end = strstr(grown, "\r\n\r\n");
+            }
+        }
+        if (header_end || live->rx_size > 16384) break;
+        if (live_receive(live, deadline) <= 0) break;
+    }
+    int status = 0;
+    if (header_end) sscanf((char*)live->rx, "HTTP/%*s %d", &status);
+    bool accepted = false;
+    if (status == 101) {
+        const char* guid = "258EAFA5-E914-47DA-95CA-C5AB0DC85B11";
+        char concatenated[128];
+        unsigned char digest[20];
+        int length = snprintf(concatenated, sizeof(concatenated), "%s%s", ws_key, guid);
+        sha1_digest((const unsigned char*)concatenated, length, digest);
+        char* expected = base64_encode(digest, sizeof(digest));
+        for (char* line = strstr((char*)live->rx, "\r\n"); expected && line && line < header_end; line = strstr(line + 2, "\r\n")) {
+            if (strncasecmp(line + 2, "Sec-WebSocket-Accept:", 21) != 0) continue;
+            const char* value = line + 23;
+            while (*value == ' ') value++;
+            accepted = strncmp(value, expected, strlen(expected)) == 0;
+        }
+        free(expected);
+    }
+    free(ws_key);
+    if (!accepted) {
+        if (!header_end) snprintf(reason, reason_size, "no handshake response");
+        else if (status != 101) snprintf(reason, reason_size, "HTTP %d", status);
+        else snprintf(reason, reason_size, "bad Sec-WebSocket-Accept");
+        live_close(live);
+        return false;
+    }
+    size_t consumed = (size_t)(header_end + 4 - (char*)live->rx);
+    memmove(live->rx, live->rx + consumed, live->rx_size - consumed);
+    live->rx_size -= consumed;
+
+    // Session setup.
+    char* message = NULL;
+    int result = live_send_frame(live, 0x1, setup_json, strlen(setup_json));
+    if (result == 1) result = live_read_message(live, &message, LIVE_TIMEOUT_SEC);
+    cJSON* reply = result == 1 ? cJSON_Parse(message) : NULL;
+    bool ready = cJSON_GetObjectItem(reply, "setupComplete") != NULL;
+    if (!ready) {
+        const cJSON* error = cJSON_GetObjectItem(cJSON_GetObjectItem(reply, "error"), "message");
+        snprintf(reason, reason_size, "%s", cJSON_IsString(error) ? error->valuestring :
+                 result == 1 ? "unexpected setup reply" : result == 0 ? "setup timed out" : "closed during setup");
+        live_close(live);
+    }
+    cJSON_Delete(reply);
+    free(message);
+    if (ready) live->key_index = key_index;
+    return ready;
+}
+
+/**
+ * @brief Tells whether every message of the conversation is plain text.
+ */
+static bool live_history_is_text_only(AppState* state) {
+    for (int i = 0; i < state->history.num_contents; i++) {
+        const Content* content = &state->history.contents[i];
+        for (int j = 0; j < content->num_parts; j++) {
+            if (content->parts[j].type != PART_TYPE_TEXT) return false;
+        }
+    }
+    return state->history.num_contents > 0;
+}
+
+/**
+ * @brief Hashes the serialized form of a history message.
+ */
+static uint64_t live_hash_content(uint64_t hash, Content* content) {
+    size_t length = 0;
+    const char* json = content_json(content, &length);
+    return json ? fnv1a_64(hash, json, length) : hash;
+}
+
+/**
+ * @brief Sends the pending turn over the Live session, if there is one to use.
+ * @details With `"live": true`, a text conversation is kept on a Live API
+ *          WebSocket session: the server holds the conversation, so each turn
+ *          sends only the messages it has not seen yet (normally just the new
+ *          prompt) instead of the whole history. The session is opened on first
+ *          use with the whole history. It is reopened whenever the settings
+ *          change or the history no longer matches what the server was sent
+ *          (after `/clear`, `/load`, edits, or a turn that went over HTTP).
+ *          If the session cannot be opened, the turn goes over HTTP and Live is
+ *          not tried again for LIVE_RETRY_SEC seconds. If the connection is
+ *          lost before any answer arrives, the turn goes over HTTP too; if
+ *          it is lost in the middle of the answer, HTTP continues the answer
+ *          from the text already shown. Turns are charged to the rate limiter
+ *          like HTTP requests.
+ * @param state The current application state, with the user's turn as the last
+ *              message of the history.
+ * @param[out] full_response_out Receives the answer on success. When the turn
+ *             is left to HTTP, receives the start of the answer to continue,
+ *             or NULL.
+ * @param[out] success_out Receives whether the turn succeeded, when handled.
+ * @return true if the turn was handled here, false to send it over HTTP.
+ */
+static bool live_session_turn(AppState* state, char** full_response_out, bool* success_out) {
+    LiveSession* live = &state->live;
+    *full_response_out = NULL;
+    if (!live->enabled || state->num_api_keys == 0) return false;
+    // Attachments need the Files API and inline data, which only HTTP has.
+    if (!live_history_is_text_only(state)) {
+        live_close(live);
+        return false;
+    }
+    if (!live->curl && time(NULL) < live->unavailable_until) return false;
+
+    // The setup carries the model and the settings; the contents come from
+    // the same serializer as an HTTP request, so both paths send the same text.
+    cJSON* request = build_request_tree(state, false, false);
+    if (!request) return false;
+    cJSON* setup_message = cJSON_CreateObject();
+    cJSON* setup = cJSON_AddObjectToObject(setup_message, "setup");
+    char model[256];
+    snprintf(model, sizeof(model), "models/%s", live->model ? live->model : state->model_name);
+    cJSON_AddStringToObject(setup, "model", model);
+    cJSON* generation_config = cJSON_DetachItemFromObject(request, "generationConfig");
+    cJSON_DeleteItemFromObject(generation_config, "thinkingConfig");
+    cJSON_DeleteItemFromObject(generation_config, "seed");
+    cJSON_AddItemToObject(generation_config, "responseModalities", cJSON_CreateStringArray((const char*[]){ "TEXT" }, 1));
+    cJSON_AddItemToObject(setup, "generationConfig", generation_config);
+    cJSON* system_instruction = cJSON_DetachItemFromObject(request, "systemInstruction");
+    if (system_instruction) cJSON_AddItemToObject(setup, "systemInstruction", system_instruction);
+    if (state->google_grounding) {
+        cJSON* tools = cJSON_AddArrayToObject(setup, "tools");
+        cJSON* search = cJSON_CreateObject();
+        cJSON_AddItemToObject(search, "googleSearch", cJSON_CreateObject());
+        cJSON_AddItemToArray(tools, search);
+    }
+    char* setup_json = cJSON_PrintUnformatted(setup_message);
+    cJSON_Delete(setup_message);
+    if (!setup_json) {
+        cJSON_Delete(request);
+        return false;
+    }
+    uint64_t setup_hash = fnv1a_64(FNV1A_64_INIT, setup_json, strlen(setup_json));
+
+    // Is the session still in step with the history?
+    Content* contents = state->history.contents;
+    int num_contents = state->history.num_contents;
+    if (live->curl) {
+        uint64_t hash = FNV1A_64_INIT;
+        for (int i = 0; i < live->synced_contents && i < num_contents; i++) {
+            hash = live_hash_content(hash, &contents[i]);
+        }
+        if (setup_hash != live->setup_hash || live->synced_contents >= num_contents || hash != live->synced_hash) {
+            live_close(live);
+        }
+    }
+
+    // The server reads the whole conversation it holds for every turn, so the
+    // rate limiter charges the turn as much as the same request over HTTP,
+    // to the key the session was opened with.
+    size_t request_bytes = strlen(setup_json);
+    for (int i = 0; i < num_contents; i++) {
+        size_t length = 0;
+        if (content_json(&contents[i], &length)) request_bytes += length;
+    }
+    state->rate_limit.pending_tokens = (long)(request_bytes / 4);
+    if (live->curl) state->pinned_key_index = live->key_index;
+    int key_index = rate_limited_select_api_key(state);
+    state->pinned_key_index = -1;
+    state->rate_limit.pending_tokens = -1;
+    if (key_index < 0) {
+        fprintf(stderr, "\n[Interrupted]\n");
+        interrupt_flag = 0;
+        free(setup_json);
+        cJSON_Delete(request);
+        *success_out = false;
+        return true;
+    }
+
+    char reason[256];
+    if (!live->curl) {
+        if (!live_connect(state, key_index, setup_json, reason, sizeof(reason))) {
+            fprintf(stderr, "[Live: session unavailable (%s), using HTTP for %ds]\n", reason, LIVE_RETRY_SEC);
+            rate_limiter_settle(state, false, 0);
+            live->unavailable_until = time(NULL) + LIVE_RETRY_SEC;
+            live->fallbacks++;
+            free(setup_json);
+            cJSON_Delete(request);
+            return false;
+        }
+        live->setup_hash = setup_hash;
+    }
+    free(setup_json);
+
+    // Send only what the server has not seen.
+    cJSON* turn_message = cJSON_CreateObject();
+    cJSON* client_content = cJSON_AddObjectToObject(turn_message, "clientContent");
+    cJSON* turns = cJSON_AddArrayToObject(client_content, "turns");
+    uint64_t synced_hash = live->synced_contents > 0 ? live->synced_hash : FNV1A_64_INIT;
+    for (int i = live->synced_contents; i < num_contents; i++) {
+        cJSON_AddItemToArray(turns, build_content_json(&contents[i], false));
+        synced_hash = live_hash_content(synced_hash, &contents[i]);
+    }
+    cJSON_AddBoolToObject(client_content, "turnComplete", true);
+    char* turn_json = cJSON_PrintUnformatted(turn_message);
+    cJSON_Delete(turn_message);
+    cJSON_Delete(request);
+
+    int result = turn_json ? live_send_frame(live, 0x1, turn_json, strlen(turn_json)) : -1;
+    free(turn_json);
+
+    // Stream the answer.
+    MemoryStruct answer = { .full_response = malloc(1), .full_response_size = 0 };
+    if (answer.full_response) answer.full_response[0] = '\0';
+    bool complete = false;
+    bool going_away = false;
+    long total_tokens = 0;
+    while (result == 1 && !complete && answer.full_response) {
+        char* message = NULL;
+        result = live_read_message(live, &message, LIVE_TIMEOUT_SEC);
+        if (result != 1) break;
+        cJSON* reply = cJSON_Parse(message);
+        free(message);
+        cJSON* server_content = cJSON_GetObjectItem(reply, "serverContent");
+        cJSON* parts = cJSON_GetObjectItem(cJSON_GetObjectItem(server_content, "modelTurn"), "parts");
+        const cJSON* part;
+        cJSON_ArrayForEach(part, parts) {
+            const cJSON* text = cJSON_GetObjectItem(part, "text");
+            if (!cJSON_IsString(text) || cJSON_IsTrue(cJSON_GetObjectItem(part, "thought"))) continue;
+            printf("%s", text->valuestring);
+            fflush(stdout);
+            size_t text_length = strlen(text->valuestring);
+            char* grown = realloc(answer.full_response, answer.full_response_size + text_length + 1);
+            if (!grown) break;
+            answer.full_response = grown;
+            memcpy(answer.full_response + answer.full_response_size, text->valuestring, text_length + 1);
+            answer.full_response_size += text_length;
+        }
+        if (cJSON_IsTrue(cJSON_GetObjectItem(server_content, "turnComplete")) ||
+            cJSON_IsTrue(cJSON_GetObjectItem(server_content, "interrupted"))) {
+            complete = true;
+        }
+        if (cJSON_GetObjectItem(reply, "goAway")) going_away = true;
+        const cJSON* usage = cJSON_GetObjectItem(cJSON_GetObjectItem(reply, "usageMetadata"), "totalTokenCount");
+        if (cJSON_IsNumber(usage)) total_tokens = (long)usage->valuedouble;
+        cJSON_Delete(reply);
+    }
+    rate_limiter_settle(state, answer.full_response_size > 0, total_tokens);
+
+    if (complete && answer.full_response_size > 0) {
+        // The caller stores the answer as the next message; count it as synced.
+        Part model_part = { .type = PART_TYPE_TEXT, .text = answer.full_response };
+        Content model_content = { .role = "model", .parts = &model_part, .num_parts = 1 };
+        live->synced_hash = live_hash_content(synced_hash, &model_content);
+        live->synced_contents = num_contents + 1;
+        content_invalidate_cache(&model_content);
+        live->turns++;
+        if (going_away) live_close(live);
+        *full_response_out = answer.full_response;
+        *success_out = true;
+        return true;
+    }
+
+    // Anything else leaves the server in an unknown state.
+    live_close(live);
+    if (result == -2) {
+        fprintf(stderr, "\n[Interrupted]\n");
+        interrupt_flag = 0;
+        *success_out = answer.full_response_size > 0 && state->keep_partial;
+        if (*success_out) {
+            fprintf(stderr, "[Partial answer kept in the history]\n");
+            *full_response_out = answer.full_response;
+        } else {
+            free(answer.full_response);
+        }
+        return true;
+    }
+    if (answer.full_response_size > 0) {
+        // The answer is not complete; HTTP continues it from what was shown.
+        fprintf(stderr, "\n[Live: connection lost in the middle of the answer, continuing it over HTTP]\n");
+        live->fallbacks++;
+        *full_response_out = answer.full_response;
+        return false;
+    }
+    free(answer.full_response);
+    fprintf(stderr, "[Live: %s, sending this turn over HTTP]\n", complete ? "empty answer" : result == 0 ? "no answer in time" : "connection lost");
+    live->fallbacks++;
+    return false;
+}
+
+/**
+ * @brief Prints the state of the Live session for `/stats`.
+ * @param stream The stream to print to.
+ * @param state The current application state.
+ */
+void print_live_status(FILE* stream, AppState* state) {
+    const LiveSession* live = &state->live;
+    long unavailable = (long)(live->unavailable_until - time(NULL));
+    if (live->curl) {
+        fprintf(stream, "Live session: open (%d messages held by the server)", live->synced_contents);
+    } else if (unavailable > 0) {
+        fprintf(stream, "Live session: unavailable, retried in %lds", unavailable);
+    } else {
+        fprintf(stream, "Live session: not open");
+    }
+    fprintf(stream, "; %ld turns, %ld sent over HTTP instead\n", live->turns, live->fallbacks);
+}
+
+/**
+ * @brief Sends the pending turn over HTTP, through the failover breaker; see `send_api_request`.
+ * @param state The current application state.
+ * @param resume The start of the answer to continue, or NULL; see `send_official_api_request`.
+ * @param[out] full_response_out Receives the complete model response on success.
+ * @return true if either backend answered.
+ */
+static bool send_with_failover(AppState* state, const char* resume, char** full_response_out) {
+    FailoverBreaker* breaker = &state->failover;
+    long http_code = 0;
+    if (!breaker->enabled) {
+        return send_official_api_request(state, resume, full_response_out, &http_code);
+    }
+
+    *full_response_out = NULL;
+    bool can_fail_over = failover_history_is_text_only(state);
+    if (breaker->state == BREAKER_CLOSED && can_fail_over && state->num_api_keys > 0 && key_scheduler_available(state) == 0) {
+        failover_trip(state, "no API key is usable");
+    }
+    if (breaker->state == BREAKER_OPEN && time(NULL) >= breaker->open_until) {
+        breaker->state = BREAKER_HALF_OPEN;
+        fprintf(stderr, "[Failover: probing the official API]\n");
+    }
+
+    if (breaker->state != BREAKER_OPEN || !can_fail_over) {
+        // A recovery probe should not hold the turn up with a round of retries.
+        int max_attempts = state->retry.max_attempts;
+        if (breaker->state == BREAKER_HALF_OPEN) state->retry.max_attempts = 1;
+        bool success = send_official_api_request(state, resume, full_response_out, &http_code);
+        state->retry.max_attempts = max_attempts;
+
+        if (success || (http_code != 0 && !failover_is_outage(http_code))) {
+            // Any real answer, even a rejection of this request, means the API is up.
+            failover_recover(state);
+            return success;
+        }
+        if (!failover_is_outage(http_code) || !can_fail_over) {
+            return false;
+        }
+
+        char reason[128];
+        if (http_code < 0) snprintf(reason, sizeof(reason), "%s", curl_easy_strerror((CURLcode)-http_code));
+        else snprintf(reason, sizeof(reason), "HTTP %ld", http_code);
+        if (breaker->state == BREAKER_HALF_OPEN ||
+            ++breaker->consecutive_failures >= FAILOVER_FAILURE_THRESHOLD ||
+            key_scheduler_available(state) == 0) {
+            failover_trip(state, reason);
+        } else {
+            return false;
+        }
+    }
+
+    return failover_send_free(state, full_response_out);
+}
+
+/**
+ * @brief Sends the pending turn, failing over to the free backend during an outage.
+ * @details Without `"failover": true` this is `send_official_api_request`.
+ *          With it, a circuit breaker watches the official API: after
+ *          FAILOVER_FAILURE_THRESHOLD turns in a row failed with throttling,
+ *          server or network errors (each after its own retries), or as soon as
+ *          no key is usable, the breaker opens and text-only turns are answered
+ *          by the free backend, starting with the turn that just failed. Turns
+ *          with attachments keep going to the official API. Once the open time
+ *          is over, the next turn probes the official API with a single attempt;
+ *          if it answers, the breaker closes, otherwise the turn still gets its
+ *          answer from the free backend and the breaker stays open twice as
+ *          long. Every transition is reported on stderr. While the breaker
+ *          is closed, a Live session is tried first (`live_session_turn`).
+ * @param state The current application state, with the user's turn as the last
+ *              message of the history.
+ * @param[out] full_response_out Receives the complete model response on
+ *             success; the caller frees it.
+ * @return true if either backend answered.
+ */
+bool send_api_request(AppState* state, char** full_response_out) {
+    bool live_success = false;
+    char* resume = NULL;
+    if (state->failover.state == BREAKER_CLOSED && live_session_turn(state, &resume, &live_success)) {
+        *full_response_out = resume;
+        return live_success;
+    }
+    bool success = send_with_failover(state, resume, full_response_out);
+    free(resume);
+    return success;
+}
+
+/**
+ * @brief Prints the state of the failover breaker for `/stats`.
+ * @param stream The stream to print to.
+ * @param state The current application state.
+ */
+void print_failover_status(FILE* stream, AppState* state) {
+    const FailoverBreaker* breaker = &state->failover;
+    long open_left = (long)(breaker->open_until - time(NULL));
+    if (breaker->state == BREAKER_OPEN && open_left > 0) {
+        fprintf(stream, "Failover: ON, using the free backend (official API probed in %lds)", open_left);
+    } else if (breaker->state != BREAKER_CLOSED) {
+        fprintf(stream, "Failover: ON, official API probed on the next turn");
+    } else {
+        fprintf(stream, "Failover: ON, using the official API");
+    }
+    fprintf(stream, "; %ld outages, %ld turns answered by the free backend\n", breaker->total_trips, breaker->failover_turns);
+}
+
+/**
+ * @brief Safely reads a string value from a cJSON object into a fixed-size buffer.
+ * @param obj The cJSON object to read from.
+ * @param key The key of the string value to read.
+ * @param buffer The character buffer to store the string.
+ * @param buffer_size The size of the buffer.
+ */
+static void json_read_string(const cJSON* obj, const char* key, char* buffer, size_t buffer_size) {
+    const cJSON* item = cJSON_GetObjectItem(obj, key);
+    if (cJSON_IsString(item) && (item->valuestring != NULL)) {
+        strncpy(buffer, item->valuestring, buffer_size - 1);
+        buffer[buffer_size - 1] = '\0'; // Ensure null-termination.
+    }
+}
+
+/**
+ * @brief Safely reads a float value from a cJSON object.
+ * @param obj The cJSON object to read from.
+ * @param key The key of the float value to read.
+ * @param target A pointer to the float variable to update.
+ */
+static void json_read_float(const cJSON* obj, const char* key, float* target) {
+    const cJSON* item = cJSON_GetObjectItem(obj, key);
+    if (cJSON_IsNumber(item)) {
+        *target = (float)item->valuedouble;
+    }
+}
+
+/**
+ * @brief Safely reads an integer value from a cJSON object.
+ * @param obj The cJSON object to read from.
+ * @param key The key of the integer value to read.
+ * @param target A pointer to the integer variable to update.
+ */
+static void json_read_int(const cJSON* obj, const char* key, int* target) {
+    const cJSON* item = cJSON_GetObjectItem(obj, key);
+    if (cJSON_IsNumber(item)) {
+        *target = item->valueint;
+    }
+}
+
+/**
+ * @brief Safely reads a boolean value from a cJSON object.
+ * @details It handles both true/false boolean types and numeric 0/1 values
+ *          for better compatibility.
+ * @param obj The cJSON object to read from.
+ * @param key The key of the boolean value to read.
+ * @param target A pointer to the bool variable to update.
+ */
+static void json_read_bool(const cJSON* obj, const char* key, bool* target) {
+    const cJSON* item = cJSON_GetObjectItem(obj, key);
+    if (cJSON_IsBool(item)) {
+        *target = cJSON_IsTrue(item);
+    } else if (cJSON_IsNumber(item)) { // For compatibility with config files using 0/1
+        *target = (item->valueint != 0);
+    }
+}
+
+/**
+ * @brief Parses command-line options and updates the application state.
+ * @details This function iterates through the command-line arguments, looking for
+ *          recognized flags (e.g., -m, --temp, --free). When a flag is found,
+ *          it updates the corresponding field in the AppState struct. The parsing
+ *          stops when the first non-option argument (like a prompt word or
+ *          filename) is encountered.
+ * @param argc The argument count from main().
+ * @param argv The argument vector from main().
+ * @param state A pointer to the AppState struct to be updated.
+ * @return The index of the first argument that was not a recognized option. This
+ *         allows the main session logic to process the remaining arguments as
+ *         part of the initial prompt or as file attachments.
+ */
+
+/*
+  Enum of all recognized options
+*/
+typedef enum {
+    OPT_UNKNOWN,
+    OPT_MODEL, OPT_HOST, OPT_SYSTEM, OPT_CONFIG,
+    OPT_TEMP, OPT_PROXY, OPT_SEED, OPT_MAX_TOKENS,
+    OPT_TOPK, OPT_TOPP, OPT_BUDGET, OPT_ML, OPT_MM,
+    OPT_EXECUTE, OPT_QUIET, OPT_NO_GROUNDING, OPT_FREE, OPT_NO_URL_CONTEXT, OPT_SAFETY,
+    OPT_LOC, OPT_MAP,
+    OPT_LIST_KEYS, OPT_ADD_KEY, OPT_REMOVE_KEY, OPT_CHECK_KEYS,
+    OPT_LIST_MODELS, OPT_LIST_SESSIONS, OPT_SAVE_SESSION, OPT_LOAD_SESSION,
+    OPT_BENCHMARK, OPT_HELP
+} OptionType;
+
+/*
+  Map a flag string to its OptionType
+*/
+static OptionType classify_option(const char *arg) {
+    if (!STRCASECMP(arg, "-m")          || !STRCASECMP(arg, "--model"))          return OPT_MODEL;
+    if (!STRCASECMP(arg, "-H")          || !STRCASECMP(arg, "--host"))           return OPT_HOST;
+    if (!STRCASECMP(arg, "-S")          || !STRCASECMP(arg, "--system"))         return OPT_SYSTEM;
+    if (!STRCASECMP(arg, "-c")          || !STRCASECMP(arg, "--config"))         return OPT_CONFIG;
+    if (!STRCASECMP(arg, "-t")          || !STRCASECMP(arg, "--temp"))           return OPT_TEMP;
+    if (!STRCASECMP(arg, "-p")          || !STRCASECMP(arg, "--proxy"))          return OPT_PROXY;
+    if (!STRCASECMP(arg, "-s")          || !STRCASECMP(arg, "--seed"))           return OPT_SEED;
+    if (!STRCASECMP(arg, "-o")          || !STRCASECMP(arg, "--max-tokens"))     return OPT_MAX_TOKENS;
+    if (!STRCASECMP(arg, "--topk"))                                              return OPT_TOPK;
+    if (!STRCASECMP(arg, "--topp"))                                              return OPT_TOPP;
+    if (!STRCASECMP(arg, "-b")          || !STRCASECMP(arg, "--budget"))         return OPT_BUDGET;
+    if (!STRCASECMP(arg, "-e")          || !STRCASECMP(arg, "--execute"))        return OPT_EXECUTE;
+    if (!STRCASECMP(arg, "-q")          || !STRCASECMP(arg, "--quiet"))          return OPT_QUIET;
+    if (!STRCASECMP(arg, "-ng")         || !STRCASECMP(arg, "--no-grounding"))   return OPT_NO_GROUNDING;
+    if (!STRCASECMP(arg, "-f")          || !STRCASECMP(arg, "--free"))           return OPT_FREE;
+    if (!STRCASECMP(arg, "-nu")         || !STRCASECMP(arg, "--no-url-context")) return OPT_NO_URL_CONTEXT;
+    if (!STRCASECMP(arg, "--safety"))                                            return OPT_SAFETY;
+    if (!STRCASECMP(arg, "--loc"))                                               return OPT_LOC;
+    if (!STRCASECMP(arg, "--map"))                                               return OPT_MAP;
+    if (!STRCASECMP(arg, "--list-keys"))                                         return OPT_LIST_KEYS;
+    if (!STRCASECMP(arg, "--add-key"))                                           return OPT_ADD_KEY;
+    if (!STRCASECMP(arg, "--remove-key"))                                        return OPT_REMOVE_KEY;
+    if (!STRCASECMP(arg, "--check-keys"))                                        return OPT_CHECK_KEYS;
+    if (!STRCASECMP(arg, "-l")          || !STRCASECMP(arg, "--list"))           return OPT_LIST_MODELS;
+    if (!STRCASECMP(arg, "--mm"))                                                return OPT_MM;
+    if (!STRCASECMP(arg, "--ml"))                                                return OPT_ML;
+    if (!STRCASECMP(arg, "--list-sessions") || !STRCASECMP(arg, "--sl"))         return OPT_LIST_SESSIONS;
+    if (!STRCASECMP(arg, "--save-session")  || !STRCASECMP(arg, "--ss"))         return OPT_SAVE_SESSION;
+    if (!STRCASECMP(arg, "--load-session")  || !STRCASECMP(arg, "--ls"))         return OPT_LOAD_SESSION;
+    if (!STRCASECMP(arg, "--benchmark"))                                         return OPT_BENCHMARK;
+    if (!STRCASECMP(arg, "-h")          || !STRCASECMP(arg, "--help"))           return OPT_HELP;
+    return OPT_UNKNOWN;
+}
+
+int parse_common_options(int argc, char *argv[], AppState *state) {
+	
+    for (int i = 1; i < argc; i++) {
+        const char   *arg      = argv[i];
+        const char   *next_arg = (i + 1 < argc ? argv[i + 1] : NULL);
+        OptionType    opt      = classify_option(arg);
+
+        switch (opt) {
+
+            // --- Model and Configuration ---
+            case OPT_MODEL:
+                if (next_arg) {
+                    strncpy(state->model_name,
+                            next_arg,
+                            sizeof(state->model_name) - 1);
+                    i++;
+                }
+                break;
+
+            case OPT_HOST:
+                if (next_arg) {
+                    if (state->host) {
+                        free(state->host);
+                    }
+                    state->host = strdup(next_arg);
+                    // An explicit host replaces the configured host list.
+                    free_string_list(&state->endpoints.hosts, &state->endpoints.num_hosts);
+                    i++;
+                }
+                break;
+
+            case OPT_SYSTEM:
+                if (next_arg) {
+                    free(state->system_prompt);
+                    state->system_prompt = strdup(next_arg);
+                    i++;
+                }
+                break;
+
+            case OPT_CONFIG:
+                if (next_arg) {
+                    // config already loaded; just skip its value
+                    i++;
+                }
+                break;
+
+
+            // --- Generation Parameters ---
+            case OPT_TEMP:
+                if (next_arg) {
+                    state->temperature = atof(next_arg);
+                    i++;
+                }
+                break;
+
+            case OPT_MM:
+                state->media_resolution = "MEDIA_RESOLUTION_MEDIUM";
+                break;
+
+            case OPT_ML:
+                state->media_resolution = "MEDIA_RESOLUTION_LOW";
+                break;
+
+            case OPT_PROXY:
+                if (next_arg) {
+                    snprintf(state->proxy,
+                             sizeof(state->proxy),
+                             "%s",
+                             next_arg);
+                    free_string_list(&state->endpoints.proxies, &state->endpoints.num_proxies);
+                    i++;
+                }
+                break;
+
+            case OPT_SEED:
+                if (next_arg) {
+                    state->seed = atoi(next_arg);
+                    i++;
+                }
+                break;
+
+            case OPT_MAX_TOKENS:
+                if (next_arg) {
+                    state->max_output_tokens = atoi(next_arg);
+                    i++;
+                }
+                break;
+
+            case OPT_TOPK:
+                if (next_arg) {
+                    state->topK = atoi(next_arg);
+                    i++;
+                }
+                break;
+
+            case OPT_TOPP:
+                if (next_arg) {
+                    state->topP = atof(next_arg);
+                    i++;
+                }
+                break;
+
+            case OPT_BUDGET:
+                if (next_arg) {
+                    state->thinking_budget = atoi(next_arg);
+                    i++;
+                }
+                break;
+
+
+            // --- Boolean Flags ---
+            case OPT_EXECUTE:
+            case OPT_QUIET:
+                // handled elsewhere, just consume
+                break;
+
+            case OPT_NO_GROUNDING:
+                state->google_grounding = false;
+                break;
+
+            case OPT_FREE:
+                state->free_mode = true;
+                break;
+
+            case OPT_NO_URL_CONTEXT:
+                state->url_context = false;
+                break;
+
+            case OPT_LOC:
+                state->loc_tile |= 1;
+                break;
+
+            case OPT_SAFETY:
+                state->safety |= 1;
+                break;
+
+            case OPT_MAP:
+                state->loc_tile |= 2;
+                break;
+
+
+            // --- Immediate Actions (exit) ---
+            case OPT_LIST_KEYS: {
+                fprintf(stdout, "--- API Keys in Config ---\n");
+                if (state->num_api_keys == 0) {
+                    fprintf(stdout, "  (No API keys found in configuration)\n");
+                } else {
+                    for (int j = 0; j < state->num_api_keys; j++) {
+                        const char *key    = state->api_keys[j];
+                        const char *origin = state->origins[j];
+                        size_t key_len     = strlen(key);
+                        fprintf(stdout, "  [%d] ", j);
+                        if (key_len > 11)
+                            fprintf(stdout,
+                                    "%.4s...%.4s (%s)",
+                                    key + 6,
+                                    key + key_len - 4,
+                                    origin);
+                        else
+                            fprintf(stdout,
+                                    "%.*s... (%s)",
+                                    (int)key_len,
+                                    key,
+                                    origin);
+                        fprintf(stdout, "\n");
+                    }
+                }
+                exit(0);
+            }
+
+            case OPT_ADD_KEY:
+                get_api_key_securely(state);
+                save_configuration(state);
+                exit(0);
+
+            case OPT_REMOVE_KEY:
+                if (next_arg) {
+                    long idx = strtol(next_arg, NULL, 10);
+                    if (idx < 0 || idx >= state->num_api_keys) {
+                        fprintf(stderr, "Error: Invalid key index.\n");
+                    } else {
+                        free(state->api_keys[idx]);
+                        free(state->origins[idx]);
+                        if (idx < state->num_api_keys - 1) {
+                            memmove(&state->api_keys[idx],
+                                    &state->api_keys[idx + 1],
+                                    sizeof(char*) *
+                                      (state->num_api_keys - idx - 1));
+                            memmove(&state->origins[idx],
+                                    &state->origins[idx + 1],
+                                    sizeof(char*) *
+                                      (state->num_api_keys - idx - 1));
+                        }
+                        state->num_api_keys--;
+                        if (state->next_key_index >= state->num_api_keys &&
+                            state->num_api_keys > 0) {
+                            state->next_key_index = 0;
+                        }
+                        save_configuration(state);
+                        fprintf(stdout,
+                                "Removed key at index %ld from configuration.\n",
+                                idx);
+                    }
+                    i++;
+                }
+                exit(0);
+
+            case OPT_CHECK_KEYS: {
+                fprintf(stdout, "Checking API keys from configuration...\n");
+                check_api_keys(state, stdout);
+                exit(0);
+            }
+
+            case OPT_LIST_MODELS:
+                list_available_models(state);
+                exit(0);
+
+            case OPT_BENCHMARK:
+                if (!next_arg) {
+                    fprintf(stderr, "Error: --benchmark needs a name (gzip, base64).\n");
+                    exit(1);
+                }
+                exit(run_benchmark(next_arg, i + 2 < argc ? argv[i + 2] : NULL));
+
+            case OPT_LIST_SESSIONS:
+                list_sessions();
+                exit(0);
+
+            case OPT_SAVE_SESSION:
+                if (next_arg) {
+                    free(state->save_session_path);
+                    state->save_session_path = strdup(next_arg);
+                    i++;
+                }
+                break;
+
+            case OPT_LOAD_SESSION:
+                if (next_arg) {
+                    char file_path[PATH_MAX];
+                    if (build_session_path(next_arg,
+                                            file_path,
+                                            sizeof(file_path))) {
+                        load_history_from_file(state, file_path);
+                        strncpy(state->current_session_name,
+                                next_arg,
+                                sizeof(state->current_session_name) - 1);
+                    }
+                    i++;
+                }
+                break;
+
+            case OPT_HELP:
+                print_usage(argv[0]);
+                exit(0);
+
+            case OPT_UNKNOWN:
+            default:
+                // first non-option → return its index
+                return i;
+        }
+    }
+
+    // all args parsed as options
+    return argc;
+}
+
+/**
+ * @brief Prints the command-line usage instructions and exits.
+ * @details This function displays a comprehensive help message that outlines the
+ *          program's modes of operation and lists all available command-line
+ *          options with brief descriptions. It is typically called when the
+ *          user provides the -h or --help flag.
+ * @param prog_name The name of the executable (from argv[0]).
+ */
+void print_usage(const char* prog_name) {
+    fprintf(stderr, "Usage: %s [options] [prompt or files...]\n\n", prog_name);
+    fprintf(stderr, "A portable, feature-rich command-line client for the Google Gemini API.\n\n");
+    fprintf(stderr, "The client operates in two modes:\n");
+    fprintf(stderr, "  - Interactive Mode: (Default) A full chat session with history and commands.\n");
+    fprintf(stderr, "  - Non-Interactive Mode: Engaged if stdin or stdout is piped.\n\n");
+    fprintf(stderr, "Options:\n");
+    fprintf(stderr, "  -c, --config <path>        Load configuration from a specific file path.\n");
+    fprintf(stderr, "  -m, --model <name>         Specify the model name (e.g., gemini-1.5-pro-latest).\n");
+    fprintf(stderr, "  -t, --temp <float>         Set the generation temperature (e.g., 1.0).\n");
+    fprintf(stderr, "  -s, --seed <int>           Set the random seed for reproducible outputs.\n");
+    fprintf(stderr, "  -S, --system <prompt>      Set a system prompt for the entire session.\n");
+    fprintf(stderr, "  -o, --max-tokens <int>     Set the maximum number of tokens in the response.\n");
+    fprintf(stderr, "  -b, --budget <int>         Set the model's max 'thinking' token budget.\n");
+    fprintf(stderr, "  -p, --proxy <url>          Specify a proxy to use (e.g., 'http://localhost:8080').\n");
+    fprintf(stderr, "      --topk <int>           Set the Top-K sampling parameter.\n");
+    fprintf(stderr, "      --topp <float>         Set the Top-P (nucleus) sampling parameter.\n");
+    fprintf(stderr, "  -e, --execute              Execute a single prompt non-interactively and exit.\n");
+    fprintf(stderr, "  -q, --quiet                Enable quiet mode; print only the final response to stdout.\n");
+    fprintf(stderr, "  -f, --free                 Use the unofficial, key-free API endpoint.\n");
+    fprintf(stderr, "      --loc                  Get location information (requires --free mode).\n");
+    fprintf(stderr, "      --map                  Get map URL for location (requires --free mode).\n");
+    fprintf(stderr, "  -ng, --no-grounding        Disable Google Search grounding for the response.\n");
+    fprintf(stderr, "  -nu, --no-url-context      Disable automatic fetching of URL context.\n");
+    fprintf(stderr, "  -l, --list                 List all available models and exit.\n");
+    fprintf(stderr, "  --sl --list-sessions       List all saved sessions and exit.\n");
+    fprintf(stderr, "  --ls --load-session <name> Load a saved session by name and start chatting.\n");
+    fprintf(stderr, "  --ss --save-session <file> Save the conversation to a file after a non-interactive run.\n");
+    fprintf(stderr, "      --benchmark <name>     Run a built-in benchmark (gzip, base64), on [file] if given, and exit.\n");
+    fprintf(stderr, "\nKey Management:\n");
+    fprintf(stderr, "      --list-keys            List API keys from the configuration file and exit.\n");
+    fprintf(stderr, "      --add-key <key>        Add a new API key to the configuration file and exit.\n");
+    fprintf(stderr, "      --remove-key <index>   Remove an API key from the configuration file and exit.\n");
+    fprintf(stderr, "      --check-keys           Validate all configured API keys and exit.\n\n");
+    fprintf(stderr, "  -h, --help                 Show this help message and exit.\n\n");
+    fprintf(stderr, "For a list of in-session commands (like /save, /attach), start interactive mode and type /help.\n");
+}
+
+/**
+ * @brief Sets the application state to its default values.
+ * @details This function initializes a new AppState struct by first clearing it
+ *          with `memset` and then populating it with the standard default
+ *          settings for the model, generation parameters, and features. This
+ *          ensures the application starts in a consistent state before any
+ *          user configuration is loaded.
+ * @param state A pointer to the AppState struct to be initialized.
+ */
+void initialize_default_state(AppState* state) {
+    // Start with a clean, zeroed-out state struct to prevent undefined behavior.
+    memset(state, 0, sizeof(AppState));
+
+    // --- Set default values ---
+    strncpy(state->current_session_name, "[unsaved]", sizeof(state->current_session_name) - 1);
+    strncpy(state->origin, "default", sizeof(state->origin) - 1);
+
+    // Default model and generation parameters.
+    strncpy(state->model_name, DEFAULT_MODEL_NAME, sizeof(state->model_name) - 1);
+    state->temperature = 0.75f;
+    state->seed = 42;
+    state->max_output_tokens = 0; // A high default limit.
+
+    // Default feature toggles.
+    state->google_grounding = true;
+    state->url_context = true;
+
+    // Default values indicating that these parameters are not set by default.
+    // The API will use its own defaults for these.
+    state->thinking_budget = -1;
+    state->topK = -1;
     state->topP = -1.0f;
 
-    // The application starts in official API mode by default.
-    state->free_mode = false;
+    // The application starts in official API mode by default.
+    state->free_mode = false;
+
+    // Ensure all string buffers are properly null-terminated.
+    state->model_name[sizeof(state->model_name) - 1] = '\0';
+    state->current_session_name[sizeof(state->current_session_name) - 1] = '\0';
+    state->origin[sizeof(state->origin) - 1] = '\0';
+
+    state->api_keys = NULL;
+    state->origins = NULL;
+    
+    state->num_api_keys = 0;
+    state->next_key_index = 0;
+    state->last_key_index = 0;
+    state->key_health = NULL;
+    state->num_key_health = 0;
+    state->key_use_sequence = 0;
+    
+    // Ensure pointers are initialized to NULL.
+    state->last_free_response_part = NULL;
+    state->last_model_response = NULL;
+    state->system_prompt = NULL;
+    state->final_code = NULL;
+    
+    state->loc_tile = 0;
+
+    state->safety = 0;
+
+    state->loc_gathered = false;
+    
+    state->save_session_path = NULL;
+    
+    state->host = strdup("generativelanguage.googleapis.com");
+
+    state->transport.prewarm_enabled = true;
+    state->transport.net_cache_enabled = true;
+
+    state->retry.max_attempts = RETRY_DEFAULT_MAX_ATTEMPTS;
+    state->retry.base_delay_ms = RETRY_DEFAULT_BASE_DELAY_MS;
+    state->retry.max_delay_ms = RETRY_DEFAULT_MAX_DELAY_MS;
+    state->retry.budget = RETRY_DEFAULT_BUDGET;
+    state->retry.budget_left = RETRY_DEFAULT_BUDGET;
+    state->retry.retries_taken = 0;
+
+    memset(&state->rate_limit, 0, sizeof(state->rate_limit));
+    state->rate_limit.pending_tokens = -1;
+    state->rate_limit.reserved_key_index = -1;
+
+    memset(&state->hedge, 0, sizeof(state->hedge));
+    state->hedge.percentile = HEDGE_DEFAULT_PERCENTILE;
+    state->auto_continue = true;
+    state->keep_partial = true;
+    compress_policy_init(&state->compress);
+    memset(&state->files, 0, sizeof(state->files));
+    state->files.enabled = true;
+    memset(&state->blob_store, 0, sizeof(state->blob_store));
+    state->blob_store.enabled = true;
+    memset(&state->context_cache, 0, sizeof(state->context_cache));
+    state->context_cache.min_tokens = CONTEXT_CACHE_DEFAULT_MIN_TOKENS;
+    state->pinned_key_index = -1;
+    
+    state->media_resolution = NULL;
+}
+
+/**
+ * @brief Resets the current session to a clean state.
+ * @details This function is invoked by the `/clear` or `/session new` command.
+ *          It clears the entire conversation history, frees the last model
+ *          response, removes any system prompt, clears all pending file
+ *          attachments, and resets the session name to "[unsaved]". This allows
+ *          the user to start a completely new conversation without restarting
+ *          the program.
+ * @param state A pointer to the AppState struct to be cleared.
+ */
+void clear_session_state(AppState* state) {
+    // Deallocate all memory associated with the conversation history.
+    free_history(&state->history);
+
+    // Free the buffers holding the last responses from both API modes.
+    if (state->last_model_response) {
+        free(state->last_model_response);
+        state->last_model_response = NULL;
+    }
+    if (state->last_free_response_part) {
+        free(state->last_free_response_part);
+        state->last_free_response_part = NULL;
+    }
+
+    // Free the system prompt if it was set.
+    if (state->system_prompt) {
+        free(state->system_prompt);
+        state->system_prompt = NULL;
+    }
+
+    if (state->final_code) {
+        free(state->final_code);
+        state->final_code = NULL;
+    }
+    
+    // Clear any files that were attached but not yet sent with a prompt.
+    free_pending_attachments(state);
+
+    // Reset the session name to its default.
+    strncpy(state->current_session_name, "[unsaved]", sizeof(state->current_session_name) - 1);
+    state->current_session_name[sizeof(state->current_session_name) - 1] = '\0';
+
+    fprintf(stderr, "New session started.\n");
+}
+
+/**
+ * @brief Gets the path for the 'sessions' subdirectory, creating it if needed.
+ * @details This function constructs the path to the directory where all named
+ *          session files are stored. It builds upon the base application path
+ *          (e.g., `~/.config/gemini-cli`) and appends the 'sessions' subdirectory
+ *          name, creating it on the filesystem if it does not already exist.
+ * @param buffer A character buffer to store the resulting path.
+ * @param buffer_size The size of the buffer. The buffer will be empty on failure.
+ */
+void get_sessions_path(char* buffer, size_t buffer_size) {
+    const char* sessions_dir_name = "sessions";
+    char base_app_path[PATH_MAX];
+
+    // First, get the main application data directory path.
+    get_base_app_path(base_app_path, sizeof(base_app_path));
+    if (base_app_path[0] == '\0') {
+        buffer[0] = '\0'; // Abort if the base path could not be determined.
+        return;
+    }
+
+    // Pre-calculate the required buffer size to prevent an overflow.
+    size_t required_size = strlen(base_app_path) + 1 /*separator*/ + strlen(sessions_dir_name) + 1 /*null*/;
+    if (required_size > buffer_size) {
+        fprintf(stderr, "Error: Resolved sessions path is too long.\n");
+        buffer[0] = '\0';
+        return;
+    }
+
+    // Safely construct the final, full path.
+    snprintf(buffer, buffer_size, "%s/%s", base_app_path, sessions_dir_name);
+
+    // Create the sessions directory if it doesn't already exist.
+    MKDIR(buffer);
+}
+
+/**
+ * @brief Validates a session name to ensure it is safe for use as a filename.
+ * @details This is a security function designed to prevent path traversal
+ *          attacks. It checks that the user-provided session name does not
+ *          contain any characters that could be used to navigate the filesystem
+ *          (e.g., '/', '\', '.').
+ * @param name The session name string to validate.
+ * @return Returns true if the name is safe, and false otherwise. A specific
+ *         error message is printed to stderr if the name is found to be unsafe.
+ */
+bool is_session_name_safe(const char* name) {
+    if (name == NULL || name[0] == '\0') {
+        return false;
+    }
+
+    // Disallow directory separators and dots to prevent path traversal.
+    // For example, a name like "../my_secrets" would be rejected.
+    if (strchr(name, '/') || strchr(name, '\\') || strchr(name, '.')) {
+        fprintf(stderr, "Error: Session name cannot contain '/', '\\', or '.' characters.\n");
+        return false;
+    }
+
+    return true;
+}
+
+/**
+ * @brief Lists all saved session files from the sessions directory.
+ * @details This function reads the contents of the sessions directory, filters
+ *          for files ending in ".json", and prints their names (without the
+ *          extension) to the console. It uses platform-specific APIs for
+ *          directory traversal to ensure portability between Windows and
+ *          POSIX systems.
+ */
+void list_sessions() {
+    char sessions_path[PATH_MAX];
+    get_sessions_path(sessions_path, sizeof(sessions_path));
+    if (sessions_path[0] == '\0') {
+        fprintf(stderr, "Error: Could not determine sessions directory.\n");
+        return;
+    }
+
+    fprintf(stderr, "Saved Sessions:\n");
+    int count = 0;
+
+    // --- POSIX (Linux, macOS) Implementation ---
+    DIR *d = opendir(sessions_path);
+    if (d) {
+        struct dirent *dir;
+        // Iterate through all entries in the directory.
+        while ((dir = readdir(d)) != NULL) {
+            // Check if the entry is a file ending in .json.
+            char* dot = strrchr(dir->d_name, '.');
+            if (dot && strcmp(dot, ".json") == 0) {
+                *dot = '\0'; // Temporarily remove extension.
+                fprintf(stderr, "  - %s\n", dir->d_name);
+                *dot = '.'; // Restore it for the next check (good practice).
+                count++;
+            }
+        }
+        closedir(d);
+    }
+
+    if (count == 0) {
+        fprintf(stderr, "  (No sessions found)\n");
+    }
+}
+
+/**
+ * @brief Gets the full path for the application's configuration file.
+ * @details This function constructs the absolute path to the `config.json` file.
+ *          It builds upon the base application path and appends the standard
+ *          configuration filename.
+ *          - On Windows, this resolves to `%APPDATA%\gemini-cli\config.json`.
+ *          - On POSIX systems, this resolves to `~/.config/gemini-cli/config.json`.
+ * @param buffer A character buffer to store the resulting path.
+ * @param buffer_size The size of the buffer. The buffer will be empty on failure.
+ */
+void get_config_path(char* buffer, size_t buffer_size) {
+    const char* config_file_name = "config.json";
+    char base_app_path[PATH_MAX];
+
+    // First, get the main application data directory path.
+    get_base_app_path(base_app_path, sizeof(base_app_path));
+    if (base_app_path[0] == '\0') {
+        buffer[0] = '\0'; // Abort if the base path could not be determined.
+        return;
+    }
+
+    const char* separator = "/";
+
+    // Pre-calculate the required buffer size to prevent an overflow with snprintf.
+    // Required size = base_path + separator + config_file_name + null_terminator
+    size_t required_size = strlen(base_app_path) + strlen(separator) + strlen(config_file_name) + 1;
+    if (required_size > buffer_size) {
+        fprintf(stderr, "Error: Resolved configuration path is too long.\n");
+        buffer[0] = '\0';
+        return;
+    }
+
+    // Safely construct the final, full path.
+    snprintf(buffer, buffer_size, "%s%s%s", base_app_path, separator, config_file_name);
+}
+
+/**
+ * @brief Safely reads a string from a cJSON object and allocates new memory for it.
+ * @details This is used for fields that can be of variable length, like the
+ *          system prompt. The caller is responsible for freeing the memory
+ *          allocated to `*target`.
+ * @param obj The cJSON object to read from.
+ * @param key The key of the string value to read.
+ * @param target A pointer to the char pointer that will hold the new string.
+ *               If `*target` already points to a string, it will be freed first.
+ */
+static void json_read_strdup(const cJSON* obj, const char* key, char** target) {
+    const cJSON* item = cJSON_GetObjectItem(obj, key);
+    if (cJSON_IsString(item) && (item->valuestring != NULL)) {
+        // Free the existing string, if any, to prevent memory leaks.
+        if (*target) {
+            free(*target);
+        }
+        *target = strdup(item->valuestring);
+    }
+}
+
+/**
+ * @brief Reads an array of strings from a cJSON object into a new list.
+ * @details Non-string elements are skipped. If the key is missing or not an
+ *          array, the existing list is left alone; otherwise it is replaced.
+ *          Free the list with `free_string_list`.
+ * @param obj The cJSON object to read from.
+ * @param key The key of the array to read.
+ * @param target Receives the list of newly allocated strings.
+ * @param count Receives the number of strings in the list.
+ */
+static void json_read_string_array(const cJSON* obj, const char* key, char*** target, int* count) {
+    const cJSON* array = cJSON_GetObjectItem(obj, key);
+    if (!cJSON_IsArray(array)) return;
+    free_string_list(target, count);
+
+    *target = calloc(cJSON_GetArraySize(array) + 1, sizeof(char*));
+    if (!*target) return;
+    const cJSON* item;
+    cJSON_ArrayForEach(item, array) {
+        if (!cJSON_IsString(item) || !item->valuestring) continue;
+        char* copy = strdup(item->valuestring);
+        if (copy) (*target)[(*count)++] = copy;
+    }
+}
+
+/**
+ * @brief Loads application settings from a specified configuration file path.
+ * @details This function reads a JSON configuration file from the given path,
+ *          parses it, and updates the application's state with the values found
+ *          in the file. It uses a series of `json_read_*` helper functions to
+ *          safely extract the values and handle missing keys gracefully.
+ * @param state The application state struct to update with the loaded settings.
+ * @param filepath The absolute path to the `config.json` file to load.
+ */
+void load_configuration_from_path(AppState* state, const char* filepath) {
+    FILE* file = fopen(filepath, "r");
+    if (!file) {
+        // This is not an error if the default config file doesn't exist on first run,
+        // so we don't print an error message here. We simply return.
+        return;
+    }
+
+    // Read the entire file content into a buffer.
+    fseek(file, 0, SEEK_END);
+    long length = ftell(file);
+    fseek(file, 0, SEEK_SET);
+
+    char* buffer = malloc(length + 1);
+    if (!buffer) {
+        fclose(file);
+        fprintf(stderr, "Warning: Failed to allocate memory to read config file.\n");
+        return;
+    }
+
+    if (fread(buffer, 1, length, file) != (size_t)length) {
+        fclose(file);
+        free(buffer);
+        fprintf(stderr, "Warning: Failed to read content from config file.\n");
+        return;
+    }
+    buffer[length] = '\0';
+    fclose(file);
+
+    // Parse the buffer content as a JSON object.
+    cJSON* root = cJSON_Parse(buffer);
+    free(buffer); // The file content is now in the cJSON object.
+
+    if (!cJSON_IsObject(root)) {
+        if (root) cJSON_Delete(root);
+        fprintf(stderr, "Warning: Could not parse configuration file '%s' or it is not a valid JSON object.\n", filepath);
+        return;
+    }
+
+    // Use the helper functions to safely read each value from the JSON object
+    // into the AppState struct. This gracefully handles missing keys.
+    json_read_string(root, "model", state->model_name, sizeof(state->model_name));
+    json_read_strdup(root, "host", &state->host);
+    json_read_float(root, "temperature", &state->temperature);
+    json_read_int(root, "seed", &state->seed);
+    json_read_strdup(root, "system_prompt", &state->system_prompt);
+    json_read_string(root, "proxy", state->proxy, sizeof(state->proxy));
+    json_read_string_array(root, "hosts", &state->endpoints.hosts, &state->endpoints.num_hosts);
+    json_read_string_array(root, "proxies", &state->endpoints.proxies, &state->endpoints.num_proxies);
+
+    json_read_int(root, "next_key_index", &state->next_key_index);
+
+    const cJSON* keys_array = cJSON_GetObjectItem(root, "api_keys");
+    const cJSON* origins_array = cJSON_GetObjectItem(root, "origins");
+    if (cJSON_IsArray(keys_array)) {
+        // New format: "api_keys": ["key1", "key2"]
+        state->num_api_keys = cJSON_GetArraySize(keys_array);
+        state->api_keys = malloc(sizeof(char*) * state->num_api_keys);
+        state->origins = malloc(sizeof(char*) * state->num_api_keys);
+        cJSON* key_item;
+        cJSON* origin_item;
+        int i = 0;
+        cJSON_ArrayForEach(key_item, keys_array) {
+            if (cJSON_IsString(key_item)) {
+                state->api_keys[i++] = strdup(key_item->valuestring);
+            }
+        }
+        i = 0;
+        cJSON_ArrayForEach(origin_item, origins_array) {
+            if (cJSON_IsString(origin_item)) {
+                state->origins[i++] = strdup(origin_item->valuestring);
+            }
+        }
+    } else {
+        // Backward compatibility: "api_key": "key1"
+        const cJSON* single_key = cJSON_GetObjectItem(root, "api_key");
+        const cJSON* single_origin = cJSON_GetObjectItem(root, "origin");
+        if (cJSON_IsString(single_key)) {
+            state->num_api_keys = 1;
+            state->api_keys = malloc(sizeof(char*));
+            state->api_keys[0] = strdup(single_key->valuestring);
+            state->origins = malloc(sizeof(char*));
+            state->origins[0] = strdup(single_origin->valuestring);
+        }
+    }
+    
+    // Ensure index is not out of bounds
+    if (state->num_api_keys > 0 && state->next_key_index >= state->num_api_keys) {
+        state->next_key_index = 0;
+    }
+    
+    //json_read_string(root, "origin", state->origin, sizeof(state->origin));
+    json_read_int(root, "max_output_tokens", &state->max_output_tokens);
+    json_read_int(root, "thinking_budget", &state->thinking_budget);
+    json_read_bool(root, "google_grounding", &state->google_grounding);
+    json_read_bool(root, "url_context", &state->url_context);
+    json_read_int(root, "top_k", &state->topK);
+    json_read_float(root, "top_p", &state->topP);
+    json_read_bool(root, "prewarm", &state->transport.prewarm_enabled);
+    json_read_bool(root, "net_cache", &state->transport.net_cache_enabled);
+    json_read_int(root, "retry_max_attempts", &state->retry.max_attempts);
+    json_read_int(root, "retry_base_delay_ms", &state->retry.base_delay_ms);
+    json_read_int(root, "retry_max_delay_ms", &state->retry.max_delay_ms);
+    json_read_int(root, "retry_budget", &state->retry.budget);
+    if (state->retry.max_attempts < 1) state->retry.max_attempts = 1;
+    const cJSON* rate_limits = cJSON_GetObjectItem(root, "rate_limits");
+    if (cJSON_IsObject(rate_limits)) {
+        json_read_int(rate_limits, "rpm", &state->rate_limit.rpm);
+        json_read_int(rate_limits, "tpm", &state->rate_limit.tpm);
+        json_read_int(rate_limits, "rpd", &state->rate_limit.rpd);
+    }
+    json_read_bool(root, "hedging", &state->hedge.enabled);
+    json_read_int(root, "hedge_percentile", &state->hedge.percentile);
+    if (state->hedge.percentile < 1) state->hedge.percentile = 1;
+    if (state->hedge.percentile > 100) state->hedge.percentile = 100;
+    json_read_bool(root, "failover", &state->failover.enabled);
+    json_read_bool(root, "auto_continue", &state->auto_continue);
+    json_read_bool(root, "keep_partial", &state->keep_partial);
+    json_read_bool(root, "adaptive_compression", &state->compress.adaptive);
+    json_read_bool(root, "files_api", &state->files.enabled);
+    json_read_bool(root, "blob_store", &state->blob_store.enabled);
+    json_read_int(root, "context_cache_min_tokens", &state->context_cache.min_tokens);
+    if (state->context_cache.min_tokens < 0) state->context_cache.min_tokens = 0;
+    json_read_bool(root, "live", &state->live.enabled);
+    json_read_strdup(root, "live_model", &state->live.model);
+    state->retry.budget_left = state->retry.budget;
+
+    // Clean up the parsed JSON object.
+    cJSON_Delete(root);
+}
+
+/**
+ * @brief Loads application settings from the default configuration file.
+ * @details This is a convenience wrapper around `load_configuration_from_path`.
+ *          It determines the default path for the `config.json` file and then
+ *          calls the main loading function to parse it and update the state.
+ * @param state The application state struct to update with the loaded settings.
+ */
+void load_configuration(AppState* state) {
+    char config_path[PATH_MAX];
+
+    // Get the default configuration file path (e.g., ~/.config/gemini-cli/config.json).
+    get_config_path(config_path, sizeof(config_path));
+
+    // If the path could not be determined, abort.
+    if (config_path[0] == '\0') {
+        return;
+    }
+
+    // Load the configuration from that specific path.
+    load_configuration_from_path(state, config_path);
+}
+
+/**
+ * @brief Prompts the user and reads their input without echoing it to the screen.
+ * @details This function provides a secure way to get sensitive information, like
+ *          an API key, from the user. It displays a prompt and then reads user
+ *          input character-by-character, printing an asterisk '*' for each one
+ *          instead of the character itself. It correctly handles backspace for
+ *          editing and is implemented with platform-specific terminal controls
+ *          to work on both Windows and POSIX-compliant systems.
+ * @param prompt The message to display to the user before reading input.
+ * @param buffer The character buffer where the user's input will be stored.
+ * @param buffer_size The total size of the buffer.
+ */
+void get_masked_input(const char* prompt, char* buffer, size_t buffer_size) {
+    fprintf(stderr, "%s", prompt);
+    fflush(stderr); // Ensure the prompt is displayed immediately.
+
+    memset(buffer, 0, buffer_size);
+    size_t i = 0;
+
+    // --- POSIX (Linux, macOS) Implementation using termios.h ---
+    struct termios old_term, new_term;
+
+    // Get the current terminal settings.
+    tcgetattr(STDIN_FILENO, &old_term);
+    new_term = old_term;
+
+    // Disable canonical mode (line buffering) and character echoing.
+    new_term.c_lflag &= ~(ECHO | ICANON);
+
+    // Apply the new, temporary settings.
+    tcsetattr(STDIN_FILENO, TCSANOW, &new_term);
+
+    int c;
+    // Read character by character.
+    while (i < buffer_size - 1 && (c = getchar()) != '\n' && c != '\r' && c != EOF) {
+        if (c == 127 || c == 8) { // ASCII for Backspace/Delete.
+            if (i > 0) {
+                i--;
+                fprintf(stderr, "\b \b"); // Erase the last asterisk from the screen.
+            }
+        } else if (isprint(c)) { // A printable character was entered.
+            buffer[i++] = (char)c;
+            fprintf(stderr, "*");
+            fflush(stderr);
+        }
+    }
+
+    // IMPORTANT: Restore the original terminal settings.
+    tcsetattr(STDIN_FILENO, TCSANOW, &old_term);
+
+    buffer[i] = '\0'; // Always null-terminate the final string.
+    fprintf(stderr, "\n"); // Move to the next line after input is complete.
+}
+
+/**
+ * @brief Securely gets the API key and (optionally) the origin from the user.
+ * @details This function orchestrates the process of obtaining user credentials.
+ *          It uses the `get_masked_input` helper function to prompt the user for
+ *          their API key. If the origin has not already been set (i.e., it is
+ *          still "default"), it will also prompt for the origin, allowing the
+ *          user to skip it by pressing Enter.
+ * @param state A pointer to the AppState struct where the key and origin will be
+ *              stored.
+ */
+void get_api_key_securely(AppState* state) {
+    char key_buffer[128];
+    get_masked_input("Enter your API Key: ", key_buffer, sizeof(key_buffer));
+
+    // If no API key entered, do nothing
+    if (key_buffer[0] == '\0') {
+        return;
+    }
+
+    // 1) Append new API key
+    state->num_api_keys += 1;
+    state->api_keys = realloc(
+        state->api_keys,
+        state->num_api_keys * sizeof *state->api_keys
+    );
+    state->api_keys[state->num_api_keys - 1] = strdup(key_buffer);
+
+    // 2) Prompt for origin (Enter → "default")
+    char origin_buffer[128];
+    get_masked_input(
+      "Enter your Origin (press Enter for 'default'): ",
+      origin_buffer,
+      sizeof(origin_buffer)
+    );
+
+    // 3) Append origin in lock-step with api_keys count
+    state->origins = realloc(
+        state->origins,
+        state->num_api_keys * sizeof *state->origins
+    );
+
+    if (origin_buffer[0] == '\0') {
+        state->origins[state->num_api_keys - 1] = strdup("default");
+    } else {
+        state->origins[state->num_api_keys - 1] = strdup(origin_buffer);
+    }
+    
+}
+
+
+/**
+ * @brief Serializes one part of a history message.
+ * @param part The part.
+ * @param with_data Whether to encode the data of a blob part into it; without,
+ *        its `data` string is left empty for `content_json` to splice into.
+ * @return A new cJSON object; the caller frees it with `cJSON_Delete`. NULL
+ *         on allocation failure.
+ */
+static cJSON* build_part_json(const Part* part, bool with_data) {
+    cJSON* part_item = cJSON_CreateObject();
+
+    if (part->type == PART_TYPE_TEXT) {
+        if (part->text) {
+            cJSON_AddStringToObject(part_item, "text", part->text);
+        }
+    } else if (part->type == PART_TYPE_URI) {
+        cJSON* file_data = cJSON_CreateObject();
+        cJSON_AddStringToObject(file_data, "fileUri", part->uri);
+        cJSON_AddStringToObject(file_data, "mimeType", part->mime_type);
+        cJSON_AddItemToObject(part_item, "fileData", file_data);
+    } else {
+        cJSON* inline_data = cJSON_CreateObject();
+        cJSON_AddStringToObject(inline_data, "mimeType", part->mime_type);
+        if (part->blob && with_data) {
+            blob_check(part->blob);
+            char* encoded = base64_encode(part->blob->data, part->blob->size);
+            if (!encoded) {
+                cJSON_Delete(inline_data);
+                cJSON_Delete(part_item);
+                return NULL;
+            }
+            cJSON_AddStringToObject(inline_data, "data", encoded);
+            free(encoded);
+        } else if (part->blob) {
+            cJSON_AddStringToObject(inline_data, "data", "");
+        } else {
+            cJSON_AddStringToObject(inline_data, "data", part->base64_data);
+        }
+        cJSON_AddItemToObject(part_item, "inlineData", inline_data);
+    }
+    return part_item;
+}
+
+/**
+ * @brief Adds a reference into the blob store to a serialized part, for saved sessions.
+ * @details Adds `"blobRef": {"mimeType", "sha256", "size"}`. An inline
+ *          attachment is saved as the reference alone; an uploaded one keeps
+ *          its `fileData` next to it.
+ * @param part_item The serialized part.
+ * @param part The part; its blob must be stored.
+ * @return `part_item`, for convenience.
+ */
+static cJSON* build_blob_ref_json(cJSON* part_item, const Part* part) {
+    cJSON* blob_ref = cJSON_AddObjectToObject(part_item, "blobRef");
+    cJSON_AddStringToObject(blob_ref, "mimeType", part->mime_type);
+    cJSON_AddStringToObject(blob_ref, "sha256", part->blob->hash);
+    cJSON_AddNumberToObject(blob_ref, "size", (double)part->blob->size);
+    return part_item;
+}
+
+/**
+ * @brief Serializes one history message into the form the API expects.
+ * @param content The message.
+ * @param by_reference Write attachments that are in the blob store as
+ *        references to it rather than as Base64; only for saved sessions.
+ * @return A new cJSON object (`{"role": ..., "parts": [...]}`); the caller
+ *         frees it with `cJSON_Delete`.
+ */
+static cJSON* build_content_json(const Content* content, bool by_reference) {
+    cJSON* content_item = cJSON_CreateObject();
+    cJSON_AddStringToObject(content_item, "role", content->role);
+
+    cJSON* parts_array = cJSON_CreateArray();
+    cJSON_AddItemToObject(content_item, "parts", parts_array);
+
+    for (int j = 0; j < content->num_parts; j++) {
+        const Part* part = &content->parts[j];
+        bool stored = by_reference && part->blob && part->blob->stored;
+        cJSON* part_item = stored && part->type == PART_TYPE_FILE ? cJSON_CreateObject() : build_part_json(part, true);
+        if (stored && part_item) build_blob_ref_json(part_item, part);
+        cJSON_AddItemToArray(parts_array, part_item);
+    }
+    return content_item;
+}
+
+/**
+ * @brief Returns the blob whose data goes into a splice of a message's JSON.
+ */
+static Blob* content_splice_blob(const Content* content, int splice) {
+    for (int i = 0; i < content->num_parts; i++) {
+        const Part* part = &content->parts[i];
+        if (part->type == PART_TYPE_FILE && part->blob && splice-- == 0) return part->blob;
+    }
+    return NULL;
+}
+
+/**
+ * @brief Checks the blobs of a message (see `blob_check`) and adds up their versions.
+ * @return The sum; it differs from `blob_versions` once the data of one was replaced.
+ */
+static unsigned long content_blobs_version(const Content* content) {
+    unsigned long versions = 0;
+    for (int i = 0; i < content->num_parts; i++) {
+        Blob* blob = content->parts[i].type == PART_TYPE_FILE ? content->parts[i].blob : NULL;
+        if (!blob) continue;
+        blob_check(blob);
+        versions += blob->version;
+    }
+    return versions;
+}
+
+/**
+ * @brief Reads the next piece of the JSON of a message with blob parts.
+ * @details The JSON is the text kept in `json` with the Base64 of each blob
+ *          spliced in, encoded from the blob as it is read, so the message is
+ *          never held in memory in full. Mapped blobs are read through their
+ *          descriptor (see `blob_pread`); if the file shrank, `failed` is set
+ *          on the cursor and reading stops.
+ * @param content The message, serialized by `content_json`.
+ * @param cursor The read position, zeroed to start from the beginning.
+ * @param out Receives the JSON.
+ * @param capacity The room at `out`; at least 4 bytes.
+ * @param scratch Room for `capacity` bytes of blob data.
+ * @return The number of bytes read, 0 at the end or on failure.
+ */
+static size_t content_stream_read(const Content* content, ContentCursor* cursor, char* out, size_t capacity,
+                                  unsigned char* scratch) {
+    size_t produced = 0;
+    while (cursor->piece <= 2 * content->num_splices) {
+        int splice = cursor->piece / 2;
+        size_t piece_length;
+        if (cursor->piece % 2 == 0) {
+            size_t start = splice > 0 ? content->splices[splice - 1] : 0;
+            size_t end = splice < content->num_splices ? content->splices[splice] : content->json_length;
+            piece_length = end - start;
+            size_t count = piece_length - cursor->offset;
+            if (count > capacity - produced) count = capacity - produced;
+            memcpy(out + produced, content->json + start + cursor->offset, count);
+            produced += count;
+            cursor->offset += count;
+        } else {
+            // Whole groups of four characters, so that the offset maps back onto the data.
+            const Blob* blob = content_splice_blob(content, splice);
+            piece_length = 4 * ((blob->size + 2) / 3);
+            size_t groups = (capacity - produced) / 4;
+            size_t data_offset = cursor->offset / 4 * 3;
+            size_t data_length = blob->size - data_offset < groups * 3 ? blob->size - data_offset : groups * 3;
+            const unsigned char* data = blob->data + data_offset;
+            if (blob->mapped) {
+                if (!blob_pread(blob, scratch, data_offset, data_length)) {
+                    cursor->failed = true;
+                    return 0;
+                }
+                data = scratch;
+            }
+            size_t written = base64_encode_to(data, data_length, out + produced);
+            produced += written;
+            cursor->offset += written;
+        }
+        if (cursor->offset < piece_length) break;
+        cursor->piece++;
+        cursor->offset = 0;
+    }
+    return produced;
+}
+
+/**
+ * @brief Serializes a message with blob parts, leaving the data of the blobs out.
+ * @details The text is what cJSON prints for the message, with each blob's
+ *          data string empty; `splices` records where the data goes. The
+ *          length and CRC-32 of the full JSON are worked out by reading it
+ *          once with `content_stream_read`.
+ * @param content The message.
+ * @param blobs The number of blob parts in it.
+ * @return true on success.
+ */
+static bool content_json_spliced(Content* content, int blobs) {
+    cJSON* role = cJSON_CreateString(content->role);
+    char* role_json = role ? cJSON_PrintUnformatted(role) : NULL;
+    cJSON_Delete(role);
+    char** parts_json = calloc(content->num_parts, sizeof(char*));
+    size_t* splices = malloc(sizeof(size_t) * blobs);
+    bool ok = role_json && parts_json && splices;
+    size_t length = strlen("{\"role\":") + (role_json ? strlen(role_json) : 0) + strlen(",\"parts\":[]}");
+    for (int i = 0; ok && i < content->num_parts; i++) {
+        cJSON* item = build_part_json(&content->parts[i], false);
+        parts_json[i] = item ? cJSON_PrintUnformatted(item) : NULL;
+        cJSON_Delete(item);
+        ok = parts_json[i] != NULL;
+        if (ok) length += strlen(parts_json[i]) + (i > 0 ? 1 : 0);
+    }
+
+    char* json = ok ? malloc(length + 1) : NULL;
+    if (json) {
+        size_t at = (size_t)sprintf(json, "{\"role\":%s,\"parts\":[", role_json);
+        int splice = 0;
+        for (int i = 0; i < content->num_parts; i++) {
+            size_t part_length = strlen(parts_json[i]);
+            if (i > 0) json[at++] = ',';
+            memcpy(json + at, parts_json[i], part_length);
+            const Part* part = &content->parts[i];
+            if (part->type == PART_TYPE_FILE && part->blob) {
+                // The part ends in `"data":""}}`; the data goes between the quotes.
+                splices[splice++] = at + part_length - 3;
+            }
+            at += part_length;
+        }
+        memcpy(json + at, "]}", 3);
+    }
+    free(role_json);
+    for (int i = 0; parts_json && i < content->num_parts; i++) free(parts_json[i]);
+    free(parts_json);
+
+    char* chunk = json ? malloc(2 * UPLOAD_STREAM_CHUNK) : NULL;
+    if (!chunk) {
+        free(json);
+        free(splices);
+        return false;
+    }
+    content->json = json;
+    content->json_length = length;
+    content->splices = splices;
+    content->num_splices = blobs;
+    content->full_length = 0;
+    content->json_crc = crc32_z(0L, Z_NULL, 0);
+    ContentCursor cursor = { 0, 0, false };
+    unsigned char* scratch = (unsigned char*)chunk + UPLOAD_STREAM_CHUNK;
+    size_t read;
+    while ((read = content_stream_read(content, &cursor, chunk, UPLOAD_STREAM_CHUNK, scratch)) > 0) {
+        content->full_length += read;
+        content->json_crc = crc32_z(content->json_crc, (const Bytef*)chunk, read);
+    }
+    free(chunk);
+    if (cursor.failed) {
+        content_invalidate_cache(content);
+        return false;
+    }
+    return true;
+}
+
+/**
+ * @brief Returns the serialized JSON of a history message, serializing it on first use.
+ * @details A message does not change once it is in the history, so it is
+ *          serialized only once and the text is kept on the Content. This
+ *          makes building a request cost the size of the new turn rather than
+ *          of the whole conversation, attachments included. Code that edits a
+ *          message in place must call `content_invalidate_cache`. The data of
+ *          blob parts is left out of the text (see `content_json_spliced`);
+ *          such messages are read with `content_stream_read`, and
+ *          `content_length` tells their full length.
+ * @param content The message.
+ * @param[out] length_out Receives the length of the text.
+ * @return The cached text, owned by the Content, or NULL on allocation failure.
+ */
+const char* content_json(Content* content, size_t* length_out) {
+    if (!content->json) {
+        int blobs = 0;
+        for (int i = 0; i < content->num_parts; i++) {
+            if (content->parts[i].type == PART_TYPE_FILE && content->parts[i].blob) blobs++;
+        }
+        if (blobs > 0) {
+            // The length and CRC-32 are taken from the blobs; a file that
+            // shrank meanwhile is checked again and copied on the second try.
+            for (int tries = 0; tries < 2 && !content->json; tries++) {
+                content->blob_versions = content_blobs_version(content);
+                content_json_spliced(content, blobs);
+            }
+            if (!content->json) {
+                *length_out = 0;
+                return NULL;
+            }
+        } else {
+            cJSON* item = build_content_json(content, false);
+            content->json = item ? cJSON_PrintUnformatted(item) : NULL;
+            cJSON_Delete(item);
+            content->json_length = content->json ? strlen(content->json) : 0;
+        }
+    }
+    *length_out = content->json_length;
+    return content->json;
+}
+
+/**
+ * @brief Returns the length of a message's JSON, with the data of its blob parts.
+ * @details `content_json` must have serialized the message.
+ */
+static size_t content_length(const Content* content) {
+    return content->splices ? content->full_length : content->json_length;
+}
+
+/**
+ * @brief Compresses one piece of a request body into a self-contained raw deflate segment.
+ * @details The segment ends on a full flush, so it is byte aligned, holds no
+ *          final block and refers to nothing before it. Segments compressed
+ *          separately can therefore be concatenated into one deflate stream,
+ *          which is how `request_body_build` stitches bodies together. The
+ *          stream is left ready for the next segment.
+ * @param stream A raw deflate stream (negative window bits).
+ * @param data The bytes to compress.
+ * @param length The number of bytes.
+ * @param[out] length_out Receives the size of the segment.
+ * @return The segment, which the caller frees, or NULL on failure.
+ */
+static unsigned char* deflate_segment(z_stream* stream, const char* data, size_t length, size_t* length_out) {
+    size_t capacity = deflateBound(stream, length) + 64;
+    unsigned char* out = malloc(capacity);
+    if (!out) return NULL;
+
+    size_t produced = 0;
+    size_t remaining = length;
+    stream->next_in = (Bytef*)data;
+    stream->avail_in = 0;
+    for (;;) {
+        if (stream->avail_in == 0 && remaining > 0) {
+            stream->avail_in = (uInt)(remaining > UINT_MAX ? UINT_MAX : remaining);
+            remaining -= stream->avail_in;
+        }
+        if (produced == capacity) {
+            unsigned char* grown = realloc(out, capacity * 2);
+            if (!grown) {
+                free(out);
+                return NULL;
+            }
+            out = grown;
+            capacity *= 2;
+        }
+        size_t room = capacity - produced;
+        stream->next_out = out + produced;
+        stream->avail_out = (uInt)(room > UINT_MAX ? UINT_MAX : room);
+        uInt avail_out = stream->avail_out;
+        int flush = remaining == 0 ? Z_FULL_FLUSH : Z_NO_FLUSH;
+        if (deflate(stream, flush) == Z_STREAM_ERROR) {
+            free(out);
+            return NULL;
+        }
+        produced += avail_out - stream->avail_out;
+        // The flush is complete once deflate stops filling the whole buffer.
+        if (flush == Z_FULL_FLUSH && stream->avail_out != 0) break;
+    }
+    *length_out = produced;
+    return out;
+}
+
+/**
+ * @brief A segment being compressed in blocks by a pool of threads.
+ */
+typedef struct {
+    const unsigned char* data;
+    size_t length;
+    int level;
+    int num_blocks;
+    unsigned char** blocks;        // Compressed block i, filled in by whichever worker took it.
+    size_t* block_lengths;
+    atomic_int next_block;
+    atomic_bool failed;
+} ParallelDeflate;
+
+/**
+ * @brief Worker of `deflate_segment_parallel`: compresses blocks until none are left.
+ * @details Each block is compressed by a reset stream primed with the 32 KiB
+ *          before it, so matches may reach back into the previous block just
+ *          as in a single stream, and ends on a sync flush so the blocks can
+ *          be joined byte for byte.
+ */
+static void* parallel_deflate_worker(void* arg) {
+    ParallelDeflate* job = arg;
+    z_stream stream;
+    memset(&stream, 0, sizeof(stream));
+    if (deflateInit2(&stream, job->level, Z_DEFLATED, -15, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+        atomic_store(&job->failed, true);
+        return NULL;
+    }
+    for (;;) {
+        int i = atomic_fetch_add(&job->next_block, 1);
+        if (i >= job->num_blocks || atomic_load(&job->failed)) break;
+        size_t start = (size_t)i * COMPRESS_BLOCK_SIZE;
+        size_t length = job->length - start < COMPRESS_BLOCK_SIZE ? job->length - start : COMPRESS_BLOCK_SIZE;
+
+        deflateReset(&stream);
+        if (start > 0) {
+            size_t window = start < DEFLATE_WINDOW_SIZE ? start : DEFLATE_WINDOW_SIZE;
+            deflateSetDictionary(&stream, job->data + start - window, (uInt)window);
+        }
+        size_t capacity = deflateBound(&stream, length) + 64;
+        unsigned char* out = malloc(capacity);
+        if (!out) {
+            atomic_store(&job->failed, true);
+            break;
+        }
+        stream.next_in = (Bytef*)(job->data + start);
+        stream.avail_in = (uInt)length;
+        stream.next_out = out;
+        stream.avail_out = (uInt)capacity;
+        if (deflate(&stream, Z_SYNC_FLUSH) != Z_OK || stream.avail_in != 0 || stream.avail_out == 0) {
+            free(out);
+            atomic_store(&job->failed, true);
+            break;
+        }
+        job->blocks[i] = out;
+        job->block_lengths[i] = capacity - stream.avail_out;
+    }
+    deflateEnd(&stream);
+    return NULL;
+}
+
+/**
+ * @brief Returns how many threads large segments are compressed with.
+ */
+static int compress_threads(void) {
+    long cores = sysconf(_SC_NPROCESSORS_ONLN);
+    if (cores < 1) return 1;
+    return cores > COMPRESS_MAX_THREADS ? COMPRESS_MAX_THREADS : (int)cores;
+}
+
+/**
+ * @brief Compresses a large segment on several threads, pigz style.
+ * @details The data is cut into COMPRESS_BLOCK_SIZE blocks that a pool of
+ *          workers compresses independently (see `parallel_deflate_worker`);
+ *          joined in order they make the same kind of segment as
+ *          `deflate_segment`: byte aligned, without a final block, and
+ *          referring to nothing before it. Priming every block with the
+ *          previous 32 KiB keeps the ratio within a fraction of a percent of
+ *          a single stream.
+ * @param data The bytes to compress.
+ * @param length The number of bytes.
+ * @param level The zlib compression level.
+ * @param threads The number of workers; the calling thread is one of them.
+ * @param[out] length_out Receives the size of the segment.
+ * @return The segment, which the caller frees, or NULL on failure.
+ */
+static unsigned char* deflate_segment_parallel(const unsigned char* data, size_t length, int level, int threads, size_t* length_out) {
+    ParallelDeflate job;
+    memset(&job, 0, sizeof(job));
+    job.data = data;
+    job.length = length;
+    job.level = level;
+    job.num_blocks = (int)((length + COMPRESS_BLOCK_SIZE - 1) / COMPRESS_BLOCK_SIZE);
+    if (job.num_blocks == 0) job.num_blocks = 1;
+    job.blocks = calloc(job.num_blocks, sizeof(*job.blocks));
+    job.block_lengths = calloc(job.num_blocks, sizeof(*job.block_lengths));
+    atomic_init(&job.next_block, 0);
+    atomic_init(&job.failed, job.blocks == NULL || job.block_lengths == NULL);
+
+    if (threads > job.num_blocks) threads = job.num_blocks;
+    pthread_t workers[COMPRESS_MAX_THREADS];
+    int started = 0;
+    if (!atomic_load(&job.failed)) {
+        for (; started < threads - 1 && started < COMPRESS_MAX_THREADS; started++) {
+            if (pthread_create(&workers[started], NULL, parallel_deflate_worker, &job) != 0) break;
+        }
+        // Whatever could not be handed to a thread is done here.
+        parallel_deflate_worker(&job);
+    }
+    for (int i = 0; i < started; i++) pthread_join(workers[i], NULL);
+
+    unsigned char* out = NULL;
+    if (!atomic_load(&job.failed)) {
+        size_t total = 0;
+        for (int i = 0; i < job.num_blocks; i++) total += job.block_lengths[i];
+        out = malloc(total ? total : 1);
+        if (out) {
+            size_t offset = 0;
+            for (int i = 0; i < job.num_blocks; i++) {
+                memcpy(out + offset, job.blocks[i], job.block_lengths[i]);
+                offset += job.block_lengths[i];
+            }
+            *length_out = total;
+        }
+    }
+    for (int i = 0; job.blocks && i < job.num_blocks; i++) free(job.blocks[i]);
+    free(job.blocks);
+    free(job.block_lengths);
+    return out;
+}
+
+static const int compress_levels[COMPRESS_NUM_LEVELS] = { 0, 1, 6, Z_BEST_COMPRESSION };
+
+/**
+ * @brief Sets up the compression policy with typical zlib figures.
+ * @details Base64 of already compressed media shrinks by about a quarter
+ *          whatever the level, since only the 6-bit alphabet is redundant,
+ *          while text gains a lot from the higher levels.
+ */
+void compress_policy_init(CompressionPolicy* policy) {
+    static const double text_speed[COMPRESS_NUM_LEVELS] = { 800000, 80000, 30000, 11000 };
+    static const double text_ratio[COMPRESS_NUM_LEVELS] = { 1.0, 0.30, 0.24, 0.235 };
+    static const double media_speed[COMPRESS_NUM_LEVELS] = { 800000, 30000, 27000, 25000 };
+    static const double media_ratio[COMPRESS_NUM_LEVELS] = { 1.0, 0.775, 0.76, 0.76 };
+    memset(policy, 0, sizeof(*policy));
+    policy->adaptive = true;
+    memcpy(policy->speed[0], text_speed, sizeof(text_speed));
+    memcpy(policy->ratio[0], text_ratio, sizeof(text_ratio));
+    memcpy(policy->speed[1], media_speed, sizeof(media_speed));
+    memcpy(policy->ratio[1], media_ratio, sizeof(media_ratio));
+}
+
+/**
+ * @brief Estimates the share of a message's JSON that is base64 media.
+ * @details Attachments of a textual type compress like text and are not
+ *          counted.
+ */
+static double content_media_share(const Content* content, size_t json_length) {
+    size_t media = 0;
+    for (int i = 0; i < content->num_parts; i++) {
+        const Part* part = &content->parts[i];
+        if (part->type != PART_TYPE_FILE || (!part->base64_data && !part->blob)) continue;
+        const char* mime = part->mime_type ? part->mime_type : "";
+        if (strncmp(mime, "text/", 5) == 0 || strstr(mime, "json") || strstr(mime, "xml") || strstr(mime, "javascript")) continue;
+        media += part->blob ? 4 * ((part->blob->size + 2) / 3) : strlen(part->base64_data);
+    }
+    if (json_length == 0) return 0.0;
+    return media >= json_length ? 1.0 : (double)media / json_length;
+}
+
+/**
+ * @brief Estimates the time a segment costs when compressed at a level.
+ * @details The compression time plus the upload time of the result. A
+ *          segment is cached and sent again with every later turn, so its
+ *          upload counts COMPRESS_UPLOAD_WEIGHT times.
+ * @param policy The compression policy.
+ * @param length The size of the JSON.
+ * @param media_share The share of it that is base64 media.
+ * @param level The index of the level in `compress_levels`.
+ * @return The estimated time in ms.
+ */
+static double compress_policy_estimate(const CompressionPolicy* policy, size_t length, double media_share, int level) {
+    double bandwidth = policy->upload_bytes_per_ms > 0 ? policy->upload_bytes_per_ms : COMPRESS_DEFAULT_BANDWIDTH;
+    double text_share = 1.0 - media_share;
+    double compress_ms = length * (media_share / policy->speed[1][level] + text_share / policy->speed[0][level]);
+    double ratio = media_share * policy->ratio[1][level] + text_share * policy->ratio[0][level];
+    return compress_ms + COMPRESS_UPLOAD_WEIGHT * length * ratio / bandwidth;
+}
+
+/**
+ * @brief Picks the compression level of a new segment.
+ * @details The level with the lowest estimated cost (see
+ *          `compress_policy_estimate`) wins: on a slow link the highest
+ *          level pays off, on a fast one storing the data uncompressed may be
+ *          quickest, and base64 media rarely deserves more than level 1.
+ * @return The index of the level in `compress_levels`.
+ */
+static int compress_policy_choose(const CompressionPolicy* policy, size_t length, double media_share) {
+    if (!policy->adaptive) return COMPRESS_NUM_LEVELS - 1;
+    int best = COMPRESS_NUM_LEVELS - 1;
+    double best_ms = compress_policy_estimate(policy, length, media_share, best);
+    for (int level = 0; level < COMPRESS_NUM_LEVELS - 1; level++) {
+        double ms = compress_policy_estimate(policy, length, media_share, level);
+        if (ms < best_ms) {
+            best = level;
+            best_ms = ms;
+        }
+    }
+    return best;
+}
+
+/**
+ * @brief Feeds the measured upload bandwidth of a finished upload into the policy.
+ * @details The time between libcurl taking the first and the last bytes of
+ *          the body is the upload time, short of what the socket buffers
+ *          held. Small uploads are too quick to tell and are ignored.
+ */
+static void compress_policy_observe_upload(AppState* state, const BodyUpload* upload) {
+    if (upload->body->streaming && upload->segment > upload->body->num_segments + 1) {
+        // Its size was only known once it was sent.
+        state->compress.last_wire_length = upload->bytes_sent;
+    }
+    if (upload->bytes_sent < COMPRESS_MIN_SAMPLE || upload->segment <= upload->body->num_segments + 1) return;
+    double ms = (upload->last_read.tv_sec - upload->first_read.tv_sec) * 1000.0 +
+                (upload->last_read.tv_nsec - upload->first_read.tv_nsec) / 1000000.0;
+    if (ms < 1.0) return;
+    CompressionPolicy* policy = &state->compress;
+    double rate = upload->bytes_sent / ms;
+    policy->upload_bytes_per_ms = policy->upload_bytes_per_ms == 0
+        ? rate
+        : COMPRESS_EWMA_ALPHA * rate + (1.0 - COMPRESS_EWMA_ALPHA) * policy->upload_bytes_per_ms;
+}
+
+/**
+ * @brief Returns the raw deflate stream of a compression level, opening it on first use.
+ * @return The stream, or NULL if zlib could not set it up.
+ */
+static z_stream* segment_compressor_stream(SegmentCompressor* compressor, int level) {
+    if (!compressor->ready[level]) {
+        memset(&compressor->streams[level], 0, sizeof(z_stream));
+        // Negative window bits: raw deflate, the gzip framing is added by `request_body_build`.
+        if (deflateInit2(&compressor->streams[level], compress_levels[level], Z_DEFLATED, -15, 8, Z_DEFAULT_STRATEGY) != Z_OK) return NULL;
+        compressor->ready[level] = true;
+    }
+    return &compressor->streams[level];
+}
+
+/**
+ * @brief Closes the streams of a SegmentCompressor.
+ */
+static void segment_compressor_end(SegmentCompressor* compressor) {
+    for (int level = 0; level < COMPRESS_NUM_LEVELS; level++) {
+        if (compressor->ready[level]) deflateEnd(&compressor->streams[level]);
+        compressor->ready[level] = false;
+    }
+}
+
+/**
+ * @brief Compresses a segment at the level the policy picks, and learns from the result.
+ * @details Segments of COMPRESS_PARALLEL_MIN bytes or more are compressed on
+ *          all cores (see `deflate_segment_parallel`). Large segments that are
+ *          mostly text or mostly media update the speed and ratio of their
+ *          kind at the chosen level, so the policy learns the parallel speed.
+ * @param state The current application state holding the policy.
+ * @param compressor The streams to compress with.
+ * @param data The bytes to compress.
+ * @param length The number of bytes.
+ * @param media_share The share of them that is base64 media.
+ * @param[out] length_out Receives the size of the segment.
+ * @param[out] level_out Receives the index of the level used; may be NULL.
+ * @return The segment, which the caller frees, or NULL on failure.
+ */
+static unsigned char* compress_policy_deflate(AppState* state, SegmentCompressor* compressor, const char* data, size_t length, double media_share, size_t* length_out, int* level_out) {
+    CompressionPolicy* policy = &state->compress;
+    int level = compress_policy_choose(policy, length, media_share);
+
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    unsigned char* segment = NULL;
+    int threads = compress_threads();
+    if (length >= COMPRESS_PARALLEL_MIN && compress_levels[level] > 0 && threads > 1) {
+        segment = deflate_segment_parallel((const unsigned char*)data, length, compress_levels[level], threads, length_out);
+        if (segment) policy->parallel_segments++;
+    } else {
+        z_stream* stream = segment_compressor_stream(compressor, level);
+        if (stream) segment = deflate_segment(stream, data, length, length_out);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    if (!segment) return NULL;
+    double ms = (end.tv_sec - start.tv_sec) * 1000.0 + (end.tv_nsec - start.tv_nsec) / 1000000.0;
+
+    if (length >= COMPRESS_MIN_SAMPLE && ms > 0 && (media_share <= 0.2 || media_share >= 0.8)) {
+        int kind = media_share >= 0.8 ? 1 : 0;
+        double speed = length / ms;
+        double ratio = (double)*length_out / length;
+        policy->speed[kind][level] = COMPRESS_EWMA_ALPHA * speed + (1.0 - COMPRESS_EWMA_ALPHA) * policy->speed[kind][level];
+        policy->ratio[kind][level] = COMPRESS_EWMA_ALPHA * ratio + (1.0 - COMPRESS_EWMA_ALPHA) * policy->ratio[kind][level];
+    }
+    policy->compress_ms += ms;
+    policy->last_compress_ms += ms;
+    if (level_out) *level_out = level;
+    return segment;
+}
+
+/**
+ * @brief Prints the compression choices and savings for `/stats`.
+ * @details The session totals come first, then the last request body: how
+ *          many of its messages were compressed at each level and how many
+ *          were reused from the cache. The time saved is the estimate for
+ *          Z_BEST_COMPRESSION minus the estimate for the chosen level.
+ * @param stream The stream to print to.
+ * @param state The current application state.
+ */
+void print_compression_stats(FILE* stream, AppState* state) {
+    const CompressionPolicy* policy = &state->compress;
+    fprintf(stream, "Compression: %s, upload %.1f MB/s (%s)", policy->adaptive ? "adaptive" : "fixed level 9",
+            (policy->upload_bytes_per_ms > 0 ? policy->upload_bytes_per_ms : COMPRESS_DEFAULT_BANDWIDTH) / 1000.0,
+            policy->upload_bytes_per_ms > 0 ? "measured" : "assumed");
+    fprintf(stream, "; messages at level 0/1/6/9: %ld/%ld/%ld/%ld, %.1f -> %.1f KB in %.0f ms",
+            policy->choices[0], policy->choices[1], policy->choices[2], policy->choices[3],
+            policy->bytes_in / 1024.0, policy->bytes_out / 1024.0, policy->compress_ms);
+    if (policy->parallel_segments > 0) {
+        fprintf(stream, " (%ld on %d threads)", policy->parallel_segments, compress_threads());
+    }
+    if (policy->streamed_segments > 0) {
+        fprintf(stream, "; %ld attachment messages compressed while sent", policy->streamed_segments);
+    }
+    if (policy->adaptive) {
+        fprintf(stream, ", ~%.0f ms saved over level 9; %ld bodies sent plain", policy->saved_ms, policy->plain_bodies);
+    }
+    fprintf(stream, "\n");
+    if (policy->last_json_length == 0) return;
+    fprintf(stream, "  Last request: %.1f KB JSON, %.1f KB sent (%.0f%% saved)", policy->last_json_length / 1024.0,
+            policy->last_wire_length / 1024.0, 100.0 - 100.0 * policy->last_wire_length / policy->last_json_length);
+    if (policy->last_plain) {
+        fprintf(stream, ", sent plain\n");
+        return;
+    }
+    fprintf(stream, ", new messages at level 0/1/6/9: %d/%d/%d/%d, %d reused, %d streamed, %.1f ms compressing\n",
+            policy->last_choices[0], policy->last_choices[1], policy->last_choices[2], policy->last_choices[3],
+            policy->last_reused, policy->last_streamed, policy->last_compress_ms);
+}
+
+/**
+ * @brief Returns the compressed form of a history message, compressing it on first use.
+ * @details Like its JSON, a message is compressed only once and the segment
+ *          (see `deflate_segment`) is kept on the Content together with the
+ *          CRC-32 of the JSON, so a request only compresses what is new in it.
+ *          The level is chosen by the compression policy, and the choice is
+ *          counted in its statistics.
+ * @param state The current application state holding the policy.
+ * @param content The message.
+ * @param compressor The streams to compress with.
+ * @param[out] length_out Receives the size of the segment.
+ * @return The cached segment, owned by the Content, or NULL on failure.
+ */
+static const unsigned char* content_deflated(AppState* state, Content* content, SegmentCompressor* compressor, size_t* length_out) {
+    if (!content->deflated) {
+        CompressionPolicy* policy = &state->compress;
+        size_t json_length = 0;
+        const char* json = content_json(content, &json_length);
+        if (!json) return NULL;
+        double media_share = content_media_share(content, json_length);
+        int level = 0;
+        content->deflated = compress_policy_deflate(state, compressor, json, json_length, media_share, &content->deflated_length, &level);
+        if (!content->deflated) return NULL;
+        content->json_crc = crc32_z(0L, (const Bytef*)json, json_length);
+
+        policy->choices[level]++;
+        policy->last_choices[level]++;
+        policy->bytes_in += json_length;
+        policy->bytes_out += content->deflated_length;
+        policy->saved_ms += compress_policy_estimate(policy, json_length, media_share, COMPRESS_NUM_LEVELS - 1) -
+                            compress_policy_estimate(policy, json_length, media_share, level);
+    } else {
+        state->compress.last_reused++;
+    }
+    *length_out = content->deflated_length;
+    return content->deflated;
+}
+
+/**
+ * @brief Drops the cached serialized and compressed forms of a message after it was edited.
+ * @param content The message.
+ */
+void content_invalidate_cache(Content* content) {
+    free(content->json);
+    content->json = NULL;
+    content->json_length = 0;
+    free(content->deflated);
+    content->deflated = NULL;
+    content->deflated_length = 0;
+    free(content->splices);
+    content->splices = NULL;
+    content->num_splices = 0;
+    content->full_length = 0;
+}
+
+/**
+ * @brief Constructs the main JSON request object from the application state.
+ * @details This function builds the cJSON object that serves as the payload
+ *          for a `generateContent` API call. It serializes the different
+ *          parts of the AppState into the format required by the Gemini API,
+ *          including the system prompt, the conversation history, tool
+ *          configurations (like grounding), and generation parameters.
+ * @param state A pointer to the application's current state.
+ * @param include_contents Whether to add the conversation history; without it
+ *        the object holds only the settings, for `build_request_body`.
+ * @param by_reference Write stored attachments as blob store references (see
+ *        `build_content_json`).
+ * @return A pointer to the root cJSON object of the request. The caller is
+ *         responsible for freeing this object with `cJSON_Delete`. Returns
+ *         NULL on failure.
+ */
+static cJSON* build_request_tree(AppState* state, bool include_contents, bool by_reference) {
+    cJSON* root = cJSON_CreateObject();
+    if (!root) return NULL;
+
+    // --- 1. Add System Instruction (if provided) ---
+    if (state->system_prompt) {
+        cJSON* sys_instruction = cJSON_CreateObject();
+        cJSON* sys_parts_array = cJSON_CreateArray();
+        cJSON* sys_part_item = cJSON_CreateObject();
+
+        cJSON_AddStringToObject(sys_part_item, "text", state->system_prompt);
+        cJSON_AddItemToArray(sys_parts_array, sys_part_item);
+        cJSON_AddItemToObject(sys_instruction, "parts", sys_parts_array);
+        cJSON_AddItemToObject(root, "systemInstruction", sys_instruction);
+    }
+
+    // --- 2. Add Contents (the conversation history) ---
+    if (include_contents) {
+        cJSON* contents = cJSON_CreateArray();
+        cJSON_AddItemToObject(root, "contents", contents);
+        for (int i = 0; i < state->history.num_contents; i++) {
+            cJSON_AddItemToArray(contents, build_content_json(&state->history.contents[i], by_reference));
+        }
+    }
+
+    // --- 3. Add Tools Configuration ---
+    // Only add the "tools" object if at least one tool is enabled.
+    if (state->url_context || state->google_grounding) {
+        cJSON* tools_array = cJSON_CreateArray();
+        if (state->url_context) {
+            cJSON* tool1 = cJSON_CreateObject();
+            cJSON_AddItemToObject(tool1, "urlContext", cJSON_CreateObject());
+            cJSON_AddItemToArray(tools_array, tool1);
+        }
+        if (state->google_grounding) {
+            cJSON* tool2 = cJSON_CreateObject();
+            cJSON_AddItemToObject(tool2, "googleSearch", cJSON_CreateObject());
+            cJSON_AddItemToArray(tools_array, tool2);
+        }
+        cJSON_AddItemToObject(root, "tools", tools_array);
+    }
+
+    // --- Add Safety Settings (Hardcoded to BLOCK_NONE) ---
+    if (!state->safety) {
+        cJSON* safety_settings_array = cJSON_CreateArray();
+        if (safety_settings_array) {
+            // CORRECTED: Use only the four universally supported categories.
+            const char* categories[] = {
+                "HARM_CATEGORY_HARASSMENT",
+                "HARM_CATEGORY_HATE_SPEECH",
+                "HARM_CATEGORY_SEXUALLY_EXPLICIT",
+                "HARM_CATEGORY_DANGEROUS_CONTENT",
+                "HARM_CATEGORY_CIVIC_INTEGRITY"
+            };
+            int num_categories = sizeof(categories) / sizeof(categories[0]);
+
+            for (int i = 0; i < num_categories; i++) {
+                cJSON* setting_item = cJSON_CreateObject();
+                if (setting_item) {
+                    cJSON_AddStringToObject(setting_item, "category", categories[i]);
+                    cJSON_AddStringToObject(setting_item, "threshold", "BLOCK_NONE");
+                    cJSON_AddItemToArray(safety_settings_array, setting_item);
+                }
+            }
+            cJSON_AddItemToObject(root, "safetySettings", safety_settings_array);
+        }
+    }
+    // --- 4. Add Generation Configuration ---
+    cJSON* gen_config = cJSON_CreateObject();
+    cJSON_AddNumberToObject(gen_config, "temperature", state->temperature);
+    if (state->max_output_tokens > 0) cJSON_AddNumberToObject(gen_config, "maxOutputTokens", state->max_output_tokens);
+    cJSON_AddNumberToObject(gen_config, "seed", state->seed);
+    if (state->topK > 0) {
+        cJSON_AddNumberToObject(gen_config, "topK", state->topK);
+    }
+    if (state->topP > 0.0f) {
+        cJSON_AddNumberToObject(gen_config, "topP", state->topP);
+    }
+
+    // Add thinking budget as a sub-object within generationConfig.
+    cJSON* thinking_config = cJSON_CreateObject();
+    cJSON_AddNumberToObject(thinking_config, "thinkingBudget", state->thinking_budget);
+    cJSON_AddItemToObject(gen_config, "thinkingConfig", thinking_config);
+
+    if (state->media_resolution) cJSON_AddStringToObject(gen_config, "mediaResolution", state->media_resolution);
+
+    cJSON_AddItemToObject(root, "generationConfig", gen_config);
+
+    return root;
+}
+
+/**
+ * @brief Constructs the complete JSON request object, history included.
+ * @param state A pointer to the application's current state.
+ * @param by_reference Write attachments that are in the blob store as
+ *        references to it, as named sessions do.
+ * @return The root cJSON object; the caller frees it with `cJSON_Delete`.
+ *         NULL on failure.
+ */
+cJSON* build_request_json(AppState* state, bool by_reference) {
+    return build_request_tree(state, true, by_reference);
+}
+
+/**
+ * @brief Appends a segment to a request body under construction.
+ */
+static void request_body_append(RequestBody* body, const unsigned char* data, size_t length) {
+    body->segments[body->num_segments] = data;
+    body->sources[body->num_segments] = NULL;
+    body->lengths[body->num_segments++] = length;
+    body->wire_length += length;
+}
+
+/**
+ * @brief Appends a segment that is produced from a message while the body is sent.
+ * @details In plain bodies the size is the message's JSON; in gzip bodies it
+ *          is not known until the segment was compressed.
+ */
+static void request_body_append_stream(RequestBody* body, Content* content) {
+    size_t length = body->gzip ? 0 : content_length(content);
+    body->segments[body->num_segments] = NULL;
+    body->sources[body->num_segments] = content;
+    body->lengths[body->num_segments++] = length;
+    body->wire_length += length;
+    if (body->gzip) body->streaming = true;
+}
+
+/**
+ * @brief Stitches a gzip-compressed request body from the cached history segments.
+ * @details The JSON is `{"contents":[...]}` followed by the members of
+ *          `settings`. Every message is sent as its cached deflate segment
+ *          (see `content_deflated`), so only messages that were never sent
+ *          before are compressed; the opening, the separator and the settings
+ *          tail are small and compressed for this body alone. Sent in a row
+ *          behind a gzip header, the segments form one deflate stream, which
+ *          an empty final block and a trailer end. The trailer's CRC-32 is
+ *          combined from the CRCs of the pieces with `crc32_combine`, so the
+ *          cached messages are not read at all. Bodies smaller than
+ *          COMPRESS_MIN_BODY are sent as plain JSON, where gzip would only add
+ *          work on both ends. Messages with blob parts are not cached in
+ *          compressed form; their segments are produced while the body is sent
+ *          (see `body_upload_stream`), and only their CRC-32 is needed here.
+ *          The finished body is reused as is for retries and hedged requests.
+ *          The history must not change while the body is in use.
+ * @param state The current application state; its history is the conversation.
+ * @param settings Everything but the contents, from `build_request_tree`.
+ * @param[out] body Receives the segments; free it with `request_body_free`.
+ * @return true on success.
+ */
+bool request_body_build(AppState* state, const cJSON* settings, RequestBody* body) {
+    return request_body_build_range(state, settings, 0, state->history.num_contents, body);
+}
+
+/**
+ * @brief Stitches a request body from a range of the history messages.
+ * @details Like `request_body_build`, for bodies that hold only part of the
+ *          conversation: the messages a context cache holds, or the ones that
+ *          follow them.
+ * @param state The current application state; its history is the conversation.
+ * @param settings Everything but the contents.
+ * @param first The first history message to include.
+ * @param count The number of messages to include.
+ * @param[out] body Receives the segments; free it with `request_body_free`.
+ * @return true on success.
+ */
+bool request_body_build_range(AppState* state, const cJSON* settings, int first, int count, RequestBody* body) {
+    static const char contents_open[] = "{\"contents\":[";
+    static const char comma[] = ",";
+    CompressionPolicy* policy = &state->compress;
+    Content* contents = state->history.contents + first;
+
+    memset(body, 0, sizeof(*body));
+    body->key_index = -1;
+    char* settings_json = cJSON_PrintUnformatted(settings);
+    int capacity = 2 * count + 2;
+    body->segments = malloc(sizeof(*body->segments) * capacity);
+    body->lengths = malloc(sizeof(*body->lengths) * capacity);
+    body->sources = malloc(sizeof(*body->sources) * capacity);
+    body->stream_best = !policy->adaptive;
+    if (!settings_json || !body->segments || !body->lengths || !body->sources) {
+        free(settings_json);
+        request_body_free(body);
+        return false;
+    }
+
+    // The tail closes the contents and splices in the settings object with
+    // its opening brace turned into a comma.
+    size_t settings_length = strlen(settings_json);
+    if (settings_length > 2) {
+        settings_json[0] = ',';
+    } else {
+        strcpy(settings_json, "}");
+        settings_length = 1;
+    }
+    char* tail = malloc(settings_length + 2);
+    if (tail) {
+        tail[0] = ']';
+        memcpy(tail + 1, settings_json, settings_length + 1);
+    }
+    free(settings_json);
+    size_t tail_length = settings_length + 1;
+
+    body->json_length = sizeof(contents_open) - 1 + tail_length;
+    for (int i = 0; tail && i < count; i++) {
+        size_t length = 0;
+        if (contents[i].splices && content_blobs_version(&contents[i]) != contents[i].blob_versions) {
+            // The file of an attachment was written to and its data replaced.
+            content_invalidate_cache(&contents[i]);
+        }
+        if (!content_json(&contents[i], &length)) {
+            free(tail);
+            request_body_free(body);
+            return false;
+        }
+        body->json_length += content_length(&contents[i]) + (i > 0 ? 1 : 0);
+    }
+    memset(policy->last_choices, 0, sizeof(policy->last_choices));
+    policy->last_reused = 0;
+    policy->last_streamed = 0;
+    policy->last_compress_ms = 0;
+    policy->last_json_length = body->json_length;
+    policy->last_plain = policy->adaptive && body->json_length < COMPRESS_MIN_BODY;
+
+    if (tail && policy->last_plain) {
+        // Plain JSON: the pieces are sent as they are.
+        policy->plain_bodies++;
+        body->owned[2] = (unsigned char*)tail;
+        request_body_append(body, (const unsigned char*)contents_open, sizeof(contents_open) - 1);
+        for (int i = 0; i < count; i++) {
+            size_t length = 0;
+            const char* json = content_json(&contents[i], &length);
+            if (i > 0) request_body_append(body, (const unsigned char*)comma, 1);
+            if (contents[i].splices) {
+                request_body_append_stream(body, &contents[i]);
+            } else {
+                request_body_append(body, (const unsigned char*)json, length);
+            }
+        }
+        request_body_append(body, body->owned[2], tail_length);
+        policy->last_wire_length = body->wire_length;
+        return true;
+    }
+
+    body->gzip = true;
+    SegmentCompressor compressor;
+    memset(&compressor, 0, sizeof(compressor));
+    size_t open_size = 0, comma_size = 0, tail_size = 0;
+    body->owned[0] = compress_policy_deflate(state, &compressor, contents_open, sizeof(contents_open) - 1, 0.0, &open_size, NULL);
+    body->owned[1] = compress_policy_deflate(state, &compressor, comma, 1, 0.0, &comma_size, NULL);
+    body->owned[2] = tail ? compress_policy_deflate(state, &compressor, tail, tail_length, 0.0, &tail_size, NULL) : NULL;
+    bool built = body->owned[0] && body->owned[1] && body->owned[2];
+
+    // Gzip header: magic, deflate, no flags, no time, no extra flags, Unix.
+    static const unsigned char gzip_header[10] = { 0x1f, 0x8b, 8, 0, 0, 0, 0, 0, 0, 3 };
+    memcpy(body->header, gzip_header, sizeof(gzip_header));
+    body->wire_length = sizeof(body->header) + sizeof(body->trailer);
+    request_body_append(body, body->owned[0], open_size);
+    uLong crc = crc32_z(0L, (const Bytef*)contents_open, sizeof(contents_open) - 1);
+    uLong comma_crc = crc32_z(0L, (const Bytef*)comma, 1);
+
+    for (int i = 0; built && i < count; i++) {
+        Content* content = &contents[i];
+        size_t segment_size = 0;
+        const unsigned char* segment = content->splices ? NULL : content_deflated(state, content, &compressor, &segment_size);
+        if (!segment && !content->splices) {
+            built = false;
+            break;
+        }
+        if (i > 0) {
+            request_body_append(body, body->owned[1], comma_size);
+            crc = crc32_combine(crc, comma_crc, 1);
+        }
+        if (content->splices) {
+            request_body_append_stream(body, content);
+            policy->streamed_segments++;
+            policy->last_streamed++;
+        } else {
+            request_body_append(body, segment, segment_size);
+        }
+        crc = crc32_combine(crc, content->json_crc, (z_off_t)content_length(content));
+    }
+
+    if (built) {
+        request_body_append(body, body->owned[2], tail_size);
+        crc = crc32_combine(crc, crc32_z(0L, (const Bytef*)tail, tail_length), (z_off_t)tail_length);
+
+        // An empty final block with fixed codes, then CRC-32 and ISIZE, little-endian.
+        unsigned char* trailer = body->trailer;
+        trailer[0] = 0x03;
+        trailer[1] = 0x00;
+        for (int i = 0; i < 4; i++) {
+            trailer[2 + i] = (unsigned char)(crc >> (8 * i));
+            trailer[6 + i] = (unsigned char)((uint64_t)body->json_length >> (8 * i));
+        }
+    }
+
+    free(tail);
+    segment_compressor_end(&compressor);
+    if (!built) {
+        request_body_free(body);
+        return false;
+    }
+    policy->last_wire_length = body->wire_length;
+    return true;
+}
+
+/**
+ * @brief Frees a request body built by `request_body_build`.
+ * @details The cached segments of the history messages are left alone.
+ */
+void request_body_free(RequestBody* body) {
+    free(body->segments);
+    free(body->lengths);
+    free(body->sources);
+    for (int i = 0; i < 3; i++) free(body->owned[i]);
+    free(body->owned_message);
+    memset(body, 0, sizeof(*body));
+}
+
+/**
+ * @brief Prepares one upload of a request body.
+ * @details Every transfer needs its own BodyUpload, even when several send
+ *          the same body (retries, hedged legs); the body itself is shared.
+ * @param upload The upload state to set up.
+ * @param body The body to send; it must outlive the upload.
+ */
+void body_upload_init(BodyUpload* upload, const RequestBody* body) {
+    memset(upload, 0, sizeof(*upload));
+    upload->body = body;
+}
+
+/**
+ * @brief Forgets how far a streamed segment got, to start the next one (or this one again).
+ */
+static void body_upload_reset_stream(BodyUpload* upload) {
+    if (upload->deflate) {
+        deflateEnd(upload->deflate);
+        free(upload->deflate);
+        upload->deflate = NULL;
+    }
+    memset(&upload->cursor, 0, sizeof(upload->cursor));
+    upload->buffered = 0;
+    upload->buffer_offset = 0;
+    upload->input_done = false;
+}
+
+/**
+ * @brief Releases what an upload allocated for streamed segments.
+ * @details Call it once the transfer that used the upload is over.
+ */
+void body_upload_end(BodyUpload* upload) {
+    body_upload_reset_stream(upload);
+    free(upload->buffer);
+    upload->buffer = NULL;
+}
+
+/**
+ * @brief Produces the next bytes of a segment streamed from a message with blob parts.
+ * @details The message's JSON is read with `content_stream_read`, so its
+ *          attachments are Base64-encoded straight from their blobs as the
+ *          body goes out. Plain bodies get the JSON as it is. In gzip bodies
+ *          it goes through a raw deflate stream of the upload's own, which
+ *          ends on a full flush like the cached segments around it. Media is
+ *          compressed with Huffman coding alone: Base64 has no redundancy
+ *          beyond its alphabet, which that removes as well as LZ77 matching
+ *          would, at several times the speed. Text attachments use level 1.
+ *          Every upload compresses on its own, so hedged requests can send
+ *          the same body side by side.
+ * @param upload The upload, positioned on the segment.
+ * @param content The message the segment is made of.
+ * @return false on allocation or compression failure, or when the file of an
+ *         attachment shrank (`blob_unreadable` is set then).
+ */
+static bool body_upload_stream(BodyUpload* upload, const Content* content) {
+    if (!upload->buffer) {
+        upload->buffer = malloc(3 * UPLOAD_STREAM_CHUNK);
+        if (!upload->buffer) return false;
+    }
+    char* json = (char*)upload->buffer;
+    unsigned char* out = upload->buffer + UPLOAD_STREAM_CHUNK;
+    unsigned char* scratch = upload->buffer + 2 * UPLOAD_STREAM_CHUNK;
+    upload->buffer_offset = 0;
+    if (!upload->body->gzip) {
+        upload->buffered = content_stream_read(content, &upload->cursor, (char*)out, UPLOAD_STREAM_CHUNK, scratch);
+        upload->input_done = upload->buffered == 0;
+        upload->blob_unreadable = upload->cursor.failed;
+        return !upload->cursor.failed;
+    }
+
+    z_stream* stream = upload->deflate;
+    if (!stream) {
+        stream = calloc(1, sizeof(z_stream));
+        int level = upload->body->stream_best ? Z_BEST_COMPRESSION : 1;
+        int strategy = !upload->body->stream_best && content_media_share(content, content->full_length) >= 0.5
+            ? Z_HUFFMAN_ONLY : Z_DEFAULT_STRATEGY;
+        if (!stream || deflateInit2(stream, level, Z_DEFLATED, -15, 8, strategy) != Z_OK) {
+            free(stream);
+            return false;
+        }
+        upload->deflate = stream;
+    }
+    stream->next_out = out;
+    stream->avail_out = UPLOAD_STREAM_CHUNK;
+    while (stream->avail_out > 0) {
+        bool json_done = upload->cursor.piece > 2 * content->num_splices;
+        if (stream->avail_in == 0 && !json_done) {
+            stream->next_in = (Bytef*)json;
+            stream->avail_in = (uInt)content_stream_read(content, &upload->cursor, json, UPLOAD_STREAM_CHUNK, scratch);
+            if (upload->cursor.failed) {
+                upload->blob_unreadable = true;
+                return false;
+            }
+            continue;
+        }
+        if (deflate(stream, json_done ? Z_FULL_FLUSH : Z_NO_FLUSH) == Z_STREAM_ERROR) return false;
+        // The flush is complete once deflate leaves room in the output.
+        if (json_done && stream->avail_out > 0) {
+            upload->input_done = true;
+            break;
+        }
+    }
+    upload->buffered = UPLOAD_STREAM_CHUNK - stream->avail_out;
+    return true;
+}
+
+/**
+ * @brief libcurl read callback that sends the segments of a request body.
+ * @details The segments are copied straight into libcurl's upload buffer, so
+ *          no contiguous copy of the whole body is ever made. Segments of
+ *          messages with blob parts are produced on the way, a chunk at a
+ *          time (see `body_upload_stream`).
+ * @param buffer libcurl's upload buffer.
+ * @param size The size of each item.
+ * @param nitems The number of items that fit.
+ * @param userdata The BodyUpload.
+ * @return The number of bytes written, 0 at the end of the body.
+ */
+static size_t body_upload_read(char* buffer, size_t size, size_t nitems, void* userdata) {
+    BodyUpload* upload = userdata;
+    const RequestBody* body = upload->body;
+    size_t capacity = size * nitems;
+    size_t produced = 0;
+    while (produced < capacity && upload->segment <= body->num_segments + 1) {
+        const unsigned char* segment;
+        size_t length;
+        if (!body->gzip && (upload->segment == 0 || upload->segment > body->num_segments)) {
+            upload->segment++;
+            continue;
+        }
+        const Content* source = upload->segment >= 1 && upload->segment <= body->num_segments
+            ? body->sources[upload->segment - 1] : NULL;
+        if (source) {
+            if (upload->buffer_offset == upload->buffered) {
+                if (upload->input_done) {
+                    body_upload_reset_stream(upload);
+                    upload->segment++;
+                } else if (!body_upload_stream(upload, source)) {
+                    return CURL_READFUNC_ABORT;
+                }
+                continue;
+            }
+            size_t count = upload->buffered - upload->buffer_offset;
+            if (count > capacity - produced) count = capacity - produced;
+            memcpy(buffer + produced, upload->buffer + UPLOAD_STREAM_CHUNK + upload->buffer_offset, count);
+            produced += count;
+            upload->buffer_offset += count;
+            continue;
+        }
+        if (upload->segment == 0) {
+            segment = body->header;
+            length = sizeof(body->header);
+        } else if (upload->segment > body->num_segments) {
+            segment = body->trailer;
+            length = sizeof(body->trailer);
+        } else {
+            segment = body->segments[upload->segment - 1];
+            length = body->lengths[upload->segment - 1];
+        }
+        size_t count = length - upload->offset < capacity - produced ? length - upload->offset : capacity - produced;
+        memcpy(buffer + produced, segment + upload->offset, count);
+        produced += count;
+        upload->offset += count;
+        if (upload->offset == length) {
+            upload->segment++;
+            upload->offset = 0;
+        }
+    }
+    if (produced > 0) {
+        if (upload->bytes_sent == 0) clock_gettime(CLOCK_MONOTONIC, &upload->first_read);
+        clock_gettime(CLOCK_MONOTONIC, &upload->last_read);
+    }
+    upload->bytes_sent += produced;
+    return produced;
+}
+
+/**
+ * @brief libcurl seek callback of an upload; only rewinding to the start is supported.
+ * @details libcurl rewinds when it has to send the body again on a new
+ *          connection.
+ */
+static int body_upload_seek(void* userdata, curl_off_t offset, int origin) {
+    BodyUpload* upload = userdata;
+    if (offset != 0 || origin != SEEK_SET) return CURL_SEEKFUNC_CANTSEEK;
+    body_upload_reset_stream(upload);
+    upload->segment = 0;
+    upload->offset = 0;
+    upload->bytes_sent = 0;
+    return CURL_SEEKFUNC_OK;
+}
+
+/**
+ * @brief Parses a JSON error response from the API and prints a clean message.
+ * @details When an API call fails, the body of the HTTP response often contains
+ *          a JSON object with error details. This function attempts to parse that
+ *          JSON, find the "message" field within the "error" object, and print
+ *          it to stderr for the user. If parsing fails, it prints the raw
+ *          buffer as a fallback.
+ * @param error_buffer The raw response body received from a failed API call.
+ */
+void parse_and_print_error_json(const char* error_buffer) {
+    if (!error_buffer) return;
+
+    // The actual JSON object may be preceded by other text in the error buffer.
+    // Find the opening brace to ensure we parse only the JSON part.
+    const char* json_start = strchr(error_buffer, '{');
+    if (!json_start) {
+        // If no JSON object is found, print the raw error buffer as-is.
+        fprintf(stderr, "API Error: %s\n", error_buffer);
+        return;
+    }
+
+    cJSON* root = cJSON_Parse(json_start);
+    if (!root) {
+        // If parsing fails, we can't extract a specific message.
+        return;
+    }
+
+    cJSON* error = cJSON_GetObjectItem(root, "error");
+    if (error) {
+        cJSON* message = cJSON_GetObjectItem(error, "message");
+        if (cJSON_IsString(message) && message->valuestring) {
+            // Print the clean, user-friendly error message from the API.
+            fprintf(stderr, "API Error Message: %s\n", message->valuestring);
+        }
+    }
+
+    cJSON_Delete(root);
+}
+
+/**
+ * @brief A libcurl write callback for non-streaming API responses.
+ * @details This function is used for API calls that return a complete JSON
+ *          object in a single response (e.g., `countTokens`). It simply
+ *          appends all received data chunks into the MemoryStruct's buffer
+ *          until the request is finished.
+ * @param contents A pointer to the data received.
+ * @param size The size of each data member (always 1 for text).
+ * @param nmemb The number of data members received.
+ * @param userp A user-defined pointer to a MemoryStruct to store the data.
+ * @return The total number of bytes successfully handled.
+ */
+static size_t write_to_memory_struct_callback(void* contents, size_t size, size_t nmemb, void* userp) {
+    size_t realsize = size * nmemb;
+    MemoryStruct* mem = (MemoryStruct*)userp;
+
+    // Expand the buffer to accommodate the new data chunk.
+    char* ptr = realloc(mem->buffer, mem->size + realsize + 1);
+    if (!ptr) {
+        fprintf(stderr, "Error: realloc failed in token count callback.\n");
+        return 0; // Signal an error to libcurl.
+    }
+    mem->buffer = ptr;
+
+    // Append the new data and update the size.
+    memcpy(&(mem->buffer[mem->size]), contents, realsize);
+    mem->size += realsize;
+    mem->buffer[mem->size] = '\0'; // Ensure the buffer is always null-terminated.
+
+    return realsize;
+}
+
+/**
+ * @brief Calculates the token count for the current conversation history.
+ * @details This function sends the current conversation contents to the Gemini
+ *          API's `countTokens` endpoint. It builds a request similar to a
+ *          standard generation request but omits unnecessary fields like
+ *          `generationConfig`. It then parses the response to extract the integer
+ *          value for the total token count.
+ * @param state The current application state, containing the history to be counted.
+ * @return The integer token count on success, or -1 on failure.
+ */
+int get_token_count(AppState* state) {
+    // Build the request settings; the history comes from the cached fragments.
+    cJSON* root = build_request_tree(state, false, false);
+    if (!root) return -1;
+
+    // The countTokens endpoint does not use these fields, so remove them.
+    cJSON_DeleteItemFromObject(root, "generationConfig");
+    cJSON_DeleteItemFromObject(root, "tools");
+    cJSON_DeleteItemFromObject(root, "safetySettings");
+
+    // Assemble the payload from the cached message segments.
+    RequestBody body;
+    bool built = request_body_build(state, root, &body);
+    cJSON_Delete(root);
+    if (!built) {
+        fprintf(stderr, "Failed to build payload for token count.\n");
+        return -1;
+    }
+
+    // Prepare a memory buffer for the API response.
+    MemoryStruct chunk = { .buffer = malloc(1), .size = 0 };
+    if (!chunk.buffer) {
+        request_body_free(&body);
+        return -1;
+    }
+    chunk.buffer[0] = '\0';
+
+    // Perform the API call to the "countTokens" endpoint.
+    long http_code = perform_api_curl_request(
+        state,
+        "countTokens",
+        &body,
+        write_to_memory_struct_callback, // Use the simple, non-streaming callback.
+        &chunk
+    );
+
+    int token_count = -1;
+    if (http_code == 200) {
+        // If successful, parse the JSON response.
+        cJSON* json_resp = cJSON_Parse(chunk.buffer);
+        if (json_resp) {
+            // Extract the "totalTokens" value.
+            cJSON* tokens = cJSON_GetObjectItem(json_resp, "totalTokens");
+            if (cJSON_IsNumber(tokens)) {
+                token_count = tokens->valueint;
+            }
+            cJSON_Delete(json_resp);
+        }
+    } else {
+        // On failure, print the error.
+        fprintf(stderr, "Token count API call failed (HTTP code: %ld)\n", http_code);
+        if (http_code < 0) fprintf(stderr, "Curl error: %s\n", curl_easy_strerror(-http_code));
+        parse_and_print_error_json(chunk.buffer);
+    }
+
+    // Clean up resources.
+    request_body_free(&body);
+    free(chunk.buffer);
+    return token_count;
+}
+
+/**
+ * @brief Records the context cache in a saved session.
+ * @details The hashes are written as hex strings, which a JSON number could
+ *          not hold exactly.
+ */
+static void context_cache_save(const AppState* state, cJSON* root) {
+    const ContextCache* cache = &state->context_cache;
+    if (cache->name[0] == '\0') return;
+    cJSON* item = cJSON_AddObjectToObject(root, "contextCache");
+    char hex[17];
+    cJSON_AddStringToObject(item, "name", cache->name);
+    cJSON_AddStringToObject(item, "key", cache->key_id);
+    cJSON_AddNumberToObject(item, "messages", cache->num_contents);
+    snprintf(hex, sizeof(hex), "%016llx", (unsigned long long)cache->setup_hash);
+    cJSON_AddStringToObject(item, "setupHash", hex);
+    snprintf(hex, sizeof(hex), "%016llx", (unsigned long long)cache->contents_hash);
+    cJSON_AddStringToObject(item, "contentsHash", hex);
+    cJSON_AddNumberToObject(item, "tokens", cache->tokens);
+    cJSON_AddNumberToObject(item, "expireTime", (double)cache->expire_time);
+}
+
+/**
+ * @brief Takes over the context cache recorded in a loaded session.
+ * @details A cache that has expired in the meantime is ignored. Whether it
+ *          still matches the conversation is checked when the next request is
+ *          built, like for a cache created in this run.
+ */
+static void context_cache_load(AppState* state, const cJSON* root) {
+    ContextCache* cache = &state->context_cache;
+    const cJSON* item = cJSON_GetObjectItem(root, "contextCache");
+    const cJSON* name = cJSON_GetObjectItem(item, "name");
+    const cJSON* key = cJSON_GetObjectItem(item, "key");
+    const cJSON* messages = cJSON_GetObjectItem(item, "messages");
+    const cJSON* setup_hash = cJSON_GetObjectItem(item, "setupHash");
+    const cJSON* contents_hash = cJSON_GetObjectItem(item, "contentsHash");
+    const cJSON* tokens = cJSON_GetObjectItem(item, "tokens");
+    const cJSON* expire_time = cJSON_GetObjectItem(item, "expireTime");
+    bool valid = cJSON_IsString(name) && strlen(name->valuestring) < sizeof(cache->name) &&
+                 cJSON_IsString(key) && strlen(key->valuestring) < sizeof(cache->key_id) &&
+                 cJSON_IsNumber(messages) && cJSON_IsString(setup_hash) && cJSON_IsString(contents_hash) &&
+                 cJSON_IsNumber(expire_time) && expire_time->valuedouble > time(NULL) + CONTEXT_CACHE_MARGIN_SEC;
+
+    // The cache of the conversation being replaced is no longer needed,
+    // unless the session refers to the same one.
+    bool same = valid && strcmp(cache->name, name->valuestring) == 0;
+    context_cache_forget(state, !same);
+    if (!valid) return;
+    snprintf(cache->name, sizeof(cache->name), "%s", name->valuestring);
+    snprintf(cache->key_id, sizeof(cache->key_id), "%s", key->valuestring);
+    cache->num_contents = messages->valueint;
+    cache->setup_hash = strtoull(setup_hash->valuestring, NULL, 16);
+    cache->contents_hash = strtoull(contents_hash->valuestring, NULL, 16);
+    cache->tokens = cJSON_IsNumber(tokens) ? (long)tokens->valuedouble : 0;
+    cache->expire_time = (time_t)expire_time->valuedouble;
+    cache->last_used = time(NULL);
+    cache->next_refresh_at = 0;
+}
+
+/**
+ * @brief Saves the current conversation state to a JSON file.
+ * @details This function serializes the entire application state, including the
+ *          conversation history, system prompt, and configuration, into a JSON
+ *          object using `build_request_json`. It then saves this JSON to the
+ *          specified file path, allowing a session to be resumed later. A
+ *          context cache in use is recorded too, so that loading the session
+ *          (`/load`, `--load-session`) references it instead of creating a new one.
+ *          Sessions in the sessions directory refer to their attachments in
+ *          the blob store by hash (see `blob_store_save_history`), so sessions
+ *          sharing an attachment do not each hold a copy; files saved anywhere
+ *          else embed them and stay self-contained.
+ * @param state A pointer to the current application state to be saved.
+ * @param filepath The path of the file where the history will be saved.
+ */
+void save_history_to_file(AppState* state, const char* filepath) {
+    FILE* file = fopen(filepath, "w");
+    if (!file) {
+        perror("Failed to open file for writing");
+        return;
+    }
+
+    bool by_reference = state->blob_store.enabled && session_path_is_named(filepath);
+    if (by_reference) blob_store_save_history(state);
+
+    // Use the existing function to build a complete JSON representation of the state.
+    cJSON* root = build_request_json(state, by_reference);
+    if (!root) {
+        fclose(file);
+        return;
+    }
+    context_cache_save(state, root);
+
+    // Convert the cJSON object to a formatted, human-readable string.
+    char* json_string = cJSON_Print(root);
+    cJSON_Delete(root);
+
+    if (json_string) {
+        fputs(json_string, file);
+        free(json_string);
+    }
+
+    fclose(file);
+    fprintf(stderr, "Conversation history saved to %s\n", filepath);
+}
+
+/**
+ * @brief Loads a conversation state from a JSON file.
+ * @details This function reads a JSON file from the given path, parses it, and
+ *          repopulates the application's state. It clears any existing history
+ *          before loading the new data. It carefully iterates through the JSON
+ *          structure to reconstruct the `contents` (history), `systemInstruction`,
+ *          and other settings.
+ * @param state A pointer to the AppState struct that will be overwritten with the
+ *              loaded data.
+ * @param filepath The path of the file from which to load the history.
+ */
+void load_history_from_file(AppState* state, const char* filepath) {
+    FILE* file = fopen(filepath, "r");
+    if (!file) {
+        perror("Failed to open file for reading");
+        return;
+    }
+
+    // Read the entire file content into a memory buffer.
+    fseek(file, 0, SEEK_END);
+    long length = ftell(file);
+    fseek(file, 0, SEEK_SET);
+    char* buffer = malloc(length + 1);
+    if (!buffer) {
+        fclose(file);
+        return;
+    }
+    if (fread(buffer, 1, length, file) != (size_t)length) {
+        fclose(file);
+        free(buffer);
+        fprintf(stderr, "Error reading file content.\n");
+        return;
+    }
+    buffer[length] = '\0';
+    fclose(file);
+
+    // Parse the buffer into a cJSON object.
+    cJSON* root = cJSON_Parse(buffer);
+    free(buffer);
+    if (!cJSON_IsObject(root)) {
+        fprintf(stderr, "Error: JSON file is not a valid history object.\n");
+        if(root) cJSON_Delete(root);
+        return;
+    }
+
+    // --- Repopulate the AppState ---
+
+    // 1. Clear existing history before loading the new session.
+    free_history(&state->history);
+    context_cache_load(state, root);
+
+    // 2. Load the conversation history ("contents").
+    cJSON* contents = cJSON_GetObjectItem(root, "contents");
+    if (cJSON_IsArray(contents)) {
+        cJSON* content_item;
+        cJSON_ArrayForEach(content_item, contents) {
+            cJSON* role_json = cJSON_GetObjectItem(content_item, "role");
+            cJSON* parts_array = cJSON_GetObjectItem(content_item, "parts");
+            if (!cJSON_IsString(role_json) || !cJSON_IsArray(parts_array)) continue;
+
+            int num_parts = cJSON_GetArraySize(parts_array);
+            Part* loaded_parts = calloc(num_parts, sizeof(Part)); // Use calloc for zero-initialization
+            if (!loaded_parts) continue;
+
+            cJSON* part_item;
+            int part_idx = 0;
+            cJSON_ArrayForEach(part_item, parts_array) {
+                if (part_idx >= num_parts) break; // Should not happen, but safe
+                cJSON* text_json = cJSON_GetObjectItem(part_item, "text");
+                cJSON* inline_data_json = cJSON_GetObjectItem(part_item, "inlineData");
+                cJSON* file_data_json = cJSON_GetObjectItem(part_item, "fileData");
+                cJSON* blob_ref_json = cJSON_GetObjectItem(part_item, "blobRef");
+
+                if (cJSON_IsString(text_json)) {
+                    loaded_parts[part_idx].type = PART_TYPE_TEXT;
+                    loaded_parts[part_idx].text = strdup(text_json->valuestring);
+                } else if (file_data_json) {
+                    cJSON* uri_json = cJSON_GetObjectItem(file_data_json, "fileUri");
+                    cJSON* mime_json = cJSON_GetObjectItem(file_data_json, "mimeType");
+                    cJSON* hash_json = cJSON_GetObjectItem(blob_ref_json, "sha256");
+                    if (cJSON_IsString(uri_json) && cJSON_IsString(mime_json)) {
+                        loaded_parts[part_idx].type = PART_TYPE_URI;
+                        loaded_parts[part_idx].uri = strdup(uri_json->valuestring);
+                        loaded_parts[part_idx].mime_type = strdup(mime_json->valuestring);
+                        // An uploaded file keeps its data, to upload it again once it expired.
+                        if (cJSON_IsString(hash_json)) {
+                            loaded_parts[part_idx].blob = blob_store_open(&state->blob_store, hash_json->valuestring);
+                        }
+                    }
+                } else if (inline_data_json) {
+                    cJSON* mime_json = cJSON_GetObjectItem(inline_data_json, "mimeType");
+                    cJSON* data_json = cJSON_GetObjectItem(inline_data_json, "data");
+                    if (cJSON_IsString(mime_json) && cJSON_IsString(data_json)) {
+                        loaded_parts[part_idx].type = PART_TYPE_FILE;
+                        loaded_parts[part_idx].mime_type = strdup(mime_json->valuestring);
+                        // Kept decoded, a quarter smaller and sent like a fresh attachment.
+                        Blob* blob = blob_from_base64(data_json->valuestring);
+                        loaded_parts[part_idx].blob = blob ? blob_store_intern(&state->blob_store, blob) : NULL;
+                        if (!loaded_parts[part_idx].blob) {
+                            loaded_parts[part_idx].base64_data = strdup(data_json->valuestring);
+                        }
+                    }
+                } else if (blob_ref_json) {
+                    cJSON* mime_json = cJSON_GetObjectItem(blob_ref_json, "mimeType");
+                    cJSON* hash_json = cJSON_GetObjectItem(blob_ref_json, "sha256");
+                    if (cJSON_IsString(mime_json) && cJSON_IsString(hash_json)) {
+                        Blob* blob = blob_store_open(&state->blob_store, hash_json->valuestring);
+                        if (blob) {
+                            loaded_parts[part_idx].type = PART_TYPE_FILE;
+                            loaded_parts[part_idx].mime_type = strdup(mime_json->valuestring);
+                            loaded_parts[part_idx].blob = blob;
+                        } else {
+                            // Keep the message, so the conversation still alternates.
+                            fprintf(stderr, "Warning: Attachment %.12s (%s) is missing from the blob store and was left out.\n",
+                                    hash_json->valuestring, mime_json->valuestring);
+                            char note[160];
+                            snprintf(note, sizeof(note), "[Attachment %.12s (%s) is no longer available]", hash_json->valuestring, mime_json->valuestring);
+                            loaded_parts[part_idx].type = PART_TYPE_TEXT;
+                            loaded_parts[part_idx].text = strdup(note);
+                        }
+                    }
+                }
+                part_idx++;
+            }
+            add_content_to_history(&state->history, role_json->valuestring, loaded_parts, num_parts);
+
+            // Free the temporary parts structure.
+            for (int i = 0; i < num_parts; i++) {
+                if (loaded_parts[i].text) free(loaded_parts[i].text);
+                if (loaded_parts[i].mime_type) free(loaded_parts[i].mime_type);
+                if (loaded_parts[i].base64_data) free(loaded_parts[i].base64_data);
+                if (loaded_parts[i].uri) free(loaded_parts[i].uri);
+                blob_release(loaded_parts[i].blob);
+            }
+            free(loaded_parts);
+        }
+    }
+
+    // 3. Load the system prompt.
+    cJSON* sys_instruction = cJSON_GetObjectItem(root, "systemInstruction");
+    if (sys_instruction) {
+        cJSON* parts_array = cJSON_GetObjectItem(sys_instruction, "parts");
+        if (cJSON_IsArray(parts_array)) {
+            cJSON* part_item = cJSON_GetArrayItem(parts_array, 0);
+            if (part_item) {
+                cJSON* text_item = cJSON_GetObjectItem(part_item, "text");
+                if (cJSON_IsString(text_item)) {
+                    if (state->system_prompt) free(state->system_prompt);
+                    state->system_prompt = strdup(text_item->valuestring);
+                }
+            }
+        }
+    }
+
+    cJSON_Delete(root);
+    fprintf(stderr, "Conversation history loaded from %s\n", filepath);
+}
+
+/**
+ * @brief Adds a new content block (a user or model turn) to the conversation history.
+ * @details This function appends a new `Content` struct to the history array.
+ *          It performs a deep copy of the role string and all the `Part` structs
+ *          provided, ensuring that the history owns its own memory. Attachment
+ *          data held in a blob is shared rather than copied.
+ * @param history A pointer to the History struct to be modified.
+ * @param role The role for this turn, either "user" or "model".
+ * @param parts An array of Part structs that make up this turn's content.
+ * @param num_parts The number of parts in the `parts` array.
+ */
+void add_content_to_history(History* history, const char* role, Part* parts, int num_parts) {
+    // Expand the contents array to make room for the new entry.
+    Content* new_contents = realloc(history->contents, sizeof(Content) * (history->num_contents + 1));
+    if (!new_contents) {
+        fprintf(stderr, "Error: realloc failed when adding to history.\n");
+        return;
+    }
+    history->contents = new_contents;
+
+    // Get a pointer to the new content block at the end of the array.
+    Content* new_content = &history->contents[history->num_contents];
+    new_content->role = strdup(role);
+    new_content->num_parts = num_parts;
+    new_content->parts = calloc(num_parts, sizeof(Part));
+    new_content->json = NULL;
+    new_content->json_length = 0;
+    new_content->deflated = NULL;
+    new_content->deflated_length = 0;
+    new_content->splices = NULL;
+    new_content->num_splices = 0;
+    new_content->full_length = 0;
+
+    if (!new_content->parts || !new_content->role) {
+        fprintf(stderr, "Error: malloc failed for new history content.\n");
+        // Attempt to roll back the realloc if allocation fails here.
+        if (new_content->role) free(new_content->role);
+        if (new_content->parts) free(new_content->parts);
+        history->contents = realloc(history->contents, sizeof(Content) * history->num_contents);
+        return;
+    }
+
+    // Perform a deep copy of each part from the input array into the history.
+    for (int i = 0; i < num_parts; i++) {
+        new_content->parts[i].type = parts[i].type;
+        if (parts[i].type == PART_TYPE_TEXT) {
+            new_content->parts[i].text = parts[i].text ? strdup(parts[i].text) : NULL;
+            new_content->parts[i].mime_type = NULL;
+            new_content->parts[i].base64_data = NULL;
+            new_content->parts[i].filename = NULL;
+        } else if (parts[i].type == PART_TYPE_URI) {
+            new_content->parts[i].text = NULL;
+            new_content->parts[i].mime_type = parts[i].mime_type ? strdup(parts[i].mime_type) : NULL;
+            new_content->parts[i].base64_data = NULL;
+            new_content->parts[i].filename = parts[i].filename ? strdup(parts[i].filename) : NULL;
+            new_content->parts[i].uri = parts[i].uri ? strdup(parts[i].uri) : NULL;
+            new_content->parts[i].blob = blob_retain(parts[i].blob);
+        } else { // PART_TYPE_FILE
+            new_content->parts[i].text = NULL;
+            new_content->parts[i].mime_type = parts[i].mime_type ? strdup(parts[i].mime_type) : NULL;
+            new_content->parts[i].base64_data = parts[i].base64_data ? strdup(parts[i].base64_data) : NULL;
+            new_content->parts[i].filename = parts[i].filename ? strdup(parts[i].filename) : NULL;
+            new_content->parts[i].blob = blob_retain(parts[i].blob); // Shared, not copied.
+        }
+    }
+    history->num_contents++;
+}
+
+/**
+ * @brief Frees all memory associated with a single Content struct.
+ * @details This is a helper function for cleaning up history. It deallocates the
+ *          memory for the role string and for each individual part within the
+ *          content block, including text, MIME types, Base64 data, and filenames,
+ *          and drops its references to attachment blobs.
+ * @param content A pointer to the Content struct to be freed.
+ */
+void free_content(Content* content) {
+    if (!content) return;
+
+    // Free the role string (e.g., "user", "model").
+    if (content->role) free(content->role);
+
+    // Free the data within each part of the content.
+    if (content->parts) {
+        for (int i = 0; i < content->num_parts; i++) {
+            if (content->parts[i].text) free(content->parts[i].text);
+            if (content->parts[i].mime_type) free(content->parts[i].mime_type);
+            if (content->parts[i].base64_data) free(content->parts[i].base64_data);
+            if (content->parts[i].filename) free(content->parts[i].filename);
+            if (content->parts[i].uri) free(content->parts[i].uri);
+            blob_release(content->parts[i].blob);
+        }
+        // Free the array of parts itself.
+        free(content->parts);
+    }
+    content_invalidate_cache(content);
+}
+
+/**
+ * @brief Frees all memory used by pending attachments.
+ * @details This function is called to clear the list of attachments that have
+ *          been prepared but not yet sent with a prompt. It iterates through the
+ *          `attached_parts` array and frees all dynamically allocated fields.
+ * @param state A pointer to the AppState containing the attachments to clear.
+ */
+void free_pending_attachments(AppState* state) {
+    for (int i = 0; i < state->num_attached_parts; i++) {
+        // Free all possible dynamically allocated fields for each pending part.
+        if (state->attached_parts[i].text) free(state->attached_parts[i].text);
+        if (state->attached_parts[i].filename) free(state->attached_parts[i].filename);
+        if (state->attached_parts[i].mime_type) free(state->attached_parts[i].mime_type);
+        if (state->attached_parts[i].base64_data) free(state->attached_parts[i].base64_data);
+        if (state->attached_parts[i].uri) free(state->attached_parts[i].uri);
+        blob_release(state->attached_parts[i].blob);
+    }
+    // Reset the counter to zero, effectively clearing the list.
+    state->num_attached_parts = 0;
+}
+
+/**
+ * @brief Frees all memory associated with the entire conversation history.
+ * @details This function iterates through every content block in the history,
+ *          calling `free_content` on each one to perform a deep clean. Finally,
+ *          it frees the top-level `contents` array itself and resets the history.
+ * @param history A pointer to the History struct to be completely freed.
+ */
+void free_history(History* history) {
+    if (!history) return;
+
+    // Free each content block in the history array.
+    for (int i = 0; i < history->num_contents; i++) {
+        free_content(&history->contents[i]);
+    }
+
+    // Free the array of content blocks itself.
+    if (history->contents) {
+        free(history->contents);
+    }
+
+    // Reset the history to a clean, empty state.
+    history->contents = NULL;
+    history->num_contents = 0;
+}
+
+/**
+ * @brief Compresses data using the Gzip algorithm.
+ * @details This function takes a buffer of input data and compresses it using
+ *          zlib's deflate functionality with Gzip headers. This is used to
+ *          reduce the size of the JSON payload sent to the Gemini API, which can
+ *          improve network performance for large requests.
+ * @param input_data A pointer to the raw data to be compressed.
+ * @param input_size The size of the input data in bytes.
+ * @return A GzipResult struct containing a pointer to the compressed data and
+ *         its size. The `data` field will be NULL on failure. The caller is
+ *         responsible for freeing the `data` buffer.
+ */
+GzipResult gzip_compress(const unsigned char* input_data, size_t input_size) {
+    GzipResult result = { .data = NULL, .size = 0 };
+    z_stream strm = {0};
+
+    // Initialize the zlib stream for Gzip compression.
+    // 15 + 16 enables Gzip headers.
+    if (deflateInit2(&strm, Z_BEST_COMPRESSION, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+        return result; // Return empty result on failure.
+    }
+
+    strm.avail_in = input_size;
+    strm.next_in = (Bytef*)input_data;
+
+    unsigned char out_chunk[GZIP_CHUNK_SIZE];
+
+    // Compress the data in chunks until all input is processed.
+    do {
+        strm.avail_out = GZIP_CHUNK_SIZE;
+        strm.next_out = out_chunk;
+
+        // Perform the compression. Z_FINISH tells zlib that this is the last chunk.
+        int ret = deflate(&strm, Z_FINISH);
+        if (ret != Z_STREAM_END && ret != Z_OK) {
+            deflateEnd(&strm);
+            if (result.data) free(result.data);
+            return (GzipResult){NULL, 0}; // Return empty result on failure.
+        }
+
+        // Calculate how much compressed data was produced in this chunk.
+        size_t have = GZIP_CHUNK_SIZE - strm.avail_out;
+        if (have > 0) {
+            // Expand the result buffer and append the new compressed data.
+            unsigned char* new_data = realloc(result.data, result.size + have);
+            if (!new_data) {
+                deflateEnd(&strm);
+                if (result.data) free(result.data);
+                return (GzipResult){NULL, 0}; // Return empty result on failure.
+            }
+            result.data = new_data;
+            memcpy(result.data + result.size, out_chunk, have);
+            result.size += have;
+        }
+    } while (strm.avail_out == 0); // Continue if the output chunk was filled completely.
+
+    // Clean up the zlib stream.
+    deflateEnd(&strm);
+    return result;
+}
+
+/**
+ * @brief Returns the time of a monotonic clock in milliseconds, for benchmarks.
+ */
+static double benchmark_clock_ms(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000.0 + now.tv_nsec / 1000000.0;
+}
+
+/**
+ * @brief Loads the input of a benchmark, or makes up a sample when no file is given.
+ * @details The sample mimics a session with large attachments: three quarters
+ *          log text, one quarter base64 of random bytes.
+ * @param filepath The file to load, or NULL.
+ * @param[out] length_out Receives the size of the data.
+ * @return The data, which the caller frees, or NULL on failure.
+ */
+static unsigned char* benchmark_load_input(const char* filepath, size_t* length_out) {
+    if (filepath) {
+        FILE* file = fopen(filepath, "rb");
+        if (!file) {
+            fprintf(stderr, "Error: Cannot open '%s': %s\n", filepath, strerror(errno));
+            return NULL;
+        }
+        fseek(file, 0, SEEK_END);
+        long size = ftell(file);
+        fseek(file, 0, SEEK_SET);
+        unsigned char* data = size >= 0 ? malloc(size > 0 ? size : 1) : NULL;
+        if (!data || fread(data, 1, size, file) != (size_t)size) {
+            fprintf(stderr, "Error: Cannot read '%s'.\n", filepath);
+            free(data);
+            fclose(file);
+            return NULL;
+        }
+        fclose(file);
+        *length_out = size;
+        return data;
+    }
+
+    size_t text_length = 24 * 1024 * 1024;
+    size_t media_bytes = 6 * 1024 * 1024;
+    unsigned char* random = malloc(media_bytes);
+    unsigned char* data = malloc(text_length + media_bytes * 4 / 3 + 4096);
+    if (!random || !data) {
+        free(random);
+        free(data);
+        return NULL;
+    }
+    static const char* levels[] = { "INFO", "DEBUG", "WARN", "ERROR" };
+    uint32_t rng = 0x9e3779b9u;
+    size_t length = 0;
+    while (length < text_length) {
+        rng ^= rng << 13; rng ^= rng >> 17; rng ^= rng << 5;
+        length += snprintf((char*)data + length, 200, "2025-06-%02u 12:%02u:%02u %s worker-%u processed request %u in %u ms\n",
+                           1 + rng % 28, rng % 60, (rng >> 8) % 60, levels[(rng >> 3) % 4], (rng >> 12) % 16, rng >> 4, (rng >> 20) % 900);
+    }
+    for (size_t i = 0; i < media_bytes; i++) {
+        rng ^= rng << 13; rng ^= rng >> 17; rng ^= rng << 5;
+        random[i] = (unsigned char)rng;
+    }
+    char* media = base64_encode(random, media_bytes);
+    free(random);
+    if (!media) {
+        free(data);
+        return NULL;
+    }
+    size_t media_length = strlen(media);
+    memcpy(data + length, media, media_length);
+    free(media);
+    *length_out = length + media_length;
+    return data;
+}
+
+/**
+ * @brief Checks that a gzip stream decompresses to the original data.
+ */
+static bool benchmark_gzip_verify(const GzipResult* gz, const unsigned char* data, size_t length) {
+    z_stream stream;
+    memset(&stream, 0, sizeof(stream));
+    if (inflateInit2(&stream, 15 + 16) != Z_OK) return false;
+    unsigned char* out = malloc(length + 1);
+    bool ok = out != NULL;
+    if (ok) {
+        stream.next_in = gz->data;
+        stream.avail_in = (uInt)gz->size;
+        stream.next_out = out;
+        stream.avail_out = (uInt)(length + 1);
+        ok = inflate(&stream, Z_FINISH) == Z_STREAM_END && stream.total_out == length && memcmp(out, data, length) == 0;
+    }
+    inflateEnd(&stream);
+    free(out);
+    return ok;
+}
+
+/**
+ * @brief Compares `gzip_compress` with the parallel compressor used for large segments.
+ * @details Both produce a complete gzip stream at level 9: the parallel one is
+ *          framed the way `request_body_build` frames segments. Every result is
+ *          decompressed and compared with the input.
+ * @param filepath The file to compress, or NULL for a generated sample.
+ * @return The process exit status.
+ */
+static int benchmark_gzip(const char* filepath) {
+    size_t length = 0;
+    unsigned char* data = benchmark_load_input(filepath, &length);
+    if (!data) return 1;
+    if (length == 0) {
+        fprintf(stderr, "Error: Nothing to compress in '%s'.\n", filepath);
+        free(data);
+        return 1;
+    }
+    int cores = compress_threads();
+    fprintf(stdout, "Benchmark gzip: %.1f MB of %s, %d threads available\n", length / 1048576.0,
+            filepath ? filepath : "sample data (3/4 log text, 1/4 base64 media)", cores);
+
+    double start = benchmark_clock_ms();
+    GzipResult baseline = gzip_compress(data, length);
+    double elapsed = benchmark_clock_ms() - start;
+    bool ok = baseline.data && benchmark_gzip_verify(&baseline, data, length);
+    fprintf(stdout, "  %-32s %8.0f ms %8.1f MB/s  ratio %.4f  %s\n", "gzip_compress", elapsed,
+            length / 1048576.0 / (elapsed / 1000.0), baseline.size / (double)length, ok ? "verified" : "FAILED");
+    free(baseline.data);
+    int status = ok ? 0 : 1;
+
+    uLong crc = crc32_z(0L, data, length);
+    for (int threads = 1; threads <= cores; threads = threads * 2 > cores && threads < cores ? cores : threads * 2) {
+        size_t segment_length = 0;
+        start = benchmark_clock_ms();
+        unsigned char* segment = deflate_segment_parallel(data, length, Z_BEST_COMPRESSION, threads, &segment_length);
+        GzipResult gz = { .data = segment ? malloc(segment_length + 20) : NULL, .size = 0 };
+        if (gz.data) {
+            static const unsigned char gzip_header[10] = { 0x1f, 0x8b, 8, 0, 0, 0, 0, 0, 0, 3 };
+            memcpy(gz.data, gzip_header, sizeof(gzip_header));
+            memcpy(gz.data + 10, segment, segment_length);
+            unsigned char* trailer = gz.data + 10 + segment_length;
+            trailer[0] = 0x03;
+            trailer[1] = 0x00;
+            for (int i = 0; i < 4; i++) {
+                trailer[2 + i] = (unsigned char)(crc >> (8 * i));
+                trailer[6 + i] = (unsigned char)((uint64_t)length >> (8 * i));
+            }
+            gz.size = segment_length + 20;
+        }
+        elapsed = benchmark_clock_ms() - start;
+        free(segment);
+        ok = gz.data && benchmark_gzip_verify(&gz, data, length);
+        char label[64];
+        snprintf(label, sizeof(label), "parallel, %d thread%s", threads, threads == 1 ? "" : "s");
+        fprintf(stdout, "  %-32s %8.0f ms %8.1f MB/s  ratio %.4f  %s\n", label, elapsed,
+                length / 1048576.0 / (elapsed / 1000.0), gz.size / (double)length, ok ? "verified" : "FAILED");
+        free(gz.data);
+        if (!ok) status = 1;
+    }
+    free(data);
+    return status;
+}
+
+/**
+ * @brief Runs a built-in benchmark for `--benchmark`.
+ * @param name The benchmark to run.
+ * @param filepath Its input file, or NULL for generated data.
+ * @return The process exit status.
+ */
+int run_benchmark(const char* name, const char* filepath) {
+    if (STRCASECMP(name, "gzip") == 0) return benchmark_gzip(filepath);
+    if (STRCASECMP(name, "base64") == 0) return benchmark_base64(filepath);
+    fprintf(stderr, "Error: Unknown benchmark '%s'. Available: gzip, base64\n", name);
+    return 1;
+}
+
+/**
+ * @brief Validates a file path to ensure it is safe.
+ * @details This is a security function that checks for common path traversal
+ *          patterns. It rejects any path that contains ".." and also rejects
+ *          absolute paths, ensuring that file operations are restricted to the
+ *          current working directory and its subdirectories.
+ * @param path The file path string to validate.
+ * @return Returns true if the path is deemed safe, and false otherwise.
+ */
+bool is_path_safe(const char* path) {
+    if (path == NULL || path[0] == '\0') {
+        return false;
+    }
+
+    // Reject paths containing ".." to prevent directory traversal attacks.
+    if (strstr(path, "..")) {
+        return false;
+    }
+
+    // Reject absolute paths.
+
+    if (path[0] == '/') {
+        return false;
+    }
+
+    return true;
+}
+
+/**
+ * @brief Checks if a string is a recognizable YouTube URL.
+ * @param url The string to check.
+ * @return True if it's a YouTube URL, false otherwise.
+ */
+bool is_youtube_url(const char* url) {
+    if (url == NULL) return false;
+    // Check for the two common YouTube URL formats.
+    return (strstr(url, "youtube.com/watch") != NULL || strstr(url, "youtu.be/") != NULL);
+}
+
+/**
+ * @brief Scans a prompt for YouTube URLs, attaches them, and returns a new prompt string.
+ * @details This function takes a string, creates a modifiable copy, and iterates
+ *          through it to find and process YouTube URLs. For each URL found, it
+ *          uses the existing attachment handler and then removes the URL from the
+ *          string. This function correctly handles multiple URLs in a single prompt.
+ * @param original_prompt The user's raw input string.
+ * @param state A pointer to the application state to add attachments to.
+ * @return A new, dynamically allocated string containing the prompt with all
+ *         YouTube URLs stripped out. The caller is responsible for freeing this memory.
+ *         This new string is a distinct allocation from the original_prompt.
+ */
+char* process_and_strip_urls(const char* original_prompt, AppState* state) {
+    // Start with a mutable copy of the original prompt.
+    char* processed_prompt = strdup(original_prompt);
+    if (!processed_prompt) return NULL; // Should not happen
+
+    bool url_was_found_and_removed;
+    do {
+        url_was_found_and_removed = false;
+        char* search_start = processed_prompt;
+
+        // Find the beginning of a URL.
+        char* url_start = strstr(search_start, "https://");
+        if (!url_start) {
+            url_start = strstr(search_start, "http://");
+        }
+
+        if (url_start) {
+            // Find the end of the URL (a space or the end of the string).
+            char* url_end = url_start;
+            while (*url_end != '\0' && !isspace((unsigned char)*url_end)) {
+                url_end++;
+            }
+
+            // Temporarily null-terminate the URL to treat it as a separate string.
+            char original_char = *url_end;
+            *url_end = '\0';
+
+            // Check if this substring is a valid YouTube URL.
+            if (is_youtube_url(url_start)) {
+                // Attach the URL using the existing handler.
+                handle_attachment_from_stream(NULL, url_start, "video/*", state);
+
+                // Use the existing str_replace helper to remove the URL.
+                // We pass an empty string "" as the replacement.
+                char* temp_prompt = str_replace(processed_prompt, url_start, "");
+
+                // Free the old processed_prompt and point to the new one.
+                free(processed_prompt);
+                processed_prompt = temp_prompt;
+
+                // Set flag to true so the `do-while` loop runs again,
+                // allowing us to find multiple URLs in the same prompt.
+                url_was_found_and_removed = true;
+            }
+
+            // Restore the original character if we modified the string.
+             *url_end = original_char;
+        }
+    } while (url_was_found_and_removed);
+
+    return processed_prompt;
+}
 
-    // Ensure all string buffers are properly null-terminated.
-    state->model_name[sizeof(state->model_name) - 1] = '\0';
-    state->current_session_name[sizeof(state->current_session_name) - 1] = '\0';
-    state->origin[sizeof(state->origin) - 1] = '\0';
+/**
+ * @brief Computes the SHA-256 digest of a buffer.
+ * @details Attachments are held in the blob store by this digest, and those
+ *          uploaded through the Files API are cached by it, so the same
+ *          content is kept and uploaded only once.
+ * @param data The bytes to hash.
+ * @param size The number of bytes.
+ * @param digest Receives the 32-byte digest.
+ */
+static void sha256_digest(const unsigned char* data, size_t size, unsigned char digest[32]) {
+    static const uint32_t k[64] = {
+        0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+        0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+        0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+        0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+        0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+        0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+        0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+        0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+    };
+    uint32_t h[8] = { 0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19 };
+    uint64_t bit_length = (uint64_t)size * 8;
+    // Full blocks are read in place; only the padded tail (one or two blocks) is copied.
+    size_t full_blocks = size / 64;
+    unsigned char tail[128];
+    size_t tail_size = size % 64;
+    memset(tail, 0, sizeof(tail));
+    if (tail_size > 0) memcpy(tail, data + full_blocks * 64, tail_size);
+    tail[tail_size] = 0x80;
+    size_t tail_blocks = tail_size + 9 > 64 ? 2 : 1;
+    for (int i = 0; i < 8; i++) tail[tail_blocks * 64 - 1 - i] = (unsigned char)(bit_length >> (8 * i));
+
+    #define SHA256_ROTR(x, n) ((x) >> (n) | (x) << (32 - (n)))
+    for (size_t n = 0; n < full_blocks + tail_blocks; n++) {
+        const unsigned char* block = n < full_blocks ? data + n * 64 : tail + (n - full_blocks) * 64;
+        uint32_t w[64];
+        for (int i = 0; i < 16; i++) {
+            w[i] = (uint32_t)block[4 * i] << 24 | (uint32_t)block[4 * i + 1] << 16 | (uint32_t)block[4 * i + 2] << 8 | block[4 * i + 3];
+        }
+        for (int i = 16; i < 64; i++) {
+            uint32_t s0 = SHA256_ROTR(w[i - 15], 7) ^ SHA256_ROTR(w[i - 15], 18) ^ (w[i - 15] >> 3);
+            uint32_t s1 = SHA256_ROTR(w[i - 2], 17) ^ SHA256_ROTR(w[i - 2], 19) ^ (w[i - 2] >> 10);
+            w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+        }
+        uint32_t a = h[0], b = h[1], c = h[2], d = h[3], e = h[4], f = h[5], g = h[6], hh = h[7];
+        for (int i = 0; i < 64; i++) {
+            uint32_t s1 = SHA256_ROTR(e, 6) ^ SHA256_ROTR(e, 11) ^ SHA256_ROTR(e, 25);
+            uint32_t ch = (e & f) ^ (~e & g);
+            uint32_t temp1 = hh + s1 + ch + k[i] + w[i];
+            uint32_t s0 = SHA256_ROTR(a, 2) ^ SHA256_ROTR(a, 13) ^ SHA256_ROTR(a, 22);
+            uint32_t maj = (a & b) ^ (a & c) ^ (b & c);
+            uint32_t temp2 = s0 + maj;
+            hh = g;
+            g = f;
+            f = e;
+            e = d + temp1;
+            d = c;
+            c = b;
+            b = a;
+            a = temp1 + temp2;
+        }
+        h[0] += a; h[1] += b; h[2] += c; h[3] += d; h[4] += e; h[5] += f; h[6] += g; h[7] += hh;
+    }
+    #undef SHA256_ROTR
 
-    state->api_keys = NULL;
-    state->origins = NULL;
-    
-    state->num_api_keys = 0;
-    state->next_key_index = 0;
-    
-    // Ensure pointers are initialized to NULL.
-    state->last_free_response_part = NULL;
-    state->last_model_response = NULL;
-    state->system_prompt = NULL;
-    state->final_code = NULL;
-    
-    state->loc_tile = 0;
+    for (int i = 0; i < 8; i++) {
+        digest[4 * i] = (unsigned char)(h[i] >> 24);
+        digest[4 * i + 1] = (unsigned char)(h[i] >> 16);
+        digest[4 * i + 2] = (unsigned char)(h[i] >> 8);
+        digest[4 * i + 3] = (unsigned char)h[i];
+    }
+}
 
-    state->safety = 0;
+/**
+ * @brief The response headers of a Files API upload call that matter.
+ */
+typedef struct {
+    char upload_url[2048];
+    char status[32];               // X-Goog-Upload-Status: active, final or cancelled.
+    long long size_received;       // -1 if the header was absent.
+    long long granularity;         // Chunk sizes must be a multiple of this; 0 if absent.
+} UploadHeaders;
 
-    state->loc_gathered = false;
-    
-    state->save_session_path = NULL;
-    
-    state->host = strdup("generativelanguage.googleapis.com");
-    
-    state->media_resolution = NULL;
+/**
+ * @brief libcurl header callback that picks out the X-Goog-Upload-* headers.
+ */
+static size_t files_header_callback(char* buffer, size_t size, size_t nitems, void* userdata) {
+    UploadHeaders* headers = userdata;
+    size_t length = size * nitems;
+    char line[2200];
+    size_t copy = length < sizeof(line) - 1 ? length : sizeof(line) - 1;
+    memcpy(line, buffer, copy);
+    line[copy] = '\0';
+    line[strcspn(line, "\r\n")] = '\0';
+
+    char* colon = strchr(line, ':');
+    if (!colon) return length;
+    *colon = '\0';
+    const char* value = colon + 1;
+    while (*value == ' ') value++;
+    if (STRCASECMP(line, "x-goog-upload-url") == 0) {
+        snprintf(headers->upload_url, sizeof(headers->upload_url), "%s", value);
+    } else if (STRCASECMP(line, "x-goog-upload-status") == 0) {
+        snprintf(headers->status, sizeof(headers->status), "%s", value);
+    } else if (STRCASECMP(line, "x-goog-upload-size-received") == 0) {
+        headers->size_received = atoll(value);
+    } else if (STRCASECMP(line, "x-goog-upload-chunk-granularity") == 0) {
+        headers->granularity = atoll(value);
+    }
+    return length;
 }
 
 /**
- * @brief Resets the current session to a clean state.
- * @details This function is invoked by the `/clear` or `/session new` command.
- *          It clears the entire conversation history, frees the last model
- *          response, removes any system prompt, clears all pending file
- *          attachments, and resets the session name to "[unsaved]". This allows
- *          the user to start a completely new conversation without restarting
- *          the program.
- * @param state A pointer to the AppState struct to be cleared.
+ * @brief Makes one call of the Files API.
+ * @param state The current application state, used for the proxy.
+ * @param key_index The API key (and matching origin) to authenticate with.
+ * @param url The full URL.
+ * @param extra_headers Headers to add, or NULL; the list is freed.
+ * @param body The request body, or NULL for a GET.
+ * @param body_length The size of the body.
+ * @param[out] headers_out Receives the upload headers of the response.
+ * @param[out] response Receives the response body.
+ * @return The HTTP status, or a negative CURLcode for transport errors.
  */
-void clear_session_state(AppState* state) {
-    // Deallocate all memory associated with the conversation history.
-    free_history(&state->history);
+static long files_api_call(AppState* state, int key_index, const char* url, struct curl_slist* extra_headers, const void* body, size_t body_length, UploadHeaders* headers_out, MemoryStruct* response) {
+    memset(headers_out, 0, sizeof(*headers_out));
+    headers_out->size_received = -1;
+    response->size = 0;
+    if (response->buffer) response->buffer[0] = '\0';
 
-    // Free the buffers holding the last responses from both API modes.
-    if (state->last_model_response) {
-        free(state->last_model_response);
-        state->last_model_response = NULL;
+    CURL* curl = transport_acquire(&state->transport);
+    if (!curl) {
+        curl_slist_free_all(extra_headers);
+        return -CURLE_FAILED_INIT;
     }
-    if (state->last_free_response_part) {
-        free(state->last_free_response_part);
-        state->last_free_response_part = NULL;
+    char auth_header[256];
+    snprintf(auth_header, sizeof(auth_header), "x-goog-api-key: %s", state->api_keys[key_index]);
+    struct curl_slist* headers = curl_slist_append(extra_headers, auth_header);
+    if (strcmp(state->origins[key_index], "default") != 0) {
+        char origin_header[256];
+        snprintf(origin_header, sizeof(origin_header), "Origin: %s", state->origins[key_index]);
+        headers = curl_slist_append(headers, origin_header);
     }
+    headers = curl_slist_append(headers, "Expect:");
 
-    // Free the system prompt if it was set.
-    if (state->system_prompt) {
-        free(state->system_prompt);
-        state->system_prompt = NULL;
+    curl_easy_setopt(curl, CURLOPT_URL, url);
+    if (state->proxy[0] != '\0') {
+        curl_easy_setopt(curl, CURLOPT_PROXY, state->proxy);
     }
-
-    if (state->final_code) {
-        free(state->final_code);
-        state->final_code = NULL;
+    curl_easy_setopt(curl, CURLOPT_HTTPHEADER, headers);
+    if (body) {
+        curl_easy_setopt(curl, CURLOPT_POSTFIELDS, body);
+        curl_easy_setopt(curl, CURLOPT_POSTFIELDSIZE_LARGE, (curl_off_t)body_length);
     }
-    
-    // Clear any files that were attached but not yet sent with a prompt.
-    free_pending_attachments(state);
+    curl_easy_setopt(curl, CURLOPT_HEADERFUNCTION, files_header_callback);
+    curl_easy_setopt(curl, CURLOPT_HEADERDATA, headers_out);
+    curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, write_to_memory_struct_callback);
+    curl_easy_setopt(curl, CURLOPT_WRITEDATA, response);
 
-    // Reset the session name to its default.
-    strncpy(state->current_session_name, "[unsaved]", sizeof(state->current_session_name) - 1);
-    state->current_session_name[sizeof(state->current_session_name) - 1] = '\0';
+    long http_code = 0;
+    CURLcode res = transport_perform(&state->transport, curl, headers, &http_code);
+    if (res != CURLE_OK && http_code == 0) return -(long)res;
+    return http_code;
+}
 
-    fprintf(stderr, "New session started.\n");
+/**
+ * @brief Parses an RFC 3339 timestamp such as `2025-06-21T10:00:00.123Z` (UTC).
+ * @return The time, or 0 if it cannot be parsed.
+ */
+static time_t files_parse_time(const char* text) {
+    struct tm tm;
+    memset(&tm, 0, sizeof(tm));
+    if (!text || sscanf(text, "%d-%d-%dT%d:%d:%d", &tm.tm_year, &tm.tm_mon, &tm.tm_mday, &tm.tm_hour, &tm.tm_min, &tm.tm_sec) != 6) return 0;
+    tm.tm_year -= 1900;
+    tm.tm_mon -= 1;
+    return timegm(&tm);
 }
 
 /**
- * @brief Gets the path for the 'sessions' subdirectory, creating it if needed.
- * @details This function constructs the path to the directory where all named
- *          session files are stored. It builds upon the base application path
- *          (e.g., `~/.config/gemini-cli`) and appends the 'sessions' subdirectory
- *          name, creating it on the filesystem if it does not already exist.
- * @param buffer A character buffer to store the resulting path.
- * @param buffer_size The size of the buffer. The buffer will be empty on failure.
+ * @brief Looks up a still usable upload of some content in the upload cache.
+ * @details Entries are keyed by the SHA-256 of the content and the key that
+ *          uploaded it, since files belong to the project of that key. An
+ *          entry is usable until FILES_EXPIRY_MARGIN_SEC before it expires,
+ *          so that it does not expire in the middle of a conversation.
+ * @param id The cache key, `<sha256>-<key id>`.
+ * @param[out] uri_out Receives a copy of the file URI.
+ * @return true if a usable entry was found.
  */
-void get_sessions_path(char* buffer, size_t buffer_size) {
-    const char* sessions_dir_name = "sessions";
-    char base_app_path[PATH_MAX];
+static bool files_cache_lookup(const char* id, char** uri_out) {
+    cJSON* cache = NULL;
+    int fd = json_file_lock(FILES_CACHE_FILENAME, &cache);
+    if (fd < 0) return false;
+    const cJSON* entry = cJSON_GetObjectItem(cache, id);
+    const cJSON* uri = cJSON_GetObjectItem(entry, "uri");
+    const cJSON* expires = cJSON_GetObjectItem(entry, "expires");
+    bool found = cJSON_IsString(uri) && cJSON_IsNumber(expires) && expires->valuedouble > time(NULL) + FILES_EXPIRY_MARGIN_SEC;
+    if (found) *uri_out = strdup(uri->valuestring);
+    json_file_unlock(fd, cache, false);
+    return found && *uri_out;
+}
 
-    // First, get the main application data directory path.
-    get_base_app_path(base_app_path, sizeof(base_app_path));
-    if (base_app_path[0] == '\0') {
-        buffer[0] = '\0'; // Abort if the base path could not be determined.
-        return;
-    }
+/**
+ * @brief Finds the upload cache entry of a file URI.
+ * @param uri The URI of an uploaded file.
+ * @param[out] key_id_out Receives the `quota_key_id` of the key that uploaded it (17 bytes).
+ * @param[out] expires_out Receives when the file expires.
+ * @return false if the URI is not in the cache, such as a YouTube link or a
+ *         file uploaded on another machine.
+ */
+static bool files_cache_find_uri(const char* uri, char* key_id_out, time_t* expires_out) {
+    cJSON* cache = NULL;
+    int fd = json_file_lock(FILES_CACHE_FILENAME, &cache);
+    if (fd < 0) return false;
+    bool found = false;
+    const cJSON* entry;
+    cJSON_ArrayForEach(entry, cache) {
+        const cJSON* entry_uri = cJSON_GetObjectItem(entry, "uri");
+        const cJSON* expires = cJSON_GetObjectItem(entry, "expires");
+        const char* key_id = entry->string ? strchr(entry->string, '-') : NULL;
+        if (!cJSON_IsString(entry_uri) || strcmp(entry_uri->valuestring, uri) != 0 || !key_id) continue;
+        snprintf(key_id_out, 17, "%s", key_id + 1);
+        *expires_out = cJSON_IsNumber(expires) ? (time_t)expires->valuedouble : 0;
+        found = true;
+        break;
+    }
+    json_file_unlock(fd, cache, false);
+    return found;
+}
 
-    // Pre-calculate the required buffer size to prevent an overflow.
-    size_t required_size = strlen(base_app_path) + 1 /*separator*/ + strlen(sessions_dir_name) + 1 /*null*/;
-    if (required_size > buffer_size) {
-        fprintf(stderr, "Error: Resolved sessions path is too long.\n");
-        buffer[0] = '\0';
-        return;
+/**
+ * @brief Records an upload in the upload cache and drops expired entries.
+ */
+static void files_cache_store(const char* id, const char* name, const char* uri, const char* mime_type, time_t expires) {
+    cJSON* cache = NULL;
+    int fd = json_file_lock(FILES_CACHE_FILENAME, &cache);
+    if (fd < 0) return;
+    time_t now = time(NULL);
+    cJSON* entry = cache->child;
+    while (entry) {
+        cJSON* next = entry->next;
+        const cJSON* entry_expires = cJSON_GetObjectItem(entry, "expires");
+        if (!cJSON_IsNumber(entry_expires) || entry_expires->valuedouble <= now) {
+            cJSON_Delete(cJSON_DetachItemViaPointer(cache, entry));
+        }
+        entry = next;
     }
+    cJSON_DeleteItemFromObject(cache, id);
+    entry = cJSON_AddObjectToObject(cache, id);
+    cJSON_AddStringToObject(entry, "name", name);
+    cJSON_AddStringToObject(entry, "uri", uri);
+    cJSON_AddStringToObject(entry, "mime_type", mime_type);
+    cJSON_AddNumberToObject(entry, "expires", (double)expires);
+    if (!json_file_unlock(fd, cache, true)) {
+        fprintf(stderr, "Warning: Could not update the upload cache.\n");
+    }
+}
 
-    // Safely construct the final, full path.
-    snprintf(buffer, buffer_size, "%s/%s", base_app_path, sessions_dir_name);
-
-    // Create the sessions directory if it doesn't already exist.
-    MKDIR(buffer);
+/**
+ * @brief Waits until an uploaded file has been processed by the server.
+ * @details Videos and some documents are in the PROCESSING state for a while
+ *          after the upload and cannot be used in a prompt before they are
+ *          ACTIVE.
+ * @return true once the file is ACTIVE.
+ */
+static bool files_api_wait_active(AppState* state, int key_index, const char* name) {
+    char url[512];
+    snprintf(url, sizeof(url), "https://%s/v1beta/%s", state->host, name);
+    MemoryStruct response = { .buffer = malloc(1), .size = 0 };
+    bool active = false;
+    time_t deadline = time(NULL) + FILES_PROCESSING_TIMEOUT_SEC;
+    fprintf(stderr, "[Waiting for the server to process %s]\n", name);
+    while (time(NULL) < deadline) {
+        if (!retry_sleep(state, FILES_POLL_INTERVAL_MS)) break;
+        UploadHeaders headers;
+        long http_code = files_api_call(state, key_index, url, NULL, NULL, 0, &headers, &response);
+        if (http_code != 200) continue;
+        cJSON* file = cJSON_Parse(response.buffer);
+        const cJSON* file_state = cJSON_GetObjectItem(file, "state");
+        bool done = !cJSON_IsString(file_state) || strcmp(file_state->valuestring, "PROCESSING") != 0;
+        active = done && (!cJSON_IsString(file_state) || strcmp(file_state->valuestring, "ACTIVE") == 0);
+        cJSON_Delete(file);
+        if (done) break;
+    }
+    free(response.buffer);
+    return active;
 }
 
 /**
- * @brief Validates a session name to ensure it is safe for use as a filename.
- * @details This is a security function designed to prevent path traversal
- *          attacks. It checks that the user-provided session name does not
- *          contain any characters that could be used to navigate the filesystem
- *          (e.g., '/', '\', '.').
- * @param name The session name string to validate.
- * @return Returns true if the name is safe, and false otherwise. A specific
- *         error message is printed to stderr if the name is found to be unsafe.
+ * @brief Uploads an attachment through the resumable Files API.
+ * @details The upload is started with a small JSON request that returns the
+ *          session URL, then the data is sent in FILES_CHUNK_SIZE chunks
+ *          (rounded to the granularity the server asks for), the last one
+ *          finalizing the upload. When a chunk fails and the shared retry
+ *          policy allows another attempt, the server is asked how much it has
+ *          received and the upload resumes from there instead of starting
+ *          over. The chunks of a mapped blob are read through its descriptor
+ *          (see `blob_pread`), so a file that shrinks meanwhile fails the
+ *          upload rather than the program.
+ * @param state The current application state.
+ * @param key_index The key to upload with.
+ * @param blob The content.
+ * @param mime_type Its MIME type.
+ * @param display_name The name shown in the Files API.
+ * @param[out] file_out Receives the `file` resource of the finished upload.
+ * @return true on success.
  */
-bool is_session_name_safe(const char* name) {
-    if (name == NULL || name[0] == '\0') {
+static bool files_api_upload(AppState* state, int key_index, const Blob* blob, const char* mime_type, const char* display_name, cJSON** file_out) {
+    *file_out = NULL;
+    size_t length = blob->size;
+    MemoryStruct response = { .buffer = malloc(1), .size = 0 };
+    UploadHeaders headers;
+    if (!response.buffer) return false;
+
+    // 1. Start the resumable session.
+    char url[512];
+    snprintf(url, sizeof(url), "https://%s/upload/v1beta/files", state->host);
+    cJSON* metadata = cJSON_CreateObject();
+    cJSON* metadata_file = cJSON_AddObjectToObject(metadata, "file");
+    cJSON_AddStringToObject(metadata_file, "display_name", display_name);
+    char* metadata_json = cJSON_PrintUnformatted(metadata);
+    cJSON_Delete(metadata);
+    if (!metadata_json) {
+        free(response.buffer);
         return false;
     }
-
-    // Disallow directory separators and dots to prevent path traversal.
-    // For example, a name like "../my_secrets" would be rejected.
-    if (strchr(name, '/') || strchr(name, '\\') || strchr(name, '.')) {
-        fprintf(stderr, "Error: Session name cannot contain '/', '\\', or '.' characters.\n");
+    long http_code = 0;
+    for (int attempt = 1;; attempt++) {
+        char length_header[128], type_header[256];
+        snprintf(length_header, sizeof(length_header), "X-Goog-Upload-Header-Content-Length: %zu", length);
+        snprintf(type_header, sizeof(type_header), "X-Goog-Upload-Header-Content-Type: %s", mime_type);
+        struct curl_slist* start_headers = curl_slist_append(NULL, "X-Goog-Upload-Protocol: resumable");
+        start_headers = curl_slist_append(start_headers, "X-Goog-Upload-Command: start");
+        start_headers = curl_slist_append(start_headers, length_header);
+        start_headers = curl_slist_append(start_headers, type_header);
+        start_headers = curl_slist_append(start_headers, "Content-Type: application/json");
+        http_code = files_api_call(state, key_index, url, start_headers, metadata_json, strlen(metadata_json), &headers, &response);
+        if (http_code == 200 && headers.upload_url[0] != '\0') break;
+        if (!retry_policy_should_retry(state, "upload_start", attempt, http_code)) break;
+    }
+    free(metadata_json);
+    if (http_code != 200 || headers.upload_url[0] == '\0') {
+        if (http_code > 0) parse_and_print_error_json(response.buffer);
+        free(response.buffer);
         return false;
     }
+    char upload_url[sizeof(headers.upload_url)];
+    memcpy(upload_url, headers.upload_url, sizeof(upload_url));
+    size_t chunk_size = FILES_CHUNK_SIZE;
+    if (headers.granularity > 0 && chunk_size % headers.granularity != 0) {
+        chunk_size = (chunk_size / headers.granularity + 1) * headers.granularity;
+    }
+
+    // 2. Send the chunks, resuming from what the server has after a failure.
+    unsigned char* chunk = blob->mapped ? malloc(chunk_size) : NULL;
+    size_t offset = 0;
+    int attempt = 0;
+    cJSON* file = NULL;
+    while (!file && (chunk || !blob->mapped)) {
+        size_t count = length - offset < chunk_size ? length - offset : chunk_size;
+        bool last = offset + count == length;
+        const unsigned char* data = blob->data + offset;
+        if (chunk) {
+            if (!blob_pread(blob, chunk, offset, count)) {
+                fprintf(stderr, "\nError: '%s' shrank while it was uploaded.\n", display_name);
+                http_code = 0;
+                break;
+            }
+            data = chunk;
+        }
+        char offset_header[64];
+        snprintf(offset_header, sizeof(offset_header), "X-Goog-Upload-Offset: %zu", offset);
+        struct curl_slist* chunk_headers = curl_slist_append(NULL, last ? "X-Goog-Upload-Command: upload, finalize" : "X-Goog-Upload-Command: upload");
+        chunk_headers = curl_slist_append(chunk_headers, offset_header);
+        http_code = files_api_call(state, key_index, upload_url, chunk_headers, data, count, &headers, &response);
+        if (http_code == 200) {
+            state->files.bytes_uploaded += count;
+            offset += count;
+            attempt = 0;
+            fprintf(stderr, "\r[Uploading %s: %.1f of %.1f MB]", display_name, offset / 1048576.0, length / 1048576.0);
+            if (last) {
+                fprintf(stderr, "\n");
+                cJSON* root = cJSON_Parse(response.buffer);
+                file = cJSON_DetachItemFromObject(root, "file");
+                cJSON_Delete(root);
+                if (!file) break;
+            }
+            continue;
+        }
 
-    return true;
+        fprintf(stderr, "\n");
+        if (!retry_policy_should_retry(state, "upload", ++attempt, http_code)) break;
+        struct curl_slist* query_headers = curl_slist_append(NULL, "X-Goog-Upload-Command: query");
+        long query_code = files_api_call(state, key_index, upload_url, query_headers, "", 0, &headers, &response);
+        if (query_code != 200) continue; // Resend the same chunk.
+        if (strcmp(headers.status, "final") == 0) {
+            cJSON* root = cJSON_Parse(response.buffer);
+            file = cJSON_DetachItemFromObject(root, "file");
+            cJSON_Delete(root);
+            break;
+        }
+        if (strcmp(headers.status, "active") != 0 || headers.size_received < 0 || (size_t)headers.size_received > length) break;
+        offset = (size_t)headers.size_received;
+        fprintf(stderr, "[Resuming the upload at %.1f MB]\n", offset / 1048576.0);
+    }
+    if (!file && http_code > 0 && http_code != 200) parse_and_print_error_json(response.buffer);
+    free(chunk);
+    free(response.buffer);
+    *file_out = file;
+    return file != NULL;
 }
 
 /**
- * @brief Lists all saved session files from the sessions directory.
- * @details This function reads the contents of the sessions directory, filters
- *          for files ending in ".json", and prints their names (without the
- *          extension) to the console. It uses platform-specific APIs for
- *          directory traversal to ensure portability between Windows and
- *          POSIX systems.
+ * @brief Turns a large attachment into a Files API reference.
+ * @details Inline attachments are base64-encoded into every later request of
+ *          the conversation; an uploaded file is sent once and then referred
+ *          to by its URI, so a 15 MB video costs a few bytes per turn. Content
+ *          uploaded before with the same key is found in the upload cache
+ *          (`files.json` in the application data directory) by its SHA-256
+ *          and not uploaded again while the server still keeps it. The key
+ *          comes from the rate limiter and is charged one request; while
+ *          requests are pinned to a key (see `files_api_prepare`), that key
+ *          uploads.
+ * @param state The current application state.
+ * @param blob The content; its hash is the one the blob store uses.
+ * @param mime_type Its MIME type.
+ * @param filepath The name it was attached as.
+ * @param part The part to fill in as a PART_TYPE_URI reference.
+ * @return true if the part now refers to an uploaded file; false if the
+ *         attachment should be sent inline.
  */
-void list_sessions() {
-    char sessions_path[PATH_MAX];
-    get_sessions_path(sessions_path, sizeof(sessions_path));
-    if (sessions_path[0] == '\0') {
-        fprintf(stderr, "Error: Could not determine sessions directory.\n");
-        return;
-    }
-
-    fprintf(stderr, "Saved Sessions:\n");
-    int count = 0;
-
-    // --- POSIX (Linux, macOS) Implementation ---
-    DIR *d = opendir(sessions_path);
-    if (d) {
-        struct dirent *dir;
-        // Iterate through all entries in the directory.
-        while ((dir = readdir(d)) != NULL) {
-            // Check if the entry is a file ending in .json.
-            char* dot = strrchr(dir->d_name, '.');
-            if (dot && strcmp(dot, ".json") == 0) {
-                *dot = '\0'; // Temporarily remove extension.
-                fprintf(stderr, "  - %s\n", dir->d_name);
-                *dot = '.'; // Restore it for the next check (good practice).
-                count++;
-            }
+static bool files_api_attach(AppState* state, Blob* blob, const char* mime_type, const char* filepath, Part* part) {
+    // An upload takes a request slot from the key's quota but no tokens.
+    long pending_tokens = state->rate_limit.pending_tokens;
+    state->rate_limit.pending_tokens = 0;
+    int key_index = rate_limited_select_api_key(state);
+    state->rate_limit.pending_tokens = pending_tokens;
+    if (key_index < 0) return false;
+    char id[96];
+    memcpy(id, blob_hash(blob), 64);
+    id[64] = '-';
+    quota_key_id(state->api_keys[key_index], id + 65, sizeof(id) - 65);
+
+    char* uri = NULL;
+    if (files_cache_lookup(id, &uri)) {
+        state->files.reused++;
+    } else {
+        endpoint_pool_select(state);
+        const char* slash = strrchr(filepath, '/');
+        const char* display_name = slash ? slash + 1 : filepath;
+        cJSON* file = NULL;
+        bool uploaded = files_api_upload(state, key_index, blob, mime_type, display_name, &file);
+        rate_limiter_settle(state, uploaded, 0);
+        if (!uploaded) {
+            return false;
         }
-        closedir(d);
+        const cJSON* name = cJSON_GetObjectItem(file, "name");
+        const cJSON* file_uri = cJSON_GetObjectItem(file, "uri");
+        const cJSON* file_state = cJSON_GetObjectItem(file, "state");
+        const cJSON* expiration = cJSON_GetObjectItem(file, "expirationTime");
+        bool usable = cJSON_IsString(name) && cJSON_IsString(file_uri);
+        if (usable && cJSON_IsString(file_state) && strcmp(file_state->valuestring, "PROCESSING") == 0) {
+            usable = files_api_wait_active(state, key_index, name->valuestring);
+        }
+        if (usable) {
+            time_t expires = files_parse_time(cJSON_IsString(expiration) ? expiration->valuestring : NULL);
+            if (expires == 0) expires = time(NULL) + FILES_DEFAULT_TTL_SEC;
+            files_cache_store(id, name->valuestring, file_uri->valuestring, mime_type, expires);
+            uri = strdup(file_uri->valuestring);
+            state->files.uploads++;
+        }
+        cJSON_Delete(file);
+        if (!uri) return false;
     }
 
-    if (count == 0) {
-        fprintf(stderr, "  (No sessions found)\n");
-    }
+    part->type = PART_TYPE_URI;
+    part->uri = uri;
+    return true;
 }
 
 /**
- * @brief Gets the full path for the application's configuration file.
- * @details This function constructs the absolute path to the `config.json` file.
- *          It builds upon the base application path and appends the standard
- *          configuration filename.
- *          - On Windows, this resolves to `%APPDATA%\gemini-cli\config.json`.
- *          - On POSIX systems, this resolves to `~/.config/gemini-cli/config.json`.
- * @param buffer A character buffer to store the resulting path.
- * @param buffer_size The size of the buffer. The buffer will be empty on failure.
+ * @brief Makes the uploaded files of the conversation usable by one key before a generate request.
+ * @details Uploaded files belong to the project of the key that uploaded
+ *          them and expire after two days, while requests go to whichever
+ *          key the scheduler picks. Each uploaded file in the history is
+ *          looked up in the upload cache. The key of the first one that is
+ *          still usable becomes the key every request is pinned to, which
+ *          also keeps hedging off. Files uploaded with another key, about to
+ *          expire or not in the cache are uploaded again with that key from
+ *          the data the part keeps, or sent inline if that fails. A file
+ *          that expired or whose key is gone, with no data to upload again
+ *          (sessions saved without the blob store), is replaced by a note.
+ * @param state The current application state.
+ * @return The key to pin requests to, or -1 if the history holds no usable uploaded files.
  */
-void get_config_path(char* buffer, size_t buffer_size) {
-    const char* config_file_name = "config.json";
-    char base_app_path[PATH_MAX];
+static int files_api_prepare(AppState* state) {
+    int pinned = -1;
+    if (state->free_mode || state->num_api_keys == 0) return -1;
+    for (int i = 0; i < state->history.num_contents; i++) {
+        Content* content = &state->history.contents[i];
+        for (int j = 0; j < content->num_parts; j++) {
+            Part* part = &content->parts[j];
+            if (part->type != PART_TYPE_URI || !part->uri || is_youtube_url(part->uri)) continue;
+            char key_id[17];
+            time_t expires = 0;
+            bool known = files_cache_find_uri(part->uri, key_id, &expires);
+            if (!known && !part->blob) continue; // Uploaded elsewhere; nothing to check it against.
+            int key_index = known ? quota_key_index(state, key_id) : -1;
+            bool fresh = expires > time(NULL) + FILES_EXPIRY_MARGIN_SEC;
+            if (key_index >= 0 && fresh && (pinned < 0 || key_index == pinned)) {
+                pinned = key_index;
+                continue;
+            }
+            if (!part->blob) {
+                if (key_index >= 0 && fresh) continue; // Another key's file; only that key can read it.
+                fprintf(stderr, "Warning: Uploaded file %s has %s and was left out.\n", part->uri,
+                        key_index < 0 ? "no key left that can read it" : "expired");
+                char note[160];
+                snprintf(note, sizeof(note), "[Uploaded file (%s) is no longer available]", part->mime_type ? part->mime_type : "unknown type");
+                free(part->uri);
+                free(part->mime_type);
+                part->uri = NULL;
+                part->mime_type = NULL;
+                part->type = PART_TYPE_TEXT;
+                part->text = strdup(note);
+                content_invalidate_cache(content);
+                continue;
+            }
 
-    // First, get the main application data directory path.
-    get_base_app_path(base_app_path, sizeof(base_app_path));
-    if (base_app_path[0] == '\0') {
-        buffer[0] = '\0'; // Abort if the base path could not be determined.
-        return;
+            char* old_uri = part->uri;
+            part->uri = NULL;
+            state->pinned_key_index = pinned;
+            bool uploaded = state->files.enabled &&
+                files_api_attach(state, part->blob, part->mime_type, part->filename ? part->filename : "attachment", part);
+            state->pinned_key_index = -1;
+            if (uploaded && files_cache_find_uri(part->uri, key_id, &expires)) pinned = quota_key_index(state, key_id);
+            if (!uploaded) {
+                fprintf(stderr, "Warning: %s could not be uploaded again and is sent inline.\n", old_uri);
+                part->type = PART_TYPE_FILE;
+            }
+            free(old_uri);
+            content_invalidate_cache(content);
+        }
     }
+    return pinned;
+}
 
-    const char* separator = "/";
+/**
+ * @brief Wraps a heap buffer as the data of an attachment.
+ * @param data The bytes, allocated with malloc; the blob takes them over.
+ * @param size Their number.
+ * @return The blob with one reference, or NULL on allocation failure (the
+ *         buffer then still belongs to the caller).
+ */
+Blob* blob_from_buffer(unsigned char* data, size_t size) {
+    Blob* blob = calloc(1, sizeof(Blob));
+    if (!blob) return NULL;
+    blob->refs = 1;
+    blob->data = data;
+    blob->size = size;
+    blob->fd = -1;
+    return blob;
+}
 
-    // Pre-calculate the required buffer size to prevent an overflow with snprintf.
-    // Required size = base_path + separator + config_file_name + null_terminator
-    size_t required_size = strlen(base_app_path) + strlen(separator) + strlen(config_file_name) + 1;
-    if (required_size > buffer_size) {
-        fprintf(stderr, "Error: Resolved configuration path is too long.\n");
-        buffer[0] = '\0';
-        return;
+/**
+ * @brief Maps a regular file into memory as the data of an attachment.
+ * @details The mapping is private and read-only, so its pages belong to the
+ *          page cache rather than the heap. A descriptor of the file is kept
+ *          with the blob, and its time stamp too, so that writing to the file
+ *          later is noticed before the changed data goes out (see
+ *          `blob_check`).
+ * @param fd An open descriptor of the file.
+ * @param path The file's name.
+ * @param st The file's status from `fstat`.
+ * @return The blob with one reference, or NULL with errno set.
+ */
+static Blob* blob_map_file(int fd, const char* path, const struct stat* st) {
+    size_t size = (size_t)st->st_size;
+    void* data = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (data == MAP_FAILED) return NULL;
+    // The data is read front to back: sniffed, hashed, encoded.
+    madvise(data, size, MADV_SEQUENTIAL);
+    Blob* blob = blob_from_buffer(data, size);
+    char* path_copy = strdup(path);
+    int kept_fd = blob && path_copy ? dup(fd) : -1;
+    if (kept_fd < 0) {
+        int error = blob && path_copy ? errno : ENOMEM;
+        munmap(data, size);
+        free(blob);
+        free(path_copy);
+        errno = error;
+        return NULL;
     }
-
-    // Safely construct the final, full path.
-    snprintf(buffer, buffer_size, "%s%s%s", base_app_path, separator, config_file_name);
+    blob->mapped = true;
+    blob->fd = kept_fd;
+    blob->path = path_copy;
+    blob->file = *st;
+    return blob;
 }
 
 /**
- * @brief Safely reads a string from a cJSON object and allocates new memory for it.
- * @details This is used for fields that can be of variable length, like the
- *          system prompt. The caller is responsible for freeing the memory
- *          allocated to `*target`.
- * @param obj The cJSON object to read from.
- * @param key The key of the string value to read.
- * @param target A pointer to the char pointer that will hold the new string.
- *               If `*target` already points to a string, it will be freed first.
+ * @brief Reads a file into a blob on the heap.
+ * @details Files smaller than BLOB_MAP_MIN_SIZE are read when attached, so
+ *          they are a snapshot that later writes to the file cannot touch; a
+ *          mapped file that was written to is copied this way too. The file
+ *          is read from its start whatever the descriptor's position.
+ * @param fd An open descriptor of the file.
+ * @param size The file's size from `fstat`; a file that shrank since is read to its end.
+ * @return The blob with one reference, or NULL with errno set (EIO for a file that became empty).
  */
-static void json_read_strdup(const cJSON* obj, const char* key, char** target) {
-    const cJSON* item = cJSON_GetObjectItem(obj, key);
-    if (cJSON_IsString(item) && (item->valuestring != NULL)) {
-        // Free the existing string, if any, to prevent memory leaks.
-        if (*target) {
-            free(*target);
+static Blob* blob_read_file(int fd, size_t size) {
+    unsigned char* data = malloc(size);
+    if (!data) return NULL;
+    size_t done = 0;
+    while (done < size) {
+        ssize_t got = pread(fd, data + done, size - done, (off_t)done);
+        if (got < 0 && errno == EINTR) continue;
+        if (got < 0) {
+            free(data);
+            return NULL;
         }
-        *target = strdup(item->valuestring);
+        if (got == 0) break;
+        done += (size_t)got;
+    }
+    Blob* blob = done > 0 ? blob_from_buffer(data, done) : NULL;
+    if (!blob) {
+        free(data);
+        errno = done > 0 ? ENOMEM : EIO;
     }
+    return blob;
 }
 
 /**
- * @brief Loads application settings from a specified configuration file path.
- * @details This function reads a JSON configuration file from the given path,
- *          parses it, and updates the application's state with the values found
- *          in the file. It uses a series of `json_read_*` helper functions to
- *          safely extract the values and handle missing keys gracefully.
- * @param state The application state struct to update with the loaded settings.
- * @param filepath The absolute path to the `config.json` file to load.
+ * @brief Reads part of a mapped blob's file through its descriptor rather than the mapping.
+ * @details Reading a mapping past the end of a file that shrank would crash,
+ *          so attachments are streamed into requests this way; a short read
+ *          reports the file shrank instead.
+ * @return false if the file no longer has that many bytes at that offset.
  */
-void load_configuration_from_path(AppState* state, const char* filepath) {
-    FILE* file = fopen(filepath, "r");
-    if (!file) {
-        // This is not an error if the default config file doesn't exist on first run,
-        // so we don't print an error message here. We simply return.
-        return;
+static bool blob_pread(const Blob* blob, unsigned char* out, size_t offset, size_t length) {
+    while (length > 0) {
+        ssize_t got = pread(blob->fd, out, length, (off_t)offset);
+        if (got < 0 && errno == EINTR) continue;
+        if (got <= 0) return false;
+        out += got;
+        offset += (size_t)got;
+        length -= (size_t)got;
     }
+    return true;
+}
 
-    // Read the entire file content into a buffer.
-    fseek(file, 0, SEEK_END);
-    long length = ftell(file);
-    fseek(file, 0, SEEK_SET);
+/**
+ * @brief Takes another reference to a blob.
+ * @return The blob, for convenience; NULL stays NULL.
+ */
+Blob* blob_retain(Blob* blob) {
+    if (blob) blob->refs++;
+    return blob;
+}
 
-    char* buffer = malloc(length + 1);
-    if (!buffer) {
-        fclose(file);
-        fprintf(stderr, "Warning: Failed to allocate memory to read config file.\n");
+/**
+ * @brief Drops a reference to a blob, unmapping or freeing the data with the last one.
+ * @param blob The blob; may be NULL.
+ */
+void blob_release(Blob* blob) {
+    if (!blob || --blob->refs > 0) return;
+    if (blob->store) blob_store_remove(blob->store, blob);
+    if (blob->mapped) munmap(blob->data, blob->size);
+    else free(blob->data);
+    if (blob->fd >= 0) close(blob->fd);
+    free(blob->path);
+    free(blob);
+}
+
+/**
+ * @brief Decodes the Base64 data of a saved attachment into a blob.
+ * @param text The Base64 text.
+ * @return The blob with one reference, or NULL if the text is not valid
+ *         padded Base64 (the caller then keeps the text as it is).
+ */
+static Blob* blob_from_base64(const char* text) {
+    size_t length = strlen(text);
+    if (length == 0) return NULL;
+    Base64DecodeResult decoded = base64_decode_length(text, length);
+    if (!decoded.data) return NULL;
+    Blob* blob = blob_from_buffer(decoded.data, decoded.size);
+    if (!blob) free(decoded.data);
+    return blob;
+}
+
+/**
+ * @brief Makes sure a mapped blob's data can still be used, replacing it if its file was written to.
+ * @details A mapping shows later writes to the file, and reading past the end
+ *          of a file that shrank would crash. Replacing the file with a new
+ *          one, as most editors do when saving, or deleting it leaves the
+ *          mapping intact; writing to it in place does not. The blob then
+ *          takes the data as attached back from the blob store if a session
+ *          was saved with it, and otherwise a copy of the file as it is now,
+ *          which raises its version so that the messages built from it are
+ *          serialized again. The attachment is never dropped or sent empty;
+ *          the change is reported once.
+ * @param blob The blob.
+ */
+static void blob_check(Blob* blob) {
+    struct stat st;
+    if (!blob->mapped || fstat(blob->fd, &st) != 0) return;
+    if (st.st_size == blob->file.st_size && st.st_mtim.tv_sec == blob->file.st_mtim.tv_sec &&
+        st.st_mtim.tv_nsec == blob->file.st_mtim.tv_nsec) {
         return;
     }
-
-    if (fread(buffer, 1, length, file) != (size_t)length) {
-        fclose(file);
-        free(buffer);
-        fprintf(stderr, "Warning: Failed to read content from config file.\n");
+    Blob* copy = blob->stored ? blob_store_map(blob->hash) : NULL;
+    bool original = copy && copy->size == blob->size;
+    if (!original) {
+        blob_release(copy);
+        copy = blob_read_file(blob->fd, (size_t)st.st_size);
+    }
+    if (!copy) {
+        // Keep the mapping; streaming reads it through the descriptor, which is safe.
+        fprintf(stderr, "Error: '%s' was changed after it was attached and could not be read again: %s\n",
+                blob->path, strerror(errno));
+        blob->file = st;
         return;
     }
-    buffer[length] = '\0';
-    fclose(file);
-
-    // Parse the buffer content as a JSON object.
-    cJSON* root = cJSON_Parse(buffer);
-    free(buffer); // The file content is now in the cJSON object.
-
-    if (!cJSON_IsObject(root)) {
-        if (root) cJSON_Delete(root);
-        fprintf(stderr, "Warning: Could not parse configuration file '%s' or it is not a valid JSON object.\n", filepath);
+    munmap(blob->data, blob->size);
+    close(blob->fd);
+    blob->data = copy->data;
+    blob->size = copy->size;
+    blob->mapped = copy->mapped;
+    blob->in_store = copy->in_store;
+    blob->fd = copy->fd;
+    blob->file = copy->file;
+    copy->data = NULL;
+    copy->mapped = false;
+    copy->fd = -1;
+    blob_release(copy);
+    if (original) {
+        fprintf(stderr, "Warning: '%s' was changed after it was attached; the attached content is sent from the blob store.\n", blob->path);
         return;
     }
+    blob->version++;
+    blob->hash[0] = '\0';
+    blob->stored = false;
+    if (blob->store) blob_store_remove(blob->store, blob);
+    fprintf(stderr, "Warning: '%s' was changed after it was attached; its new content is sent from now on.\n", blob->path);
+}
 
-    // Use the helper functions to safely read each value from the JSON object
-    // into the AppState struct. This gracefully handles missing keys.
-    json_read_string(root, "model", state->model_name, sizeof(state->model_name));
-    json_read_strdup(root, "host", &state->host);
-    json_read_float(root, "temperature", &state->temperature);
-    json_read_int(root, "seed", &state->seed);
-    json_read_strdup(root, "system_prompt", &state->system_prompt);
-    json_read_string(root, "proxy", state->proxy, sizeof(state->proxy));
-
-    json_read_int(root, "next_key_index", &state->next_key_index);
-
-    const cJSON* keys_array = cJSON_GetObjectItem(root, "api_keys");
-    const cJSON* origins_array = cJSON_GetObjectItem(root, "origins");
-    if (cJSON_IsArray(keys_array)) {
-        // New format: "api_keys": ["key1", "key2"]
-        state->num_api_keys = cJSON_GetArraySize(keys_array);
-        state->api_keys = malloc(sizeof(char*) * state->num_api_keys);
-        state->origins = malloc(sizeof(char*) * state->num_api_keys);
-        cJSON* key_item;
-        cJSON* origin_item;
-        int i = 0;
-        cJSON_ArrayForEach(key_item, keys_array) {
-            if (cJSON_IsString(key_item)) {
-                state->api_keys[i++] = strdup(key_item->valuestring);
-            }
-        }
-        i = 0;
-        cJSON_ArrayForEach(origin_item, origins_array) {
-            if (cJSON_IsString(origin_item)) {
-                state->origins[i++] = strdup(origin_item->valuestring);
-            }
-        }
-    } else {
-        // Backward compatibility: "api_key": "key1"
-        const cJSON* single_key = cJSON_GetObjectItem(root, "api_key");
-        const cJSON* single_origin = cJSON_GetObjectItem(root, "origin");
-        if (cJSON_IsString(single_key)) {
-            state->num_api_keys = 1;
-            state->api_keys = malloc(sizeof(char*));
-            state->api_keys[0] = strdup(single_key->valuestring);
-            state->origins = malloc(sizeof(char*));
-            state->origins[0] = strdup(single_origin->valuestring);
-        }
-    }
-    
-    // Ensure index is not out of bounds
-    if (state->num_api_keys > 0 && state->next_key_index >= state->num_api_keys) {
-        state->next_key_index = 0;
+/**
+ * @brief Returns the SHA-256 of a blob's data in hex, computing it on first use.
+ */
+static const char* blob_hash(Blob* blob) {
+    if (blob->hash[0] == '\0') {
+        unsigned char digest[32];
+        sha256_digest(blob->data, blob->size, digest);
+        for (int i = 0; i < 32; i++) snprintf(blob->hash + 2 * i, 3, "%02x", digest[i]);
     }
-    
-    //json_read_string(root, "origin", state->origin, sizeof(state->origin));
-    json_read_int(root, "max_output_tokens", &state->max_output_tokens);
-    json_read_int(root, "thinking_budget", &state->thinking_budget);
-    json_read_bool(root, "google_grounding", &state->google_grounding);
-    json_read_bool(root, "url_context", &state->url_context);
-    json_read_int(root, "top_k", &state->topK);
-    json_read_float(root, "top_p", &state->topP);
+    return blob->hash;
+}
 
-    // Clean up the parsed JSON object.
-    cJSON_Delete(root);
+/**
+ * @brief Tells whether a string is a SHA-256 in lowercase hex, as blob store file names are.
+ */
+static bool blob_hash_is_valid(const char* hash) {
+    size_t length = strspn(hash, "0123456789abcdef");
+    return length == 64 && hash[64] == '\0';
 }
 
 /**
- * @brief Loads application settings from the default configuration file.
- * @details This is a convenience wrapper around `load_configuration_from_path`.
- *          It determines the default path for the `config.json` file and then
- *          calls the main loading function to parse it and update the state.
- * @param state The application state struct to update with the loaded settings.
+ * @brief Finds the blob the store holds in memory for a content hash.
  */
-void load_configuration(AppState* state) {
-    char config_path[PATH_MAX];
+static Blob* blob_store_find(const BlobStore* store, const char* hash) {
+    for (int i = 0; i < store->num_blobs; i++) {
+        if (strcmp(store->blobs[i]->hash, hash) == 0) return store->blobs[i];
+    }
+    return NULL;
+}
 
-    // Get the default configuration file path (e.g., ~/.config/gemini-cli/config.json).
-    get_config_path(config_path, sizeof(config_path));
+/**
+ * @brief Indexes a blob in the store; it leaves the index with its last reference.
+ */
+static void blob_store_add(BlobStore* store, Blob* blob) {
+    if (store->num_blobs == store->capacity) {
+        int capacity = store->capacity ? store->capacity * 2 : 16;
+        Blob** grown = realloc(store->blobs, sizeof(Blob*) * capacity);
+        if (!grown) return; // Only sharing is lost.
+        store->blobs = grown;
+        store->capacity = capacity;
+    }
+    store->blobs[store->num_blobs++] = blob;
+    blob->store = store;
+}
 
-    // If the path could not be determined, abort.
-    if (config_path[0] == '\0') {
-        return;
+/**
+ * @brief Removes a blob from the store's index.
+ */
+static void blob_store_remove(BlobStore* store, Blob* blob) {
+    for (int i = 0; i < store->num_blobs; i++) {
+        if (store->blobs[i] != blob) continue;
+        store->blobs[i] = store->blobs[--store->num_blobs];
+        break;
+    }
+    blob->store = NULL;
+    if (store->num_blobs == 0) {
+        free(store->blobs);
+        store->blobs = NULL;
+        store->capacity = 0;
     }
-
-    // Load the configuration from that specific path.
-    load_configuration_from_path(state, config_path);
 }
 
 /**
- * @brief Prompts the user and reads their input without echoing it to the screen.
- * @details This function provides a secure way to get sensitive information, like
- *          an API key, from the user. It displays a prompt and then reads user
- *          input character-by-character, printing an asterisk '*' for each one
- *          instead of the character itself. It correctly handles backspace for
- *          editing and is implemented with platform-specific terminal controls
- *          to work on both Windows and POSIX-compliant systems.
- * @param prompt The message to display to the user before reading input.
- * @param buffer The character buffer where the user's input will be stored.
- * @param buffer_size The total size of the buffer.
+ * @brief Tells whether a blob's data can never change: it is on the heap or
+ *        mapped from the blob store, not mapped from a file the user may edit.
  */
-void get_masked_input(const char* prompt, char* buffer, size_t buffer_size) {
-    fprintf(stderr, "%s", prompt);
-    fflush(stderr); // Ensure the prompt is displayed immediately.
+static bool blob_is_snapshot(const Blob* blob) {
+    return !blob->mapped || blob->in_store;
+}
 
-    memset(buffer, 0, buffer_size);
-    size_t i = 0;
+/**
+ * @brief Makes equal attachment data share one blob.
+ * @details Looks the blob's content hash up among the blobs in memory. If
+ *          the same data is held already, the new blob is released and the
+ *          held one shared instead; otherwise the new blob is indexed, so
+ *          later copies find it. A held blob whose file was changed since it
+ *          was mapped no longer has that content and is replaced.
+ *          A mapping of a user's file is only shared by attachments of that
+ *          same file: an attachment of another file with equal content must
+ *          not change when the first file is edited. Such an attachment
+ *          keeps its own blob, and takes the held one's place in the index
+ *          if its data cannot change.
+ * @param store The blob store.
+ * @param blob A blob with one reference, which is taken over.
+ * @return The blob to use, with one reference for the caller.
+ */
+static Blob* blob_store_intern(BlobStore* store, Blob* blob) {
+    const char* hash = blob_hash(blob);
+    Blob* held = blob_store_find(store, hash);
+    if (held == blob) return blob;
+    if (held) {
+        blob_check(held);
+        held = blob_store_find(store, hash);
+    }
+    if (held && held->size == blob->size &&
+        (blob_is_snapshot(held) || (blob->mapped && !blob->in_store &&
+                                    blob->file.st_dev == held->file.st_dev && blob->file.st_ino == held->file.st_ino))) {
+        store->shared++;
+        blob_release(blob);
+        return blob_retain(held);
+    }
+    if (held && !blob_is_snapshot(blob)) return blob;
+    if (held) blob_store_remove(store, held);
+    blob_store_add(store, blob);
+    return blob;
+}
 
-    // --- POSIX (Linux, macOS) Implementation using termios.h ---
-    struct termios old_term, new_term;
+/**
+ * @brief Builds the path of the blob store directory, or of one blob in it.
+ * @details The directory is `blobs` in the application data directory and is
+ *          created if needed.
+ * @param hash The content hash of the blob, or NULL for the directory.
+ * @param buffer Receives the path.
+ * @param buffer_size The size of the buffer.
+ * @return false if the path could not be determined.
+ */
+static bool blob_store_path(const char* hash, char* buffer, size_t buffer_size) {
+    char base_app_path[PATH_MAX];
+    get_base_app_path(base_app_path, sizeof(base_app_path));
+    if (base_app_path[0] == '\0') return false;
+    int length = snprintf(buffer, buffer_size, "%s/%s", base_app_path, BLOB_STORE_DIRNAME);
+    if (length < 0 || (size_t)length >= buffer_size) return false;
+    MKDIR(buffer);
+    if (!hash) return true;
+    length = snprintf(buffer, buffer_size, "%s/%s/%s", base_app_path, BLOB_STORE_DIRNAME, hash);
+    return length > 0 && (size_t)length < buffer_size;
+}
 
-    // Get the current terminal settings.
-    tcgetattr(STDIN_FILENO, &old_term);
-    new_term = old_term;
+/**
+ * @brief Makes sure a blob's data is in the blob store on disk.
+ * @details Content already stored is not written again, but its time stamp
+ *          is renewed so that `blob_store_gc` running in another instance
+ *          leaves it alone while the session is being saved. New content is
+ *          written to a temporary file and renamed into place, so a blob file
+ *          is always complete.
+ * @param store The blob store.
+ * @param blob The blob.
+ * @return true if the blob is stored; `blob->stored` tells the same.
+ */
+static bool blob_store_write(BlobStore* store, Blob* blob) {
+    char path[PATH_MAX];
+    blob_check(blob);
+    blob->stored = false;
+    if (!blob_store_path(blob_hash(blob), path, sizeof(path))) return false;
 
-    // Disable canonical mode (line buffering) and character echoing.
-    new_term.c_lflag &= ~(ECHO | ICANON);
+    struct stat st;
+    if (stat(path, &st) == 0 && S_ISREG(st.st_mode) && (size_t)st.st_size == blob->size) {
+        utimensat(AT_FDCWD, path, NULL, 0);
+        blob->stored = true;
+        return true;
+    }
 
-    // Apply the new, temporary settings.
-    tcsetattr(STDIN_FILENO, TCSANOW, &new_term);
+    char temp_path[PATH_MAX + 32];
+    snprintf(temp_path, sizeof(temp_path), "%s.%ld.tmp", path, (long)getpid());
+    FILE* file = fopen(temp_path, "wb");
+    bool ok = file && fwrite(blob->data, 1, blob->size, file) == blob->size;
+    if (file && fclose(file) != 0) ok = false;
+    if (ok && rename(temp_path, path) != 0) ok = false;
+    if (!ok) {
+        fprintf(stderr, "Warning: Could not write an attachment to the blob store (%s); it is saved inline.\n", strerror(errno));
+        remove(temp_path);
+        return false;
+    }
+    store->written++;
+    store->bytes_written += blob->size;
+    blob->stored = true;
+    return true;
+}
 
-    int c;
-    // Read character by character.
-    while (i < buffer_size - 1 && (c = getchar()) != '\n' && c != '\r' && c != EOF) {
-        if (c == 127 || c == 8) { // ASCII for Backspace/Delete.
-            if (i > 0) {
-                i--;
-                fprintf(stderr, "\b \b"); // Erase the last asterisk from the screen.
-            }
-        } else if (isprint(c)) { // A printable character was entered.
-            buffer[i++] = (char)c;
-            fprintf(stderr, "*");
-            fflush(stderr);
+/**
+ * @brief Writes the attachments of the conversation to the blob store before a session is saved.
+ * @details Attachments that cannot be stored are left unmarked and embedded
+ *          in the session as before.
+ * @param state The current application state.
+ */
+static void blob_store_save_history(AppState* state) {
+    for (int i = 0; i < state->history.num_contents; i++) {
+        Content* content = &state->history.contents[i];
+        for (int j = 0; j < content->num_parts; j++) {
+            Part* part = &content->parts[j];
+            if (part->blob) blob_store_write(&state->blob_store, part->blob);
         }
     }
-
-    // IMPORTANT: Restore the original terminal settings.
-    tcsetattr(STDIN_FILENO, TCSANOW, &old_term);
-
-    buffer[i] = '\0'; // Always null-terminate the final string.
-    fprintf(stderr, "\n"); // Move to the next line after input is complete.
 }
 
 /**
- * @brief Securely gets the API key and (optionally) the origin from the user.
- * @details This function orchestrates the process of obtaining user credentials.
- *          It uses the `get_masked_input` helper function to prompt the user for
- *          their API key. If the origin has not already been set (i.e., it is
- *          still "default"), it will also prompt for the origin, allowing the
- *          user to skip it by pressing Enter.
- * @param state A pointer to the AppState struct where the key and origin will be
- *              stored.
+ * @brief Gets the blob a saved session refers to.
+ * @details A blob already in memory is shared if its data cannot change;
+ *          otherwise the blob's file in the store is mapped, so loading a
+ *          session reads no attachment data. An attached file with the same
+ *          content is not shared (see `blob_store_intern`); it is only copied
+ *          if the store has lost the blob.
+ * @param store The blob store.
+ * @param hash The content hash from the session.
+ * @return The blob with one reference, or NULL if the store does not have it.
  */
-void get_api_key_securely(AppState* state) {
-    char key_buffer[128];
-    get_masked_input("Enter your API Key: ", key_buffer, sizeof(key_buffer));
-
-    // If no API key entered, do nothing
-    if (key_buffer[0] == '\0') {
-        return;
+static Blob* blob_store_open(BlobStore* store, const char* hash) {
+    if (!blob_hash_is_valid(hash)) return NULL;
+    Blob* held = blob_store_find(store, hash);
+    if (held) {
+        blob_check(held);
+        held = blob_store_find(store, hash);
+    }
+    if (held && blob_is_snapshot(held)) {
+        store->shared++;
+        return blob_retain(held);
+    }
+    Blob* blob = blob_store_map(hash);
+    if (!blob && held) {
+        blob = blob_read_file(held->fd, held->size);
+        if (blob && strcmp(blob_hash(blob), hash) != 0) {
+            blob_release(blob);
+            blob = NULL;
+        }
     }
+    if (!blob) return NULL;
+    if (held) blob_store_remove(store, held);
+    blob_store_add(store, blob);
+    return blob;
+}
 
-    // 1) Append new API key
-    state->num_api_keys += 1;
-    state->api_keys = realloc(
-        state->api_keys,
-        state->num_api_keys * sizeof *state->api_keys
-    );
-    state->api_keys[state->num_api_keys - 1] = strdup(key_buffer);
-
-    // 2) Prompt for origin (Enter → "default")
-    char origin_buffer[128];
-    get_masked_input(
-      "Enter your Origin (press Enter for 'default'): ",
-      origin_buffer,
-      sizeof(origin_buffer)
-    );
+/**
+ * @brief Maps the file of one blob in the store on disk.
+ * @details Blob files are only ever written whole and renamed into place, so
+ *          a mapping of one never changes under the reader.
+ * @param hash The content hash.
+ * @return The blob with one reference, not indexed in memory, or NULL if the store does not have it.
+ */
+static Blob* blob_store_map(const char* hash) {
+    char path[PATH_MAX];
+    if (!blob_store_path(hash, path, sizeof(path))) return NULL;
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) return NULL;
+    struct stat st;
+    Blob* blob = NULL;
+    if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0) {
+        blob = blob_map_file(fd, path, &st);
+    }
+    close(fd);
+    if (!blob) return NULL;
+    snprintf(blob->hash, sizeof(blob->hash), "%s", hash);
+    blob->stored = true;
+    blob->in_store = true;
+    return blob;
+}
 
-    // 3) Append origin in lock-step with api_keys count
-    state->origins = realloc(
-        state->origins,
-        state->num_api_keys * sizeof *state->origins
-    );
+/**
+ * @brief Adds the blob hashes a saved session refers to to a set.
+ * @param filepath The session file.
+ * @param referenced A cJSON object used as a set of hashes.
+ * @return false if the session could not be read, so its references are unknown.
+ */
+static bool blob_store_collect_references(const char* filepath, cJSON* referenced) {
+    FILE* file = fopen(filepath, "rb");
+    if (!file) return false;
+    fseek(file, 0, SEEK_END);
+    long length = ftell(file);
+    fseek(file, 0, SEEK_SET);
+    char* buffer = length >= 0 ? malloc(length + 1) : NULL;
+    bool ok = buffer && fread(buffer, 1, length, file) == (size_t)length;
+    fclose(file);
+    if (!ok) {
+        free(buffer);
+        return false;
+    }
+    buffer[length] = '\0';
+    cJSON* root = cJSON_Parse(buffer);
+    free(buffer);
+    if (!cJSON_IsObject(root)) {
+        cJSON_Delete(root);
+        return false;
+    }
 
-    if (origin_buffer[0] == '\0') {
-        state->origins[state->num_api_keys - 1] = strdup("default");
-    } else {
-        state->origins[state->num_api_keys - 1] = strdup(origin_buffer);
+    const cJSON* content;
+    cJSON_ArrayForEach(content, cJSON_GetObjectItem(root, "contents")) {
+        const cJSON* part;
+        cJSON_ArrayForEach(part, cJSON_GetObjectItem(content, "parts")) {
+            const cJSON* hash = cJSON_GetObjectItem(cJSON_GetObjectItem(part, "blobRef"), "sha256");
+            if (cJSON_IsString(hash) && !cJSON_GetObjectItemCaseSensitive(referenced, hash->valuestring)) {
+                cJSON_AddTrueToObject(referenced, hash->valuestring);
+            }
+        }
     }
-    
+    cJSON_Delete(root);
+    return true;
 }
 
-
 /**
- * @brief Constructs the main JSON request object from the application state.
- * @details This function builds the complete cJSON object that serves as the
- *          payload for a `generateContent` API call. It serializes the different
- *          parts of the AppState into the format required by the Gemini API,
- *          including the system prompt, the conversation history, tool
- *          configurations (like grounding), and generation parameters.
- * @param state A pointer to the application's current state.
- * @return A pointer to the root cJSON object of the request. The caller is
- *         responsible for freeing this object with `cJSON_Delete`. Returns
- *         NULL on failure.
+ * @brief Deletes the blobs that no saved session and no open conversation refers to (`/blobs gc`).
+ * @details Every session in the sessions directory is read for references.
+ *          If one cannot be read, nothing is deleted. Blobs written in the
+ *          last BLOB_GC_GRACE_SEC seconds are kept, because another instance
+ *          may be about to save the session that refers to them, and so are
+ *          the blobs of the attachments in memory, which can still be saved.
+ *          Leftover temporary files of interrupted writes are removed too.
+ * @param state The current application state.
+ * @param stream The stream to report to.
  */
-cJSON* build_request_json(AppState* state) {
-    cJSON* root = cJSON_CreateObject();
-    if (!root) return NULL;
+static void blob_store_gc(AppState* state, FILE* stream) {
+    char store_path[PATH_MAX];
+    char sessions_path[PATH_MAX];
+    get_sessions_path(sessions_path, sizeof(sessions_path));
+    if (!blob_store_path(NULL, store_path, sizeof(store_path)) || sessions_path[0] == '\0') {
+        fprintf(stderr, "Error: Could not determine the blob store directory.\n");
+        return;
+    }
 
-    // --- 1. Add System Instruction (if provided) ---
-    if (state->system_prompt) {
-        cJSON* sys_instruction = cJSON_CreateObject();
-        cJSON* sys_parts_array = cJSON_CreateArray();
-        cJSON* sys_part_item = cJSON_CreateObject();
+    cJSON* referenced = cJSON_CreateObject();
+    if (!referenced) return;
+    for (int i = 0; i < state->blob_store.num_blobs; i++) {
+        const char* hash = state->blob_store.blobs[i]->hash;
+        if (!cJSON_GetObjectItemCaseSensitive(referenced, hash)) cJSON_AddTrueToObject(referenced, hash);
+    }
+
+    DIR* dir = opendir(sessions_path);
+    struct dirent* entry;
+    while (dir && (entry = readdir(dir)) != NULL) {
+        const char* dot = strrchr(entry->d_name, '.');
+        if (!dot || strcmp(dot, ".json") != 0) continue;
+        char session_path[sizeof(sessions_path) + 256];
+        snprintf(session_path, sizeof(session_path), "%s/%s", sessions_path, entry->d_name);
+        if (!blob_store_collect_references(session_path, referenced)) {
+            fprintf(stderr, "Error: Could not read session '%s'; no blobs were deleted.\n", entry->d_name);
+            closedir(dir);
+            cJSON_Delete(referenced);
+            return;
+        }
+    }
+    if (dir) closedir(dir);
+
+    int removed = 0, kept = 0;
+    long long removed_bytes = 0, kept_bytes = 0;
+    time_t now = time(NULL);
+    dir = opendir(store_path);
+    while (dir && (entry = readdir(dir)) != NULL) {
+        const char* name = entry->d_name;
+        size_t name_length = strlen(name);
+        bool is_blob = blob_hash_is_valid(name);
+        bool is_temp = name_length > 4 && strcmp(name + name_length - 4, ".tmp") == 0;
+        if (!is_blob && !is_temp) continue;
+        char path[sizeof(store_path) + 256];
+        snprintf(path, sizeof(path), "%s/%s", store_path, name);
+        struct stat st;
+        if (stat(path, &st) != 0 || !S_ISREG(st.st_mode)) continue;
+        bool recent = now - st.st_mtime < BLOB_GC_GRACE_SEC;
+        if (recent || (is_blob && cJSON_GetObjectItemCaseSensitive(referenced, name))) {
+            if (is_blob) {
+                kept++;
+                kept_bytes += st.st_size;
+            }
+        } else if (remove(path) == 0 && is_blob) {
+            removed++;
+            removed_bytes += st.st_size;
+        }
+    }
+    if (dir) closedir(dir);
+    cJSON_Delete(referenced);
+    fprintf(stream, "Deleted %d unreferenced blob%s (%.1f MB); %d blob%s (%.1f MB) still in use.\n",
+            removed, removed == 1 ? "" : "s", removed_bytes / 1048576.0, kept, kept == 1 ? "" : "s", kept_bytes / 1048576.0);
+}
 
-        cJSON_AddStringToObject(sys_part_item, "text", state->system_prompt);
-        cJSON_AddItemToArray(sys_parts_array, sys_part_item);
-        cJSON_AddItemToObject(sys_instruction, "parts", sys_parts_array);
-        cJSON_AddItemToObject(root, "systemInstruction", sys_instruction);
+/**
+ * @brief Prints the contents of the blob store for `/blobs`.
+ * @param state The current application state.
+ * @param stream The stream to print to.
+ */
+static void blob_store_print(AppState* state, FILE* stream) {
+    char store_path[PATH_MAX];
+    if (!blob_store_path(NULL, store_path, sizeof(store_path))) {
+        fprintf(stderr, "Error: Could not determine the blob store directory.\n");
+        return;
     }
+    int files = 0;
+    long long bytes = 0;
+    DIR* dir = opendir(store_path);
+    struct dirent* entry;
+    while (dir && (entry = readdir(dir)) != NULL) {
+        if (!blob_hash_is_valid(entry->d_name)) continue;
+        char path[sizeof(store_path) + 256];
+        snprintf(path, sizeof(path), "%s/%s", store_path, entry->d_name);
+        struct stat st;
+        if (stat(path, &st) != 0) continue;
+        files++;
+        bytes += st.st_size;
+    }
+    if (dir) closedir(dir);
+
+    long long held_bytes = 0;
+    for (int i = 0; i < state->blob_store.num_blobs; i++) held_bytes += state->blob_store.blobs[i]->size;
+    fprintf(stream, "Blob store: %s (%s)\n", store_path, state->blob_store.enabled ? "used by named sessions" : "OFF");
+    fprintf(stream, "  On disk: %d blob%s, %.1f MB\n", files, files == 1 ? "" : "s", bytes / 1048576.0);
+    fprintf(stream, "  In memory: %d blob%s, %.1f MB; %ld attachment%s shared instead of held twice\n",
+            state->blob_store.num_blobs, state->blob_store.num_blobs == 1 ? "" : "s", held_bytes / 1048576.0,
+            state->blob_store.shared, state->blob_store.shared == 1 ? "" : "s");
+}
 
-    // --- 2. Add Contents (the conversation history) ---
-    cJSON* contents = cJSON_CreateArray();
-    cJSON_AddItemToObject(root, "contents", contents);
-    for (int i = 0; i < state->history.num_contents; i++) {
-        cJSON* content_item = cJSON_CreateObject();
-        cJSON_AddStringToObject(content_item, "role", state->history.contents[i].role);
+/**
+ * @brief Reads data from a stream and creates a pending file attachment.
+ * @details This function is a robust, production-ready handler for all file and
+ *          stream-based attachments (`/attach`, `/paste`, piped input). It safely
+ *          acquires a file handle and then creates a `Part` struct. Regular
+ *          files of BLOB_MAP_MIN_SIZE bytes and more are mapped rather than
+ *          read, and their type is sniffed from the mapping, so the file is
+ *          opened once and never copied; smaller files and pipes are read
+ *          into a buffer. The attachment is handled differently based on
+ *          the API mode: in official mode, the part refers to the data, which
+ *          is Base64-encoded only as a request is sent; in free mode, it's
+ *          formatted as plain text. It uses a goto-based cleanup to ensure all
+ *          resources are deallocated correctly on all execution paths.
+ * @param stream An optional, pre-opened file stream. If NULL, the function will
+ *               open the file specified by `filepath`.
+ * @param filepath A descriptive name for the source (e.g., filename or "stdin").
+ *                 If `stream` is NULL, this is used as the path to open.
+ * @param mime_type The MIME type of the data, used in official API mode; NULL
+ *                  to tell it from the content and the name.
+ * @param state The application state where the new attachment part will be added.
+ */
+void handle_attachment_from_stream(FILE* stream, const char* filepath, const char* mime_type, AppState* state) {
+    // --- Variable Declarations ---
+    FILE* input_stream = stream;
+    unsigned char* buffer = NULL;
+    Blob* blob = NULL;
+    char* formatted_text = NULL;
+    bool opened_here = false;
+    size_t total_read = 0;
+
+    // --- 1. Pre-flight Checks ---
+    if (state->num_attached_parts >= ATTACHMENT_LIMIT) {
+        fprintf(stderr, "Error: Attachment limit of %d reached.\n", ATTACHMENT_LIMIT);
+        return;
+    }
 
-        cJSON* parts_array = cJSON_CreateArray();
-        cJSON_AddItemToObject(content_item, "parts", parts_array);
+    // This block intercepts the call if the filepath is a YouTube URL.
+    if (stream == NULL && is_youtube_url(filepath)) {
+        if (state->free_mode) {
+            fprintf(stderr, "Warning: URL attachments are not supported in free mode. Ignoring %s\n", filepath);
+            return;
+        }
+        Part* part = &state->attached_parts[state->num_attached_parts];
+        memset(part, 0, sizeof(Part));
 
-        for (int j = 0; j < state->history.contents[i].num_parts; j++) {
-            Part* current_part = &state->history.contents[i].parts[j];
-            cJSON* part_item = cJSON_CreateObject();
+        part->type = PART_TYPE_URI;
+        part->uri = strdup(filepath);
+        part->mime_type = strdup("video/*"); // As specified in your example
 
-            if (current_part->type == PART_TYPE_TEXT) {
-                if (current_part->text) {
-                    cJSON_AddStringToObject(part_item, "text", current_part->text);
-                }
-            } else if (current_part->type == PART_TYPE_URI) {
-                cJSON* file_data = cJSON_CreateObject();
-                cJSON_AddStringToObject(file_data, "fileUri", current_part->uri);
-                cJSON_AddStringToObject(file_data, "mimeType", current_part->mime_type);
-                cJSON_AddItemToObject(part_item, "fileData", file_data);
-            } else {
-                cJSON* inline_data = cJSON_CreateObject();
-                cJSON_AddStringToObject(inline_data, "mimeType", current_part->mime_type);
-                cJSON_AddStringToObject(inline_data, "data", current_part->base64_data);
-                cJSON_AddItemToObject(part_item, "inlineData", inline_data);
-            }
-            cJSON_AddItemToArray(parts_array, part_item);
+        if (!part->uri || !part->mime_type) {
+            fprintf(stderr, "Error: Failed to allocate memory for YouTube URL attachment.\n");
+            if (part->uri) free(part->uri);
+            if (part->mime_type) free(part->mime_type);
+            return;
         }
-        cJSON_AddItemToArray(contents, content_item);
-    }
 
-    // --- 3. Add Tools Configuration ---
-    // Only add the "tools" object if at least one tool is enabled.
-    if (state->url_context || state->google_grounding) {
-        cJSON* tools_array = cJSON_CreateArray();
-        if (state->url_context) {
-            cJSON* tool1 = cJSON_CreateObject();
-            cJSON_AddItemToObject(tool1, "urlContext", cJSON_CreateObject());
-            cJSON_AddItemToArray(tools_array, tool1);
+        fprintf(stderr, "Attached YouTube URL: %s\n", filepath);
+        (state->num_attached_parts)++;
+        return; // Exit the function since we've handled the attachment.
+    }
+    
+    // --- 2. Resource Acquisition ---
+    if (input_stream == NULL) {
+        if (!is_path_safe(filepath)) {
+            fprintf(stderr, "Error: Unsafe or absolute file path specified: %s\n", filepath);
+            return;
         }
-        if (state->google_grounding) {
-            cJSON* tool2 = cJSON_CreateObject();
-            cJSON_AddItemToObject(tool2, "googleSearch", cJSON_CreateObject());
-            cJSON_AddItemToArray(tools_array, tool2);
+        input_stream = fopen(filepath, "rb");
+        if (!input_stream) {
+            perror("Error opening file");
+            return;
         }
-        cJSON_AddItemToObject(root, "tools", tools_array);
+        opened_here = true;
     }
 
-    // --- Add Safety Settings (Hardcoded to BLOCK_NONE) ---
-    if (!state->safety) {
-        cJSON* safety_settings_array = cJSON_CreateArray();
-        if (safety_settings_array) {
-            // CORRECTED: Use only the four universally supported categories.
-            const char* categories[] = {
-                "HARM_CATEGORY_HARASSMENT",
-                "HARM_CATEGORY_HATE_SPEECH",
-                "HARM_CATEGORY_SEXUALLY_EXPLICIT",
-                "HARM_CATEGORY_DANGEROUS_CONTENT",
-                "HARM_CATEGORY_CIVIC_INTEGRITY"
-            };
-            int num_categories = sizeof(categories) / sizeof(categories[0]);
+    // --- 3. Map or Read the Stream ---
+    int fd = fileno(input_stream);
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
+        perror("Error getting file status");
+        goto cleanup;
+    }
 
-            for (int i = 0; i < num_categories; i++) {
-                cJSON* setting_item = cJSON_CreateObject();
-                if (setting_item) {
-                    cJSON_AddStringToObject(setting_item, "category", categories[i]);
-                    cJSON_AddStringToObject(setting_item, "threshold", "BLOCK_NONE");
-                    cJSON_AddItemToArray(safety_settings_array, setting_item);
+    // Check if the stream is a regular file
+    if (S_ISREG(st.st_mode)) {
+        if (st.st_size <= 0) {
+            fprintf(stderr, "Warning: File '%s' is empty or invalid. Attachment skipped.\n", filepath);
+            goto cleanup;
+        }
+        // Small files are read, so they are a snapshot from the start.
+        if (st.st_size < BLOB_MAP_MIN_SIZE) {
+            blob = blob_read_file(fd, (size_t)st.st_size);
+        } else {
+            blob = blob_map_file(fd, filepath, &st);
+        }
+        if (!blob) {
+            fprintf(stderr, "Error reading file '%s': %s\n", filepath, strerror(errno));
+            goto cleanup;
+        }
+    } else { // Stream is not a regular file (it's a pipe or the console)
+        size_t capacity = 4096;
+        buffer = malloc(capacity);
+        if (!buffer) {
+            fprintf(stderr, "Error: Failed to allocate memory for stream buffer.\n");
+            goto cleanup;
+        }
+
+                // On POSIX, or for a non-interactive pipe on Windows,
+                // the existing block-read logic is safe and efficient.
+                ssize_t bytes_read;
+                while ((bytes_read = read(fd, buffer + total_read, 1024)) > 0) {
+                    total_read += (size_t)bytes_read;
+                    if (capacity - total_read < 1024) {
+                        capacity *= 2;
+                        unsigned char* new_buffer = realloc(buffer, capacity);
+                        if (!new_buffer) {
+                            fprintf(stderr, "Error: Failed to reallocate pipe buffer.\n");
+                            goto cleanup;
+                        }
+                        buffer = new_buffer;
+                    }
                 }
-            }
-            cJSON_AddItemToObject(root, "safetySettings", safety_settings_array);
+                if (bytes_read < 0) {
+                    perror("Error reading from input stream");
+                    goto cleanup;
+                }
+
+        if (total_read == 0) {
+            fprintf(stderr, "Warning: No data received from input stream. Attachment skipped.\n");
+            goto cleanup;
         }
+        // Give back the slack of the doubling before the data is kept.
+        unsigned char* fitted = realloc(buffer, total_read);
+        if (fitted) buffer = fitted;
+        blob = blob_from_buffer(buffer, total_read);
+        if (!blob) {
+            fprintf(stderr, "Error: Failed to allocate memory for stream buffer.\n");
+            goto cleanup;
+        }
+        buffer = NULL; // Owned by the blob now.
     }
-    // --- 4. Add Generation Configuration ---
-    cJSON* gen_config = cJSON_CreateObject();
-    cJSON_AddNumberToObject(gen_config, "temperature", state->temperature);
-    if (state->max_output_tokens > 0) cJSON_AddNumberToObject(gen_config, "maxOutputTokens", state->max_output_tokens);
-    cJSON_AddNumberToObject(gen_config, "seed", state->seed);
-    if (state->topK > 0) {
-        cJSON_AddNumberToObject(gen_config, "topK", state->topK);
-    }
-    if (state->topP > 0.0f) {
-        cJSON_AddNumberToObject(gen_config, "topP", state->topP);
+    total_read = blob->size;
+    if (!mime_type) {
+        mime_type = get_mime_type(filepath, blob->data, blob->size);
     }
 
-    // Add thinking budget as a sub-object within generationConfig.
-    cJSON* thinking_config = cJSON_CreateObject();
-    cJSON_AddNumberToObject(thinking_config, "thinkingBudget", state->thinking_budget);
-    cJSON_AddItemToObject(gen_config, "thinkingConfig", thinking_config);
-
-    if (state->media_resolution) cJSON_AddStringToObject(gen_config, "mediaResolution", state->media_resolution);
-
-    cJSON_AddItemToObject(root, "generationConfig", gen_config);
-
-    return root;
-}
-
-/**
- * @brief Parses a JSON error response from the API and prints a clean message.
- * @details When an API call fails, the body of the HTTP response often contains
- *          a JSON object with error details. This function attempts to parse that
- *          JSON, find the "message" field within the "error" object, and print
- *          it to stderr for the user. If parsing fails, it prints the raw
- *          buffer as a fallback.
- * @param error_buffer The raw response body received from a failed API call.
- */
-void parse_and_print_error_json(const char* error_buffer) {
-    if (!error_buffer) return;
+    // --- 4. Create Attachment Part ---
+    Part* part = &state->attached_parts[state->num_attached_parts];
+    memset(part, 0, sizeof(Part));
 
-    // The actual JSON object may be preceded by other text in the error buffer.
-    // Find the opening brace to ensure we parse only the JSON part.
-    const char* json_start = strchr(error_buffer, '{');
-    if (!json_start) {
-        // If no JSON object is found, print the raw error buffer as-is.
-        fprintf(stderr, "API Error: %s\n", error_buffer);
-        return;
-    }
+    if (state->free_mode) {
+        if (total_read > INT_MAX) {
+            fprintf(stderr, "Error: '%s' is too large to attach in free mode.\n", filepath);
+            goto cleanup;
+        }
+        if (strcmp(filepath, "stdin") == 0) {
+            const char* format = "\n--- Pasted Text ---\n%.*s\n--- End of Pasted Text ---\n";
+            size_t len = snprintf(NULL, 0, format, (int)total_read, (const char*)blob->data);
+            formatted_text = malloc(len + 1);
+            if (formatted_text) sprintf(formatted_text, format, (int)total_read, (const char*)blob->data);
+        } else {
+            const char* format = "\n--- Attached File: %s ---\n%.*s\n--- End of File ---\n";
+            size_t len = snprintf(NULL, 0, format, filepath, (int)total_read, (const char*)blob->data);
+            formatted_text = malloc(len + 1);
+            if (formatted_text) sprintf(formatted_text, format, filepath, (int)total_read, (const char*)blob->data);
+        }
 
-    cJSON* root = cJSON_Parse(json_start);
-    if (!root) {
-        // If parsing fails, we can't extract a specific message.
-        return;
-    }
+        if (!formatted_text) {
+            fprintf(stderr, "Error: Failed to allocate memory for formatted text.\n");
+            goto cleanup;
+        }
+        part->type = PART_TYPE_TEXT;
+        part->text = formatted_text;
+    } else { // Official API mode
+        // Content attached before, in this session or a loaded one, is shared.
+        blob = blob_store_intern(&state->blob_store, blob);
+        part->filename = strdup(filepath);
+        part->mime_type = strdup(mime_type);
+        bool uploaded = false;
+        if (state->files.enabled && total_read >= FILES_UPLOAD_MIN_BYTES && state->num_api_keys > 0 && part->mime_type) {
+            uploaded = files_api_attach(state, blob, mime_type, filepath, part);
+            if (!uploaded && interrupt_flag) {
+                fprintf(stderr, "\n[Interrupted]\n");
+                interrupt_flag = 0;
+                free(part->filename);
+                free(part->mime_type);
+                goto cleanup;
+            }
+            if (!uploaded) {
+                fprintf(stderr, "Warning: Upload through the Files API failed, attaching '%s' inline.\n", filepath);
+            }
+        }
+        // The data stays in the blob and is base64-encoded only as it is sent;
+        // an uploaded file keeps it to be uploaded again once it expired.
+        if (!uploaded) part->type = PART_TYPE_FILE;
+        part->blob = blob_retain(blob);
 
-    cJSON* error = cJSON_GetObjectItem(root, "error");
-    if (error) {
-        cJSON* message = cJSON_GetObjectItem(error, "message");
-        if (cJSON_IsString(message) && message->valuestring) {
-            // Print the clean, user-friendly error message from the API.
-            fprintf(stderr, "API Error Message: %s\n", message->valuestring);
+        if (!part->filename || !part->mime_type) {
+             fprintf(stderr, "Error: Failed to allocate memory for attachment metadata.\n");
+             if (part->filename) free(part->filename);
+             if (part->mime_type) free(part->mime_type);
+             if (part->uri) free(part->uri);
+             blob_release(part->blob);
+             goto cleanup;
         }
     }
 
-    cJSON_Delete(root);
-}
-
-/**
- * @brief A libcurl write callback for non-streaming API responses.
- * @details This function is used for API calls that return a complete JSON
- *          object in a single response (e.g., `countTokens`). It simply
- *          appends all received data chunks into the MemoryStruct's buffer
- *          until the request is finished.
- * @param contents A pointer to the data received.
- * @param size The size of each data member (always 1 for text).
- * @param nmemb The number of data members received.
- * @param userp A user-defined pointer to a MemoryStruct to store the data.
- * @return The total number of bytes successfully handled.
- */
-static size_t write_to_memory_struct_callback(void* contents, size_t size, size_t nmemb, void* userp) {
-    size_t realsize = size * nmemb;
-    MemoryStruct* mem = (MemoryStruct*)userp;
+    fprintf(stderr, "Attached %s (MIME: %s, Size: %zu bytes%s%s)\n",
+            state->free_mode ? "stdin/file" : part->filename,
+            state->free_mode ? "text/plain" : part->mime_type,
+            total_read, part->uri ? ", uploaded as " : "", part->uri ? part->uri : "");
+    (state->num_attached_parts)++;
 
-    // Expand the buffer to accommodate the new data chunk.
-    char* ptr = realloc(mem->buffer, mem->size + realsize + 1);
-    if (!ptr) {
-        fprintf(stderr, "Error: realloc failed in token count callback.\n");
-        return 0; // Signal an error to libcurl.
+cleanup:
+    free(buffer);
+    blob_release(blob);
+    if (opened_here && input_stream) {
+        fclose(input_stream);
     }
-    mem->buffer = ptr;
-
-    // Append the new data and update the size.
-    memcpy(&(mem->buffer[mem->size]), contents, realsize);
-    mem->size += realsize;
-    mem->buffer[mem->size] = '\0'; // Ensure the buffer is always null-terminated.
-
-    return realsize;
 }
 
+static const char base64_alphabet[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+
+// The value of every byte as a Base64 digit; 0xFF for anything else, including '='.
+static const unsigned char base64_values[256] = {
+    0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+    0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+    0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,   62, 0xFF, 0xFF, 0xFF,   63,
+      52,   53,   54,   55,   56,   57,   58,   59,   60,   61, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+    0xFF,    0,    1,    2,    3,    4,    5,    6,    7,    8,    9,   10,   11,   12,   13,   14,
+      15,   16,   17,   18,   19,   20,   21,   22,   23,   24,   25, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+    0xFF,   26,   27,   28,   29,   30,   31,   32,   33,   34,   35,   36,   37,   38,   39,   40,
+      41,   42,   43,   44,   45,   46,   47,   48,   49,   50,   51, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+    0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+    0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+    0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+    0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+    0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+    0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+    0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+    0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+};
+
 /**
- * @brief Calculates the token count for the current conversation history.
- * @details This function sends the current conversation contents to the Gemini
- *          API's `countTokens` endpoint. It builds a request similar to a
- *          standard generation request but omits unnecessary fields like
- *          `generationConfig`. It then parses the response to extract the integer
- *          value for the total token count.
- * @param state The current application state, containing the history to be counted.
- * @return The integer token count on success, or -1 on failure.
+ * @brief A set of Base64 kernels for one instruction set.
+ * @details The kernels convert the bulk of the input and leave the rest to the
+ *          scalar code: `encode` converts whole groups of three bytes, and
+ *          `decode` whole groups of four characters, stopping before a block
+ *          that holds anything but Base64 digits. Both return how much of the
+ *          input they consumed. NULL kernels mean the scalar code does it all.
  */
-int get_token_count(AppState* state) {
-    // Build the request JSON, which includes history and system prompt.
-    cJSON* root = build_request_json(state);
-    if (!root) return -1;
+typedef struct {
+    const char* name;
+    bool (*supported)(void);
+    size_t (*encode)(const unsigned char* in, size_t length, char* out);
+    size_t (*decode)(const char* in, size_t length, unsigned char* out);
+} Base64Kernels;
 
-    // The countTokens endpoint does not use these fields, so remove them.
-    cJSON_DeleteItemFromObject(root, "generationConfig");
-    cJSON_DeleteItemFromObject(root, "tools");
-    cJSON_DeleteItemFromObject(root, "safetySettings");
+/**
+ * @brief Encodes binary data as Base64 three bytes at a time.
+ * @details The reference the vector kernels are checked against, and the code
+ *          that finishes their work, including the padding.
+ * @param data The data.
+ * @param input_length Its size in bytes.
+ * @param out Receives 4 * ((input_length + 2) / 3) characters.
+ * @return The number of characters written.
+ */
+static size_t base64_encode_scalar(const unsigned char* data, size_t input_length, char* out) {
+    // Calculate the length of the output string.
+    size_t output_length = 4 * ((input_length + 2) / 3);
 
-    // Serialize and compress the payload.
-    char* json_string = cJSON_PrintUnformatted(root);
-    cJSON_Delete(root);
-    if (!json_string) return -1;
+    // Process the input data in 3-byte chunks, converting them to 4 Base64 characters.
+    for (size_t i = 0, j = 0; i < input_length;) {
+        uint32_t octet_a = i < input_length ? data[i++] : 0;
+        uint32_t octet_b = i < input_length ? data[i++] : 0;
+        uint32_t octet_c = i < input_length ? data[i++] : 0;
 
-    GzipResult compressed_result = gzip_compress((unsigned char*)json_string, strlen(json_string));
-    free(json_string);
-    if (!compressed_result.data) {
-        fprintf(stderr, "Failed to compress payload for token count.\n");
-        return -1;
-    }
+        uint32_t triple = (octet_a << 16) + (octet_b << 8) + octet_c;
 
-    // Prepare a memory buffer for the API response.
-    MemoryStruct chunk = { .buffer = malloc(1), .size = 0 };
-    if (!chunk.buffer) {
-        free(compressed_result.data);
-        return -1;
+        out[j++] = base64_alphabet[(triple >> 18) & 0x3F];
+        out[j++] = base64_alphabet[(triple >> 12) & 0x3F];
+        out[j++] = base64_alphabet[(triple >> 6) & 0x3F];
+        out[j++] = base64_alphabet[triple & 0x3F];
     }
-    chunk.buffer[0] = '\0';
-
-    // Perform the API call to the "countTokens" endpoint.
-    long http_code = perform_api_curl_request(
-        state,
-        "countTokens",
-        (const char*)compressed_result.data,
-        compressed_result.size,
-        write_to_memory_struct_callback, // Use the simple, non-streaming callback.
-        &chunk
-    );
 
-    int token_count = -1;
-    if (http_code == 200) {
-        // If successful, parse the JSON response.
-        cJSON* json_resp = cJSON_Parse(chunk.buffer);
-        if (json_resp) {
-            // Extract the "totalTokens" value.
-            cJSON* tokens = cJSON_GetObjectItem(json_resp, "totalTokens");
-            if (cJSON_IsNumber(tokens)) {
-                token_count = tokens->valueint;
-            }
-            cJSON_Delete(json_resp);
-        }
-    } else {
-        // On failure, print the error.
-        fprintf(stderr, "Token count API call failed (HTTP code: %ld)\n", http_code);
-        if (http_code < 0) fprintf(stderr, "Curl error: %s\n", curl_easy_strerror(-http_code));
-        parse_and_print_error_json(chunk.buffer);
+    // Add padding characters ('=') if the input length was not a multiple of 3.
+    static const int mod_table[] = {0, 2, 1};
+    for (int i = 0; i < mod_table[input_length % 3]; i++) {
+        out[output_length - 1 - i] = '=';
     }
-
-    // Clean up resources.
-    free(compressed_result.data);
-    free(chunk.buffer);
-    return token_count;
+    return output_length;
 }
 
 /**
- * @brief Saves the current conversation state to a JSON file.
- * @details This function serializes the entire application state, including the
- *          conversation history, system prompt, and configuration, into a JSON
- *          object using `build_request_json`. It then saves this JSON to the
- *          specified file path, allowing a session to be resumed later.
- * @param state A pointer to the current application state to be saved.
- * @param filepath The path of the file where the history will be saved.
+ * @brief Decodes Base64 text four characters at a time.
+ * @details The reference the vector kernels are checked against, and the code
+ *          that finishes their work. Only strict Base64 is accepted: digits
+ *          from the standard alphabet, with at most two '=' at the very end.
+ * @param in The text.
+ * @param length Its length, a multiple of 4.
+ * @param out Receives up to length / 4 * 3 bytes.
+ * @return The number of bytes written, or (size_t)-1 if the text is not Base64.
  */
-void save_history_to_file(AppState* state, const char* filepath) {
-    FILE* file = fopen(filepath, "w");
-    if (!file) {
-        perror("Failed to open file for writing");
-        return;
-    }
-
-    // Use the existing function to build a complete JSON representation of the state.
-    cJSON* root = build_request_json(state);
-    if (!root) {
-        fclose(file);
-        return;
-    }
+static size_t base64_decode_scalar(const char* in, size_t length, unsigned char* out) {
+    size_t j = 0;
+    for (size_t i = 0; i < length; i += 4) {
+        int padding = 0;
+        if (i + 4 == length && in[i + 3] == '=') padding = in[i + 2] == '=' ? 2 : 1;
+
+        uint32_t sextet_a = base64_values[(unsigned char)in[i]];
+        uint32_t sextet_b = base64_values[(unsigned char)in[i + 1]];
+        uint32_t sextet_c = padding == 2 ? 0 : base64_values[(unsigned char)in[i + 2]];
+        uint32_t sextet_d = padding ? 0 : base64_values[(unsigned char)in[i + 3]];
+        if ((sextet_a | sextet_b | sextet_c | sextet_d) & 0xC0) return (size_t)-1;
 
-    // Convert the cJSON object to a formatted, human-readable string.
-    char* json_string = cJSON_Print(root);
-    cJSON_Delete(root);
+        uint32_t triple = (sextet_a << 18) + (sextet_b << 12) + (sextet_c << 6) + sextet_d;
 
-    if (json_string) {
-        fputs(json_string, file);
-        free(json_string);
+        out[j++] = (triple >> 16) & 0xFF;
+        if (padding < 2) out[j++] = (triple >> 8) & 0xFF;
+        if (padding < 1) out[j++] = triple & 0xFF;
     }
-
-    fclose(file);
-    fprintf(stderr, "Conversation history saved to %s\n", filepath);
+    return j;
 }
 
 /**
- * @brief Loads a conversation state from a JSON file.
- * @details This function reads a JSON file from the given path, parses it, and
- *          repopulates the application's state. It clears any existing history
- *          before loading the new data. It carefully iterates through the JSON
- *          structure to reconstruct the `contents` (history), `systemInstruction`,
- *          and other settings.
- * @param state A pointer to the AppState struct that will be overwritten with the
- *              loaded data.
- * @param filepath The path of the file from which to load the history.
+ * @brief Decodes Base64 text the way the client did before the vector kernels.
+ * @details Kept unchanged as the reference `benchmark_base64_equivalent`
+ *          checks the decoders against, except that it no longer reads before
+ *          empty input or past its table for bytes above 127, which now
+ *          decode to 0. `base64_decode` differs from it on purpose in two
+ *          ways. It rejects text that `base64_is_strict` does not accept,
+ *          where this decodes stray characters and misplaced '=' to garbage.
+ *          And it decodes padding correctly: this reads '=' as the digit -1,
+ *          which garbles the last byte or two before it, so the check
+ *          replaces the padding with 'A' (0) and drops the extra bytes.
+ * @param data The text.
+ * @param input_len Its length.
+ * @return The decoded bytes, NULL data if the length is not a multiple of 4.
  */
-void load_history_from_file(AppState* state, const char* filepath) {
-    FILE* file = fopen(filepath, "r");
-    if (!file) {
-        perror("Failed to open file for reading");
-        return;
-    }
-
-    // Read the entire file content into a memory buffer.
-    fseek(file, 0, SEEK_END);
-    long length = ftell(file);
-    fseek(file, 0, SEEK_SET);
-    char* buffer = malloc(length + 1);
-    if (!buffer) {
-        fclose(file);
-        return;
-    }
-    if (fread(buffer, 1, length, file) != (size_t)length) {
-        fclose(file);
-        free(buffer);
-        fprintf(stderr, "Error reading file content.\n");
-        return;
-    }
-    buffer[length] = '\0';
-    fclose(file);
-
-    // Parse the buffer into a cJSON object.
-    cJSON* root = cJSON_Parse(buffer);
-    free(buffer);
-    if (!cJSON_IsObject(root)) {
-        fprintf(stderr, "Error: JSON file is not a valid history object.\n");
-        if(root) cJSON_Delete(root);
-        return;
-    }
-
-    // --- Repopulate the AppState ---
-
-    // 1. Clear existing history before loading the new session.
-    free_history(&state->history);
+static Base64DecodeResult base64_decode_reference(const char* data, size_t input_len) {
+    static const int b64_inv_table[256] = {
+        -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+        -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+        -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, 62, -1, -1, -1, 63,
+        52, 53, 54, 55, 56, 57, 58, 59, 60, 61, -1, -1, -1, -1, -1, -1,
+        -1,  0,  1,  2,  3,  4,  5,  6,  7,  8,  9, 10, 11, 12, 13, 14,
+        15, 16, 17, 18, 19, 20, 21, 22, 23, 24, 25, -1, -1, -1, -1, -1,
+        -1, 26, 27, 28, 29, 30, 31, 32, 33, 34, 35, 36, 37, 38, 39, 40,
+        41, 42, 43, 44, 45, 46, 47, 48, 49, 50, 51, -1, -1, -1, -1, -1
+        // Bytes above 127 decode to 0.
+    };
 
-    // 2. Load the conversation history ("contents").
-    cJSON* contents = cJSON_GetObjectItem(root, "contents");
-    if (cJSON_IsArray(contents)) {
-        cJSON* content_item;
-        cJSON_ArrayForEach(content_item, contents) {
-            cJSON* role_json = cJSON_GetObjectItem(content_item, "role");
-            cJSON* parts_array = cJSON_GetObjectItem(content_item, "parts");
-            if (!cJSON_IsString(role_json) || !cJSON_IsArray(parts_array)) continue;
+    Base64DecodeResult result = { .data = NULL, .size = 0 };
 
-            int num_parts = cJSON_GetArraySize(parts_array);
-            Part* loaded_parts = calloc(num_parts, sizeof(Part)); // Use calloc for zero-initialization
-            if (!loaded_parts) continue;
+    if (input_len % 4 != 0) return result; // Invalid Base64 length
 
-            cJSON* part_item;
-            int part_idx = 0;
-            cJSON_ArrayForEach(part_item, parts_array) {
-                if (part_idx >= num_parts) break; // Should not happen, but safe
-                cJSON* text_json = cJSON_GetObjectItem(part_item, "text");
-                cJSON* inline_data_json = cJSON_GetObjectItem(part_item, "inlineData");
-                cJSON* file_data_json = cJSON_GetObjectItem(part_item, "fileData");
+    result.size = input_len / 4 * 3;
+    if (input_len > 0 && data[input_len - 1] == '=') (result.size)--;
+    if (input_len > 0 && data[input_len - 2] == '=') (result.size)--;
 
-                if (cJSON_IsString(text_json)) {
-                    loaded_parts[part_idx].type = PART_TYPE_TEXT;
-                    loaded_parts[part_idx].text = strdup(text_json->valuestring);
-                } else if (file_data_json) {
-                    cJSON* uri_json = cJSON_GetObjectItem(file_data_json, "fileUri");
-                    cJSON* mime_json = cJSON_GetObjectItem(file_data_json, "mimeType");
-                    if (cJSON_IsString(uri_json) && cJSON_IsString(mime_json)) {
-                        loaded_parts[part_idx].type = PART_TYPE_URI;
-                        loaded_parts[part_idx].uri = strdup(uri_json->valuestring);
-                        loaded_parts[part_idx].mime_type = strdup(mime_json->valuestring);
-                    }
-                } else if (inline_data_json) {
-                    cJSON* mime_json = cJSON_GetObjectItem(inline_data_json, "mimeType");
-                    cJSON* data_json = cJSON_GetObjectItem(inline_data_json, "data");
-                    if (cJSON_IsString(mime_json) && cJSON_IsString(data_json)) {
-                        loaded_parts[part_idx].type = PART_TYPE_FILE;
-                        loaded_parts[part_idx].mime_type = strdup(mime_json->valuestring);
-                        loaded_parts[part_idx].base64_data = strdup(data_json->valuestring);
-                    }
-                }
-                part_idx++;
-            }
-            add_content_to_history(&state->history, role_json->valuestring, loaded_parts, num_parts);
+    result.data = malloc(result.size + 1);
+    if (!result.data) return result;
 
-            // Free the temporary parts structure.
-            for (int i = 0; i < num_parts; i++) {
-                if (loaded_parts[i].text) free(loaded_parts[i].text);
-                if (loaded_parts[i].mime_type) free(loaded_parts[i].mime_type);
-                if (loaded_parts[i].base64_data) free(loaded_parts[i].base64_data);
-            }
-            free(loaded_parts);
-        }
-    }
+    for (size_t i = 0, j = 0; i < input_len; ) {
+        uint32_t sextet_a = (i < input_len) ? b64_inv_table[(unsigned char)data[i++]] : 0;
+        uint32_t sextet_b = (i < input_len) ? b64_inv_table[(unsigned char)data[i++]] : 0;
+        uint32_t sextet_c = (i < input_len) ? b64_inv_table[(unsigned char)data[i++]] : 0;
+        uint32_t sextet_d = (i < input_len) ? b64_inv_table[(unsigned char)data[i++]] : 0;
 
-    // 3. Load the system prompt.
-    cJSON* sys_instruction = cJSON_GetObjectItem(root, "systemInstruction");
-    if (sys_instruction) {
-        cJSON* parts_array = cJSON_GetObjectItem(sys_instruction, "parts");
-        if (cJSON_IsArray(parts_array)) {
-            cJSON* part_item = cJSON_GetArrayItem(parts_array, 0);
-            if (part_item) {
-                cJSON* text_item = cJSON_GetObjectItem(part_item, "text");
-                if (cJSON_IsString(text_item)) {
-                    if (state->system_prompt) free(state->system_prompt);
-                    state->system_prompt = strdup(text_item->valuestring);
-                }
-            }
-        }
+        uint32_t triple = (sextet_a << 18) + (sextet_b << 12) + (sextet_c << 6) + sextet_d;
+
+        if (j < result.size) result.data[j++] = (triple >> 16) & 0xFF;
+        if (j < result.size) result.data[j++] = (triple >> 8) & 0xFF;
+        if (j < result.size) result.data[j++] = triple & 0xFF;
     }
 
-    cJSON_Delete(root);
-    fprintf(stderr, "Conversation history loaded from %s\n", filepath);
+    result.data[result.size] = '\0';
+    return result;
 }
 
 /**
- * @brief Adds a new content block (a user or model turn) to the conversation history.
- * @details This function appends a new `Content` struct to the history array.
- *          It performs a deep copy of the role string and all the `Part` structs
- *          provided, ensuring that the history owns its own memory.
- * @param history A pointer to the History struct to be modified.
- * @param role The role for this turn, either "user" or "model".
- * @param parts An array of Part structs that make up this turn's content.
- * @param num_parts The number of parts in the `parts` array.
+ * @brief Tells whether text is strict Base64: a multiple of 4 characters from
+ *        the standard alphabet, with at most two '=' at the very end.
+ * @details The input `base64_decode` accepts; see `base64_decode_reference`.
  */
-void add_content_to_history(History* history, const char* role, Part* parts, int num_parts) {
-    // Expand the contents array to make room for the new entry.
-    Content* new_contents = realloc(history->contents, sizeof(Content) * (history->num_contents + 1));
-    if (!new_contents) {
-        fprintf(stderr, "Error: realloc failed when adding to history.\n");
-        return;
+static bool base64_is_strict(const char* text, size_t length) {
+    if (length % 4 != 0) return false;
+    size_t padding = 0;
+    while (padding < 2 && padding < length && text[length - 1 - padding] == '=') padding++;
+    for (size_t i = 0; i < length - padding; i++) {
+        if (!memchr(base64_alphabet, text[i], 64)) return false;
     }
-    history->contents = new_contents;
+    return true;
+}
 
-    // Get a pointer to the new content block at the end of the array.
-    Content* new_content = &history->contents[history->num_contents];
-    new_content->role = strdup(role);
-    new_content->num_parts = num_parts;
-    new_content->parts = calloc(num_parts, sizeof(Part));
+#if defined(__x86_64__) || defined(__i386__)
+/**
+ * @brief Tells whether the CPU has AVX2.
+ */
+static bool base64_has_avx2(void) {
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("avx2");
+}
 
-    if (!new_content->parts || !new_content->role) {
-        fprintf(stderr, "Error: malloc failed for new history content.\n");
-        // Attempt to roll back the realloc if allocation fails here.
-        if (new_content->role) free(new_content->role);
-        if (new_content->parts) free(new_content->parts);
-        history->contents = realloc(history->contents, sizeof(Content) * history->num_contents);
-        return;
-    }
+/**
+ * @brief Tells whether the CPU has SSSE3.
+ */
+static bool base64_has_ssse3(void) {
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("ssse3");
+}
 
-    // Perform a deep copy of each part from the input array into the history.
-    for (int i = 0; i < num_parts; i++) {
-        new_content->parts[i].type = parts[i].type;
-        if (parts[i].type == PART_TYPE_TEXT) {
-            new_content->parts[i].text = parts[i].text ? strdup(parts[i].text) : NULL;
-            new_content->parts[i].mime_type = NULL;
-            new_content->parts[i].base64_data = NULL;
-            new_content->parts[i].filename = NULL;
-        } else if (parts[i].type == PART_TYPE_URI) {
-            new_content->parts[i].text = NULL;
-            new_content->parts[i].mime_type = parts[i].mime_type ? strdup(parts[i].mime_type) : NULL;
-            new_content->parts[i].base64_data = NULL;
-            new_content->parts[i].filename = NULL;
-            new_content->parts[i].uri = parts[i].uri ? strdup(parts[i].uri) : NULL;
-        } else { // PART_TYPE_FILE
-            new_content->parts[i].text = NULL;
-            new_content->parts[i].mime_type = parts[i].mime_type ? strdup(parts[i].mime_type) : NULL;
-            new_content->parts[i].base64_data = parts[i].base64_data ? strdup(parts[i].base64_data) : NULL;
-            new_content->parts[i].filename = parts[i].filename ? strdup(parts[i].filename) : NULL;
-        }
-    }
-    history->num_contents++;
+/**
+ * @brief Encodes 12 bytes at a time with SSSE3.
+ * @details Each group of three bytes is spread over four bytes, the four
+ *          sextets are moved into place with two multiplies, and a 16-entry
+ *          table maps each sextet to the offset that turns it into its digit.
+ *          Reads 16 bytes per 12 consumed.
+ */
+__attribute__((target("ssse3")))
+static size_t base64_encode_ssse3(const unsigned char* in, size_t length, char* out) {
+    const __m128i spread = _mm_setr_epi8(1, 0, 2, 1, 4, 3, 5, 4, 7, 6, 8, 7, 10, 9, 11, 10);
+    const __m128i offsets = _mm_setr_epi8('a' - 26, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52,
+                                          '0' - 52, '0' - 52, '0' - 52, '0' - 52, '+' - 62, '/' - 63, 'A', 0, 0);
+    size_t i = 0, j = 0;
+    for (; i + 16 <= length; i += 12, j += 16) {
+        __m128i v = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)(in + i)), spread);
+        __m128i ac = _mm_mulhi_epu16(_mm_and_si128(v, _mm_set1_epi32(0x0fc0fc00)), _mm_set1_epi32(0x04000040));
+        __m128i bd = _mm_mullo_epi16(_mm_and_si128(v, _mm_set1_epi32(0x003f03f0)), _mm_set1_epi32(0x01000010));
+        __m128i sextets = _mm_or_si128(ac, bd);
+        __m128i range = _mm_subs_epu8(sextets, _mm_set1_epi8(51));
+        range = _mm_or_si128(range, _mm_and_si128(_mm_cmpgt_epi8(_mm_set1_epi8(26), sextets), _mm_set1_epi8(13)));
+        _mm_storeu_si128((__m128i*)(out + j), _mm_add_epi8(sextets, _mm_shuffle_epi8(offsets, range)));
+    }
+    return i;
 }
 
 /**
- * @brief Frees all memory associated with a single Content struct.
- * @details This is a helper function for cleaning up history. It deallocates the
- *          memory for the role string and for each individual part within the
- *          content block, including text, MIME types, Base64 data, and filenames.
- * @param content A pointer to the Content struct to be freed.
+ * @brief Decodes 16 characters at a time with SSSE3.
+ * @details Two 16-entry tables indexed by the low and high nibble of each
+ *          character flag invalid characters, a third maps the high nibble to
+ *          the offset that turns a digit into its value, and two multiply-adds
+ *          pack the sextets into bytes. Writes 16 bytes per 12 produced.
  */
-void free_content(Content* content) {
-    if (!content) return;
+__attribute__((target("ssse3")))
+static size_t base64_decode_ssse3(const char* in, size_t length, unsigned char* out) {
+    const __m128i lut_lo = _mm_setr_epi8(0x15, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11,
+                                         0x11, 0x11, 0x13, 0x1A, 0x1B, 0x1B, 0x1B, 0x1A);
+    const __m128i lut_hi = _mm_setr_epi8(0x10, 0x10, 0x01, 0x02, 0x04, 0x08, 0x04, 0x08,
+                                         0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10);
+    const __m128i lut_roll = _mm_setr_epi8(0, 16, 19, 4, -65, -65, -71, -71, 0, 0, 0, 0, 0, 0, 0, 0);
+    const __m128i pack = _mm_setr_epi8(2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1);
+    const __m128i nibble = _mm_set1_epi8(0x0f);
+    size_t i = 0, j = 0;
+    for (; i + 32 <= length; i += 16, j += 12) {
+        __m128i v = _mm_loadu_si128((const __m128i*)(in + i));
+        __m128i hi_nibbles = _mm_and_si128(_mm_srli_epi32(v, 4), nibble);
+        __m128i flags = _mm_and_si128(_mm_shuffle_epi8(lut_lo, _mm_and_si128(v, nibble)), _mm_shuffle_epi8(lut_hi, hi_nibbles));
+        if (_mm_movemask_epi8(_mm_cmpeq_epi8(flags, _mm_setzero_si128())) != 0xFFFF) break;
+        __m128i roll = _mm_shuffle_epi8(lut_roll, _mm_add_epi8(_mm_cmpeq_epi8(v, _mm_set1_epi8('/')), hi_nibbles));
+        v = _mm_maddubs_epi16(_mm_add_epi8(v, roll), _mm_set1_epi32(0x01400140));
+        v = _mm_madd_epi16(v, _mm_set1_epi32(0x00011000));
+        _mm_storeu_si128((__m128i*)(out + j), _mm_shuffle_epi8(v, pack));
+    }
+    return i;
+}
 
-    // Free the role string (e.g., "user", "model").
-    if (content->role) free(content->role);
+/**
+ * @brief Encodes 24 bytes at a time with AVX2.
+ * @details The SSSE3 kernel with each 128-bit lane taking 12 bytes. Reads 28
+ *          bytes per 24 consumed.
+ */
+__attribute__((target("avx2")))
+static size_t base64_encode_avx2(const unsigned char* in, size_t length, char* out) {
+    const __m256i spread = _mm256_broadcastsi128_si256(_mm_setr_epi8(1, 0, 2, 1, 4, 3, 5, 4, 7, 6, 8, 7, 10, 9, 11, 10));
+    const __m256i offsets = _mm256_broadcastsi128_si256(
+        _mm_setr_epi8('a' - 26, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52,
+                      '0' - 52, '0' - 52, '0' - 52, '0' - 52, '+' - 62, '/' - 63, 'A', 0, 0));
+    size_t i = 0, j = 0;
+    for (; i + 28 <= length; i += 24, j += 32) {
+        __m256i v = _mm256_inserti128_si256(_mm256_castsi128_si256(_mm_loadu_si128((const __m128i*)(in + i))),
+                                            _mm_loadu_si128((const __m128i*)(in + i + 12)), 1);
+        v = _mm256_shuffle_epi8(v, spread);
+        __m256i ac = _mm256_mulhi_epu16(_mm256_and_si256(v, _mm256_set1_epi32(0x0fc0fc00)), _mm256_set1_epi32(0x04000040));
+        __m256i bd = _mm256_mullo_epi16(_mm256_and_si256(v, _mm256_set1_epi32(0x003f03f0)), _mm256_set1_epi32(0x01000010));
+        __m256i sextets = _mm256_or_si256(ac, bd);
+        __m256i range = _mm256_subs_epu8(sextets, _mm256_set1_epi8(51));
+        range = _mm256_or_si256(range, _mm256_and_si256(_mm256_cmpgt_epi8(_mm256_set1_epi8(26), sextets), _mm256_set1_epi8(13)));
+        _mm256_storeu_si256((__m256i*)(out + j), _mm256_add_epi8(sextets, _mm256_shuffle_epi8(offsets, range)));
+    }
+    return i;
+}
 
-    // Free the data within each part of the content.
-    if (content->parts) {
-        for (int i = 0; i < content->num_parts; i++) {
-            if (content->parts[i].text) free(content->parts[i].text);
-            if (content->parts[i].mime_type) free(content->parts[i].mime_type);
-            if (content->parts[i].base64_data) free(content->parts[i].base64_data);
-            if (content->parts[i].filename) free(content->parts[i].filename);
-            if (content->parts[i].uri) free(content->parts[i].uri);
+/**
+ * @brief Decodes 32 characters at a time with AVX2.
+ * @details The SSSE3 kernel on two lanes; the 12 bytes of each lane are then
+ *          joined with a cross-lane permute. Writes 32 bytes per 24 produced.
+ */
+__attribute__((target("avx2")))
+static size_t base64_decode_avx2(const char* in, size_t length, unsigned char* out) {
+    const __m256i lut_lo = _mm256_broadcastsi128_si256(_mm_setr_epi8(0x15, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11,
+                                                                     0x11, 0x11, 0x13, 0x1A, 0x1B, 0x1B, 0x1B, 0x1A));
+    const __m256i lut_hi = _mm256_broadcastsi128_si256(_mm_setr_epi8(0x10, 0x10, 0x01, 0x02, 0x04, 0x08, 0x04, 0x08,
+                                                                     0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10));
+    const __m256i lut_roll = _mm256_broadcastsi128_si256(_mm_setr_epi8(0, 16, 19, 4, -65, -65, -71, -71, 0, 0, 0, 0, 0, 0, 0, 0));
+    const __m256i pack = _mm256_broadcastsi128_si256(_mm_setr_epi8(2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1));
+    const __m256i join = _mm256_setr_epi32(0, 1, 2, 4, 5, 6, 7, 7);
+    const __m256i nibble = _mm256_set1_epi8(0x0f);
+    size_t i = 0, j = 0;
+    for (; i + 64 <= length; i += 32, j += 24) {
+        __m256i v = _mm256_loadu_si256((const __m256i*)(in + i));
+        __m256i hi_nibbles = _mm256_and_si256(_mm256_srli_epi32(v, 4), nibble);
+        __m256i lo = _mm256_shuffle_epi8(lut_lo, _mm256_and_si256(v, nibble));
+        __m256i hi = _mm256_shuffle_epi8(lut_hi, hi_nibbles);
+        if (!_mm256_testz_si256(lo, hi)) break;
+        __m256i roll = _mm256_shuffle_epi8(lut_roll, _mm256_add_epi8(_mm256_cmpeq_epi8(v, _mm256_set1_epi8('/')), hi_nibbles));
+        v = _mm256_maddubs_epi16(_mm256_add_epi8(v, roll), _mm256_set1_epi32(0x01400140));
+        v = _mm256_madd_epi16(v, _mm256_set1_epi32(0x00011000));
+        v = _mm256_permutevar8x32_epi32(_mm256_shuffle_epi8(v, pack), join);
+        _mm256_storeu_si256((__m256i*)(out + j), v);
+    }
+    return i;
+}
+#elif defined(__aarch64__)
+/**
+ * @brief Encodes 48 bytes at a time with NEON.
+ * @details De-interleaving loads split the input into the first, second and
+ *          third bytes of each group, shifts form the sextets, and a 64-entry
+ *          table lookup turns them into digits.
+ */
+static size_t base64_encode_neon(const unsigned char* in, size_t length, char* out) {
+    const unsigned char* alphabet = (const unsigned char*)base64_alphabet;
+    const uint8x16x4_t table = { { vld1q_u8(alphabet), vld1q_u8(alphabet + 16), vld1q_u8(alphabet + 32), vld1q_u8(alphabet + 48) } };
+    const uint8x16_t mask = vdupq_n_u8(0x3F);
+    size_t i = 0, j = 0;
+    for (; i + 48 <= length; i += 48, j += 64) {
+        uint8x16x3_t v = vld3q_u8(in + i);
+        uint8x16x4_t digits;
+        digits.val[0] = vqtbl4q_u8(table, vshrq_n_u8(v.val[0], 2));
+        digits.val[1] = vqtbl4q_u8(table, vandq_u8(vorrq_u8(vshrq_n_u8(v.val[1], 4), vshlq_n_u8(v.val[0], 4)), mask));
+        digits.val[2] = vqtbl4q_u8(table, vandq_u8(vorrq_u8(vshrq_n_u8(v.val[2], 6), vshlq_n_u8(v.val[1], 2)), mask));
+        digits.val[3] = vqtbl4q_u8(table, vandq_u8(v.val[2], mask));
+        vst4q_u8((uint8_t*)out + j, digits);
+    }
+    return i;
+}
+
+/**
+ * @brief Decodes 64 characters at a time with NEON.
+ * @details Two 64-entry table lookups map the ASCII range to values, bytes
+ *          above it are caught by their top bit, and the sextets are packed
+ *          with shifts and stored interleaved.
+ */
+static size_t base64_decode_neon(const char* in, size_t length, unsigned char* out) {
+    const uint8x16x4_t low = { { vld1q_u8(base64_values), vld1q_u8(base64_values + 16),
+                                 vld1q_u8(base64_values + 32), vld1q_u8(base64_values + 48) } };
+    const uint8x16x4_t high = { { vld1q_u8(base64_values + 64), vld1q_u8(base64_values + 80),
+                                  vld1q_u8(base64_values + 96), vld1q_u8(base64_values + 112) } };
+    const uint8x16_t sixty_four = vdupq_n_u8(64);
+    size_t i = 0, j = 0;
+    for (; i + 64 <= length; i += 64, j += 48) {
+        uint8x16x4_t v = vld4q_u8((const uint8_t*)in + i);
+        uint8x16_t error = vdupq_n_u8(0);
+        for (int k = 0; k < 4; k++) {
+            uint8x16_t value = vqtbx4q_u8(vqtbl4q_u8(low, v.val[k]), high, vsubq_u8(v.val[k], sixty_four));
+            error = vorrq_u8(error, vorrq_u8(value, v.val[k]));
+            v.val[k] = value;
         }
-        // Free the array of parts itself.
-        free(content->parts);
-    }
+        if (vmaxvq_u8(error) & 0x80) break;
+        uint8x16x3_t bytes;
+        bytes.val[0] = vorrq_u8(vshlq_n_u8(v.val[0], 2), vshrq_n_u8(v.val[1], 4));
+        bytes.val[1] = vorrq_u8(vshlq_n_u8(v.val[1], 4), vshrq_n_u8(v.val[2], 2));
+        bytes.val[2] = vorrq_u8(vshlq_n_u8(v.val[2], 6), v.val[3]);
+        vst3q_u8(out + j, bytes);
+    }
+    return i;
 }
+#endif
+
+// Kernels from the fastest down; the first one the CPU supports is used.
+static const Base64Kernels base64_kernel_table[] = {
+#if defined(__x86_64__) || defined(__i386__)
+    { "avx2", base64_has_avx2, base64_encode_avx2, base64_decode_avx2 },
+    { "ssse3", base64_has_ssse3, base64_encode_ssse3, base64_decode_ssse3 },
+#elif defined(__aarch64__)
+    { "neon", NULL, base64_encode_neon, base64_decode_neon },
+#endif
+    { "scalar", NULL, NULL, NULL },
+};
+
+static const Base64Kernels* base64_selected = NULL;
+static pthread_once_t base64_select_once = PTHREAD_ONCE_INIT;
 
 /**
- * @brief Frees all memory used by pending attachments.
- * @details This function is called to clear the list of attachments that have
- *          been prepared but not yet sent with a prompt. It iterates through the
- *          `attached_parts` array and frees all dynamically allocated fields.
- * @param state A pointer to the AppState containing the attachments to clear.
+ * @brief Picks the fastest Base64 kernels the CPU supports.
  */
-void free_pending_attachments(AppState* state) {
-    for (int i = 0; i < state->num_attached_parts; i++) {
-        // Free all possible dynamically allocated fields for each pending part.
-        if (state->attached_parts[i].text) free(state->attached_parts[i].text);
-        if (state->attached_parts[i].filename) free(state->attached_parts[i].filename);
-        if (state->attached_parts[i].mime_type) free(state->attached_parts[i].mime_type);
-        if (state->attached_parts[i].base64_data) free(state->attached_parts[i].base64_data);
+static void base64_select_kernels(void) {
+    for (size_t i = 0; i < sizeof(base64_kernel_table) / sizeof(base64_kernel_table[0]); i++) {
+        const Base64Kernels* kernels = &base64_kernel_table[i];
+        if (!kernels->supported || kernels->supported()) {
+            base64_selected = kernels;
+            return;
+        }
     }
-    // Reset the counter to zero, effectively clearing the list.
-    state->num_attached_parts = 0;
 }
 
 /**
- * @brief Frees all memory associated with the entire conversation history.
- * @details This function iterates through every content block in the history,
- *          calling `free_content` on each one to perform a deep clean. Finally,
- *          it frees the top-level `contents` array itself and resets the history.
- * @param history A pointer to the History struct to be completely freed.
+ * @brief Returns the Base64 kernels used by `base64_encode_to` and `base64_decode`.
  */
-void free_history(History* history) {
-    if (!history) return;
-
-    // Free each content block in the history array.
-    for (int i = 0; i < history->num_contents; i++) {
-        free_content(&history->contents[i]);
-    }
+static const Base64Kernels* base64_kernels(void) {
+    pthread_once(&base64_select_once, base64_select_kernels);
+    return base64_selected;
+}
 
-    // Free the array of content blocks itself.
-    if (history->contents) {
-        free(history->contents);
-    }
+/**
+ * @brief Encodes with the given kernels, finishing with the scalar code.
+ */
+static size_t base64_encode_with(const Base64Kernels* kernels, const unsigned char* data, size_t input_length, char* out) {
+    size_t done = kernels->encode ? kernels->encode(data, input_length, out) : 0;
+    return done / 3 * 4 + base64_encode_scalar(data + done, input_length - done, out + done / 3 * 4);
+}
 
-    // Reset the history to a clean, empty state.
-    history->contents = NULL;
-    history->num_contents = 0;
+/**
+ * @brief Decodes with the given kernels, finishing with the scalar code.
+ * @details The last group of four, which may be padded, is always left to the
+ *          scalar code.
+ * @param kernels The kernels to use.
+ * @param data The text.
+ * @param length Its length, a multiple of 4.
+ * @param out Receives up to length / 4 * 3 bytes.
+ * @return The number of bytes written, or (size_t)-1 if the text is not Base64.
+ */
+static size_t base64_decode_into(const Base64Kernels* kernels, const char* data, size_t length, unsigned char* out) {
+    size_t done = kernels->decode && length > 4 ? kernels->decode(data, length - 4, out) : 0;
+    size_t written = base64_decode_scalar(data + done, length - done, out + done / 4 * 3);
+    return written == (size_t)-1 ? written : done / 4 * 3 + written;
 }
 
 /**
- * @brief Compresses data using the Gzip algorithm.
- * @details This function takes a buffer of input data and compresses it using
- *          zlib's deflate functionality with Gzip headers. This is used to
- *          reduce the size of the JSON payload sent to the Gemini API, which can
- *          improve network performance for large requests.
- * @param input_data A pointer to the raw data to be compressed.
- * @param input_size The size of the input data in bytes.
- * @return A GzipResult struct containing a pointer to the compressed data and
- *         its size. The `data` field will be NULL on failure. The caller is
- *         responsible for freeing the `data` buffer.
+ * @brief Decodes into a new buffer with the given kernels.
  */
-GzipResult gzip_compress(const unsigned char* input_data, size_t input_size) {
-    GzipResult result = { .data = NULL, .size = 0 };
-    z_stream strm = {0};
+static Base64DecodeResult base64_decode_with(const Base64Kernels* kernels, const char* data, size_t length) {
+    Base64DecodeResult result = { .data = NULL, .size = 0 };
+    if (length % 4 != 0) return result; // Invalid Base64 length
 
-    // Initialize the zlib stream for Gzip compression.
-    // 15 + 16 enables Gzip headers.
-    if (deflateInit2(&strm, Z_BEST_COMPRESSION, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
-        return result; // Return empty result on failure.
+    unsigned char* out = malloc(length / 4 * 3 + 1);
+    if (!out) return result;
+    size_t size = base64_decode_into(kernels, data, length, out);
+    if (size == (size_t)-1) {
+        free(out);
+        return result;
     }
+    result.data = out;
+    result.size = size;
+    result.data[result.size] = '\0';
+    return result;
+}
 
-    strm.avail_in = input_size;
-    strm.next_in = (Bytef*)input_data;
+/**
+ * @brief Encodes binary data as Base64 into a buffer the caller provides.
+ * @details The building block of `base64_encode`, also used to encode
+ *          attachments piece by piece while a request is sent (see
+ *          `content_stream_read`). Pieces whose size is a multiple of 3
+ *          encode to exactly the text of the whole. Uses the fastest kernels
+ *          the CPU supports (AVX2, SSSE3 or NEON).
+ * @param data A pointer to the raw binary data to be encoded.
+ * @param input_length The size of the input data in bytes.
+ * @param out Receives 4 * ((input_length + 2) / 3) characters; no terminator is added.
+ * @return The number of characters written.
+ */
+size_t base64_encode_to(const unsigned char* data, size_t input_length, char* out) {
+    return base64_encode_with(base64_kernels(), data, input_length, out);
+}
 
-    unsigned char out_chunk[GZIP_CHUNK_SIZE];
+/**
+ * @brief Encodes binary data into a Base64 string.
+ * @details This function implements the standard Base64 encoding algorithm. It
+ *          takes a buffer of binary data and converts it into a null-terminated
+ *          ASCII string suitable for embedding in JSON payloads.
+ * @param data A pointer to the raw binary data to be encoded.
+ * @param input_length The size of the input data in bytes.
+ * @return A dynamically allocated, null-terminated Base64 string. The caller
+ *         is responsible for freeing this memory. Returns NULL on failure.
+ */
+char* base64_encode(const unsigned char* data, size_t input_length) {
+    char* encoded_data = malloc(4 * ((input_length + 2) / 3) + 1);
+    if (!encoded_data) return NULL;
+    encoded_data[base64_encode_to(data, input_length, encoded_data)] = '\0';
+    return encoded_data;
+}
 
-    // Compress the data in chunks until all input is processed.
-    do {
-        strm.avail_out = GZIP_CHUNK_SIZE;
-        strm.next_out = out_chunk;
+/**
+ * @brief Decodes Base64 text of a known length into binary data.
+ * @param data The Base64 text; it need not be null-terminated.
+ * @param length The length of the text.
+ * @return A Base64DecodeResult struct. The `data` field contains the decoded
+ *         bytes, followed by a null terminator, and `size` holds the length.
+ *         The caller is responsible for freeing the `data` buffer. `data` will
+ *         be NULL if the text is not padded Base64.
+ */
+Base64DecodeResult base64_decode_length(const char* data, size_t length) {
+    return base64_decode_with(base64_kernels(), data, length);
+}
 
-        // Perform the compression. Z_FINISH tells zlib that this is the last chunk.
-        int ret = deflate(&strm, Z_FINISH);
-        if (ret != Z_STREAM_END && ret != Z_OK) {
-            deflateEnd(&strm);
-            if (result.data) free(result.data);
-            return (GzipResult){NULL, 0}; // Return empty result on failure.
+/**
+ * @brief Decodes a Base64 string into binary data.
+ * @param data The null-terminated Base64 string to decode.
+ * @return A Base64DecodeResult struct. The `data` field contains the decoded
+ *         bytes and `size` holds the length. The caller is responsible for
+ *         freeing the `data` buffer. `data` will be NULL on failure.
+ */
+Base64DecodeResult base64_decode(const char* data) {
+    return base64_decode_length(data, strlen(data));
+}
+
+/**
+ * @brief Checks a set of Base64 kernels against the reference code.
+ * @details Encodes and decodes random data of every length up to 512 bytes at
+ *          every alignment; the text must be that of `base64_encode_scalar`
+ *          and decode back to the data. Then decodes 256-character texts,
+ *          unpadded and with one and two '=', with every possible byte in
+ *          every position (in the last four only, for the padded ones). A
+ *          text `base64_is_strict` accepts must decode to exactly what
+ *          `base64_decode_reference` gives; any other must be rejected.
+ * @param kernels The kernels to check.
+ * @param[out] cases_out Receives the number of cases compared.
+ * @return true if every case matched.
+ */
+static bool benchmark_base64_equivalent(const Base64Kernels* kernels, long* cases_out) {
+    unsigned char data[512 + 4];
+    char expected[4 * (sizeof(data) / 3 + 1)];
+    char actual[sizeof(expected)];
+    uint32_t rng = 0x2545f491u;
+    for (size_t i = 0; i < sizeof(data); i++) {
+        rng ^= rng << 13; rng ^= rng >> 17; rng ^= rng << 5;
+        data[i] = (unsigned char)rng;
+    }
+
+    long cases = 0;
+    bool ok = true;
+    for (size_t offset = 0; offset < 4 && ok; offset++) {
+        for (size_t length = 0; length + offset <= sizeof(data) && ok; length++, cases++) {
+            size_t expected_length = base64_encode_scalar(data + offset, length, expected);
+            size_t actual_length = base64_encode_with(kernels, data + offset, length, actual);
+            ok = expected_length == actual_length && memcmp(expected, actual, expected_length) == 0;
+            if (!ok) break;
+            Base64DecodeResult decoded = base64_decode_with(kernels, actual, actual_length);
+            ok = decoded.data && decoded.size == length && memcmp(decoded.data, data + offset, length) == 0;
+            free(decoded.data);
         }
+    }
 
-        // Calculate how much compressed data was produced in this chunk.
-        size_t have = GZIP_CHUNK_SIZE - strm.avail_out;
-        if (have > 0) {
-            // Expand the result buffer and append the new compressed data.
-            unsigned char* new_data = realloc(result.data, result.size + have);
-            if (!new_data) {
-                deflateEnd(&strm);
-                if (result.data) free(result.data);
-                return (GzipResult){NULL, 0}; // Return empty result on failure.
+    char text[256];
+    for (size_t source = 192; source > 189 && ok; source--) {
+        base64_encode_scalar(data, source, text);
+        for (size_t position = source == 192 ? 0 : sizeof(text) - 4; position < sizeof(text) && ok; position++) {
+            for (int byte = 0; byte < 256 && ok; byte++, cases++) {
+                char saved = text[position];
+                text[position] = (char)byte;
+                Base64DecodeResult decoded = base64_decode_with(kernels, text, sizeof(text));
+                if (base64_is_strict(text, sizeof(text))) {
+                    // The reference gets zero digits in place of the padding;
+                    // see `base64_decode_reference`.
+                    char unpadded[sizeof(text)];
+                    memcpy(unpadded, text, sizeof(text));
+                    size_t padding = 0;
+                    while (padding < 2 && unpadded[sizeof(text) - 1 - padding] == '=') {
+                        unpadded[sizeof(text) - 1 - padding++] = 'A';
+                    }
+                    Base64DecodeResult reference = base64_decode_reference(unpadded, sizeof(unpadded));
+                    ok = reference.data && decoded.data && reference.size - padding == decoded.size &&
+                         memcmp(reference.data, decoded.data, decoded.size) == 0;
+                    free(reference.data);
+                } else {
+                    ok = decoded.data == NULL;
+                }
+                free(decoded.data);
+                text[position] = saved;
             }
-            result.data = new_data;
-            memcpy(result.data + result.size, out_chunk, have);
-            result.size += have;
         }
-    } while (strm.avail_out == 0); // Continue if the output chunk was filled completely.
+    }
+    *cases_out = cases;
+    return ok;
+}
 
-    // Clean up the zlib stream.
-    deflateEnd(&strm);
-    return result;
+/**
+ * @brief Compares the Base64 kernels this CPU supports.
+ * @details Every kernel, the scalar code included, is first checked against
+ *          the reference code (see `benchmark_base64_equivalent`). Then
+ *          encoding the input and decoding it back into buffers allocated up
+ *          front is timed, best of five runs; the text must match the scalar
+ *          encoding and decode to the input.
+ * @param filepath The file to encode, or NULL for a generated sample.
+ * @return The process exit status.
+ */
+static int benchmark_base64(const char* filepath) {
+    size_t length = 0;
+    unsigned char* data = benchmark_load_input(filepath, &length);
+    if (!data) return 1;
+    size_t text_length = 4 * ((length + 2) / 3);
+    char* reference = malloc(text_length + 1);
+    char* text = malloc(text_length + 1);
+    unsigned char* decoded = malloc(length + 1);
+    if (!reference || !text || !decoded) {
+        fprintf(stderr, "Error: Failed to allocate memory for the benchmark.\n");
+        free(reference);
+        free(text);
+        free(decoded);
+        free(data);
+        return 1;
+    }
+    base64_encode_scalar(data, length, reference);
+    fprintf(stdout, "Benchmark base64: %.1f MB of %s, using %s\n", length / 1048576.0,
+            filepath ? filepath : "sample data (3/4 log text, 1/4 base64 media)", base64_kernels()->name);
+
+    int status = 0;
+    for (size_t k = 0; k < sizeof(base64_kernel_table) / sizeof(base64_kernel_table[0]); k++) {
+        const Base64Kernels* kernels = &base64_kernel_table[k];
+        if (kernels->supported && !kernels->supported()) {
+            fprintf(stdout, "  %-8s not supported by this CPU\n", kernels->name);
+            continue;
+        }
+        long cases = 0;
+        bool ok = benchmark_base64_equivalent(kernels, &cases);
+
+        double encode_ms = 0, decode_ms = 0;
+        for (int run = 0; run < 5 && ok; run++) {
+            double start = benchmark_clock_ms();
+            base64_encode_with(kernels, data, length, text);
+            double elapsed = benchmark_clock_ms() - start;
+            if (run == 0 || elapsed < encode_ms) encode_ms = elapsed;
+
+            start = benchmark_clock_ms();
+            size_t decoded_length = base64_decode_into(kernels, text, text_length, decoded);
+            elapsed = benchmark_clock_ms() - start;
+            if (run == 0 || elapsed < decode_ms) decode_ms = elapsed;
+
+            ok = memcmp(text, reference, text_length) == 0 && decoded_length == length && memcmp(decoded, data, length) == 0;
+        }
+        if (!ok) {
+            fprintf(stdout, "  %-8s %ld cases  FAILED\n", kernels->name, cases);
+            status = 1;
+            continue;
+        }
+        fprintf(stdout, "  %-8s encode %7.1f ms %8.1f MB/s  decode %7.1f ms %8.1f MB/s  %ld cases  verified\n", kernels->name,
+                encode_ms, length / 1048576.0 / (encode_ms / 1000.0), decode_ms, length / 1048576.0 / (decode_ms / 1000.0), cases);
+    }
+    free(reference);
+    free(text);
+    free(decoded);
+    free(data);
+    return status;
 }
 
 /**
- * @brief Validates a file path to ensure it is safe.
- * @details This is a security function that checks for common path traversal
- *          patterns. It rejects any path that contains ".." and also rejects
- *          absolute paths, ensuring that file operations are restricted to the
- *          current working directory and its subdirectories.
- * @param path The file path string to validate.
- * @return Returns true if the path is deemed safe, and false otherwise.
+ * @brief Tells whether a string is a plain host name that is safe to put into
+ *        a CURLOPT_RESOLVE entry.
  */
-bool is_path_safe(const char* path) {
-    if (path == NULL || path[0] == '\0') {
-        return false;
-    }
-
-    // Reject paths containing ".." to prevent directory traversal attacks.
-    if (strstr(path, "..")) {
-        return false;
+static bool net_cache_host_is_safe(const char* host) {
+    if (!host || !*host || strlen(host) > 253) return false;
+    for (const char* p = host; *p; p++) {
+        if (!isalnum((unsigned char)*p) && *p != '.' && *p != '-') return false;
     }
+    return true;
+}
 
-    // Reject absolute paths.
-
-    if (path[0] == '/') {
+/**
+ * @brief Validates one cached address and turns it into a CURLOPT_RESOLVE entry.
+ * @details Entries whose host, port or address do not parse, or that were
+ *          resolved more than NET_CACHE_DNS_TTL_SEC seconds ago (or claim to be
+ *          from the future), are rejected, so a stale or tampered cache
+ *          degrades to a normal DNS lookup.
+ * @param host_port The cache key, "host:port".
+ * @param entry The cached entry with "addr" and "saved".
+ * @param now The current time.
+ * @param out Receives the entry, e.g. "+host:443:192.0.2.1".
+ * @param out_size The size of `out`.
+ * @return true if the entry is valid and fresh.
+ */
+static bool net_cache_resolve_entry(const char* host_port, const cJSON* entry, time_t now, char* out, size_t out_size) {
+    const cJSON* addr = cJSON_GetObjectItem(entry, "addr");
+    const cJSON* saved = cJSON_GetObjectItem(entry, "saved");
+    if (!cJSON_IsString(addr) || !cJSON_IsNumber(saved)) return false;
+    if (saved->valuedouble > now + 60 || now - saved->valuedouble >= NET_CACHE_DNS_TTL_SEC) return false;
+
+    const char* colon = strrchr(host_port, ':');
+    if (!colon || colon == host_port || colon - host_port > 253) return false;
+    char host[256];
+    snprintf(host, sizeof(host), "%.*s", (int)(colon - host_port), host_port);
+    char* end = NULL;
+    long port = strtol(colon + 1, &end, 10);
+    if (!net_cache_host_is_safe(host) || *end != '\0' || port < 1 || port > 65535) return false;
+
+    unsigned char binary[sizeof(struct in6_addr)];
+    if (inet_pton(AF_INET, addr->valuestring, binary) == 1) {
+        snprintf(out, out_size, "+%s:%ld:%s", host, port, addr->valuestring);
+    } else if (inet_pton(AF_INET6, addr->valuestring, binary) == 1) {
+        snprintf(out, out_size, "+%s:%ld:[%s]", host, port, addr->valuestring);
+    } else {
         return false;
     }
-
     return true;
 }
 
+#if LIBCURL_VERSION_NUM >= 0x080c00
 /**
- * @brief Checks if a string is a recognizable YouTube URL.
- * @param url The string to check.
- * @return True if it's a YouTube URL, false otherwise.
+ * @brief Hands the cached TLS sessions to libcurl's shared session cache.
+ * @details Sessions are stored only under libcurl's salted hash of the peer,
+ *          not the host name. libcurl checks that an imported session belongs
+ *          to the peer and settings of a connection before resuming it, and
+ *          rejects data it cannot parse, so a corrupt entry only costs a full
+ *          handshake.
+ * @param transport The session transport.
+ * @param curl A handle attached to the transport's share object.
  */
-bool is_youtube_url(const char* url) {
-    if (url == NULL) return false;
-    // Check for the two common YouTube URL formats.
-    return (strstr(url, "youtube.com/watch") != NULL || strstr(url, "youtu.be/") != NULL);
+static void net_cache_import_tls(Transport* transport, CURL* curl) {
+    cJSON* sessions = cJSON_GetObjectItem(transport->net_cache, "tls");
+    const cJSON* session;
+    double now = wall_clock_now();
+    cJSON_ArrayForEach(session, sessions) {
+        const cJSON* data = cJSON_GetObjectItem(session, "data");
+        const cJSON* valid_until = cJSON_GetObjectItem(session, "valid_until");
+        if (!session->string || !cJSON_IsString(data) || !cJSON_IsNumber(valid_until)) continue;
+        if (valid_until->valuedouble <= now) continue;
+
+        Base64DecodeResult shmac = base64_decode(session->string);
+        Base64DecodeResult sdata = base64_decode(data->valuestring);
+        if (shmac.data && sdata.data &&
+            curl_easy_ssls_import(curl, NULL, shmac.data, shmac.size, sdata.data, sdata.size) == CURLE_OK) {
+            transport->cached_tls_sessions++;
+        }
+        free(shmac.data);
+        free(sdata.data);
+    }
 }
 
 /**
- * @brief Scans a prompt for YouTube URLs, attaches them, and returns a new prompt string.
- * @details This function takes a string, creates a modifiable copy, and iterates
- *          through it to find and process YouTube URLs. For each URL found, it
- *          uses the existing attachment handler and then removes the URL from the
- *          string. This function correctly handles multiple URLs in a single prompt.
- * @param original_prompt The user's raw input string.
- * @param state A pointer to the application state to add attachments to.
- * @return A new, dynamically allocated string containing the prompt with all
- *         YouTube URLs stripped out. The caller is responsible for freeing this memory.
- *         This new string is a distinct allocation from the original_prompt.
+ * @brief Export callback collecting libcurl's TLS sessions into the cache file.
  */
-char* process_and_strip_urls(const char* original_prompt, AppState* state) {
-    // Start with a mutable copy of the original prompt.
-    char* processed_prompt = strdup(original_prompt);
-    if (!processed_prompt) return NULL; // Should not happen
-
-    bool url_was_found_and_removed;
-    do {
-        url_was_found_and_removed = false;
-        char* search_start = processed_prompt;
+static CURLcode net_cache_export_tls(CURL* handle, void* userptr, const char* session_key,
+                                     const unsigned char* shmac, size_t shmac_len,
+                                     const unsigned char* sdata, size_t sdata_len,
+                                     curl_off_t valid_until, int ietf_tls_id,
+                                     const char* alpn, size_t earlydata_max) {
+    (void)handle; (void)session_key; (void)ietf_tls_id; (void)alpn; (void)earlydata_max;
+    cJSON* sessions = userptr;
+    if (!shmac || !shmac_len || !sdata || !sdata_len || valid_until <= (curl_off_t)wall_clock_now()) return CURLE_OK;
+
+    char* shmac_b64 = base64_encode(shmac, shmac_len);
+    char* sdata_b64 = base64_encode(sdata, sdata_len);
+    if (shmac_b64 && sdata_b64) {
+        cJSON* session = cJSON_CreateObject();
+        cJSON_AddStringToObject(session, "data", sdata_b64);
+        cJSON_AddNumberToObject(session, "valid_until", (double)valid_until);
+        cJSON_DeleteItemFromObject(sessions, shmac_b64);
+        cJSON_AddItemToObject(sessions, shmac_b64, session);
+    }
+    free(shmac_b64);
+    free(sdata_b64);
+    return CURLE_OK;
+}
+#endif
 
-        // Find the beginning of a URL.
-        char* url_start = strstr(search_start, "https://");
-        if (!url_start) {
-            url_start = strstr(search_start, "http://");
+/**
+ * @brief Loads the addresses and TLS sessions persisted by earlier invocations.
+ * @details The cache file `netcache.json` in the application data directory
+ *          keeps the address each API host last resolved to, and (with libcurl
+ *          8.12 or newer) the TLS session tickets of recent connections. Fresh
+ *          addresses are pre-seeded into libcurl's DNS cache and sessions are
+ *          imported into its session cache, so a short-lived process can skip
+ *          the DNS lookup and resume TLS instead of paying a full handshake.
+ *          Anything missing, stale or malformed is ignored; an address that
+ *          then fails to connect is dropped (see `net_cache_note_transfer`).
+ *          Addresses are only recorded when no proxy is in use, because the
+ *          peer address would then be the proxy's.
+ * @param transport The session transport.
+ * @param proxied Whether any request may go through a configured proxy.
+ */
+void transport_load_net_cache(Transport* transport, bool proxied) {
+    if (!transport->net_cache_enabled || transport->net_cache) return;
+
+    static const char* proxy_variables[] = { "https_proxy", "HTTPS_PROXY", "all_proxy", "ALL_PROXY" };
+    transport->net_cache_record = !proxied;
+    for (size_t i = 0; i < sizeof(proxy_variables) / sizeof(proxy_variables[0]); i++) {
+        const char* value = getenv(proxy_variables[i]);
+        if (value && *value) transport->net_cache_record = false;
+    }
+
+    cJSON* file = NULL;
+    int fd = json_file_lock(NET_CACHE_FILENAME, &file);
+    if (fd < 0) return;
+    transport->net_cache = cJSON_CreateObject();
+    cJSON* dns = cJSON_AddObjectToObject(transport->net_cache, "dns");
+    cJSON* tls = cJSON_DetachItemFromObject(file, "tls");
+    cJSON_AddItemToObject(transport->net_cache, "tls", cJSON_IsObject(tls) ? tls : cJSON_CreateObject());
+    if (!cJSON_IsObject(tls)) cJSON_Delete(tls);
+
+    time_t now = time(NULL);
+    const cJSON* entry;
+    cJSON_ArrayForEach(entry, cJSON_GetObjectItem(file, "dns")) {
+        char resolve_entry[512];
+        if (!transport->net_cache_record || !entry->string) continue;
+        if (!net_cache_resolve_entry(entry->string, entry, now, resolve_entry, sizeof(resolve_entry))) continue;
+        struct curl_slist* grown = curl_slist_append(transport->resolve, resolve_entry);
+        if (!grown) break;
+        transport->resolve = grown;
+        cJSON_AddItemToObject(dns, entry->string, cJSON_Duplicate(entry, true));
+        time_t stale_at = (time_t)cJSON_GetObjectItem(entry, "saved")->valuedouble + NET_CACHE_DNS_TTL_SEC;
+        if (transport->cached_addresses++ == 0 || stale_at < transport->resolve_until) {
+            transport->resolve_until = stale_at;
         }
+    }
+    json_file_unlock(fd, file, false);
+}
 
-        if (url_start) {
-            // Find the end of the URL (a space or the end of the string).
-            char* url_end = url_start;
-            while (*url_end != '\0' && !isspace((unsigned char)*url_end)) {
-                url_end++;
-            }
-
-            // Temporarily null-terminate the URL to treat it as a separate string.
-            char original_char = *url_end;
-            *url_end = '\0';
-
-            // Check if this substring is a valid YouTube URL.
-            if (is_youtube_url(url_start)) {
-                // Attach the URL using the existing handler.
-                handle_attachment_from_stream(NULL, url_start, "video/*", state);
-
-                // Use the existing str_replace helper to remove the URL.
-                // We pass an empty string "" as the replacement.
-                char* temp_prompt = str_replace(processed_prompt, url_start, "");
-
-                // Free the old processed_prompt and point to the new one.
-                free(processed_prompt);
-                processed_prompt = temp_prompt;
-
-                // Set flag to true so the `do-while` loop runs again,
-                // allowing us to find multiple URLs in the same prompt.
-                url_was_found_and_removed = true;
-            }
-
-            // Restore the original character if we modified the string.
-             *url_end = original_char;
-        }
-    } while (url_was_found_and_removed);
+/**
+ * @brief Updates the address cache from a finished transfer.
+ * @details A transfer that reached the server records the address it
+ *          connected to, unless that is just the cached address being reused
+ *          (so the entry still ages out after NET_CACHE_DNS_TTL_SEC). A
+ *          transfer that could not connect or complete the TLS handshake to a
+ *          cached address evicts it: it is removed from libcurl's DNS cache,
+ *          and from the file on the next save, so the retry resolves afresh.
+ * @param transport The session transport.
+ * @param curl The handle of the finished transfer.
+ * @param result The CURLcode the transfer finished with.
+ */
+static void net_cache_note_transfer(Transport* transport, CURL* curl, CURLcode result) {
+    if (!transport->net_cache || !transport->net_cache_record) return;
+
+    char* url = NULL;
+    char* primary_ip = NULL;
+    long port = 0, http_code = 0;
+    curl_easy_getinfo(curl, CURLINFO_EFFECTIVE_URL, &url);
+    curl_easy_getinfo(curl, CURLINFO_PRIMARY_IP, &primary_ip);
+    curl_easy_getinfo(curl, CURLINFO_PRIMARY_PORT, &port);
+    curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &http_code);
+    if (!url) return;
+
+    CURLU* parsed = curl_url();
+    char* host = NULL;
+    char* url_port = NULL;
+    if (!parsed || curl_url_set(parsed, CURLUPART_URL, url, 0) != CURLUE_OK ||
+        curl_url_get(parsed, CURLUPART_HOST, &host, 0) != CURLUE_OK ||
+        curl_url_get(parsed, CURLUPART_PORT, &url_port, CURLU_DEFAULT_PORT) != CURLUE_OK ||
+        !net_cache_host_is_safe(host)) {
+        curl_free(host);
+        curl_free(url_port);
+        curl_url_cleanup(parsed);
+        return;
+    }
 
-    return processed_prompt;
+    char host_port[300];
+    snprintf(host_port, sizeof(host_port), "%s:%s", host, url_port);
+    cJSON* dns = cJSON_GetObjectItem(transport->net_cache, "dns");
+    cJSON* cached = cJSON_GetObjectItem(dns, host_port);
+    const cJSON* cached_addr = cJSON_GetObjectItem(cached, "addr");
+
+    bool connect_failed = http_code == 0 &&
+        (result == CURLE_COULDNT_CONNECT || result == CURLE_OPERATION_TIMEDOUT ||
+         result == CURLE_SSL_CONNECT_ERROR || result == CURLE_PEER_FAILED_VERIFICATION);
+    if (connect_failed && cJSON_IsString(cached_addr)) {
+        char removal[310];
+        snprintf(removal, sizeof(removal), "-%s", host_port);
+        struct curl_slist* grown = curl_slist_append(transport->resolve, removal);
+        if (grown) transport->resolve = grown;
+        // Keep applying the list until libcurl's own copy of the entry has expired.
+        if (transport->resolve_until < time(NULL) + 60) transport->resolve_until = time(NULL) + 60;
+        cJSON_ReplaceItemInObject(dns, host_port, cJSON_CreateNull());
+        transport->net_cache_dirty = true;
+    } else if (http_code > 0 && primary_ip && primary_ip[0] && port > 0 &&
+               !(cJSON_IsString(cached_addr) && strcmp(cached_addr->valuestring, primary_ip) == 0)) {
+        cJSON* entry = cJSON_CreateObject();
+        cJSON_AddStringToObject(entry, "addr", primary_ip);
+        cJSON_AddNumberToObject(entry, "saved", (double)time(NULL));
+        cJSON_DeleteItemFromObject(dns, host_port);
+        cJSON_AddItemToObject(dns, host_port, entry);
+        transport->net_cache_dirty = true;
+    }
+
+    curl_free(host);
+    curl_free(url_port);
+    curl_url_cleanup(parsed);
 }
 
 /**
- * @brief Reads data from a stream and creates a pending file attachment.
- * @details This function is a robust, production-ready handler for all file and
- *          stream-based attachments (`/attach`, `/paste`, piped input). It safely
- *          acquires a file handle, reads the entire contents into a buffer, and
- *          then creates a `Part` struct. The attachment is handled differently
- *          based on the API mode: in official mode, it's Base64-encoded; in
- *          free mode, it's formatted as plain text. It uses a goto-based cleanup
- *          to ensure all resources are deallocated correctly on all execution paths.
- * @param stream An optional, pre-opened file stream. If NULL, the function will
- *               open the file specified by `filepath`.
- * @param filepath A descriptive name for the source (e.g., filename or "stdin").
- *                 If `stream` is NULL, this is used as the path to open.
- * @param mime_type The MIME type of the data, used in official API mode.
- * @param state The application state where the new attachment part will be added.
+ * @brief Merges this process's addresses and TLS sessions into the cache file.
+ * @details The file is locked and re-read so concurrent invocations do not lose
+ *          each other's entries. New addresses replace old ones, evicted ones
+ *          are removed, and stale addresses and expired sessions are pruned;
+ *          at most NET_CACHE_MAX_TLS_SESSIONS sessions are kept. The file is
+ *          private to the user (mode 0600) because session tickets allow
+ *          resuming a TLS session.
+ * @param transport The session transport.
  */
-void handle_attachment_from_stream(FILE* stream, const char* filepath, const char* mime_type, AppState* state) {
-    // --- Variable Declarations ---
-    FILE* input_stream = stream;
-    unsigned char* buffer = NULL;
-    char* formatted_text = NULL;
-    bool opened_here = false;
-    size_t total_read = 0;
+void transport_save_net_cache(Transport* transport) {
+    if (!transport->net_cache) return;
+
+    cJSON* sessions = NULL;
+#if LIBCURL_VERSION_NUM >= 0x080c00
+    CURL* curl = transport_acquire(transport);
+    if (curl) {
+        sessions = cJSON_CreateObject();
+        curl_easy_ssls_export(curl, net_cache_export_tls, sessions);
+        transport_release(transport, curl);
+        if (cJSON_GetArraySize(sessions) > 0) transport->net_cache_dirty = true;
+    }
+#endif
+    if (!transport->net_cache_dirty) {
+        cJSON_Delete(sessions);
+        return;
+    }
 
-    // --- 1. Pre-flight Checks ---
-    if (state->num_attached_parts >= ATTACHMENT_LIMIT) {
-        fprintf(stderr, "Error: Attachment limit of %d reached.\n", ATTACHMENT_LIMIT);
+    cJSON* file = NULL;
+    int fd = json_file_lock(NET_CACHE_FILENAME, &file);
+    if (fd < 0) {
+        cJSON_Delete(sessions);
         return;
     }
+    cJSON* file_dns = cJSON_GetObjectItem(file, "dns");
+    if (!cJSON_IsObject(file_dns)) {
+        cJSON_DeleteItemFromObject(file, "dns");
+        file_dns = cJSON_AddObjectToObject(file, "dns");
+    }
+    cJSON* file_tls = cJSON_GetObjectItem(file, "tls");
+    if (!cJSON_IsObject(file_tls)) {
+        cJSON_DeleteItemFromObject(file, "tls");
+        file_tls = cJSON_AddObjectToObject(file, "tls");
+    }
 
-    // This block intercepts the call if the filepath is a YouTube URL.
-    if (stream == NULL && is_youtube_url(filepath)) {
-        if (state->free_mode) {
-            fprintf(stderr, "Warning: URL attachments are not supported in free mode. Ignoring %s\n", filepath);
-            return;
+    const cJSON* entry;
+    cJSON_ArrayForEach(entry, cJSON_GetObjectItem(transport->net_cache, "dns")) {
+        cJSON_DeleteItemFromObject(file_dns, entry->string);
+        if (cJSON_IsObject(entry)) {
+            cJSON_AddItemToObject(file_dns, entry->string, cJSON_Duplicate(entry, true));
         }
-        Part* part = &state->attached_parts[state->num_attached_parts];
-        memset(part, 0, sizeof(Part));
-
-        part->type = PART_TYPE_URI;
-        part->uri = strdup(filepath);
-        part->mime_type = strdup("video/*"); // As specified in your example
-
-        if (!part->uri || !part->mime_type) {
-            fprintf(stderr, "Error: Failed to allocate memory for YouTube URL attachment.\n");
-            if (part->uri) free(part->uri);
-            if (part->mime_type) free(part->mime_type);
-            return;
+    }
+    cJSON* session = sessions ? sessions->child : NULL;
+    while (session) {
+        cJSON* next = session->next;
+        cJSON_DeleteItemFromObject(file_tls, session->string);
+        cJSON_AddItemToObject(file_tls, session->string, cJSON_DetachItemViaPointer(sessions, session));
+        session = next;
+    }
+    cJSON_Delete(sessions);
+
+    // Prune what no future process could use.
+    time_t now = time(NULL);
+    char scratch[512];
+    for (cJSON* item = file_dns->child; item; ) {
+        cJSON* next = item->next;
+        if (!item->string || !net_cache_resolve_entry(item->string, item, now, scratch, sizeof(scratch))) {
+            cJSON_Delete(cJSON_DetachItemViaPointer(file_dns, item));
         }
-
-        fprintf(stderr, "Attached YouTube URL: %s\n", filepath);
-        (state->num_attached_parts)++;
-        return; // Exit the function since we've handled the attachment.
+        item = next;
     }
-    
-    // --- 2. Resource Acquisition ---
-    if (input_stream == NULL) {
-        if (!is_path_safe(filepath)) {
-            fprintf(stderr, "Error: Unsafe or absolute file path specified: %s\n", filepath);
-            return;
+    for (cJSON* item = file_tls->child; item; ) {
+        cJSON* next = item->next;
+        const cJSON* valid_until = cJSON_GetObjectItem(item, "valid_until");
+        if (!cJSON_IsString(cJSON_GetObjectItem(item, "data")) || !cJSON_IsNumber(valid_until) || valid_until->valuedouble <= now) {
+            cJSON_Delete(cJSON_DetachItemViaPointer(file_tls, item));
         }
-        input_stream = fopen(filepath, "rb");
-        if (!input_stream) {
-            perror("Error opening file");
-            return;
+        item = next;
+    }
+    while (cJSON_GetArraySize(file_tls) > NET_CACHE_MAX_TLS_SESSIONS) {
+        cJSON* oldest = NULL;
+        for (cJSON* item = file_tls->child; item; item = item->next) {
+            if (!oldest || cJSON_GetObjectItem(item, "valid_until")->valuedouble < cJSON_GetObjectItem(oldest, "valid_until")->valuedouble) {
+                oldest = item;
+            }
         }
-        opened_here = true;
+        cJSON_Delete(cJSON_DetachItemViaPointer(file_tls, oldest));
     }
 
-    // --- 3. Read Stream into Buffer ---
-    int fd = fileno(input_stream);
-    struct stat st;
-    if (fstat(fd, &st) != 0) {
-        perror("Error getting file status");
-        goto cleanup;
-    }
+    json_file_unlock(fd, file, true);
+    transport->net_cache_dirty = false;
+}
 
-    // Check if the stream is a regular file
-    if (S_ISREG(st.st_mode)) {
-        fseek(input_stream, 0, SEEK_END);
-        long file_size = ftell(input_stream);
-        fseek(input_stream, 0, SEEK_SET);
+/**
+ * @brief Applies the session-wide transport options to a pooled cURL handle.
+ * @details Every handle handed out by the transport shares the DNS cache, TLS
+ *          session cache and connection pool, prefers HTTP/2 over TLS, asks for
+ *          compressed responses and keeps idle TCP connections alive so they
+ *          can be reused by the next request.
+ * @param transport The transport owning the share object.
+ * @param curl The handle to configure.
+ */
+static void transport_apply_defaults(Transport* transport, CURL* curl) {
+    curl_easy_setopt(curl, CURLOPT_SHARE, transport->share);
+    curl_easy_setopt(curl, CURLOPT_HTTP_VERSION, (long)CURL_HTTP_VERSION_2TLS);
+    curl_easy_setopt(curl, CURLOPT_ACCEPT_ENCODING, "");
+    curl_easy_setopt(curl, CURLOPT_TCP_KEEPALIVE, 1L);
+    curl_easy_setopt(curl, CURLOPT_NOSIGNAL, 1L);
+    if (transport->resolve && time(NULL) < transport->resolve_until) {
+        curl_easy_setopt(curl, CURLOPT_RESOLVE, transport->resolve);
+    }
+}
 
-        if (file_size <= 0) {
-            fprintf(stderr, "Warning: File '%s' is empty or invalid. Attachment skipped.\n", filepath);
-            goto cleanup;
-        }
-        buffer = malloc(file_size + 1);
-        if (!buffer) {
-            fprintf(stderr, "Error: Failed to allocate memory for file buffer.\n");
-            goto cleanup;
-        }
-        total_read = fread(buffer, 1, file_size, input_stream);
-        if (total_read != (size_t)file_size) {
-            fprintf(stderr, "Error reading from file '%s'.\n", filepath);
-            goto cleanup;
-        }
-    } else { // Stream is not a regular file (it's a pipe or the console)
-        size_t capacity = 4096;
-        buffer = malloc(capacity);
-        if (!buffer) {
-            fprintf(stderr, "Error: Failed to allocate memory for stream buffer.\n");
-            goto cleanup;
+/**
+ * @brief Hands out a ready-to-use cURL handle from the session's transport pool.
+ * @details On first use this lazily creates the share object. A free pooled
+ *          handle is reset (which keeps its caches) and reconfigured with the
+ *          transport defaults. If the pool is exhausted, a standalone handle is
+ *          created that still uses the shared caches; it is destroyed on release.
+ * @param transport The session transport.
+ * @return A configured cURL handle, or NULL on allocation failure. The handle
+ *         must be returned with `transport_release`.
+ */
+CURL* transport_acquire(Transport* transport) {
+    if (!transport->share) {
+        transport->share = curl_share_init();
+        if (!transport->share) return NULL;
+        curl_share_setopt(transport->share, CURLSHOPT_SHARE, CURL_LOCK_DATA_DNS);
+        curl_share_setopt(transport->share, CURLSHOPT_SHARE, CURL_LOCK_DATA_SSL_SESSION);
+        curl_share_setopt(transport->share, CURLSHOPT_SHARE, CURL_LOCK_DATA_CONNECT);
+    }
+
+    CURL* curl = NULL;
+    for (int i = 0; i < TRANSPORT_POOL_SIZE; i++) {
+        if (transport->in_use[i]) continue;
+        if (transport->handles[i]) {
+            curl_easy_reset(transport->handles[i]);
+        } else {
+            transport->handles[i] = curl_easy_init();
+            if (!transport->handles[i]) return NULL;
         }
+        transport->in_use[i] = true;
+        curl = transport->handles[i];
+        break;
+    }
 
-                // On POSIX, or for a non-interactive pipe on Windows,
-                // the existing block-read logic is safe and efficient.
-                ssize_t bytes_read;
-                while ((bytes_read = read(fd, buffer + total_read, 1024)) > 0) {
-                    total_read += (size_t)bytes_read;
-                    if (capacity - total_read < 1024) {
-                        capacity *= 2;
-                        unsigned char* new_buffer = realloc(buffer, capacity);
-                        if (!new_buffer) {
-                            fprintf(stderr, "Error: Failed to reallocate pipe buffer.\n");
-                            goto cleanup;
-                        }
-                        buffer = new_buffer;
-                    }
-                }
-                if (bytes_read < 0) {
-                    perror("Error reading from input stream");
-                    goto cleanup;
-                }
+    // Pool exhausted: fall back to a one-off handle that still shares the caches.
+    if (!curl) {
+        curl = curl_easy_init();
+        if (!curl) return NULL;
     }
 
-    if (total_read == 0) {
-        fprintf(stderr, "Warning: No data received from input stream. Attachment skipped.\n");
-        goto cleanup;
+    transport_apply_defaults(transport, curl);
+#if LIBCURL_VERSION_NUM >= 0x080c00
+    if (transport->net_cache && !transport->net_cache_imported) {
+        transport->net_cache_imported = true;
+        net_cache_import_tls(transport, curl);
     }
-    buffer[total_read] = '\0';
+#endif
+    return curl;
+}
 
-    // --- 4. Create Attachment Part (This logic remains the same) ---
-    Part* part = &state->attached_parts[state->num_attached_parts];
-    memset(part, 0, sizeof(Part));
+/**
+ * @brief Returns a handle obtained from `transport_acquire` to the pool.
+ * @param transport The session transport.
+ * @param curl The handle to release. Standalone overflow handles are destroyed.
+ */
+void transport_release(Transport* transport, CURL* curl) {
+    if (!curl) return;
+    for (int i = 0; i < TRANSPORT_POOL_SIZE; i++) {
+        if (transport->handles[i] == curl) {
+            transport->in_use[i] = false;
+            return;
+        }
+    }
+    curl_easy_cleanup(curl);
+}
 
-    if (state->free_mode) {
-        if (strcmp(filepath, "stdin") == 0) {
-            const char* format = "\n--- Pasted Text ---\n%s\n--- End of Pasted Text ---\n";
-            size_t len = snprintf(NULL, 0, format, buffer);
-            formatted_text = malloc(len + 1);
-            if (formatted_text) sprintf(formatted_text, format, buffer);
-        } else {
-            const char* format = "\n--- Attached File: %s ---\n%s\n--- End of File ---\n";
-            size_t len = snprintf(NULL, 0, format, filepath, buffer);
-            formatted_text = malloc(len + 1);
-            if (formatted_text) sprintf(formatted_text, format, filepath, buffer);
+/**
+ * @brief A libcurl write callback that discards the response body.
+ */
+static size_t discard_callback(void* contents, size_t size, size_t nmemb, void* userp) {
+    (void)contents;
+    (void)userp;
+    return size * nmemb;
+}
+
+/**
+ * @brief Credits a finished foreground transfer to the connection statistics.
+ * @details A transfer that needed no new connection (CURLINFO_NUM_CONNECTS is 0)
+ *          was served by a pooled connection. Transfers that never reached the
+ *          server are not counted. If that connection was opened by a warm-up,
+ *          the handshake time paid in the background is credited as saved.
+ * @param transport The session transport holding the counters.
+ * @param curl The handle of the finished transfer.
+ */
+static void transport_record_connection(Transport* transport, CURL* curl) {
+    long http_code = 0;
+    long num_connects = 0;
+    curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &http_code);
+    curl_easy_getinfo(curl, CURLINFO_NUM_CONNECTS, &num_connects);
+    if (num_connects > 0) {
+        transport->new_connections += num_connects;
+        transport->warm_pending_ms = 0;
+    } else if (http_code > 0) {
+        transport->reused_connections++;
+        if (transport->warm_pending_ms > 0) {
+            transport->warm_last_saved_ms += transport->warm_pending_ms;
+            transport->warm_total_saved_ms += transport->warm_pending_ms;
+            transport->warm_pending_ms = 0;
         }
+    }
+    if (http_code > 0) {
+        transport->warm_last_touch = time(NULL);
+    }
+}
 
-        if (!formatted_text) {
-            fprintf(stderr, "Error: Failed to allocate memory for formatted text.\n");
-            goto cleanup;
+/**
+ * @brief Unlinks a transfer from the engine and frees it.
+ * @details The transfer's handle goes back to the pool and its header list is
+ *          freed. A transfer that is still running is removed from the multi
+ *          handle first, which aborts it.
+ * @param transport The session transport.
+ * @param transfer The transfer to free.
+ */
+static void transport_transfer_free(Transport* transport, Transfer* transfer) {
+    for (Transfer** link = &transport->transfers; *link; link = &(*link)->next) {
+        if (*link == transfer) {
+            *link = transfer->next;
+            break;
         }
-        part->type = PART_TYPE_TEXT;
-        part->text = formatted_text;
-    } else { // Official API mode
-        part->type = PART_TYPE_FILE;
-        part->filename = strdup(filepath);
-        part->mime_type = strdup(mime_type);
-        part->base64_data = base64_encode(buffer, total_read);
+    }
+    if (!transfer->done) {
+        curl_multi_remove_handle(transport->multi, transfer->curl);
+        transport->active_transfers--;
+    }
+    transport_release(transport, transfer->curl);
+    curl_slist_free_all(transfer->headers);
+    free(transfer);
+}
 
-        if (!part->filename || !part->mime_type || !part->base64_data) {
-             fprintf(stderr, "Error: Failed to allocate memory for attachment metadata.\n");
-             if (part->filename) free(part->filename);
-             if (part->mime_type) free(part->mime_type);
-             if (part->base64_data) free(part->base64_data);
-             goto cleanup;
+/**
+ * @brief Completes every transfer the multi handle reports as finished.
+ * @details Records the result and HTTP status on the transfer, updates the
+ *          connection statistics, runs its completion callback and, for
+ *          detached transfers, frees it.
+ * @param transport The session transport.
+ */
+static void transport_collect(Transport* transport) {
+    CURLMsg* msg;
+    int msgs_left;
+    while ((msg = curl_multi_info_read(transport->multi, &msgs_left)) != NULL) {
+        if (msg->msg != CURLMSG_DONE) continue;
+
+        // The message is invalidated by removing the handle, so read it first.
+        CURL* curl = msg->easy_handle;
+        CURLcode result = msg->data.result;
+        char* private_data = NULL;
+        curl_easy_getinfo(curl, CURLINFO_PRIVATE, &private_data);
+        curl_multi_remove_handle(transport->multi, curl);
+
+        Transfer* transfer = (Transfer*)private_data;
+        if (!transfer) continue;
+        transfer->result = result;
+        curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &transfer->http_code);
+        transfer->done = true;
+        transport->active_transfers--;
+        net_cache_note_transfer(transport, curl, result);
+
+        if (!transfer->background) {
+            curl_off_t retry_after = 0, ttfb_us = 0;
+            curl_easy_getinfo(curl, CURLINFO_RETRY_AFTER, &retry_after);
+            curl_easy_getinfo(curl, CURLINFO_STARTTRANSFER_TIME_T, &ttfb_us);
+            transport->last_result = result;
+            transport->last_retry_after = (long)retry_after;
+            transport->last_ttfb_ms = ttfb_us / 1000.0;
+            transport_record_connection(transport, curl);
+        }
+        if (transfer->on_done) {
+            transfer->on_done(transfer, transfer->userdata);
+        }
+        if (transfer->detached) {
+            transport_transfer_free(transport, transfer);
         }
     }
+}
 
-    fprintf(stderr, "Attached %s (MIME: %s, Size: %zu bytes)\n",
-            state->free_mode ? "stdin/file" : part->filename,
-            state->free_mode ? "text/plain" : part->mime_type,
-            total_read);
-    (state->num_attached_parts)++;
+/**
+ * @brief Advances all in-flight transfers without blocking longer than asked.
+ * @details This is the event loop of the request engine. It lets libcurl make
+ *          progress on every transfer, completes the finished ones and, if any
+ *          are still running, waits up to `timeout_ms` for socket activity
+ *          before making progress once more.
+ * @param transport The session transport.
+ * @param timeout_ms How long to wait for activity; 0 never waits.
+ * @return The number of transfers still in flight.
+ */
+int transport_poll(Transport* transport, int timeout_ms) {
+    if (!transport->multi) return 0;
+
+    int running = 0;
+    curl_multi_perform(transport->multi, &running);
+    transport_collect(transport);
+    if (running > 0 && timeout_ms > 0) {
+        curl_multi_poll(transport->multi, NULL, 0, timeout_ms, NULL);
+        curl_multi_perform(transport->multi, &running);
+        transport_collect(transport);
+    }
+    return transport->active_transfers;
+}
 
-cleanup:
-    if (buffer) {
-        free(buffer);
-    }
-    if (opened_here && input_stream) {
-        fclose(input_stream);
+/**
+ * @brief Drives any in-flight warm-up transfer to completion.
+ * @details Called before a real request is submitted so that a handshake already
+ *          under way in the background is finished and its connection reused,
+ *          instead of the request opening a second one next to it. The wait is
+ *          bounded by PREWARM_SETTLE_MAX_MS and ends at once on Ctrl+C: a
+ *          warm-up still stuck on a slow or unreachable host or proxy is
+ *          cancelled, and the request opens its own connection.
+ * @param transport The session transport.
+ */
+static void transport_prewarm_settle(Transport* transport) {
+    struct timespec start, now;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    while (transport->warm_transfer) {
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        long elapsed_ms = (now.tv_sec - start.tv_sec) * 1000L + (now.tv_nsec - start.tv_nsec) / 1000000L;
+        if (interrupt_flag || elapsed_ms >= PREWARM_SETTLE_MAX_MS) {
+            transport_cancel(transport, transport->warm_transfer);
+            transport->warm_transfer = NULL;
+            break;
+        }
+        long remaining_ms = PREWARM_SETTLE_MAX_MS - elapsed_ms;
+        transport_poll(transport, remaining_ms < 50 ? (int)remaining_ms : 50);
     }
 }
 
 /**
- * @brief Encodes binary data into a Base64 string.
- * @details This function implements the standard Base64 encoding algorithm. It
- *          takes a buffer of binary data and converts it into a null-terminated
- *          ASCII string suitable for embedding in JSON payloads.
- * @param data A pointer to the raw binary data to be encoded.
- * @param input_length The size of the input data in bytes.
- * @return A dynamically allocated, null-terminated Base64 string. The caller
- *         is responsible for freeing this memory. Returns NULL on failure.
+ * @brief Progress callback of every transfer; aborts foreground transfers on Ctrl+C.
+ * @details libcurl runs it on each pass of the engine, not only when data
+ *          arrives, so an interrupt takes effect within one poll interval even
+ *          while the model is still thinking and nothing is being received.
+ *          Background transfers (warm-ups, probes) are left alone. An aborted
+ *          HTTP/2 stream is reset on its own and the connection stays in the
+ *          pool; over HTTP/1.1 libcurl has to close the connection.
+ * @param clientp The Transfer.
+ * @return Nonzero to abort the transfer with CURLE_ABORTED_BY_CALLBACK.
  */
-char* base64_encode(const unsigned char* data, size_t input_length) {
-    static const char b64_chars[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
-
-    // Calculate the length of the output string.
-    size_t output_length = 4 * ((input_length + 2) / 3);
-    char* encoded_data = malloc(output_length + 1);
-    if (!encoded_data) return NULL;
+static int transport_progress_callback(void* clientp, curl_off_t dltotal, curl_off_t dlnow, curl_off_t ultotal, curl_off_t ulnow) {
+    (void)dltotal; (void)dlnow; (void)ultotal; (void)ulnow;
+    const Transfer* transfer = clientp;
+    return interrupt_flag && !transfer->background;
+}
 
-    // Process the input data in 3-byte chunks, converting them to 4 Base64 characters.
-    for (size_t i = 0, j = 0; i < input_length;) {
-        uint32_t octet_a = i < input_length ? data[i++] : 0;
-        uint32_t octet_b = i < input_length ? data[i++] : 0;
-        uint32_t octet_c = i < input_length ? data[i++] : 0;
+/**
+ * @brief Tells whether a transfer ended because the user pressed Ctrl+C.
+ * @details Write callbacks refuse data and the progress callback aborts once
+ *          the interrupt flag is set, so either result counts while the flag is
+ *          still up. Callers report the interrupt and clear the flag.
+ */
+bool transport_interrupted(CURLcode result) {
+    return (result == CURLE_WRITE_ERROR || result == CURLE_ABORTED_BY_CALLBACK) && interrupt_flag;
+}
 
-        uint32_t triple = (octet_a << 16) + (octet_b << 8) + octet_c;
+/**
+ * @brief Submits a configured handle to the asynchronous request engine.
+ * @details The transfer starts making progress the next time the engine is
+ *          polled, alongside any others already in flight; many transfers can
+ *          share the single multi handle (and, over HTTP/2, a single
+ *          connection). The engine takes ownership of the handle and of the
+ *          header list whatever the outcome: both are released when the
+ *          transfer is awaited, or when a detached transfer completes.
+ * @param transport The session transport.
+ * @param curl A handle obtained from `transport_acquire`, fully configured.
+ * @param headers The header list set on the handle, or NULL.
+ * @param on_done Optional callback run once the transfer completes, while its
+ *                handle can still be queried with `curl_easy_getinfo`.
+ * @param userdata Passed through to `on_done`.
+ * @return The in-flight transfer, or NULL if it could not be started.
+ */
+Transfer* transport_submit(Transport* transport, CURL* curl, struct curl_slist* headers, TransferCallback on_done, void* userdata) {
+    if (!transport->multi) {
+        transport->multi = curl_multi_init();
+    }
+    Transfer* transfer = transport->multi ? calloc(1, sizeof(Transfer)) : NULL;
+    if (!transfer) {
+        transport_release(transport, curl);
+        curl_slist_free_all(headers);
+        return NULL;
+    }
+    transfer->curl = curl;
+    transfer->headers = headers;
+    transfer->on_done = on_done;
+    transfer->userdata = userdata;
+    curl_easy_setopt(curl, CURLOPT_PRIVATE, (void*)transfer);
+    curl_easy_setopt(curl, CURLOPT_XFERINFOFUNCTION, transport_progress_callback);
+    curl_easy_setopt(curl, CURLOPT_XFERINFODATA, (void*)transfer);
+    curl_easy_setopt(curl, CURLOPT_NOPROGRESS, 0L);
+
+    if (curl_multi_add_handle(transport->multi, curl) != CURLM_OK) {
+        transfer->done = true;
+        transport_release(transport, curl);
+        curl_slist_free_all(headers);
+        free(transfer);
+        return NULL;
+    }
+    transfer->next = transport->transfers;
+    transport->transfers = transfer;
+    transport->active_transfers++;
+    return transfer;
+}
 
-        encoded_data[j++] = b64_chars[(triple >> 18) & 0x3F];
-        encoded_data[j++] = b64_chars[(triple >> 12) & 0x3F];
-        encoded_data[j++] = b64_chars[(triple >> 6) & 0x3F];
-        encoded_data[j++] = b64_chars[triple & 0x3F];
+/**
+ * @brief Waits for a submitted transfer to finish and frees it.
+ * @details Polls the engine until the transfer completes, so every other
+ *          transfer in flight keeps making progress in the meantime.
+ * @param transport The session transport.
+ * @param transfer A transfer returned by `transport_submit`.
+ * @param http_code_out Optional; receives the HTTP status (0 if none arrived).
+ * @return The CURLcode the transfer finished with.
+ */
+CURLcode transport_await(Transport* transport, Transfer* transfer, long* http_code_out) {
+    while (!transfer->done) {
+        transport_poll(transport, 100);
+    }
+    CURLcode result = transfer->result;
+    if (http_code_out) {
+        *http_code_out = transfer->http_code;
     }
+    transport_transfer_free(transport, transfer);
+    return result;
+}
 
-    // Add padding characters ('=') if the input length was not a multiple of 3.
-    static const int mod_table[] = {0, 2, 1};
-    for (int i = 0; i < mod_table[input_length % 3]; i++) {
-        encoded_data[output_length - 1 - i] = '=';
+/**
+ * @brief Lets a transfer run to completion in the background.
+ * @details The engine frees the transfer (after its completion callback) once
+ *          it finishes; it must not be awaited afterwards.
+ * @param transport The session transport.
+ * @param transfer A transfer returned by `transport_submit`.
+ */
+void transport_detach(Transport* transport, Transfer* transfer) {
+    if (transfer->done) {
+        transport_transfer_free(transport, transfer);
+    } else {
+        transfer->detached = true;
     }
+}
 
-    encoded_data[output_length] = '\0';
-    return encoded_data;
+/**
+ * @brief Aborts a transfer if it is still running and frees it.
+ * @details The completion callback is not run for a transfer cancelled in
+ *          flight. A finished transfer is simply freed, like `transport_await`
+ *          would.
+ * @param transport The session transport.
+ * @param transfer A transfer returned by `transport_submit`.
+ */
+void transport_cancel(Transport* transport, Transfer* transfer) {
+    transport_transfer_free(transport, transfer);
 }
 
 /**
- * @brief Decodes a Base64 string into binary data.
- * @param data The null-terminated Base64 string to decode.
- * @return A Base64DecodeResult struct. The `data` field contains the decoded
- *         bytes and `size` holds the length. The caller is responsible for
- *         freeing the `data` buffer. `data` will be NULL on failure.
+ * @brief Completion callback of a warm-up transfer.
+ * @details When the warm-up had to open a new connection, its DNS, TCP and TLS
+ *          time is remembered as "pending": the next real request that reuses
+ *          the connection is credited with not having paid it.
+ * @param transfer The finished warm-up.
+ * @param userdata The session transport.
  */
-Base64DecodeResult base64_decode(const char* data) {
-    static const int b64_inv_table[] = {
-        -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
-        -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
-        -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, 62, -1, -1, -1, 63,
-        52, 53, 54, 55, 56, 57, 58, 59, 60, 61, -1, -1, -1, -1, -1, -1,
-        -1,  0,  1,  2,  3,  4,  5,  6,  7,  8,  9, 10, 11, 12, 13, 14,
-        15, 16, 17, 18, 19, 20, 21, 22, 23, 24, 25, -1, -1, -1, -1, -1,
-        -1, 26, 27, 28, 29, 30, 31, 32, 33, 34, 35, 36, 37, 38, 39, 40,
-        41, 42, 43, 44, 45, 46, 47, 48, 49, 50, 51, -1, -1, -1, -1, -1
-    };
+static void transport_prewarm_done(Transfer* transfer, void* userdata) {
+    Transport* transport = userdata;
+    if (transfer->http_code > 0) {
+        long num_connects = 0;
+        curl_off_t connect_us = 0, appconnect_us = 0;
+        curl_easy_getinfo(transfer->curl, CURLINFO_NUM_CONNECTS, &num_connects);
+        curl_easy_getinfo(transfer->curl, CURLINFO_CONNECT_TIME_T, &connect_us);
+        curl_easy_getinfo(transfer->curl, CURLINFO_APPCONNECT_TIME_T, &appconnect_us);
+        if (num_connects > 0) {
+            transport->new_connections += num_connects;
+            curl_off_t handshake_us = appconnect_us > connect_us ? appconnect_us : connect_us;
+            transport->warm_pending_ms += handshake_us / 1000.0;
+        }
+        transport->warm_last_touch = time(NULL);
+    }
+    transport->warm_transfer = NULL;
+}
 
-    Base64DecodeResult result = { .data = NULL, .size = 0 };
-    size_t input_len = strlen(data);
+/**
+ * @brief Starts or advances the background connection warm-up for a session.
+ * @details Issues a cheap HEAD request to the endpoint the next turn will use
+ *          (the official API host, or the key-free endpoint in free mode) so the
+ *          DNS lookup, TCP connect and TLS handshake happen while the user is
+ *          still typing. All API keys of a session talk to the same host, so the
+ *          one warmed connection serves whichever key is picked next. While the
+ *          prompt stays idle the request is repeated every
+ *          PREWARM_PING_INTERVAL_SEC seconds, which keeps the connection inside
+ *          libcurl's reuse window and the server's idle timeout. This function
+ *          never blocks.
+ * @param state The session whose transport should be warmed.
+ */
+static void transport_prewarm_step(AppState* state) {
+    Transport* transport = &state->transport;
+    if (!transport->prewarm_enabled || transport->warm_transfer) return;
+    if (!state->free_mode && (state->num_api_keys == 0 || !state->host)) return;
 
-    if (input_len % 4 != 0) return result; // Invalid Base64 length
+    char url[sizeof(transport->warm_url)];
+    snprintf(url, sizeof(url), "https://%s/", state->free_mode ? FREE_API_HOST : state->host);
 
-    result.size = input_len / 4 * 3;
-    if (data[input_len - 1] == '=') (result.size)--;
-    if (data[input_len - 2] == '=') (result.size)--;
+    bool endpoint_changed = strcmp(url, transport->warm_url) != 0;
+    bool needs_ping = time(NULL) - transport->warm_last_touch >= PREWARM_PING_INTERVAL_SEC;
+    if (!endpoint_changed && !needs_ping) return;
 
-    result.data = malloc(result.size + 1);
-    if (!result.data) return result;
+    CURL* curl = transport_acquire(transport);
+    if (!curl) return;
+    curl_easy_setopt(curl, CURLOPT_URL, url);
+    if (state->proxy[0] != '\0') {
+        curl_easy_setopt(curl, CURLOPT_PROXY, state->proxy);
+    }
+    curl_easy_setopt(curl, CURLOPT_NOBODY, 1L);
+    curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, discard_callback);
+    curl_easy_setopt(curl, CURLOPT_TIMEOUT, 15L);
 
-    for (size_t i = 0, j = 0; i < input_len; ) {
-        uint32_t sextet_a = (i < input_len) ? b64_inv_table[(unsigned char)data[i++]] : 0;
-        uint32_t sextet_b = (i < input_len) ? b64_inv_table[(unsigned char)data[i++]] : 0;
-        uint32_t sextet_c = (i < input_len) ? b64_inv_table[(unsigned char)data[i++]] : 0;
-        uint32_t sextet_d = (i < input_len) ? b64_inv_table[(unsigned char)data[i++]] : 0;
+    // Whatever the outcome, don't try this endpoint again before the next interval.
+    snprintf(transport->warm_url, sizeof(transport->warm_url), "%s", url);
+    transport->warm_last_touch = time(NULL);
 
-        uint32_t triple = (sextet_a << 18) + (sextet_b << 12) + (sextet_c << 6) + sextet_d;
+    Transfer* transfer = transport_submit(transport, curl, NULL, transport_prewarm_done, transport);
+    if (!transfer) return;
+    transfer->background = true;
+    transport->warm_transfer = transfer;
+    transport_detach(transport, transfer);
+}
 
-        if (j < result.size) result.data[j++] = (triple >> 16) & 0xFF;
-        if (j < result.size) result.data[j++] = (triple >> 8) & 0xFF;
-        if (j < result.size) result.data[j++] = triple & 0xFF;
+/**
+ * @brief readline event hook that runs the request engine while input is pending.
+ * @details readline calls this periodically while it waits for a keystroke
+ *          (every 100 ms when idle, every 5 ms while transfers are in flight).
+ *          It starts the connection warm-up and the context cache TTL update
+ *          when they are due and advances all background transfers, but
+ *          never blocks.
+ * @return Always 0.
+ */
+int prewarm_event_hook(void) {
+    if (prewarm_state) {
+        Transport* transport = &prewarm_state->transport;
+        transport_prewarm_step(prewarm_state);
+        endpoint_pool_probe_step(prewarm_state);
+        context_cache_refresh_step(prewarm_state);
+        transport_poll(transport, 0);
+        // Poll more often while a transfer is in progress so the connection
+        // is ready (and its cost measured) without waiting for the next tick.
+        rl_set_keyboard_input_timeout(transport->active_transfers > 0 ? 5000 : 100000);
     }
+    return 0;
+}
 
-    result.data[result.size] = '\0';
-    return result;
+/**
+ * @brief Reports the handshake time the last turn did not have to wait for.
+ * @details Prints a short note when the request of the last turn reused a
+ *          connection that was opened in the background while the user typed.
+ * @param state The current application state.
+ */
+void report_prewarm_saving(AppState* state) {
+    Transport* transport = &state->transport;
+    if (transport->warm_last_saved_ms > 0) {
+        fprintf(stderr, "[Connection pre-warmed: saved %.0f ms of handshake]\n", transport->warm_last_saved_ms);
+    }
+    transport->warm_last_saved_ms = 0;
 }
 
 /**
- * @brief Performs the low-level cURL request for the official Gemini API.
- * @details This is the core transport function for all POST requests to the
- *          official API. It constructs the full API URL, sets the required
- *          HTTP headers (including content-type, encoding, and API key), and
- *          executes the cURL request with the provided payload and callback.
- * @param state The current application state, used for model name, API key, and origin.
+ * @brief Executes a foreground transfer to completion.
+ * @details A blocking convenience over `transport_submit` and `transport_await`
+ *          for call sites that need exactly one response before continuing.
+ *          Any warm-up still in flight is finished first so that the request
+ *          can pick up its connection.
+ * @param transport The session transport.
+ * @param curl A handle obtained from `transport_acquire`; it is released.
+ * @param headers The header list set on the handle, or NULL; it is freed.
+ * @param http_code_out Optional; receives the HTTP status (0 if none arrived).
+ * @return The CURLcode the transfer finished with.
+ */
+CURLcode transport_perform(Transport* transport, CURL* curl, struct curl_slist* headers, long* http_code_out) {
+    transport_prewarm_settle(transport);
+
+    if (http_code_out) *http_code_out = 0;
+    Transfer* transfer = transport_submit(transport, curl, headers, NULL, NULL);
+    if (!transfer) return CURLE_FAILED_INIT;
+    return transport_await(transport, transfer, http_code_out);
+}
+
+/**
+ * @brief Aborts all transfers and destroys the pooled handles and shared caches.
+ * @param transport The session transport to tear down.
+ */
+void transport_cleanup(Transport* transport) {
+    while (transport->transfers) {
+        transport_transfer_free(transport, transport->transfers);
+    }
+    transport->warm_transfer = NULL;
+    if (transport->multi) {
+        curl_multi_cleanup(transport->multi);
+        transport->multi = NULL;
+    }
+    for (int i = 0; i < TRANSPORT_POOL_SIZE; i++) {
+        if (transport->handles[i]) {
+            curl_easy_cleanup(transport->handles[i]);
+            transport->handles[i] = NULL;
+        }
+        transport->in_use[i] = false;
+    }
+    if (transport->share) {
+        curl_share_cleanup(transport->share);
+        transport->share = NULL;
+    }
+    cJSON_Delete(transport->net_cache);
+    transport->net_cache = NULL;
+    curl_slist_free_all(transport->resolve);
+    transport->resolve = NULL;
+}
+
+/**
+ * @brief Configures a pooled handle for a POST request to the official Gemini API.
+ * @details Constructs the full API URL from the model name and endpoint and sets
+ *          the required HTTP headers (content-type, encoding, API key and the
+ *          optional origin) for the given key.
+ * @param state The current application state, used for host, model and proxy.
+ * @param key_index The API key (and matching origin) to authenticate with.
  * @param endpoint The specific API endpoint to call (e.g., "streamGenerateContent").
- * @param compressed_payload The Gzipped request body.
- * @param payload_size The size of the compressed payload.
+ * @param upload The upload of the request body; it must outlive the transfer.
  * @param callback The libcurl write callback function to handle the response data.
- * @param callback_data A pointer to the data structure for the callback (e.g., MemoryStruct).
- * @return The HTTP status code of the response. On a transport-level error,
- *         it returns a negative CURLcode.
+ * @param callback_data A pointer to the data structure for the callback.
+ * @param[out] headers_out Receives the header list set on the handle.
+ * @return The configured handle, or NULL if none could be acquired.
  */
-long perform_api_curl_request(AppState* state, const char* endpoint, const char* compressed_payload, size_t payload_size, size_t (*callback)(void*, size_t, size_t, void*), void* callback_data) {
-    CURL* curl = curl_easy_init();
+static CURL* build_api_post_handle(AppState* state, int key_index, const char* endpoint, BodyUpload* upload, size_t (*callback)(void*, size_t, size_t, void*), void* callback_data, struct curl_slist** headers_out) {
+    *headers_out = NULL;
+    CURL* curl = transport_acquire(&state->transport);
     if (!curl) {
-        return -CURLE_FAILED_INIT;
-    }
-
-    if (state->num_api_keys == 0) {
-        fprintf(stderr, "Error: No API key provided.\n");
-        return -1;
+        return NULL;
     }
-
-    const char* current_key = state->api_keys[state->next_key_index];
-    const char* current_origin = state->origins[state->next_key_index];
-    state->next_key_index = (state->next_key_index + 1) % state->num_api_keys;
+    const char* current_key = state->api_keys[key_index];
+    const char* current_origin = state->origins[key_index];
     
     // Construct the full API URL from the model name and endpoint.
     char full_api_url[256];
@@ -4897,11 +12753,15 @@ long perform_api_curl_request(AppState* state, const char* endpoint, const char*
 
     struct curl_slist* headers = NULL;
     headers = curl_slist_append(headers, "Content-Type: application/json");
-    headers = curl_slist_append(headers, "Content-Encoding: gzip");
+    if (upload->body->gzip) {
+        headers = curl_slist_append(headers, "Content-Encoding: gzip");
+    }
+    // The body is ready to go; don't wait for a 100-continue first.
+    headers = curl_slist_append(headers, "Expect:");
     headers = curl_slist_append(headers, auth_header);
 
     // The 'Origin' header is optional.
-    if (strcmp(state->origins[state->next_key_index], "default") != 0) {
+    if (strcmp(current_origin, "default") != 0) {
         char origin_header[256];
         snprintf(origin_header, sizeof(origin_header), "Origin: %s", current_origin);
         headers = curl_slist_append(headers, origin_header);
@@ -4915,29 +12775,375 @@ long perform_api_curl_request(AppState* state, const char* endpoint, const char*
         curl_easy_setopt(curl, CURLOPT_PROXY, state->proxy);
     }
     curl_easy_setopt(curl, CURLOPT_HTTPHEADER, headers);
-    curl_easy_setopt(curl, CURLOPT_POSTFIELDS, compressed_payload);
-    curl_easy_setopt(curl, CURLOPT_POSTFIELDSIZE, (long)payload_size);
+    curl_easy_setopt(curl, CURLOPT_POST, 1L);
+    // A body with streamed segments goes out chunked over HTTP/1.1, as its size is not known.
+    curl_easy_setopt(curl, CURLOPT_POSTFIELDSIZE_LARGE, upload->body->streaming ? (curl_off_t)-1 : (curl_off_t)upload->body->wire_length);
+    curl_easy_setopt(curl, CURLOPT_READFUNCTION, body_upload_read);
+    curl_easy_setopt(curl, CURLOPT_READDATA, upload);
+    curl_easy_setopt(curl, CURLOPT_SEEKFUNCTION, body_upload_seek);
+    curl_easy_setopt(curl, CURLOPT_SEEKDATA, upload);
     curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, callback);
     curl_easy_setopt(curl, CURLOPT_WRITEDATA, callback_data);
 
-    // Execute the request and retrieve the HTTP response code.
+    *headers_out = headers;
+    return curl;
+}
+
+/**
+ * @brief Performs the low-level cURL request for the official Gemini API.
+ * @details This is the core transport function for all POST requests to the
+ *          official API. It picks a key, configures a handle for it with
+ *          `build_api_post_handle` and executes the request with the provided
+ *          payload and callback.
+ * @param state The current application state, used for model name, API key, and origin.
+ * @param endpoint The specific API endpoint to call (e.g., "streamGenerateContent").
+ * @param body The gzip-compressed request body.
+ * @param callback The libcurl write callback function to handle the response data.
+ * @param callback_data A pointer to the data structure for the callback (e.g., MemoryStruct).
+ * @return The HTTP status code of the response. On a transport-level error,
+ *         it returns a negative CURLcode.
+ */
+long perform_api_curl_request(AppState* state, const char* endpoint, const RequestBody* body, size_t (*callback)(void*, size_t, size_t, void*), void* callback_data) {
+    if (state->num_api_keys == 0) {
+        fprintf(stderr, "Error: No API key provided.\n");
+        return -1;
+    }
+
+    int key_index = rate_limited_select_api_key(state);
+    if (key_index < 0) {
+        fprintf(stderr, "\n[Interrupted]\n");
+        interrupt_flag = 0;
+        return -CURLE_ABORTED_BY_CALLBACK;
+    }
+
+    endpoint_pool_select(state);
+    BodyUpload upload;
+    body_upload_init(&upload, body);
+    struct curl_slist* headers = NULL;
+    CURL* curl = build_api_post_handle(state, key_index, endpoint, &upload, callback, callback_data, &headers);
+    if (!curl) {
+        return -CURLE_FAILED_INIT;
+    }
+
+    // Execute the request; the handle goes back to the pool and the headers
+    // are freed once it completes.
     long http_code = 0;
-    CURLcode res = curl_easy_perform(curl);
-    curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &http_code);
+    CURLcode res = transport_perform(&state->transport, curl, headers, &http_code);
+    compress_policy_observe_upload(state, &upload);
+    body_upload_end(&upload);
+    if (upload.blob_unreadable) {
+        // Not an interruption: the caller builds the body again.
+        res = CURLE_READ_ERROR;
+        state->transport.last_result = res;
+    }
 
-    if (res == CURLE_WRITE_ERROR && interrupt_flag) {
+    if (transport_interrupted(res)) {
         fprintf(stderr, "\n[Interrupted]\n");
         interrupt_flag = 0;
     }
     
     // If the request failed at the transport layer, return the negative cURL error code.
     if (res != CURLE_OK && http_code == 0) {
-        http_code = -res;
+        http_code = -(long)res;
     }
+    key_scheduler_record(state, key_index, http_code);
+    endpoint_pool_record(state, http_code);
 
-    // Clean up all allocated resources.
-    curl_easy_cleanup(curl);
-    curl_slist_free_all(headers);
+    return http_code;
+}
+
+struct HedgeRace;
+
+/**
+ * @brief One of the (at most two) copies of a hedged generate request.
+ */
+typedef struct {
+    struct HedgeRace* race;
+    AppState* state;
+    Transfer* transfer;
+    int key_index;
+    long reserved_tokens;          // Charged to the quota ledger, -1 if nothing was.
+    char* error_body;              // Body of a non-200 response, kept for reporting.
+    size_t error_size;
+    long http_code;
+    CURLcode result;
+    long retry_after;
+    bool finished;
+    struct timespec started_at;
+    BodyUpload upload;             // Each leg sends the shared body on its own.
+} HedgeLeg;
+
+/**
+ * @brief The shared state of a hedged generate request.
+ * @details The first leg to deliver response data with HTTP 200 becomes the
+ *          winner; only its data ever reaches the output stream.
+ */
+typedef struct HedgeRace {
+    MemoryStruct* out;
+    HedgeLeg legs[2];
+    int num_legs;
+    int winner;                    // Index into legs, -1 until data arrives.
+    int last_finished;             // Leg that completed most recently.
+    double ttft_ms;                // Winner's time from its start to first data.
+    StreamPipe pipe;               // Carries the winner's data to the renderer thread.
+} HedgeRace;
+
+/**
+ * @brief Returns the milliseconds elapsed since a CLOCK_MONOTONIC time stamp.
+ */
+static double hedge_elapsed_ms(const struct timespec* since) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - since->tv_sec) * 1000.0 + (now.tv_nsec - since->tv_nsec) / 1e6;
+}
+
+static int hedge_compare_doubles(const void* a, const void* b) {
+    double x = *(const double*)a, y = *(const double*)b;
+    return (x > y) - (x < y);
+}
+
+/**
+ * @brief Computes how long a generate request may stay silent before it is hedged.
+ * @details The configured percentile of the recent times to first data. Until
+ *          HEDGE_MIN_SAMPLES requests have been measured, HEDGE_DEFAULT_DELAY_MS
+ *          is used instead.
+ * @param hedge The hedging policy holding the samples.
+ * @return The delay in milliseconds.
+ */
+static double hedge_threshold_ms(const HedgePolicy* hedge) {
+    if (hedge->num_samples < HEDGE_MIN_SAMPLES) return HEDGE_DEFAULT_DELAY_MS;
+
+    double sorted[HEDGE_TTFT_HISTORY];
+    memcpy(sorted, hedge->ttft_ms, sizeof(double) * hedge->num_samples);
+    qsort(sorted, hedge->num_samples, sizeof(double), hedge_compare_doubles);
+    int rank = (hedge->percentile * hedge->num_samples + 99) / 100;
+    if (rank < 1) rank = 1;
+    if (rank > hedge->num_samples) rank = hedge->num_samples;
+    return sorted[rank - 1];
+}
+
+/**
+ * @brief Adds a time to first data to the hedging history.
+ */
+static void hedge_record_ttft(HedgePolicy* hedge, double ttft_ms) {
+    hedge->ttft_ms[hedge->next_sample] = ttft_ms;
+    hedge->next_sample = (hedge->next_sample + 1) % HEDGE_TTFT_HISTORY;
+    if (hedge->num_samples < HEDGE_TTFT_HISTORY) hedge->num_samples++;
+}
+
+/**
+ * @brief Write callback of a hedge leg.
+ * @details A non-200 response body is kept on the leg so the error can be
+ *          reported if every leg fails. The first leg to receive 200 data wins
+ *          the race, and from then on only the winner's data is passed on to
+ *          the receive ring, whose renderer prints it; data of any other leg
+ *          aborts that leg.
+ */
+static size_t hedge_write_callback(void* contents, size_t size, size_t nmemb, void* userp) {
+    HedgeLeg* leg = userp;
+    HedgeRace* race = leg->race;
+    size_t realsize = size * nmemb;
+    int leg_index = (int)(leg - race->legs);
+
+    long http_code = 0;
+    curl_easy_getinfo(leg->transfer->curl, CURLINFO_RESPONSE_CODE, &http_code);
+    if (http_code != 200) {
+        char* ptr = realloc(leg->error_body, leg->error_size + realsize + 1);
+        if (!ptr) return 0;
+        leg->error_body = ptr;
+        memcpy(leg->error_body + leg->error_size, contents, realsize);
+        leg->error_size += realsize;
+        leg->error_body[leg->error_size] = '\0';
+        return realsize;
+    }
+
+    if (race->winner < 0) {
+        race->winner = leg_index;
+        race->ttft_ms = hedge_elapsed_ms(&leg->started_at);
+    }
+    if (race->winner != leg_index) return 0;
+    return stream_pipe_write(contents, size, nmemb, &race->pipe);
+}
+
+/**
+ * @brief Completion callback of a hedge leg.
+ * @details Stores the outcome on the leg and feeds it to the key scheduler. A
+ *          leg that lost the race is not held against its key.
+ */
+static void hedge_leg_done(Transfer* transfer, void* userdata) {
+    HedgeLeg* leg = userdata;
+    HedgeRace* race = leg->race;
+    leg->finished = true;
+    race->last_finished = (int)(leg - race->legs);
+    leg->result = leg->upload.blob_unreadable ? CURLE_READ_ERROR : transfer->result;
+    leg->http_code = transfer->http_code;
+    leg->retry_after = leg->state->transport.last_retry_after;
+    if (leg->result != CURLE_OK && leg->http_code == 0) {
+        leg->http_code = -(long)leg->result;
+    }
+    if (race->winner < 0 || race->winner == (int)(leg - race->legs)) {
+        key_scheduler_record(leg->state, leg->key_index, leg->http_code);
+    }
+}
+
+/**
+ * @brief Starts one leg of a hedged generate request on the given key.
+ * @return true if the transfer was submitted.
+ */
+static bool hedge_start_leg(AppState* state, HedgeRace* race, int key_index, long reserved_tokens, const RequestBody* body) {
+    HedgeLeg* leg = &race->legs[race->num_legs];
+    memset(leg, 0, sizeof(*leg));
+    leg->race = race;
+    leg->state = state;
+    leg->key_index = key_index;
+    leg->reserved_tokens = reserved_tokens;
+    clock_gettime(CLOCK_MONOTONIC, &leg->started_at);
+
+    body_upload_init(&leg->upload, body);
+    struct curl_slist* headers = NULL;
+    CURL* curl = build_api_post_handle(state, key_index, "streamGenerateContent?alt=sse", &leg->upload, hedge_write_callback, leg, &headers);
+    if (!curl) {
+        rate_limiter_settle_key(state, key_index, reserved_tokens, false, 0);
+        return false;
+    }
+    leg->transfer = transport_submit(&state->transport, curl, headers, hedge_leg_done, leg);
+    if (!leg->transfer) {
+        rate_limiter_settle_key(state, key_index, reserved_tokens, false, 0);
+        return false;
+    }
+    race->num_legs++;
+    return true;
+}
+
+/**
+ * @brief Sends a streaming generate request, hedged across two keys.
+ * @details The request is sent on the key the scheduler picks. If no response
+ *          data has arrived when the configured percentile of recent times to
+ *          first data has elapsed, the same payload is also sent on
+ *          a second healthy key with budget (if there is one). The first leg to
+ *          stream data wins: its output is printed and collected in `chunk`
+ *          exactly as for a plain request, and the other leg is cancelled, so
+ *          nothing is printed or stored twice. A leg that fails does not end
+ *          the race while the other is still running. Each leg is charged to,
+ *          and settled against, the quota of its own key; the cancelled leg
+ *          gets its tokens back.
+ * @param state The current application state.
+ * @param body The request body; each leg compresses it while sending it.
+ * @param chunk Receives the streamed response, or the error body on failure.
+ * @return The HTTP status code of the winning (or last failing) leg, or a
+ *         negative CURLcode on a transport-level error.
+ */
+long perform_hedged_generate(AppState* state, const RequestBody* body, MemoryStruct* chunk) {
+    Transport* transport = &state->transport;
+    HedgePolicy* hedge = &state->hedge;
+    if (state->num_api_keys == 0) {
+        fprintf(stderr, "Error: No API key provided.\n");
+        return -1;
+    }
+
+    int primary_key = rate_limited_select_api_key(state);
+    if (primary_key < 0) {
+        fprintf(stderr, "\n[Interrupted]\n");
+        interrupt_flag = 0;
+        return -CURLE_ABORTED_BY_CALLBACK;
+    }
+    // The legs are settled here, so take the reservation off the limiter.
+    long primary_reserved = state->rate_limit.reserved_key_index >= 0 ? state->rate_limit.reserved_tokens : -1;
+    state->rate_limit.reserved_key_index = -1;
+
+    HedgeRace race = { .out = chunk, .num_legs = 0, .winner = -1, .last_finished = 0 };
+    endpoint_pool_select(state);
+    transport_prewarm_settle(transport);
+    stream_pipe_open(&race.pipe, write_memory_callback, chunk);
+    if (!hedge_start_leg(state, &race, primary_key, primary_reserved, body)) {
+        stream_pipe_close(&race.pipe, &state->receive);
+        return -CURLE_FAILED_INIT;
+    }
+
+    double threshold_ms = hedge_threshold_ms(hedge);
+    bool hedge_tried = false;
+    bool interrupted = false;
+    for (;;) {
+        if (interrupt_flag && race.winner < 0) {
+            interrupted = true;
+            break;
+        }
+        transport_poll(transport, 10);
+
+        // Cancel the loser as soon as there is a winner.
+        for (int i = 0; i < race.num_legs; i++) {
+            HedgeLeg* leg = &race.legs[i];
+            if (race.winner >= 0 && i != race.winner && leg->transfer) {
+                if (!leg->finished) key_scheduler_record_latency(state, leg->key_index, hedge_elapsed_ms(&leg->started_at));
+                transport_cancel(transport, leg->transfer);
+                leg->transfer = NULL;
+                if (!leg->finished) leg->result = CURLE_ABORTED_BY_CALLBACK;
+            }
+        }
+
+        bool all_finished = true;
+        for (int i = 0; i < race.num_legs; i++) {
+            if (race.legs[i].transfer && !race.legs[i].finished) all_finished = false;
+        }
+        if (race.winner >= 0 ? race.legs[race.winner].finished : all_finished) break;
+
+        // A leg that fails before the hedge is due is left to the retry policy.
+        if (!hedge_tried && race.winner < 0 && hedge_elapsed_ms(&race.legs[0].started_at) >= threshold_ms) {
+            hedge_tried = true;
+            long reserved = -1;
+            int spare_key = rate_limited_select_spare_key(state, primary_key, &reserved);
+            if (spare_key >= 0 && hedge_start_leg(state, &race, spare_key, reserved, body)) {
+                hedge->hedged_requests++;
+                fprintf(stderr, "[Hedging: no data after %.0f ms, also trying another key]\n", threshold_ms);
+            }
+        }
+    }
+
+    stream_pipe_close(&race.pipe, &state->receive);
+    int result_leg = race.winner >= 0 ? race.winner : race.last_finished;
+    HedgeLeg* result = &race.legs[result_leg];
+    long http_code = result->http_code;
+    if (interrupted) {
+        fprintf(stderr, "\n[Interrupted]\n");
+        interrupt_flag = 0;
+        http_code = -CURLE_ABORTED_BY_CALLBACK;
+        transport->last_result = CURLE_ABORTED_BY_CALLBACK;
+    } else {
+        if (transport_interrupted(result->result)) {
+            fprintf(stderr, "\n[Interrupted]\n");
+            interrupt_flag = 0;
+        }
+        // The retry policy looks at the outcome of the leg being reported.
+        transport->last_result = result->result;
+        transport->last_retry_after = result->retry_after;
+    }
+    state->last_key_index = result->key_index;
+
+    if (race.winner >= 0) {
+        hedge_record_ttft(hedge, race.ttft_ms);
+        if (race.winner > 0) hedge->hedge_wins++;
+    } else if (!interrupted && result->error_body) {
+        // Report the error the way a plain request would have buffered it.
+        char* ptr = realloc(chunk->buffer, result->error_size + 1);
+        if (ptr) {
+            chunk->buffer = ptr;
+            memcpy(chunk->buffer, result->error_body, result->error_size + 1);
+            chunk->size = result->error_size;
+        }
+    }
+
+    for (int i = 0; i < race.num_legs; i++) {
+        HedgeLeg* leg = &race.legs[i];
+        if (leg->transfer) transport_cancel(transport, leg->transfer);
+        compress_policy_observe_upload(state, &leg->upload);
+        body_upload_end(&leg->upload);
+        if (leg->reserved_tokens >= 0) {
+            bool won = i == race.winner && http_code == 200;
+            rate_limiter_settle_key(state, leg->key_index, leg->reserved_tokens, won, won ? chunk->total_tokens : 0);
+        }
+        free(leg->error_body);
+    }
+    endpoint_pool_record(state, http_code);
     return http_code;
 }
 